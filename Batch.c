@@ -0,0 +1,724 @@
+#include "Batch.h"
+#include "FAT.h"
+#include "HAL.h"
+#include "DirSnapshot.h"
+#include "Index.h"
+#include "DirWrite.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define BATCH_LINE_MAX 1024
+#define BATCH_MAX_ARGS 8
+#define DIR_CACHE_SIZE 64 /* directories kept decoded between commands */
+#define RECORD_SIZE_MAX (FAT_MAX_PATH + 96)
+
+#ifndef _WIN32
+#include <strings.h>
+#define _strnicmp strncasecmp
+#define _stricmp strcasecmp
+#endif
+
+/*
+ * Fields of one file or folder, from a snapshot row or a DirectoryEntry
+ */
+typedef struct
+{
+    uint32_t size;
+    uint32_t startCluster;
+    uint32_t timestamp; /* modified date << 16 | modified time */
+    uint8_t attributes;
+} BatchEntry;
+
+/*
+ * Decoded directory, sorted by name for binary search
+ */
+typedef struct
+{
+    int isValid;
+    unsigned int startCluster;
+    DirSnapshot snapshot;
+} CachedDir;
+
+/*
+ * Records of find/tree, printed once the count is known
+ */
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+    unsigned int count;
+    const char *pattern; /* NULL for tree */
+} RecordList;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static DirSnapshot *GetCachedDir(unsigned int _startCluster);
+
+static void ClearDirCache();
+
+static int FindInDir(const DirSnapshot *_snapshot, const char *_name);
+
+static int FindAlias(const DirSnapshot *_snapshot, const char *_name);
+
+static int ResolvePath(const char *_path, BatchEntry *_entry);
+
+static int FormatRecord(char *_record, const BatchEntry *_entry, const char *_name);
+
+static int MatchPattern(const char *_pattern, const char *_name);
+
+static int CollectRecord(DirectoryEntry *entry, const char *path, void *context);
+
+static int AppendRecord(RecordList *_list, const BatchEntry *_entry, const char *_path);
+
+static int CollectIndexRecords(RecordList *_list, const char *_path);
+
+static unsigned int SendChain(FILE *_out, unsigned int _startCluster, unsigned int _size);
+
+static int RunCommand(int _argc, char *_argv[], FILE *_out);
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static CachedDir s_dirCache[DIR_CACHE_SIZE];
+static unsigned int s_nextVictim = 0;
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/*!
+ * @brief <Get the decoded directory, load it on first use>
+ *
+ * @param _startCluster <Start cluster of the directory, 0 for root directory>.
+ *
+ * @return <Pointer to the snapshot sorted by name, NULL if out of memory>.
+ */
+static DirSnapshot *GetCachedDir(unsigned int _startCluster)
+{
+    CachedDir *slot;
+    unsigned int i;
+
+    for (i = 0; i < DIR_CACHE_SIZE; i++)
+    {
+        if (s_dirCache[i].isValid && (s_dirCache[i].startCluster == _startCluster))
+        {
+            return &s_dirCache[i].snapshot;
+        }
+    }
+
+    /* round robin replacement */
+    slot = &s_dirCache[s_nextVictim];
+    s_nextVictim = (s_nextVictim + 1) % DIR_CACHE_SIZE;
+
+    if (slot->isValid)
+    {
+        FreeDirSnapshot(&slot->snapshot);
+        slot->isValid = 0;
+    }
+
+    if (LoadDirSnapshot(&slot->snapshot, _startCluster) < 0)
+    {
+        return NULL;
+    }
+    SortDirSnapshot(&slot->snapshot, SORT_BY_NAME, 0);
+    slot->startCluster = _startCluster;
+    slot->isValid = 1;
+
+    return &slot->snapshot;
+}
+
+static void ClearDirCache()
+{
+    unsigned int i;
+
+    for (i = 0; i < DIR_CACHE_SIZE; i++)
+    {
+        if (s_dirCache[i].isValid)
+        {
+            FreeDirSnapshot(&s_dirCache[i].snapshot);
+            s_dirCache[i].isValid = 0;
+        }
+    }
+    s_nextVictim = 0;
+}
+
+/*!
+ * @brief <Binary search of a name in a snapshot sorted by name, case insensitive>
+ *
+ * @return <row of the entry, -1 if not found>.
+ */
+static int FindInDir(const DirSnapshot *_snapshot, const char *_name)
+{
+    int low = 0;
+    int high = (int)_snapshot->count - 1;
+
+    while (low <= high)
+    {
+        const int mid = (low + high) / 2;
+        const unsigned int row = _snapshot->order[mid];
+        const int cmp = _stricmp(_snapshot->namePool + _snapshot->nameOffsets[row], _name);
+
+        if (cmp == 0)
+        {
+            return (int)row;
+        }
+        else if (cmp < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+
+    return -1;
+}
+
+/* row whose short name is the 8.3 alias _name of an entry with a long name, -1 if none */
+static int FindAlias(const DirSnapshot *_snapshot, const char *_name)
+{
+    const char *dot = strrchr(_name, '.');
+    const size_t baseLength = (dot != NULL) ? (size_t)(dot - _name) : strlen(_name);
+    const size_t extLength = (dot != NULL) ? strlen(dot + 1) : 0;
+    uint8_t shortName[SNAPSHOT_SHORT_NAME_SIZE];
+    unsigned int row;
+    size_t i;
+
+    if ((baseLength == 0) || (baseLength > 8) || (extLength > 3))
+    {
+        return -1;
+    }
+
+    memset(shortName, ' ', sizeof(shortName));
+    for (i = 0; i < baseLength; i++)
+    {
+        shortName[i] = (uint8_t)toupper((unsigned char)_name[i]);
+    }
+    for (i = 0; i < extLength; i++)
+    {
+        shortName[8 + i] = (uint8_t)toupper((unsigned char)dot[1 + i]);
+    }
+
+    for (row = 0; row < _snapshot->count; row++)
+    {
+        if (memcmp(_snapshot->shortNames[row], shortName, sizeof(shortName)) == 0)
+        {
+            return (int)row;
+        }
+    }
+
+    return -1;
+}
+
+/*!
+ * @brief <Find the entry of an absolute path, "/" is the root directory>
+ *
+ * @param _path <path, case insensitive>.
+ * @param _entry <Pointer to store the fields of the entry>.
+ *
+ * @return <zero if found>.
+ */
+static int ResolvePath(const char *_path, BatchEntry *_entry)
+{
+    const char *p = _path;
+    const IndexNode *node = FindIndexNode(_path);
+
+    memset(_entry, 0, sizeof(BatchEntry));
+    _entry->attributes = ENTRY_DIRECTORY;
+
+    /* a loaded index answers without any directory read */
+    if (node != NULL)
+    {
+        _entry->size = node->size;
+        _entry->startCluster = node->startCluster;
+        _entry->timestamp = node->timestamp;
+        _entry->attributes = (uint8_t)node->attributes;
+        return 0;
+    }
+
+    while (*p != '\0')
+    {
+        char name[FAT_MAX_PATH];
+        size_t length = 0;
+        const DirSnapshot *snapshot;
+        int row;
+
+        while (*p == '/')
+        {
+            p++;
+        }
+        if (*p == '\0')
+        {
+            break;
+        }
+
+        while ((*p != '\0') && (*p != '/'))
+        {
+            if (length == FAT_MAX_PATH - 1)
+            {
+                return 1;
+            }
+            name[length++] = *p++;
+        }
+        name[length] = '\0';
+
+        if (!(_entry->attributes & ENTRY_DIRECTORY))
+        {
+            return 1;
+        }
+
+        snapshot = GetCachedDir(_entry->startCluster);
+        row = (snapshot != NULL) ? FindInDir(snapshot, name) : -1;
+        if ((row < 0) && (snapshot != NULL))
+        {
+            /* the short alias of a long name */
+            row = FindAlias(snapshot, name);
+        }
+        if (row < 0)
+        {
+            return 1;
+        }
+
+        _entry->size = snapshot->sizes[row];
+        _entry->startCluster = snapshot->startClusters[row];
+        _entry->timestamp = snapshot->timestamps[row];
+        _entry->attributes = snapshot->attributes[row];
+    }
+
+    return 0;
+}
+
+/* one tab separated record, returns its length */
+static int FormatRecord(char *_record, const BatchEntry *_entry, const char *_name)
+{
+    const unsigned int date = _entry->timestamp >> 16;
+    const unsigned int time = _entry->timestamp & 0xFFFF;
+
+    return snprintf(_record, RECORD_SIZE_MAX, "%c\t%u\t%u\t%04u-%02u-%02uT%02u:%02u:%02u\t0x%02X\t%s\n",
+                    (_entry->attributes & ENTRY_DIRECTORY) ? 'd' : 'f',
+                    (unsigned int)_entry->size, (unsigned int)_entry->startCluster,
+                    (date >> 9) + YEAR_OFFSET, (date >> 5) & 0x0F, date & 0x1F,
+                    time >> 11, (time >> 5) & 0x3F, (time & 0x1F) * 2,
+                    (unsigned int)_entry->attributes, _name);
+}
+
+/* '*' any run of characters, '?' one character, case insensitive */
+static int MatchPattern(const char *_pattern, const char *_name)
+{
+    const char *star = NULL;
+    const char *retry = NULL;
+
+    while (*_name != '\0')
+    {
+        if ((*_pattern == '?') ||
+            ((*_pattern != '*') && (toupper((unsigned char)*_pattern) == toupper((unsigned char)*_name))))
+        {
+            _pattern++;
+            _name++;
+        }
+        else if (*_pattern == '*')
+        {
+            star = _pattern++;
+            retry = _name;
+        }
+        else if (star != NULL)
+        {
+            _pattern = star + 1;
+            _name = ++retry;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+
+    while (*_pattern == '*')
+    {
+        _pattern++;
+    }
+
+    return *_pattern == '\0';
+}
+
+/* add one record to the list if its name matches the pattern, non-zero if out of memory */
+static int AppendRecord(RecordList *_list, const BatchEntry *_entry, const char *_path)
+{
+    RecordList *list = _list;
+    const char *name = strrchr(_path, '/');
+    char record[RECORD_SIZE_MAX];
+    int length;
+
+    if ((list->pattern != NULL) && !MatchPattern(list->pattern, (name != NULL) ? name + 1 : _path))
+    {
+        return 0;
+    }
+
+    length = FormatRecord(record, _entry, _path);
+
+    if (list->length + length + 1 > list->capacity)
+    {
+        size_t capacity = (list->capacity == 0) ? 4096 : list->capacity * 2;
+        char *data = (char *)realloc(list->data, capacity);
+
+        if (data == NULL)
+        {
+            return 1;
+        }
+        list->data = data;
+        list->capacity = capacity;
+    }
+
+    memcpy(list->data + list->length, record, length + 1);
+    list->length += length;
+    list->count++;
+
+    return 0;
+}
+
+/* WalkTree visitor of find and tree */
+static int CollectRecord(DirectoryEntry *entry, const char *path, void *context)
+{
+    BatchEntry fields;
+
+    fields.size = (uint32_t)ReadNumber(4, entry->size);
+    fields.startCluster = GetEntryCluster(entry);
+    fields.timestamp = ((uint32_t)ReadNumber(2, entry->modifiedDate) << 16) |
+                       (uint32_t)ReadNumber(2, entry->modifiedTime);
+    fields.attributes = entry->attributes;
+
+    return AppendRecord((RecordList *)context, &fields, path);
+}
+
+/*!
+ * @brief <find and tree from the loaded index: every node below _path>
+ *
+ * @return <non-zero if out of memory>.
+ */
+static int CollectIndexRecords(RecordList *_list, const char *_path)
+{
+    unsigned int count;
+    const IndexNode *nodes = GetIndexNodes(&count);
+    const size_t length = strlen(_path);
+    unsigned int i;
+    int isFailed = 0;
+
+    for (i = 0; (i < count) && !isFailed; i++)
+    {
+        const char *path = GetIndexPath(&nodes[i]);
+
+        /* paths in the index are upper case, as on disk */
+        if ((_strnicmp(path, _path, length) == 0) && (path[length] == '/'))
+        {
+            BatchEntry fields;
+
+            fields.size = nodes[i].size;
+            fields.startCluster = nodes[i].startCluster;
+            fields.timestamp = nodes[i].timestamp;
+            fields.attributes = (uint8_t)nodes[i].attributes;
+            isFailed = AppendRecord(_list, &fields, path);
+        }
+    }
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Copy a file to a stream run by run, zero filled if the chain is short>
+ *
+ * @return <number of bytes written, always _size unless the stream fails>.
+ */
+static unsigned int SendChain(FILE *_out, unsigned int _startCluster, unsigned int _size)
+{
+    const unsigned int bytePerCluster = GetBytePerSector() * GetSectorPerCluster();
+    unsigned int extentCount = 0;
+    unsigned int sent = 0;
+    unsigned int e;
+    Extent *extents = GetFileExtents(_startCluster, &extentCount);
+
+    for (e = 0; (e < extentCount) && (sent < _size); e++)
+    {
+        const uint64_t runBytes = (uint64_t)extents[e].count * bytePerCluster;
+        unsigned int length = _size - sent;
+        unsigned int n;
+
+        if (runBytes < length)
+        {
+            length = (unsigned int)runBytes;
+        }
+
+        n = SendSectors(_out, ClusterToSector(extents[e].cluster), length);
+        sent += n;
+        if (n < length)
+        {
+            break;
+        }
+    }
+    free(extents);
+
+    /* keep the framing of the reply */
+    while ((sent < _size) && (e >= extentCount) && (fputc(0, _out) != EOF))
+    {
+        sent++;
+    }
+
+    return sent;
+}
+
+/*!
+ * @brief <Run one command>
+ *
+ * @return <zero on success>.
+ */
+static int RunCommand(int _argc, char *_argv[], FILE *_out)
+{
+    const char *command = _argv[0];
+    BatchEntry entry;
+    int retVal = 0;
+
+    if ((_argc >= 2) && ((strcmp(command, "mkdir") == 0) || (strcmp(command, "touch") == 0) ||
+                         (strcmp(command, "rm") == 0) || ((strcmp(command, "mv") == 0) && (_argc > 2))))
+    {
+        /* the path may not exist yet, no ResolvePath */
+        switch (command[0])
+        {
+        case 'm':
+            retVal = (command[1] == 'k') ? FatMkdir(_argv[1]) : FatRename(_argv[1], _argv[2]);
+            break;
+        case 't':
+            retVal = FatCreateFile(_argv[1]);
+            break;
+        default:
+            retVal = FatUnlink(_argv[1]);
+            break;
+        }
+
+        if (retVal != DIR_OK)
+        {
+            fprintf(_out, "ERR %s: %s\n", command, GetDirResultText(retVal));
+            return 1;
+        }
+
+        /* the decoded folders describe the volume before the change */
+        ClearDirCache();
+        fprintf(_out, "OK 0\n");
+        return 0;
+    }
+
+    if ((_argc < 2) || (ResolvePath(_argv[1], &entry) != 0))
+    {
+        fprintf(_out, "ERR %s: no such file or folder\n", command);
+        return 1;
+    }
+
+    if (strcmp(command, "ls") == 0)
+    {
+        static const char *const columns[] = {"disk", "name", "size", "cluster", "time", "attr"};
+        DirSnapshot *snapshot = (entry.attributes & ENTRY_DIRECTORY) ? GetCachedDir(entry.startCluster) : NULL;
+        SnapshotColumn column = SORT_BY_NAME;
+        char record[RECORD_SIZE_MAX];
+        unsigned int i;
+
+        if (snapshot == NULL)
+        {
+            fprintf(_out, "ERR ls: not a folder\n");
+            return 1;
+        }
+
+        for (i = 0; (_argc > 2) && (i < sizeof(columns) / sizeof(columns[0])); i++)
+        {
+            if (strcmp(_argv[2], columns[i]) == 0)
+            {
+                column = (SnapshotColumn)i;
+            }
+        }
+        SortDirSnapshot(snapshot, column, (_argc > 3) && (strcmp(_argv[3], "desc") == 0));
+
+        fprintf(_out, "OK %u\n", snapshot->count);
+        for (i = 0; i < snapshot->count; i++)
+        {
+            const unsigned int row = snapshot->order[i];
+            BatchEntry fields;
+
+            fields.size = snapshot->sizes[row];
+            fields.startCluster = snapshot->startClusters[row];
+            fields.timestamp = snapshot->timestamps[row];
+            fields.attributes = snapshot->attributes[row];
+            FormatRecord(record, &fields, snapshot->namePool + snapshot->nameOffsets[row]);
+            fputs(record, _out);
+        }
+
+        /* the cache relies on the name order */
+        SortDirSnapshot(snapshot, SORT_BY_NAME, 0);
+    }
+    else if (strcmp(command, "stat") == 0)
+    {
+        char record[RECORD_SIZE_MAX];
+
+        FormatRecord(record, &entry, _argv[1]);
+        fprintf(_out, "OK 1\n%s", record);
+    }
+    else if (strcmp(command, "cat") == 0)
+    {
+        if (entry.attributes & ENTRY_DIRECTORY)
+        {
+            fprintf(_out, "ERR cat: is a folder\n");
+            return 1;
+        }
+
+        fprintf(_out, "OK %u\n", (unsigned int)entry.size);
+        SendChain(_out, entry.startCluster, entry.size);
+    }
+    else if ((strcmp(command, "cp") == 0) && (_argc > 2))
+    {
+        FILE *target = NULL;
+
+        if (!(entry.attributes & ENTRY_DIRECTORY))
+        {
+            fopen_s(&target, _argv[2], "wb");
+        }
+        if (target == NULL)
+        {
+            fprintf(_out, "ERR cp: can not copy to %s\n", _argv[2]);
+            return 1;
+        }
+
+        fprintf(_out, "OK %u\n", SendChain(target, entry.startCluster, entry.size));
+        fclose(target);
+    }
+    else if (((strcmp(command, "find") == 0) && (_argc > 2)) || (strcmp(command, "tree") == 0))
+    {
+        RecordList list;
+        const char *path = (strcmp(_argv[1], "/") == 0) ? "" : _argv[1];
+
+        memset(&list, 0, sizeof(list));
+        list.pattern = (command[0] == 'f') ? _argv[2] : NULL;
+
+        if (!(entry.attributes & ENTRY_DIRECTORY))
+        {
+            fprintf(_out, "ERR %s: not a folder\n", command);
+            return 1;
+        }
+
+        if (GetIndexNodes(&list.count) != NULL)
+        {
+            list.count = 0;
+            retVal = CollectIndexRecords(&list, path);
+        }
+        else
+        {
+            retVal = WalkTree(entry.startCluster, path, CollectRecord, &list);
+        }
+        if (retVal != 0)
+        {
+            fprintf(_out, "ERR %s: out of memory\n", command);
+        }
+        else
+        {
+            fprintf(_out, "OK %u\n", list.count);
+            if (list.length > 0)
+            {
+                fwrite(list.data, 1, list.length, _out);
+            }
+        }
+        free(list.data);
+    }
+    else
+    {
+        fprintf(_out, "ERR %s: unknown command\n", command);
+        retVal = 1;
+    }
+
+    return retVal;
+}
+
+/*!
+ * @brief <Run every command of a script against the mounted image>
+ *
+ * @param _in <Pointer to a FILE object to read the commands from>.
+ * @param _out <Pointer to a FILE object receiving the replies, binary mode>.
+ *
+ * @return <number of commands that failed>.
+ */
+int RunBatch(FILE *_in, FILE *_out)
+{
+    char line[BATCH_LINE_MAX];
+    int failures = 0;
+
+    while (fgets(line, sizeof(line), _in) != NULL)
+    {
+        char *argv[BATCH_MAX_ARGS];
+        int argc = 0;
+        char *p = line;
+        int isQuoted = 0;
+
+        /* split on blanks, stop at a comment; quotes are removed, blanks between them are kept */
+        while ((*p != '\0') && (*p != '#') && (argc < BATCH_MAX_ARGS) && !isQuoted)
+        {
+            char *q;
+
+            while ((*p == ' ') || (*p == '\t') || (*p == '\r') || (*p == '\n'))
+            {
+                *p++ = '\0';
+            }
+            if ((*p == '\0') || (*p == '#'))
+            {
+                break;
+            }
+
+            argv[argc++] = p;
+            q = p;
+            while ((*p != '\0') && (*p != '\r') && (*p != '\n') &&
+                   (isQuoted || ((*p != ' ') && (*p != '\t'))))
+            {
+                if (*p == '"')
+                {
+                    isQuoted = !isQuoted;
+                    p++;
+                }
+                else
+                {
+                    *q++ = *p++;
+                }
+            }
+
+            /* the separator is consumed before the argument is shortened */
+            if (*p != '\0')
+            {
+                p++;
+            }
+            *q = '\0';
+        }
+        *p = '\0';
+
+        if (isQuoted)
+        {
+            fprintf(_out, "ERR missing closing quote\n");
+            failures++;
+        }
+        else if (argc > 0)
+        {
+            failures += (RunCommand(argc, argv, _out) != 0);
+        }
+    }
+
+    /* one commit for every change of the script */
+    if (CommitWrites() != 0)
+    {
+        fprintf(_out, "ERR commit: write failed\n");
+        failures++;
+    }
+
+    fflush(_out);
+    ClearDirCache();
+
+    return failures;
+}
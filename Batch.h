@@ -0,0 +1,40 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <stdio.h>
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Run every command of a script against the mounted image>
+ *
+ * One command per line, paths are absolute ("/DOC/LKCD.PDF"), '#' starts a comment;
+ * a path with blanks is written between double quotes ("/My Documents/a b.txt").
+ * Long names and their short aliases both resolve, names are case insensitive:
+ *   ls <dir> [name|size|cluster|time|attr] [desc]
+ *   stat <path>
+ *   cat <path>
+ *   cp <path> <host file>
+ *   find <dir> <pattern with * and ?>
+ *   tree <dir>
+ *   mkdir <path>
+ *   touch <path>
+ *   rm <path>
+ *   mv <path> <new path>
+ * Every reply starts with "OK <n>" or "ERR <reason>".
+ * For ls, stat, find and tree, n records follow, one per line:
+ *   <d|f>\t<size>\t<start cluster>\t<YYYY-MM-DDTHH:MM:SS>\t<attributes>\t<name or path>
+ * For cat, n raw bytes follow; for cp, n is the number of bytes copied;
+ * mkdir, touch, rm and mv reply "OK 0" and are committed together at the
+ * end of the script (see CommitWrites), they need a journal or an overlay.
+ *
+ * @param _in <Pointer to a FILE object to read the commands from>.
+ * @param _out <Pointer to a FILE object receiving the replies, binary mode>.
+ *
+ * @return <number of commands that failed>.
+ */
+int RunBatch(FILE *_in, FILE *_out);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,484 @@
+#include "Check.h"
+#include "FAT.h"
+#include "HAL.h"
+#include "Workers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+/*
+ * Entry found by the walk, checked once the walk is over
+ */
+typedef struct
+{
+    char *path;
+    unsigned int startCluster;
+    unsigned int size;
+    int isDirectory;
+} CheckItem;
+
+/*
+ * Growable array of CheckItem, entries in WalkTree order
+ */
+typedef struct
+{
+    CheckItem *items;
+    unsigned int count;
+    unsigned int capacity;
+    int isFailed;
+} CheckItemList;
+
+/*
+ * Folders of the root directory walked by one thread
+ */
+typedef struct
+{
+    VolumeSource source;     /* mounted volume with the decoded FAT, reader set by the thread */
+    const CheckItemList *root;
+    CheckItemList *subtrees; /* one list per root entry, filled for folders only */
+    unsigned int first;      /* root entries first, first + step, ... */
+    unsigned int step;
+} CheckWorker;
+
+/*
+ * State of one CheckVolume call
+ */
+typedef struct
+{
+    uint32_t *fat;             /* decoded first FAT copy */
+    uint32_t *owner;           /* chain claiming every cluster, 0 if none */
+    unsigned int entryCount;   /* number of FAT entries, clusters 0 and 1 included */
+    unsigned int chainId;      /* id of the chain being walked */
+    unsigned int bytePerCluster;
+    unsigned int fileCount;
+    unsigned int directoryCount;
+    unsigned int usedClusters;
+    int problems;
+    FILE *report;
+} CheckContext;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static void CompareFATCopies(CheckContext *_check);
+
+static void CheckChain(CheckContext *_check, const char *_path, unsigned int _startCluster,
+                       int _isDirectory, unsigned int _size);
+
+static int CollectItem(DirectoryEntry *entry, const char *path, void *context);
+
+static void FreeItems(CheckItemList *_list);
+
+static int WalkFolders(void *_worker, int _isInline);
+
+static int WalkVolume(const uint32_t *_fat, CheckItemList *_root, CheckItemList **_subtrees);
+
+static void CheckItems(CheckContext *_check, const CheckItem *_items, unsigned int _count);
+
+static void FindLostChains(CheckContext *_check);
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/* compare every FAT copy with the first one, sector by sector */
+static void CompareFATCopies(CheckContext *_check)
+{
+    const unsigned int bytePerSector = GetBytePerSector();
+    const unsigned int sectorPerFAT = GetSectorPerFAT();
+    const size_t fatBytes = (size_t)sectorPerFAT * bytePerSector;
+    uint8_t *first = (uint8_t *)malloc(fatBytes);
+    uint8_t *copy = (uint8_t *)malloc(fatBytes);
+    unsigned int n;
+    unsigned int i;
+
+    if ((first != NULL) && (copy != NULL))
+    {
+        ReadNSectors(first, GetStartSectorFAT(), sectorPerFAT);
+
+        for (n = 1; n < GetNumFAT(); n++)
+        {
+            unsigned int differences = 0;
+
+            ReadNSectors(copy, GetStartSectorFAT() + n * sectorPerFAT, sectorPerFAT);
+
+            /* one memcmp over the whole table, per sector only if it differs */
+            if (memcmp(first, copy, fatBytes) != 0)
+            {
+                for (i = 0; i < sectorPerFAT; i++)
+                {
+                    if (memcmp(first + i * bytePerSector, copy + i * bytePerSector, bytePerSector) != 0)
+                    {
+                        differences++;
+                    }
+                }
+
+                fprintf(_check->report, "FATCOPY %u %u\n", n, differences);
+                _check->problems++;
+            }
+        }
+    }
+
+    free(first);
+    free(copy);
+}
+
+/* follow one chain through the decoded FAT and claim its clusters */
+static void CheckChain(CheckContext *_check, const char *_path, unsigned int _startCluster,
+                       int _isDirectory, unsigned int _size)
+{
+    const unsigned int needed = (unsigned int)(((uint64_t)_size + _check->bytePerCluster - 1) / _check->bytePerCluster);
+    const unsigned int id = ++_check->chainId;
+    unsigned int cluster = _startCluster;
+    unsigned int count = 0;
+    int isEnd = 0;
+    int isBroken = 0;
+
+    if (_startCluster == 0)
+    {
+        isEnd = 1;
+    }
+    else if ((_startCluster < FIRST_CLUSTER) || (_startCluster >= _check->entryCount))
+    {
+        fprintf(_check->report, "INVALID %s 0 %u\n", _path, _startCluster);
+        isEnd = 1;
+        isBroken = 1;
+    }
+
+    while (!isEnd)
+    {
+        unsigned int next;
+
+        if (_check->owner[cluster] == id)
+        {
+            fprintf(_check->report, "LOOP %s %u\n", _path, cluster);
+            isBroken = 1;
+            break;
+        }
+        if (_check->owner[cluster] != 0)
+        {
+            fprintf(_check->report, "CROSSLINK %s %u\n", _path, cluster);
+            isBroken = 1;
+            break;
+        }
+
+        _check->owner[cluster] = id;
+        _check->usedClusters++;
+        count++;
+
+        next = _check->fat[cluster];
+        if (next >= EOC_MIN)
+        {
+            isEnd = 1;
+        }
+        else if ((next < FIRST_CLUSTER) || (next >= _check->entryCount))
+        {
+            /* free, reserved, bad or out of range */
+            fprintf(_check->report, "INVALID %s %u %u\n", _path, cluster, next);
+            isBroken = 1;
+            isEnd = 1;
+        }
+        else
+        {
+            cluster = next;
+        }
+    }
+
+    /* directories have no size, only files are compared */
+    if (!isBroken && !_isDirectory && (count != needed))
+    {
+        fprintf(_check->report, "%s %s %u %u\n", (count < needed) ? "SHORT" : "LONG", _path, count, needed);
+        isBroken = 1;
+    }
+
+    if (isBroken)
+    {
+        _check->problems++;
+    }
+}
+
+/* WalkTree visitor, remember every file and folder */
+static int CollectItem(DirectoryEntry *entry, const char *path, void *context)
+{
+    CheckItemList *list = (CheckItemList *)context;
+    CheckItem *item;
+
+    if (list->count == list->capacity)
+    {
+        unsigned int capacity = (list->capacity == 0) ? 64 : list->capacity * 2;
+        CheckItem *items = (CheckItem *)realloc(list->items, capacity * sizeof(CheckItem));
+
+        if (items == NULL)
+        {
+            list->isFailed = 1;
+            return 1;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    item = &list->items[list->count];
+    item->path = (char *)malloc(strlen(path) + 1);
+    if (item->path == NULL)
+    {
+        list->isFailed = 1;
+        return 1;
+    }
+    strcpy(item->path, path);
+    item->startCluster = GetEntryCluster(entry);
+    item->size = GetSizeofFile(entry);
+    item->isDirectory = (entry->attributes & ENTRY_DIRECTORY) != 0;
+    list->count++;
+
+    return 0;
+}
+
+static void FreeItems(CheckItemList *_list)
+{
+    unsigned int i;
+
+    for (i = 0; i < _list->count; i++)
+    {
+        free(_list->items[i].path);
+    }
+    free(_list->items);
+    memset(_list, 0, sizeof(CheckItemList));
+}
+
+/*!
+ * @brief <Walk the folders of a share of the root directory, body of RunWorkers>
+ *
+ * A thread reads through its own handle of the image and follows the chains
+ * of the decoded FAT; an inline share reads through the HAL.
+ *
+ * @param _worker <Pointer to a CheckWorker object>.
+ * @param _isInline <non-zero on the calling thread>.
+ *
+ * @return <non-zero if the image can not be opened by the thread>.
+ */
+static int WalkFolders(void *_worker, int _isInline)
+{
+    CheckWorker *worker = (CheckWorker *)_worker;
+    unsigned int i;
+
+    worker->source.reader = NULL;
+    if (!_isInline)
+    {
+        worker->source.reader = OpenImgReader();
+        if (worker->source.reader == NULL)
+        {
+            return 1;
+        }
+    }
+
+    for (i = worker->first; i < worker->root->count; i += worker->step)
+    {
+        const CheckItem *folder = &worker->root->items[i];
+
+        if (folder->isDirectory)
+        {
+            /* the folder itself is one level below the root */
+            WalkTreeFrom(&worker->source, folder->startCluster, folder->path, WALK_MAX_DEPTH - 1,
+                         CollectItem, &worker->subtrees[i]);
+        }
+    }
+
+    if (worker->source.reader != NULL)
+    {
+        fclose(worker->source.reader);
+    }
+
+    return 0;
+}
+
+/*!
+ * @brief <Collect every entry of the volume, the folders of the root directory by several threads>
+ *
+ * @param _fat <decoded FAT of the mounted volume>.
+ * @param _root <Pointer to an empty CheckItemList object receiving the root entries>.
+ * @param _subtrees <Pointer to store an array of lists, the content of every root folder>.
+ *
+ * @return <zero on success, non-zero if out of memory>.
+ */
+static int WalkVolume(const uint32_t *_fat, CheckItemList *_root, CheckItemList **_subtrees)
+{
+    CheckWorker workers[WORKERS_MAX_THREADS];
+    VolumeSource source;
+    unsigned int threadCount;
+    unsigned int t;
+    unsigned int i;
+    int isFailed;
+
+    GetVolumeSource(&source, NULL, _fat);
+    WalkTreeFrom(&source, 0, "", 0, CollectItem, _root);
+    *_subtrees = (CheckItemList *)calloc(_root->count + 1, sizeof(CheckItemList));
+    isFailed = _root->isFailed || (*_subtrees == NULL);
+
+    if (isFailed)
+    {
+        return isFailed;
+    }
+
+    /* no more threads than root entries */
+    threadCount = GetWorkerCount(_root->count, 1);
+
+    /* root entries dealt in turn, big and small folders are spread over the threads */
+    for (t = 0; t < threadCount; t++)
+    {
+        workers[t].source = source;
+        workers[t].root = _root;
+        workers[t].subtrees = *_subtrees;
+        workers[t].first = t;
+        workers[t].step = threadCount;
+    }
+
+    RunWorkers(workers, sizeof(CheckWorker), threadCount, WalkFolders);
+
+    for (i = 0; i < _root->count; i++)
+    {
+        isFailed = isFailed || (*_subtrees)[i].isFailed;
+    }
+
+    return isFailed;
+}
+
+/* follow the chain of every entry and count files and folders */
+static void CheckItems(CheckContext *_check, const CheckItem *_items, unsigned int _count)
+{
+    unsigned int i;
+
+    for (i = 0; i < _count; i++)
+    {
+        const CheckItem *item = &_items[i];
+
+        if (item->isDirectory)
+        {
+            _check->directoryCount++;
+        }
+        else
+        {
+            _check->fileCount++;
+        }
+
+        CheckChain(_check, item->path, item->startCluster, item->isDirectory, item->size);
+    }
+}
+
+/* allocated clusters nobody claimed, chains counted by their first cluster */
+static void FindLostChains(CheckContext *_check)
+{
+    uint8_t *isLinked = (uint8_t *)calloc(_check->entryCount, 1);
+    unsigned int lostClusters = 0;
+    unsigned int lostChains = 0;
+    unsigned int cluster;
+
+    if (isLinked == NULL)
+    {
+        return;
+    }
+
+    for (cluster = FIRST_CLUSTER; cluster < _check->entryCount; cluster++)
+    {
+        const unsigned int next = _check->fat[cluster];
+
+        if ((next != 0) && (next != BAD_CLUSTER) && (_check->owner[cluster] == 0))
+        {
+            lostClusters++;
+            if ((next >= FIRST_CLUSTER) && (next < _check->entryCount))
+            {
+                isLinked[next] = 1;
+            }
+        }
+    }
+
+    for (cluster = FIRST_CLUSTER; cluster < _check->entryCount; cluster++)
+    {
+        const unsigned int next = _check->fat[cluster];
+
+        if ((next != 0) && (next != BAD_CLUSTER) && (_check->owner[cluster] == 0) && !isLinked[cluster])
+        {
+            lostChains++;
+        }
+    }
+
+    if (lostClusters > 0)
+    {
+        /* a lost loop has no first cluster, still one chain */
+        fprintf(_check->report, "LOST %u %u\n", lostClusters, (lostChains > 0) ? lostChains : 1);
+        _check->problems++;
+    }
+
+    free(isLinked);
+}
+
+/*!
+ * @brief <Check the consistency of the FAT and the directory tree of the mounted image>
+ *
+ * @param _report <Pointer to a FILE object receiving the problems>.
+ *
+ * @return <number of problems, -1 if out of memory>.
+ */
+int CheckVolume(FILE *_report)
+{
+    CheckContext check;
+    CheckItemList root = {NULL, 0, 0, 0};
+    CheckItemList *subtrees = NULL;
+    unsigned int i;
+
+    memset(&check, 0, sizeof(check));
+    check.report = _report;
+    check.entryCount = GetClusterCount() + FIRST_CLUSTER;
+    check.bytePerCluster = GetBytePerSector() * GetSectorPerCluster();
+
+    /* whole FAT decoded once, chains are then followed in memory */
+    check.fat = (uint32_t *)malloc(check.entryCount * sizeof(uint32_t));
+    check.owner = (uint32_t *)calloc(check.entryCount, sizeof(uint32_t));
+
+    if ((check.fat == NULL) || (check.owner == NULL))
+    {
+        check.problems = -1;
+    }
+    else
+    {
+        CompareFATCopies(&check);
+        DecodeFATEntries(0, check.entryCount, check.fat);
+        if (GetRootCluster() != 0)
+        {
+            /* FAT32 root directory, a chain owned by nobody else */
+            CheckChain(&check, "/", GetRootCluster(), 1, 0);
+        }
+    }
+
+    if ((check.problems >= 0) && (WalkVolume(check.fat, &root, &subtrees) != 0))
+    {
+        check.problems = -1;
+    }
+
+    if (check.problems >= 0)
+    {
+        /* chains are claimed in WalkTree order, every folder followed by its content */
+        for (i = 0; i < root.count; i++)
+        {
+            CheckItems(&check, &root.items[i], 1);
+            CheckItems(&check, subtrees[i].items, subtrees[i].count);
+        }
+        FindLostChains(&check);
+
+        fprintf(_report, "files %u directories %u clusters %u problems %d\n",
+                check.fileCount, check.directoryCount, check.usedClusters, check.problems);
+    }
+
+    for (i = 0; (subtrees != NULL) && (i < root.count); i++)
+    {
+        FreeItems(&subtrees[i]);
+    }
+    free(subtrees);
+    FreeItems(&root);
+    free(check.fat);
+    free(check.owner);
+    return check.problems;
+}
@@ -0,0 +1,32 @@
+#ifndef _CHECK_H_
+#define _CHECK_H_
+
+#include <stdio.h>
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Check the consistency of the FAT and the directory tree of the mounted image>
+ *
+ * Every problem is reported on one line:
+ * "FATCOPY <n> <sectors>"          FAT copy n differs from the first one,
+ * "INVALID <path> <cluster> <next>" chain leads to a free, bad or out of range cluster,
+ * "LOOP <path> <cluster>"          chain comes back to one of its clusters,
+ * "CROSSLINK <path> <cluster>"     cluster already used by another chain,
+ * "SHORT <path> <clusters> <needed>" / "LONG <path> <clusters> <needed>"
+ *                                  chain length does not match the file size,
+ * "LOST <clusters> <chains>"       allocated clusters not used by any entry.
+ * A summary line "files <n> directories <n> clusters <n> problems <n>" ends the report.
+ * The folders of the root directory are read by up to WORKERS_MAX_THREADS
+ * threads, each with its own handle of the image; the chains are then
+ * followed in WalkTree order so the report does not depend on the threads.
+ *
+ * @param _report <Pointer to a FILE object receiving the problems>.
+ *
+ * @return <number of problems, -1 if out of memory>.
+ */
+int CheckVolume(FILE *_report);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,92 @@
+#include "Clone.h"
+#include "FAT.h"
+#include "HAL.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define IS_ALLOCATED(bitmap, index) (((bitmap)[(index) / 8] >> ((index) % 8)) & 1)
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/*!
+ * @brief <Copy the mounted image, allocated clusters only>
+ *
+ * @param _outName <Name of the image to create, must not be the mounted image>.
+ *
+ * @return <zero on success>.
+ */
+int CloneImage(const char *_outName)
+{
+    const unsigned int entryCount = GetClusterCount() + FIRST_CLUSTER;
+    const unsigned int sectorPerCluster = GetSectorPerCluster();
+    const uint64_t dataStart = ClusterToSector(FIRST_CLUSTER);
+    const uint64_t dataEnd = ClusterToSector(entryCount);
+    uint8_t *allocated = LoadAllocationBitmap();
+    uint64_t imageSize = 0;
+    uint64_t imageMtime = 0;
+    FILE *out = NULL;
+    unsigned int cluster = FIRST_CLUSTER;
+    uint64_t totalSectors;
+    int isFailed = (allocated == NULL) || (GetImgInfo(&imageSize, &imageMtime) != 0);
+
+    if (!isFailed)
+    {
+        fopen_s(&out, _outName, "wb");
+        isFailed = (out == NULL);
+    }
+
+    if (!isFailed)
+    {
+        totalSectors = imageSize / GetBytePerSector();
+
+        /* boot sector, FAT copies and root directory (or exFAT boot region and FAT) */
+        isFailed = (CloneSectors(out, 0, dataStart) != dataStart);
+
+        /* one call per run of allocated clusters */
+        while ((cluster < entryCount) && !isFailed)
+        {
+            unsigned int count = 0;
+
+            while ((cluster + count < entryCount) &&
+                   IS_ALLOCATED(allocated, cluster + count - FIRST_CLUSTER))
+            {
+                count++;
+            }
+
+            if (count == 0)
+            {
+                cluster++;
+            }
+            else
+            {
+                const uint64_t sectorCount = (uint64_t)count * sectorPerCluster;
+
+                isFailed = (CloneSectors(out, ClusterToSector(cluster), sectorCount) != sectorCount);
+                cluster += count;
+            }
+        }
+
+        /* sectors after the last cluster */
+        if (!isFailed && (totalSectors > dataEnd))
+        {
+            isFailed = (CloneSectors(out, dataEnd, totalSectors - dataEnd) != totalSectors - dataEnd);
+        }
+
+        /* trailing free clusters */
+        isFailed = isFailed || (SetFileSize(out, imageSize) != 0);
+    }
+
+    if (out != NULL)
+    {
+        isFailed = (fclose(out) != 0) || isFailed;
+    }
+
+    free(allocated);
+    return isFailed;
+}
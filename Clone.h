@@ -0,0 +1,21 @@
+#ifndef _CLONE_H_
+#define _CLONE_H_
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Copy the mounted image, allocated clusters only>
+ *
+ * Reserved sectors, FAT copies, root directory and every cluster in use
+ * are copied at their position, in physical order and one run at a time.
+ * Free and bad clusters are skipped and left as holes in the new file.
+ *
+ * @param _outName <Name of the image to create, must not be the mounted image>.
+ *
+ * @return <zero on success>.
+ */
+int CloneImage(const char *_outName);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,1071 @@
+#include "Daemon.h"
+#include "FAT.h"
+#include "HAL.h"
+#include "FileTable.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define DAEMON_MAX_EVENTS 64
+#define DAEMON_LISTEN_BACKLOG 128
+#define DAEMON_RECV_CHUNK (64 * 1024)
+#define DAEMON_OUT_HIGH (4 * 1024 * 1024) /* pending reply bytes before requests are left unread */
+#define DAEMON_CACHE_BUCKETS 4096         /* must be a power of two */
+
+/*
+ * Growable byte buffer
+ */
+typedef struct
+{
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+/*
+ * Cached STAT or READDIR reply, key and payload follow the structure
+ */
+typedef struct CacheItem
+{
+    struct CacheItem *next;  /* bucket chain */
+    struct CacheItem *newer; /* LRU list */
+    struct CacheItem *older;
+    uint32_t hash;
+    uint64_t imageSize; /* image the reply was built from */
+    uint64_t imageMtime;
+    size_t keyLength;
+    size_t replyLength;
+    uint16_t status;
+} CacheItem;
+
+/*
+ * Descriptor to attach to the byte at position of the output of a connection
+ */
+typedef struct
+{
+    size_t position;
+    int fd;
+} PendingFd;
+
+/*
+ * One client
+ */
+typedef struct
+{
+    int fd;
+    Buffer in;
+    Buffer out;
+    size_t sent; /* bytes of out already written */
+    PendingFd *fds;
+    unsigned int fdCount;
+    unsigned int fdCapacity;
+    int isWaitingOut; /* EPOLLOUT is set */
+} Connection;
+
+/*
+ * State of LookupPath for one directory
+ */
+typedef struct
+{
+    const char *name;
+    size_t length;
+    DirectoryEntry entry;
+    int isFound;
+} LookupContext;
+
+/*
+ * State of a READDIR reply
+ */
+typedef struct
+{
+    Buffer *reply;
+    uint32_t count;
+    int isFailed;
+} ListContext;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static int Reserve(Buffer *_buffer, size_t _extra);
+
+static int Append(Buffer *_buffer, const void *_data, size_t _length);
+
+static void PutNumber(uint8_t *_destination, int _count, uint64_t _value);
+
+static uint32_t HashKey(const uint8_t *_key, size_t _length);
+
+static CacheItem *CacheFind(const uint8_t *_key, size_t _length, uint64_t _size, uint64_t _mtime);
+
+static void CacheUnlink(CacheItem *_item);
+
+static void CacheStore(const uint8_t *_key, size_t _keyLength, uint16_t _status,
+                       const uint8_t *_reply, size_t _replyLength, uint64_t _size, uint64_t _mtime);
+
+static void CacheClear();
+
+static int StatImage(const char *_name, uint64_t *_size, uint64_t *_mtime);
+
+static int MountImage(const char *_name, uint64_t _size, uint64_t _mtime);
+
+static const char *EntryName(DirectoryEntry *entry, const char *path, char *_shortName);
+
+static int MatchEntry(DirectoryEntry *entry, const char *path, void *context);
+
+static int ListEntry(DirectoryEntry *entry, const char *path, void *context);
+
+static int LookupPath(const char *_path, DirectoryEntry *entry);
+
+static uint16_t BuildReply(uint16_t _op, const uint8_t *_payload, size_t _length, Buffer *_reply, int *_fd);
+
+static void HandleRequest(Connection *_connection, uint16_t _op, uint32_t _tag, const uint8_t *_payload, size_t _length);
+
+static int FlushConnection(Connection *_connection);
+
+static int ProcessRequests(Connection *_connection);
+
+static void CloseConnection(Connection *_connection);
+
+static void OnSignal(int _signal);
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static volatile sig_atomic_t s_isStopped = 0;
+
+static CacheItem *s_buckets[DAEMON_CACHE_BUCKETS];
+static CacheItem *s_newest = NULL;
+static CacheItem *s_oldest = NULL;
+static size_t s_cacheBytes = 0;
+static size_t s_cacheBudget = 0;
+
+static char *s_mountedName = NULL; /* image of the mounted volume */
+static uint64_t s_mountedSize = 0;
+static uint64_t s_mountedMtime = 0;
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/* room for _extra more bytes, non-zero if out of memory */
+static int Reserve(Buffer *_buffer, size_t _extra)
+{
+    int isFailed = 0;
+
+    if (_buffer->length + _extra > _buffer->capacity)
+    {
+        size_t capacity = (_buffer->capacity == 0) ? 4096 : _buffer->capacity;
+        uint8_t *data;
+
+        while (capacity < _buffer->length + _extra)
+        {
+            capacity *= 2;
+        }
+
+        data = (uint8_t *)realloc(_buffer->data, capacity);
+        isFailed = (data == NULL);
+        if (!isFailed)
+        {
+            _buffer->data = data;
+            _buffer->capacity = capacity;
+        }
+    }
+
+    return isFailed;
+}
+
+static int Append(Buffer *_buffer, const void *_data, size_t _length)
+{
+    int isFailed = Reserve(_buffer, _length);
+
+    if (!isFailed)
+    {
+        memcpy(_buffer->data + _buffer->length, _data, _length);
+        _buffer->length += _length;
+    }
+
+    return isFailed;
+}
+
+/* little endian, the opposite of ReadNumber */
+static void PutNumber(uint8_t *_destination, int _count, uint64_t _value)
+{
+    int i;
+
+    for (i = 0; i < _count; i++)
+    {
+        _destination[i] = (uint8_t)(_value >> (8 * i));
+    }
+}
+
+/* FNV-1a */
+static uint32_t HashKey(const uint8_t *_key, size_t _length)
+{
+    uint32_t hash = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < _length; i++)
+    {
+        hash = (hash ^ _key[i]) * 16777619U;
+    }
+
+    return hash;
+}
+
+/* cached reply of a key, made the newest; stale replies are dropped */
+static CacheItem *CacheFind(const uint8_t *_key, size_t _length, uint64_t _size, uint64_t _mtime)
+{
+    const uint32_t hash = HashKey(_key, _length);
+    CacheItem *item = s_buckets[hash & (DAEMON_CACHE_BUCKETS - 1)];
+
+    while ((item != NULL) &&
+           ((item->hash != hash) || (item->keyLength != _length) || (memcmp(item + 1, _key, _length) != 0)))
+    {
+        item = item->next;
+    }
+
+    if ((item != NULL) && ((item->imageSize != _size) || (item->imageMtime != _mtime)))
+    {
+        /* the image changed since */
+        CacheUnlink(item);
+        free(item);
+        item = NULL;
+    }
+
+    if ((item != NULL) && (item != s_newest))
+    {
+        /* move to the head of the LRU list */
+        item->newer->older = item->older;
+        if (item->older != NULL)
+        {
+            item->older->newer = item->newer;
+        }
+        else
+        {
+            s_oldest = item->newer;
+        }
+        item->older = s_newest;
+        item->newer = NULL;
+        s_newest->newer = item;
+        s_newest = item;
+    }
+
+    return item;
+}
+
+/* remove from the bucket and the LRU list, the caller frees */
+static void CacheUnlink(CacheItem *_item)
+{
+    CacheItem **link = &s_buckets[_item->hash & (DAEMON_CACHE_BUCKETS - 1)];
+
+    while (*link != _item)
+    {
+        link = &(*link)->next;
+    }
+    *link = _item->next;
+
+    if (_item->newer != NULL)
+    {
+        _item->newer->older = _item->older;
+    }
+    else
+    {
+        s_newest = _item->older;
+    }
+
+    if (_item->older != NULL)
+    {
+        _item->older->newer = _item->newer;
+    }
+    else
+    {
+        s_oldest = _item->newer;
+    }
+
+    s_cacheBytes -= sizeof(CacheItem) + _item->keyLength + _item->replyLength;
+}
+
+static void CacheStore(const uint8_t *_key, size_t _keyLength, uint16_t _status,
+                       const uint8_t *_reply, size_t _replyLength, uint64_t _size, uint64_t _mtime)
+{
+    const size_t bytes = sizeof(CacheItem) + _keyLength + _replyLength;
+    CacheItem *item;
+
+    if (bytes > s_cacheBudget / 4)
+    {
+        return;
+    }
+
+    /* one budget for every image, the least recently used replies go first */
+    while ((s_oldest != NULL) && (s_cacheBytes + bytes > s_cacheBudget))
+    {
+        item = s_oldest;
+        CacheUnlink(item);
+        free(item);
+    }
+
+    item = (CacheItem *)malloc(bytes);
+    if (item != NULL)
+    {
+        item->hash = HashKey(_key, _keyLength);
+        item->imageSize = _size;
+        item->imageMtime = _mtime;
+        item->keyLength = _keyLength;
+        item->replyLength = _replyLength;
+        item->status = _status;
+        memcpy(item + 1, _key, _keyLength);
+        memcpy((uint8_t *)(item + 1) + _keyLength, _reply, _replyLength);
+
+        item->next = s_buckets[item->hash & (DAEMON_CACHE_BUCKETS - 1)];
+        s_buckets[item->hash & (DAEMON_CACHE_BUCKETS - 1)] = item;
+        item->older = s_newest;
+        item->newer = NULL;
+        if (s_newest != NULL)
+        {
+            s_newest->newer = item;
+        }
+        else
+        {
+            s_oldest = item;
+        }
+        s_newest = item;
+        s_cacheBytes += bytes;
+    }
+}
+
+static void CacheClear()
+{
+    while (s_oldest != NULL)
+    {
+        CacheItem *item = s_oldest;
+
+        CacheUnlink(item);
+        free(item);
+    }
+}
+
+/* identity of an image file, the cache and the mount are checked against it */
+static int StatImage(const char *_name, uint64_t *_size, uint64_t *_mtime)
+{
+    struct stat info;
+    int isFailed = (stat(_name, &info) != 0) || !S_ISREG(info.st_mode);
+
+    if (!isFailed)
+    {
+        *_size = (uint64_t)info.st_size;
+        *_mtime = (uint64_t)info.st_mtime;
+    }
+
+    return isFailed;
+}
+
+/* mount _name unless it is already mounted and unchanged */
+static int MountImage(const char *_name, uint64_t _size, uint64_t _mtime)
+{
+    FILE *probe = NULL;
+    int isFailed = 0;
+
+    if ((s_mountedName == NULL) || (strcmp(s_mountedName, _name) != 0) ||
+        (s_mountedSize != _size) || (s_mountedMtime != _mtime))
+    {
+        /* FatInit exits when the image can not be opened */
+        fopen_s(&probe, _name, "rb");
+        isFailed = (probe == NULL);
+        if (!isFailed)
+        {
+            fclose(probe);
+        }
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (!isFailed)
+    {
+        if (s_mountedName != NULL)
+        {
+            FatDeInit();
+            free(s_mountedName);
+        }
+
+        FatInit(_name);
+        s_mountedName = strdup(_name);
+        s_mountedSize = _size;
+        s_mountedMtime = _mtime;
+    }
+
+    return isFailed;
+}
+
+/* name of a visible entry, NULL for the slots WalkTree skips too */
+static const char *EntryName(DirectoryEntry *entry, const char *path, char *_shortName)
+{
+    size_t length;
+
+    if ((entry->name[0] == ENTRY_EMPTY) ||
+        (entry->name[0] == ENTRY_DELETED) ||
+        (entry->name[0] == ENTRY_DOT) ||
+        (entry->attributes == ENTRY_NAME) ||
+        (entry->attributes & ENTRY_VOLUME))
+    {
+        return NULL;
+    }
+
+    /* long name of the entry, exFAT entry set or FAT long name slots */
+    if (path != NULL)
+    {
+        return path;
+    }
+
+    GetName(_shortName, entry);
+    if (entry->name[0] == ENTRY_E5)
+    {
+        _shortName[0] = (char)ENTRY_DELETED;
+    }
+
+    length = strlen(_shortName);
+    if ((length > 0) && (_shortName[length - 1] == '.'))
+    {
+        _shortName[length - 1] = '\0';
+    }
+
+    return _shortName;
+}
+
+/* ScanDirectory visitor of LookupPath */
+static int MatchEntry(DirectoryEntry *entry, const char *path, void *context)
+{
+    LookupContext *lookup = (LookupContext *)context;
+    char shortName[14];
+    const char *name = EntryName(entry, path, shortName);
+
+    if ((name != NULL) && (strlen(name) == lookup->length) && (strncasecmp(name, lookup->name, lookup->length) == 0))
+    {
+        memcpy(&lookup->entry, entry, sizeof(DirectoryEntry));
+        lookup->isFound = 1;
+    }
+
+    return lookup->isFound;
+}
+
+/* ScanDirectory visitor of READDIR */
+static int ListEntry(DirectoryEntry *entry, const char *path, void *context)
+{
+    ListContext *list = (ListContext *)context;
+    char shortName[14];
+    const char *name = EntryName(entry, path, shortName);
+    uint8_t record[12];
+
+    if (name != NULL)
+    {
+        const size_t length = strlen(name);
+
+        PutNumber(record, 4, ReadNumber(4, entry->size));
+        PutNumber(record + 4, 4, (ReadNumber(2, entry->modifiedDate) << 16) | ReadNumber(2, entry->modifiedTime));
+        record[8] = entry->attributes;
+        record[9] = 0;
+        PutNumber(record + 10, 2, length);
+
+        list->isFailed = Append(list->reply, record, sizeof(record)) || Append(list->reply, name, length);
+        list->count++;
+    }
+
+    return list->isFailed;
+}
+
+/* entry of an absolute path of the mounted volume, the root directory has cluster 0 */
+static int LookupPath(const char *_path, DirectoryEntry *entry)
+{
+    const char *p = _path;
+    int isFound = 1;
+
+    memset(entry, 0, sizeof(DirectoryEntry));
+    entry->attributes = ENTRY_DIRECTORY;
+
+    while (isFound && (*p != '\0'))
+    {
+        LookupContext lookup;
+
+        while (*p == '/')
+        {
+            p++;
+        }
+        if (*p == '\0')
+        {
+            break;
+        }
+
+        lookup.name = p;
+        while ((*p != '\0') && (*p != '/'))
+        {
+            p++;
+        }
+        lookup.length = (size_t)(p - lookup.name);
+        lookup.isFound = 0;
+
+        isFound = (entry->attributes & ENTRY_DIRECTORY) &&
+                  (ScanDirectory(GetEntryCluster(entry), MatchEntry, &lookup) != 0);
+        if (isFound)
+        {
+            memcpy(entry, &lookup.entry, sizeof(DirectoryEntry));
+        }
+    }
+
+    return !isFound;
+}
+
+/* payload of the reply to one request of the mounted image, _payload has the image name
+ * and the path terminated, *_fd is set for DAEMON_OP_OPEN */
+static uint16_t BuildReply(uint16_t _op, const uint8_t *_payload, size_t _length, Buffer *_reply, int *_fd)
+{
+    const size_t fixed = (_op == DAEMON_OP_READ) ? 12 : 0;
+    const char *path = (const char *)_payload + fixed + 4 + ReadNumber(2, _payload + fixed) + 1;
+    DirectoryEntry entry;
+    uint16_t status = DAEMON_STATUS_OK;
+
+    (void)_length; /* checked by HandleRequest */
+    if (LookupPath(path, &entry) != 0)
+    {
+        status = DAEMON_STATUS_NOT_FOUND;
+    }
+    else if (_op == DAEMON_OP_STAT)
+    {
+        uint8_t stat[16];
+
+        PutNumber(stat, 4, ReadNumber(4, entry.size));
+        PutNumber(stat + 4, 4, GetEntryCluster(&entry));
+        PutNumber(stat + 8, 4, (ReadNumber(2, entry.modifiedDate) << 16) | ReadNumber(2, entry.modifiedTime));
+        PutNumber(stat + 12, 4, entry.attributes);
+        Append(_reply, stat, sizeof(stat));
+    }
+    else if (_op == DAEMON_OP_READDIR)
+    {
+        ListContext list;
+        uint8_t count[4] = {0};
+
+        list.reply = _reply;
+        list.count = 0;
+        list.isFailed = Append(_reply, count, sizeof(count));
+
+        if (!(entry.attributes & ENTRY_DIRECTORY))
+        {
+            status = DAEMON_STATUS_BAD_REQUEST;
+        }
+        else
+        {
+            ScanDirectory(GetEntryCluster(&entry), ListEntry, &list);
+            PutNumber(_reply->data, 4, list.count);
+        }
+    }
+    else if (entry.attributes & ENTRY_DIRECTORY)
+    {
+        status = DAEMON_STATUS_BAD_REQUEST;
+    }
+    else if (_op == DAEMON_OP_READ)
+    {
+        const uint64_t offset = ReadNumber(8, _payload);
+        const unsigned int size = GetSizeofFile(&entry);
+        unsigned int length = (unsigned int)ReadNumber(4, _payload + 8);
+
+        if (offset >= size)
+        {
+            length = 0;
+        }
+        else if (length > size - offset)
+        {
+            length = size - (unsigned int)offset;
+        }
+        if (length > DAEMON_READ_MAX)
+        {
+            length = DAEMON_READ_MAX;
+        }
+
+        if ((length > 0) && (Reserve(_reply, length) == 0))
+        {
+            const int handle = OpenHandle(&entry);
+
+            if (handle != FILE_HANDLE_INVALID)
+            {
+                SeekHandle(handle, (unsigned int)offset, F_SEEK_SET);
+                _reply->length += ReadHandle(handle, _reply->data + _reply->length, length);
+                FileHandleClose(handle);
+            }
+        }
+    }
+    else
+    {
+        /* DAEMON_OP_OPEN, the client reads the run itself */
+        const unsigned int size = GetSizeofFile(&entry);
+        const unsigned int bytePerSector = GetBytePerSector();
+        unsigned int extentCount = 0;
+        Extent *extents = GetFileExtents(GetEntryCluster(&entry), &extentCount);
+        uint64_t offset = 0;
+        uint8_t range[16];
+
+        status = DAEMON_STATUS_NOT_CONTIGUOUS;
+        if ((size == 0) ||
+            ((extentCount == 1) && ((uint64_t)extents[0].count * GetSectorPerCluster() * bytePerSector >= size)))
+        {
+            const int fd = GetImgRange((size == 0) ? 0 : ClusterToSector(extents[0].cluster),
+                                       (size + bytePerSector - 1) / bytePerSector, &offset);
+
+            *_fd = (fd >= 0) ? dup(fd) : -1;
+            if (*_fd >= 0)
+            {
+                PutNumber(range, 8, offset);
+                PutNumber(range + 8, 8, size);
+                Append(_reply, range, sizeof(range));
+                status = DAEMON_STATUS_OK;
+            }
+        }
+
+        free(extents);
+    }
+
+    return status;
+}
+
+/* answer one request, the reply is queued on the connection */
+static void HandleRequest(Connection *_connection, uint16_t _op, uint32_t _tag, const uint8_t *_payload, size_t _length)
+{
+    const size_t fixed = (_op == DAEMON_OP_READ) ? 12 : 0;
+    const int isCached = (_op == DAEMON_OP_STAT) || (_op == DAEMON_OP_READDIR);
+    Buffer reply;
+    uint8_t header[DAEMON_HEADER_SIZE];
+    char *image = NULL;
+    uint64_t imageSize = 0;
+    uint64_t imageMtime = 0;
+    uint16_t status = DAEMON_STATUS_BAD_REQUEST;
+    int fd = -1;
+
+    memset(&reply, 0, sizeof(reply));
+
+    /* payload copy with the image name and the path terminated */
+    if ((_op >= DAEMON_OP_STAT) && (_op <= DAEMON_OP_OPEN) && (_length >= fixed + 4) &&
+        (fixed + 4 + ReadNumber(2, _payload + fixed) + ReadNumber(2, _payload + fixed + 2) == _length))
+    {
+        const size_t imageLength = (size_t)ReadNumber(2, _payload + fixed);
+
+        image = (char *)malloc(_length + 2);
+        if (image != NULL)
+        {
+            memcpy(image, _payload, _length);
+            image[_length] = '\0';
+            memmove(image + fixed + 4 + imageLength + 1, image + fixed + 4 + imageLength, _length - fixed - 4 - imageLength + 1);
+            image[fixed + 4 + imageLength] = '\0';
+            status = DAEMON_STATUS_NO_IMAGE;
+        }
+    }
+
+    if ((status == DAEMON_STATUS_NO_IMAGE) && (StatImage(image + fixed + 4, &imageSize, &imageMtime) == 0))
+    {
+        /* key: op, image name and path, each terminated */
+        const size_t keyLength = _length - fixed - 4 + 2;
+        uint8_t *key = (uint8_t *)image + fixed + 3;
+        const uint8_t savedOp = *key;
+        CacheItem *item;
+
+        *key = (uint8_t)_op;
+        item = isCached ? CacheFind(key, keyLength, imageSize, imageMtime) : NULL;
+        *key = savedOp;
+
+        if (item != NULL)
+        {
+            status = item->status;
+            Append(&reply, (uint8_t *)(item + 1) + item->keyLength, item->replyLength);
+        }
+        else if (MountImage(image + fixed + 4, imageSize, imageMtime) == 0)
+        {
+            status = BuildReply(_op, (const uint8_t *)image, _length + 1, &reply, &fd);
+            if (isCached)
+            {
+                *key = (uint8_t)_op;
+                CacheStore(key, keyLength, status, reply.data, reply.length, imageSize, imageMtime);
+                *key = savedOp;
+            }
+        }
+    }
+
+    if (status != DAEMON_STATUS_OK)
+    {
+        reply.length = 0;
+    }
+
+    PutNumber(header, 4, reply.length);
+    PutNumber(header + 4, 2, status);
+    PutNumber(header + 6, 2, _op);
+    PutNumber(header + 8, 4, _tag);
+
+    if (fd >= 0)
+    {
+        /* the descriptor goes with the first byte of the reply */
+        if ((_connection->fdCount == _connection->fdCapacity))
+        {
+            const unsigned int capacity = (_connection->fdCapacity == 0) ? 8 : _connection->fdCapacity * 2;
+            PendingFd *fds = (PendingFd *)realloc(_connection->fds, capacity * sizeof(PendingFd));
+
+            if (fds != NULL)
+            {
+                _connection->fds = fds;
+                _connection->fdCapacity = capacity;
+            }
+        }
+
+        if (_connection->fdCount < _connection->fdCapacity)
+        {
+            _connection->fds[_connection->fdCount].position = _connection->out.length;
+            _connection->fds[_connection->fdCount].fd = fd;
+            _connection->fdCount++;
+        }
+        else
+        {
+            close(fd);
+        }
+    }
+
+    Append(&_connection->out, header, sizeof(header));
+    Append(&_connection->out, reply.data, reply.length);
+
+    free(reply.data);
+    free(image);
+}
+
+/* write what the socket takes, non-zero if the connection is lost */
+static int FlushConnection(Connection *_connection)
+{
+    int isFailed = 0;
+
+    while (!isFailed && (_connection->sent < _connection->out.length))
+    {
+        size_t end = _connection->out.length;
+        int fd = -1;
+        struct msghdr message;
+        struct iovec vector;
+        union
+        {
+            struct cmsghdr header;
+            char space[CMSG_SPACE(sizeof(int))];
+        } control;
+        ssize_t n;
+
+        /* one sendmsg per descriptor, attached to the first byte of its reply */
+        if (_connection->fdCount > 0)
+        {
+            if (_connection->fds[0].position == _connection->sent)
+            {
+                fd = _connection->fds[0].fd;
+                end = (_connection->fdCount > 1) ? _connection->fds[1].position : end;
+            }
+            else
+            {
+                end = _connection->fds[0].position;
+            }
+        }
+
+        memset(&message, 0, sizeof(message));
+        vector.iov_base = _connection->out.data + _connection->sent;
+        vector.iov_len = end - _connection->sent;
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+
+        if (fd >= 0)
+        {
+            struct cmsghdr *cmsg;
+
+            memset(&control, 0, sizeof(control));
+            message.msg_control = control.space;
+            message.msg_controllen = sizeof(control.space);
+            cmsg = CMSG_FIRSTHDR(&message);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+
+        n = sendmsg(_connection->fd, &message, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            isFailed = (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR);
+            break;
+        }
+
+        if (fd >= 0)
+        {
+            close(fd);
+            _connection->fdCount--;
+            memmove(_connection->fds, _connection->fds + 1, _connection->fdCount * sizeof(PendingFd));
+        }
+        _connection->sent += (size_t)n;
+    }
+
+    if (_connection->sent == _connection->out.length)
+    {
+        _connection->out.length = 0;
+        _connection->sent = 0;
+    }
+
+    return isFailed;
+}
+
+/* answer the complete requests received, non-zero on a protocol error */
+static int ProcessRequests(Connection *_connection)
+{
+    size_t consumed = 0;
+    int isFailed = 0;
+
+    /* replies not read by the client hold the next requests back */
+    while (!isFailed && (_connection->out.length - _connection->sent < DAEMON_OUT_HIGH) &&
+           (_connection->in.length - consumed >= DAEMON_HEADER_SIZE))
+    {
+        const uint8_t *header = _connection->in.data + consumed;
+        const size_t length = (size_t)ReadNumber(4, header);
+
+        isFailed = (length > DAEMON_REQUEST_MAX);
+        if (!isFailed && (_connection->in.length - consumed - DAEMON_HEADER_SIZE >= length))
+        {
+            HandleRequest(_connection, (uint16_t)ReadNumber(2, header + 4), (uint32_t)ReadNumber(4, header + 8),
+                          header + DAEMON_HEADER_SIZE, length);
+            consumed += DAEMON_HEADER_SIZE + length;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    memmove(_connection->in.data, _connection->in.data + consumed, _connection->in.length - consumed);
+    _connection->in.length -= consumed;
+
+    return isFailed;
+}
+
+static void CloseConnection(Connection *_connection)
+{
+    unsigned int i;
+
+    for (i = 0; i < _connection->fdCount; i++)
+    {
+        close(_connection->fds[i].fd);
+    }
+
+    close(_connection->fd);
+    free(_connection->fds);
+    free(_connection->in.data);
+    free(_connection->out.data);
+    free(_connection);
+}
+
+static void OnSignal(int _signal)
+{
+    (void)_signal;
+    s_isStopped = 1;
+}
+
+/*!
+ * @brief <Serve stat/readdir/read requests of many images on a Unix socket>
+ *
+ * @param _socketPath <path of the socket, replaced if it exists>.
+ * @param _cacheBudget <memory limit of cached replies in bytes>.
+ *
+ * @return <zero on success>.
+ */
+int RunDaemon(const char *_socketPath, size_t _cacheBudget)
+{
+    struct sockaddr_un address;
+    struct epoll_event event;
+    struct epoll_event events[DAEMON_MAX_EVENTS];
+    struct sigaction action;
+    Connection **connections = NULL;
+    unsigned int connectionCount = 0;
+    unsigned int connectionCapacity = 0;
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int poller = epoll_create1(EPOLL_CLOEXEC);
+    int isFailed = (listener < 0) || (poller < 0) || (strlen(_socketPath) >= sizeof(address.sun_path));
+    unsigned int i;
+
+    s_cacheBudget = _cacheBudget;
+    s_isStopped = 0;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = OnSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (!isFailed)
+    {
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, _socketPath);
+        unlink(_socketPath);
+
+        event.events = EPOLLIN;
+        event.data.ptr = NULL; /* the listener */
+        isFailed = (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0) ||
+                   (listen(listener, DAEMON_LISTEN_BACKLOG) != 0) ||
+                   (epoll_ctl(poller, EPOLL_CTL_ADD, listener, &event) != 0);
+    }
+
+    while (!isFailed && !s_isStopped)
+    {
+        const int count = epoll_wait(poller, events, DAEMON_MAX_EVENTS, -1);
+        int e;
+
+        isFailed = (count < 0) && (errno != EINTR);
+
+        for (e = 0; e < count; e++)
+        {
+            Connection *connection = (Connection *)events[e].data.ptr;
+            int isClosed = 0;
+
+            if (connection == NULL)
+            {
+                int fd;
+
+                /* every pending client */
+                while ((fd = accept(listener, NULL, NULL)) >= 0)
+                {
+                    fcntl(fd, F_SETFL, O_NONBLOCK);
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    connection = (Connection *)calloc(1, sizeof(Connection));
+                    if ((connection != NULL) && (connectionCount == connectionCapacity))
+                    {
+                        const unsigned int capacity = (connectionCapacity == 0) ? 64 : connectionCapacity * 2;
+                        Connection **grown = (Connection **)realloc(connections, capacity * sizeof(Connection *));
+
+                        if (grown != NULL)
+                        {
+                            connections = grown;
+                            connectionCapacity = capacity;
+                        }
+                    }
+
+                    event.events = EPOLLIN | EPOLLRDHUP;
+                    event.data.ptr = connection;
+                    if ((connection == NULL) || (connectionCount == connectionCapacity) ||
+                        (epoll_ctl(poller, EPOLL_CTL_ADD, fd, &event) != 0))
+                    {
+                        free(connection);
+                        close(fd);
+                    }
+                    else
+                    {
+                        connection->fd = fd;
+                        connections[connectionCount++] = connection;
+                    }
+                }
+                continue;
+            }
+
+            if (events[e].events & EPOLLIN)
+            {
+                ssize_t n;
+
+                /* everything available, requests are answered in batches */
+                do
+                {
+                    n = -1;
+                    if (Reserve(&connection->in, DAEMON_RECV_CHUNK) == 0)
+                    {
+                        n = recv(connection->fd, connection->in.data + connection->in.length, DAEMON_RECV_CHUNK, 0);
+                    }
+                    if (n > 0)
+                    {
+                        connection->in.length += (size_t)n;
+                    }
+                } while (n == DAEMON_RECV_CHUNK);
+
+                isClosed = (n == 0) || ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK));
+            }
+
+            isClosed = isClosed || (events[e].events & (EPOLLERR | EPOLLHUP));
+            isClosed = isClosed || ProcessRequests(connection) || FlushConnection(connection);
+
+            /* requests held back while the output was full */
+            while (!isClosed && (connection->out.length == 0) && (connection->in.length >= DAEMON_HEADER_SIZE) &&
+                   (connection->in.length >= DAEMON_HEADER_SIZE + ReadNumber(4, connection->in.data)))
+            {
+                isClosed = ProcessRequests(connection) || FlushConnection(connection);
+            }
+
+            if (!isClosed && ((connection->out.length > 0) != connection->isWaitingOut))
+            {
+                connection->isWaitingOut = (connection->out.length > 0);
+                event.events = EPOLLIN | EPOLLRDHUP | (connection->isWaitingOut ? EPOLLOUT : 0);
+                event.data.ptr = connection;
+                epoll_ctl(poller, EPOLL_CTL_MOD, connection->fd, &event);
+            }
+
+            if (isClosed)
+            {
+                for (i = 0; i < connectionCount; i++)
+                {
+                    if (connections[i] == connection)
+                    {
+                        connections[i] = connections[--connectionCount];
+                        break;
+                    }
+                }
+                CloseConnection(connection);
+            }
+        }
+    }
+
+    for (i = 0; i < connectionCount; i++)
+    {
+        CloseConnection(connections[i]);
+    }
+    free(connections);
+
+    if (listener >= 0)
+    {
+        close(listener);
+        unlink(_socketPath);
+    }
+    if (poller >= 0)
+    {
+        close(poller);
+    }
+
+    CacheClear();
+    if (s_mountedName != NULL)
+    {
+        FatDeInit();
+        free(s_mountedName);
+        s_mountedName = NULL;
+    }
+
+    return isFailed;
+}
+
+#else
+
+/*!
+ * @brief <Serve stat/readdir/read requests of many images on a Unix socket>
+ *
+ * @param _socketPath <path of the socket, replaced if it exists>.
+ * @param _cacheBudget <memory limit of cached replies in bytes>.
+ *
+ * @return <zero on success>.
+ */
+int RunDaemon(const char *_socketPath, size_t _cacheBudget)
+{
+    /* epoll and SCM_RIGHTS are Linux only */
+    fprintf(stderr, "serve is not supported on this platform\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+
+/*
+ * Binary protocol over a Unix stream socket, every number is little endian.
+ *
+ * Request:  uint32 length of the payload, uint16 op, uint16 0, uint32 tag, payload
+ *           payload: [uint64 offset, uint32 length (DAEMON_OP_READ only)]
+ *                    uint16 image name length, uint16 path length, image name, path
+ * Response: uint32 length of the payload, uint16 status, uint16 op, uint32 tag, payload
+ *           DAEMON_OP_STAT    uint32 size, uint32 start cluster, uint32 timestamp, uint32 attributes
+ *           DAEMON_OP_READDIR uint32 count, then per entry uint32 size, uint32 timestamp,
+ *                             uint8 attributes, uint8 0, uint16 name length, UTF-8 name
+ *           DAEMON_OP_READ    file data, shorter at the end of the file
+ *           DAEMON_OP_OPEN    uint64 byte offset in the image file, uint64 length, the
+ *                             descriptor of the image file attached (SCM_RIGHTS) to the response
+ *
+ * Paths are absolute and case insensitive, "/" is the root directory.
+ * Responses come in the order of the requests of a connection.
+ */
+#define DAEMON_HEADER_SIZE 12
+#define DAEMON_REQUEST_MAX (64 * 1024) /* payload bytes of a request */
+#define DAEMON_READ_MAX (1024 * 1024)  /* bytes of one DAEMON_OP_READ */
+
+#define DAEMON_OP_STAT 1
+#define DAEMON_OP_READDIR 2
+#define DAEMON_OP_READ 3
+#define DAEMON_OP_OPEN 4 /* file data in one contiguous run only */
+
+#define DAEMON_STATUS_OK 0
+#define DAEMON_STATUS_NOT_FOUND 1
+#define DAEMON_STATUS_BAD_REQUEST 2
+#define DAEMON_STATUS_NO_IMAGE 3
+#define DAEMON_STATUS_NOT_CONTIGUOUS 4
+
+#define DAEMON_CACHE_DEFAULT_BUDGET (16 * 1024 * 1024) /* bytes of cached replies, all images */
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Serve stat/readdir/read requests of many images on a Unix socket>
+ *
+ * One epoll loop serves every connection. Images are mounted on demand, the
+ * last used one stays mounted. STAT and READDIR replies of every image share one
+ * LRU cache of _cacheBudget bytes, checked against the size and modification
+ * time of the image, so they are answered without mounting. Stops on SIGINT or SIGTERM.
+ * Linux only.
+ *
+ * @param _socketPath <path of the socket, replaced if it exists>.
+ * @param _cacheBudget <memory limit of cached replies in bytes>.
+ *
+ * @return <zero on success>.
+ */
+int RunDaemon(const char *_socketPath, size_t _cacheBudget);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,439 @@
+#include "Defrag.h"
+#include "FAT.h"
+#include "HAL.h"
+#include "Check.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define DEFRAG_BATCH_CLUSTERS 128 /* contiguous clusters copied per ReadNSectors call */
+#define FSINFO_FREE_OFFSET 488    /* FAT32 FS information sector, free cluster count and next free hint */
+#define FSINFO_HINT_BYTES 8
+
+/*
+ * Totals of WriteFragReport
+ */
+typedef struct
+{
+    FILE *out;
+    unsigned int fileCount;
+    unsigned int fragmentedCount;
+    uint64_t extentCount;
+    uint64_t seekDistance;
+} FragContext;
+
+/*
+ * New layout of the volume built by DefragImage
+ */
+typedef struct
+{
+    uint32_t *fat;          /* decoded FAT of the mounted image */
+    uint32_t *newFat;       /* FAT of the new image */
+    uint32_t *newCluster;   /* old cluster -> new cluster, 0 if dropped */
+    uint32_t *oldCluster;   /* new cluster -> old cluster, 0 if free */
+    uint8_t *isDirectory;   /* per old cluster, directory clusters are patched */
+    unsigned int entryCount;
+    unsigned int nextFree;  /* next cluster to hand out in the new image */
+} DefragContext;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static int ReportFile(DirectoryEntry *entry, const char *path, void *context);
+
+static void AssignChain(DefragContext *_defrag, unsigned int _startCluster, int _isDirectory);
+
+static int AssignEntry(DirectoryEntry *entry, const char *path, void *context);
+
+static void PatchDirectory(const DefragContext *_defrag, uint8_t *_data, unsigned int _byteCount);
+
+static int CopySectors(FILE *_out, uint8_t *_buffer, uint64_t _sectorPosition, uint64_t _count);
+
+static int WriteReservedSectors(const DefragContext *_defrag, FILE *_out, uint8_t *_buffer);
+
+static int WriteImage(const DefragContext *_defrag, FILE *_out);
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/* WalkTree visitor of WriteFragReport */
+static int ReportFile(DirectoryEntry *entry, const char *path, void *context)
+{
+    FragContext *frag = (FragContext *)context;
+    unsigned int extentCount = 0;
+    unsigned int clusterCount = 0;
+    unsigned int seek = 0;
+    unsigned int i;
+    Extent *extents;
+
+    if (entry->attributes & ENTRY_DIRECTORY)
+    {
+        return 0;
+    }
+
+    extents = GetFileExtents(GetEntryCluster(entry), &extentCount);
+
+    for (i = 0; i < extentCount; i++)
+    {
+        clusterCount += extents[i].count;
+
+        /* distance from the end of the previous run to the start of this one */
+        if (i > 0)
+        {
+            const unsigned int end = extents[i - 1].cluster + extents[i - 1].count;
+
+            seek += (extents[i].cluster > end) ? extents[i].cluster - end : end - extents[i].cluster;
+        }
+    }
+
+    fprintf(frag->out, "%6u %10.1f %8u %s\n", extentCount,
+            (extentCount > 0) ? (double)clusterCount / extentCount : 0.0, seek, path);
+
+    frag->fileCount++;
+    frag->extentCount += extentCount;
+    frag->seekDistance += seek;
+    if (extentCount > 1)
+    {
+        frag->fragmentedCount++;
+    }
+
+    free(extents);
+    return 0;
+}
+
+/*!
+ * @brief <Report the fragmentation of every file of the mounted image>
+ *
+ * @param _out <Pointer to a FILE object receiving the report>.
+ *
+ * @return <number of fragmented files>.
+ */
+int WriteFragReport(FILE *_out)
+{
+    FragContext frag;
+
+    memset(&frag, 0, sizeof(frag));
+    frag.out = _out;
+
+    fprintf(_out, "extents    avg run     seek path\n");
+    WalkTree(0, "", ReportFile, &frag);
+
+    fprintf(_out, "files %u fragmented %u extents %llu average %.2f seek %llu\n",
+            frag.fileCount, frag.fragmentedCount, (unsigned long long)frag.extentCount,
+            (frag.fileCount > 0) ? (double)frag.extentCount / frag.fileCount : 0.0,
+            (unsigned long long)frag.seekDistance);
+
+    return (int)frag.fragmentedCount;
+}
+
+/* give the clusters of a chain consecutive numbers in the new image */
+static void AssignChain(DefragContext *_defrag, unsigned int _startCluster, int _isDirectory)
+{
+    unsigned int cluster = _startCluster;
+    unsigned int previous = 0;
+
+    while ((cluster >= FIRST_CLUSTER) && (cluster < _defrag->entryCount) &&
+           (_defrag->newCluster[cluster] == 0))
+    {
+        unsigned int target;
+
+        /* bad clusters keep their place */
+        while ((_defrag->nextFree < _defrag->entryCount) &&
+               (_defrag->fat[_defrag->nextFree] == BAD_CLUSTER))
+        {
+            _defrag->nextFree++;
+        }
+        if (_defrag->nextFree >= _defrag->entryCount)
+        {
+            break;
+        }
+
+        target = _defrag->nextFree++;
+        _defrag->newCluster[cluster] = target;
+        _defrag->oldCluster[target] = cluster;
+        _defrag->isDirectory[cluster] = (uint8_t)_isDirectory;
+
+        if (previous != 0)
+        {
+            _defrag->newFat[previous] = target;
+        }
+        _defrag->newFat[target] = EOC;
+        previous = target;
+
+        cluster = _defrag->fat[cluster];
+    }
+}
+
+/* WalkTree visitor of DefragImage, a directory comes before its children */
+static int AssignEntry(DirectoryEntry *entry, const char *path, void *context)
+{
+    (void)path;
+    AssignChain((DefragContext *)context, GetEntryCluster(entry),
+                (entry->attributes & ENTRY_DIRECTORY) != 0);
+    return 0;
+}
+
+/* rewrite startClusters of the used slots of a directory */
+static void PatchDirectory(const DefragContext *_defrag, uint8_t *_data, unsigned int _byteCount)
+{
+    unsigned int offset;
+
+    for (offset = 0; offset + sizeof(DirectoryEntry) <= _byteCount; offset += sizeof(DirectoryEntry))
+    {
+        DirectoryEntry *entry = (DirectoryEntry *)(_data + offset);
+        unsigned int start;
+
+        if (entry->name[0] == ENTRY_EMPTY)
+        {
+            break;
+        }
+        if ((entry->name[0] == ENTRY_DELETED) || (entry->attributes == ENTRY_NAME) ||
+            (entry->attributes & ENTRY_VOLUME))
+        {
+            continue;
+        }
+
+        /* ".." of a first level directory stays 0 */
+        start = GetEntryCluster(entry);
+        if ((start >= FIRST_CLUSTER) && (start < _defrag->entryCount) && (_defrag->newCluster[start] != 0))
+        {
+            SetEntryCluster(entry, _defrag->newCluster[start]);
+        }
+    }
+}
+
+/* copy sectors of the mounted image unchanged, zero on success */
+static int CopySectors(FILE *_out, uint8_t *_buffer, uint64_t _sectorPosition, uint64_t _count)
+{
+    const unsigned int bytePerSector = GetBytePerSector();
+    const unsigned int batch = DEFRAG_BATCH_CLUSTERS * GetSectorPerCluster();
+    int isFailed = 0;
+
+    while ((_count > 0) && !isFailed)
+    {
+        const unsigned int n = (_count < batch) ? (unsigned int)_count : batch;
+
+        ReadNSectors(_buffer, _sectorPosition, n);
+        isFailed = (fwrite(_buffer, bytePerSector, n, _out) != n);
+        _sectorPosition += n;
+        _count -= n;
+    }
+
+    return isFailed;
+}
+
+/* copy boot and reserved sectors, the FAT32 root cluster and free space hints are updated */
+static int WriteReservedSectors(const DefragContext *_defrag, FILE *_out, uint8_t *_buffer)
+{
+    const unsigned int bytePerSector = GetBytePerSector();
+    const unsigned int rootCluster = GetRootCluster();
+    unsigned int backupBoot = 0;
+    unsigned int fsInfo = 0;
+    unsigned int sector;
+    int isFailed = 0;
+
+    if (rootCluster == 0)
+    {
+        return CopySectors(_out, _buffer, 0, GetStartSectorFAT());
+    }
+
+    ReadSector(_buffer, 0);
+    backupBoot = (unsigned int)ReadNumber(2, ((const BIOSParam *)(_buffer + BIOS_PARAM_OFFSET))->backupBootSector);
+    fsInfo = (unsigned int)ReadNumber(2, ((const BIOSParam *)(_buffer + BIOS_PARAM_OFFSET))->fsInfoSector);
+
+    for (sector = 0; (sector < GetStartSectorFAT()) && !isFailed; sector++)
+    {
+        ReadSector(_buffer, sector);
+
+        if ((sector == 0) || ((backupBoot != 0) && (sector == backupBoot)))
+        {
+            const unsigned int newRoot = _defrag->newCluster[rootCluster];
+            uint8_t *field = ((BIOSParam *)(_buffer + BIOS_PARAM_OFFSET))->rootCluster;
+
+            field[0] = (uint8_t)newRoot;
+            field[1] = (uint8_t)(newRoot >> 8);
+            field[2] = (uint8_t)(newRoot >> 16);
+            field[3] = (uint8_t)(newRoot >> 24);
+        }
+        else if ((fsInfo != 0) && ((sector == fsInfo) || ((backupBoot != 0) && (sector == backupBoot + fsInfo))))
+        {
+            /* unknown, recomputed by the next driver that needs them */
+            memset(_buffer + FSINFO_FREE_OFFSET, 0xFF, FSINFO_HINT_BYTES);
+        }
+
+        isFailed = (fwrite(_buffer, 1, bytePerSector, _out) != bytePerSector);
+    }
+
+    return isFailed;
+}
+
+/* write reserved region, FAT copies, root directory and data in the new order */
+static int WriteImage(const DefragContext *_defrag, FILE *_out)
+{
+    const unsigned int bytePerSector = GetBytePerSector();
+    const unsigned int sectorPerCluster = GetSectorPerCluster();
+    const unsigned int bytePerCluster = bytePerSector * sectorPerCluster;
+    const unsigned int sectorPerFAT = GetSectorPerFAT();
+    const size_t fatBytes = (size_t)sectorPerFAT * bytePerSector;
+    const size_t rootBytes = (size_t)SectorPerRoot() * bytePerSector;
+    size_t bufferBytes = (size_t)DEFRAG_BATCH_CLUSTERS * bytePerCluster;
+    uint8_t *buffer;
+    uint64_t imageSize = 0;
+    uint64_t imageMtime = 0;
+    uint64_t totalSectors;
+    unsigned int cluster;
+    unsigned int i;
+    int isFailed = 0;
+
+    if (bufferBytes < fatBytes)
+    {
+        bufferBytes = fatBytes;
+    }
+    if (bufferBytes < rootBytes)
+    {
+        bufferBytes = rootBytes;
+    }
+
+    buffer = (uint8_t *)malloc(bufferBytes);
+    if (buffer == NULL)
+    {
+        return 1;
+    }
+
+    /* boot and reserved sectors */
+    isFailed = WriteReservedSectors(_defrag, _out, buffer);
+
+    /* every FAT copy, media entries 0 and 1 kept */
+    memset(buffer, 0, fatBytes);
+    for (cluster = 0; cluster < _defrag->entryCount; cluster++)
+    {
+        EncodeFATEntry(buffer, cluster, (cluster < FIRST_CLUSTER) ? _defrag->fat[cluster] : _defrag->newFat[cluster]);
+    }
+    for (i = 0; (i < GetNumFAT()) && !isFailed; i++)
+    {
+        isFailed = (fwrite(buffer, 1, fatBytes, _out) != fatBytes);
+    }
+
+    /* root directory */
+    if (!isFailed)
+    {
+        ReadNSectors(buffer, GetStartSectorRoot(), SectorPerRoot());
+        PatchDirectory(_defrag, buffer, (unsigned int)rootBytes);
+        isFailed = (fwrite(buffer, 1, rootBytes, _out) != rootBytes);
+    }
+
+    /* data region, runs that were already contiguous are copied in batches */
+    cluster = FIRST_CLUSTER;
+    while ((cluster < _defrag->entryCount) && !isFailed)
+    {
+        const unsigned int old = _defrag->oldCluster[cluster];
+        unsigned int count = 1;
+
+        if (old == 0)
+        {
+            memset(buffer, 0, bytePerCluster);
+        }
+        else if (_defrag->isDirectory[old])
+        {
+            ReadNSectors(buffer, ClusterToSector(old), sectorPerCluster);
+            PatchDirectory(_defrag, buffer, bytePerCluster);
+        }
+        else
+        {
+            while ((count < DEFRAG_BATCH_CLUSTERS) && (cluster + count < _defrag->entryCount) &&
+                   (_defrag->oldCluster[cluster + count] == old + count) &&
+                   !_defrag->isDirectory[old + count])
+            {
+                count++;
+            }
+            ReadNSectors(buffer, ClusterToSector(old), count * sectorPerCluster);
+        }
+
+        isFailed = (fwrite(buffer, bytePerCluster, count, _out) != count);
+        cluster += count;
+    }
+
+    /* sectors after the last cluster */
+    GetImgInfo(&imageSize, &imageMtime);
+    totalSectors = imageSize / bytePerSector;
+    if (!isFailed && (totalSectors > ClusterToSector(_defrag->entryCount)))
+    {
+        isFailed = CopySectors(_out, buffer, ClusterToSector(_defrag->entryCount),
+                               totalSectors - ClusterToSector(_defrag->entryCount));
+    }
+
+    free(buffer);
+    return isFailed;
+}
+
+/*!
+ * @brief <Write a copy of the mounted image with every chain contiguous>
+ *
+ * @param _outName <Name of the image to create, must not be the mounted image>.
+ *
+ * @return <zero on success>.
+ */
+int DefragImage(const char *_outName)
+{
+    DefragContext defrag;
+    FILE *out = NULL;
+    int isFailed = 0;
+
+    memset(&defrag, 0, sizeof(defrag));
+    defrag.entryCount = GetClusterCount() + FIRST_CLUSTER;
+    defrag.nextFree = FIRST_CLUSTER;
+
+    defrag.fat = (uint32_t *)malloc(defrag.entryCount * sizeof(uint32_t));
+    defrag.newFat = (uint32_t *)calloc(defrag.entryCount, sizeof(uint32_t));
+    defrag.newCluster = (uint32_t *)calloc(defrag.entryCount, sizeof(uint32_t));
+    defrag.oldCluster = (uint32_t *)calloc(defrag.entryCount, sizeof(uint32_t));
+    defrag.isDirectory = (uint8_t *)calloc(defrag.entryCount, 1);
+
+    if ((defrag.fat == NULL) || (defrag.newFat == NULL) || (defrag.newCluster == NULL) ||
+        (defrag.oldCluster == NULL) || (defrag.isDirectory == NULL))
+    {
+        isFailed = 1;
+    }
+    /* moving cross-linked or looping chains would corrupt more files */
+    else if (CheckVolume(stderr) != 0)
+    {
+        isFailed = 1;
+    }
+    else
+    {
+        unsigned int cluster;
+
+        DecodeFATEntries(0, defrag.entryCount, defrag.fat);
+        for (cluster = FIRST_CLUSTER; cluster < defrag.entryCount; cluster++)
+        {
+            if (defrag.fat[cluster] == BAD_CLUSTER)
+            {
+                defrag.newFat[cluster] = BAD_CLUSTER;
+            }
+        }
+
+        /* the FAT32 root directory is a chain too, it goes first */
+        AssignChain(&defrag, GetRootCluster(), 1);
+        WalkTree(0, "", AssignEntry, &defrag);
+
+        fopen_s(&out, _outName, "wb");
+        isFailed = (out == NULL) || WriteImage(&defrag, out);
+    }
+
+    if (out != NULL)
+    {
+        isFailed = (fclose(out) != 0) || isFailed;
+    }
+
+    free(defrag.fat);
+    free(defrag.newFat);
+    free(defrag.newCluster);
+    free(defrag.oldCluster);
+    free(defrag.isDirectory);
+    return isFailed;
+}
@@ -0,0 +1,36 @@
+#ifndef _DEFRAG_H_
+#define _DEFRAG_H_
+
+#include <stdio.h>
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Report the fragmentation of every file of the mounted image>
+ *
+ * One line per file: "<extents> <average run in clusters> <seek distance in clusters> <path>",
+ * then a summary line for the volume.
+ *
+ * @param _out <Pointer to a FILE object receiving the report>.
+ *
+ * @return <number of fragmented files>.
+ */
+int WriteFragReport(FILE *_out);
+
+/*!
+ * @brief <Write a copy of the mounted image with every chain contiguous>
+ *
+ * Directories are placed in front of their children, in the order of WalkTree.
+ * All FAT copies and the startClusters field of every entry are rewritten,
+ * bad clusters keep their place and lost chains are dropped.
+ * The volume must pass CheckVolume, problems are reported on stderr.
+ *
+ * @param _outName <Name of the image to create, must not be the mounted image>.
+ *
+ * @return <zero on success>.
+ */
+int DefragImage(const char *_outName);
+
+#endif
\ No newline at end of file
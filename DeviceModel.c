@@ -0,0 +1,252 @@
+#include "DeviceModel.h"
+#include "Stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define NS_PER_SECOND 1000000000ULL
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static int ParseValue(const char *_text, size_t _length, int _isRate, uint64_t *_value);
+
+static uint32_t NextRandom();
+
+static void SleepNs(uint64_t _ns);
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static DeviceModel s_model;
+static int s_isEnabled = 0;
+static uint64_t s_head = 0;   /* byte offset after the last request */
+static uint32_t s_random = 1; /* xorshift32 state */
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/* number with a time unit (ns by default) or a K/M/G rate multiplier */
+static int ParseValue(const char *_text, size_t _length, int _isRate, uint64_t *_value)
+{
+    static const char *const units[] = {"ns", "us", "ms", "s"};
+    static const uint64_t scales[] = {1, 1000, 1000000, NS_PER_SECOND};
+    char buffer[32];
+    char *end;
+    int isFailed = (_length == 0) || (_length >= sizeof(buffer));
+    unsigned int i;
+
+    if (!isFailed)
+    {
+        memcpy(buffer, _text, _length);
+        buffer[_length] = '\0';
+        *_value = strtoull(buffer, &end, 10);
+        isFailed = (end == buffer);
+    }
+
+    if (!isFailed && (*end != '\0'))
+    {
+        isFailed = 1;
+        if (_isRate && (end[1] == '\0'))
+        {
+            const char *multipliers = "KMG";
+            const char *found = strchr(multipliers, end[0]);
+
+            isFailed = (found == NULL);
+            for (i = 0; !isFailed && (i <= (unsigned int)(found - multipliers)); i++)
+            {
+                *_value *= 1024;
+            }
+        }
+        else if (!_isRate)
+        {
+            for (i = 0; isFailed && (i < sizeof(units) / sizeof(units[0])); i++)
+            {
+                if (strcmp(end, units[i]) == 0)
+                {
+                    *_value *= scales[i];
+                    isFailed = 0;
+                }
+            }
+        }
+    }
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Parse a device model from "key=value,..." text>
+ *
+ * @param _spec <text of the model>.
+ * @param _model <Pointer to the model to fill>.
+ *
+ * @return <zero on success, non-zero on an unknown key or a bad value>.
+ */
+int ParseDeviceModel(const char *_spec, DeviceModel *_model)
+{
+    const char *p = _spec;
+    int isFailed = 0;
+
+    memset(_model, 0, sizeof(DeviceModel));
+
+    while (!isFailed && (*p != '\0'))
+    {
+        const char *end = strchr(p, ',');
+        const char *equal;
+        size_t keyLength;
+        size_t valueLength = 0;
+        uint64_t seed = 0;
+
+        end = (end == NULL) ? p + strlen(p) : end;
+        equal = memchr(p, '=', (size_t)(end - p));
+        keyLength = (size_t)(((equal != NULL) ? equal : end) - p);
+        if (equal != NULL)
+        {
+            valueLength = (size_t)(end - equal - 1);
+        }
+
+#define KEY_IS(name) ((keyLength == sizeof(name) - 1) && (strncmp(p, name, keyLength) == 0))
+        if (KEY_IS("sleep") && (equal == NULL))
+        {
+            _model->isSleeping = 1;
+        }
+        else if (equal == NULL)
+        {
+            isFailed = 1;
+        }
+        else if (KEY_IS("latency"))
+        {
+            isFailed = ParseValue(equal + 1, valueLength, 0, &_model->latencyNs);
+        }
+        else if (KEY_IS("seek"))
+        {
+            isFailed = ParseValue(equal + 1, valueLength, 0, &_model->seekNs);
+        }
+        else if (KEY_IS("maxseek"))
+        {
+            isFailed = ParseValue(equal + 1, valueLength, 0, &_model->maxSeekNs);
+        }
+        else if (KEY_IS("jitter"))
+        {
+            isFailed = ParseValue(equal + 1, valueLength, 0, &_model->jitterNs);
+        }
+        else if (KEY_IS("bw"))
+        {
+            isFailed = ParseValue(equal + 1, valueLength, 1, &_model->bytesPerSecond);
+        }
+        else if (KEY_IS("seed"))
+        {
+            isFailed = ParseValue(equal + 1, valueLength, 1, &seed);
+            _model->seed = (uint32_t)seed;
+        }
+        else
+        {
+            isFailed = 1;
+        }
+#undef KEY_IS
+
+        p = (*end == ',') ? end + 1 : end;
+    }
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Simulate the device on every read of the image, NULL reads at full speed>
+ *
+ * @param _model <Pointer to the model, copied>.
+ *
+ * @return <none>.
+ */
+void SetDeviceModel(const DeviceModel *_model)
+{
+    s_isEnabled = (_model != NULL);
+    if (s_isEnabled)
+    {
+        s_model = *_model;
+    }
+
+    s_head = 0;
+    s_random = (s_isEnabled && (s_model.seed != 0)) ? s_model.seed : 1;
+}
+
+/* xorshift32, the jitter is the same from run to run */
+static uint32_t NextRandom()
+{
+    s_random ^= s_random << 13;
+    s_random ^= s_random >> 17;
+    s_random ^= s_random << 5;
+    return s_random;
+}
+
+static void SleepNs(uint64_t _ns)
+{
+#ifdef _WIN32
+    Sleep((DWORD)(_ns / 1000000));
+#else
+    struct timespec pause;
+
+    pause.tv_sec = (time_t)(_ns / NS_PER_SECOND);
+    pause.tv_nsec = (long)(_ns % NS_PER_SECOND);
+    nanosleep(&pause, NULL);
+#endif
+}
+
+/*!
+ * @brief <Charge one read request of the image to the simulated device>
+ *
+ * @param _offset <byte offset of the request in the image file>.
+ * @param _length <bytes of the request>.
+ *
+ * @return <simulated nanoseconds, 0 if no model is set>.
+ */
+uint64_t SimulateRead(uint64_t _offset, uint64_t _length)
+{
+    VolumeStats *stats = GetVolumeStats();
+    uint64_t seek = 0;
+    uint64_t total = 0;
+
+    if (s_isEnabled)
+    {
+        /* a read following the previous one does not move the head */
+        const uint64_t distance = (_offset > s_head) ? _offset - s_head : s_head - _offset;
+
+        seek = (distance / DEVICE_SEEK_UNIT) * s_model.seekNs;
+        if ((s_model.maxSeekNs != 0) && (seek > s_model.maxSeekNs))
+        {
+            seek = s_model.maxSeekNs;
+        }
+
+        total = s_model.latencyNs + seek;
+        if (s_model.bytesPerSecond != 0)
+        {
+            total += (_length * NS_PER_SECOND) / s_model.bytesPerSecond;
+        }
+        if (s_model.jitterNs != 0)
+        {
+            total += NextRandom() % (s_model.jitterNs + 1);
+        }
+
+        s_head = _offset + _length;
+        stats->simulatedNs += total;
+        stats->simulatedSeekNs += seek;
+        HistogramAdd(&stats->simulatedRequestNs, total);
+
+        if (s_model.isSleeping)
+        {
+            SleepNs(total);
+        }
+    }
+
+    return total;
+}
@@ -0,0 +1,67 @@
+#ifndef _DEVICEMODEL_H_
+#define _DEVICEMODEL_H_
+
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define DEVICE_SEEK_UNIT 512 /* bytes of head travel charged seekNs */
+
+/*
+ * Timing of a slow device the image is read from
+ */
+typedef struct
+{
+    uint64_t latencyNs;      /* fixed cost of every request */
+    uint64_t seekNs;         /* per DEVICE_SEEK_UNIT between the end of the last request and the start of this one */
+    uint64_t maxSeekNs;      /* full stroke, 0 for no limit */
+    uint64_t bytesPerSecond; /* transfer rate, 0 for no limit */
+    uint64_t jitterNs;       /* random 0..jitterNs added to every request */
+    uint32_t seed;           /* of the jitter, the same seed gives the same times */
+    int isSleeping;          /* wait for the simulated time, not only count it */
+} DeviceModel;
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Parse a device model from "key=value,..." text>
+ *
+ * Keys: latency, seek, maxseek, jitter (times with ns, us, ms or s, ns by
+ * default), bw (bytes per second with K, M or G, powers of 1024), seed, and
+ * sleep without a value. Unset keys are 0. Example: "latency=8ms,seek=20ns,maxseek=15ms,bw=500K".
+ *
+ * @param _spec <text of the model>.
+ * @param _model <Pointer to the model to fill>.
+ *
+ * @return <zero on success, non-zero on an unknown key or a bad value>.
+ */
+int ParseDeviceModel(const char *_spec, DeviceModel *_model);
+
+/*!
+ * @brief <Simulate the device on every read of the image, NULL reads at full speed>
+ *
+ * The head starts at offset 0.
+ *
+ * @param _model <Pointer to the model, copied>.
+ *
+ * @return <none>.
+ */
+void SetDeviceModel(const DeviceModel *_model);
+
+/*!
+ * @brief <Charge one read request of the image to the simulated device>
+ *
+ * The time is latency + seek from the end of the previous request + transfer +
+ * jitter. It is added to the volume statistics and slept if the model says so.
+ *
+ * @param _offset <byte offset of the request in the image file>.
+ * @param _length <bytes of the request>.
+ *
+ * @return <simulated nanoseconds, 0 if no model is set>.
+ */
+uint64_t SimulateRead(uint64_t _offset, uint64_t _length);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,1276 @@
+#include "Diff.h"
+#include "FAT.h"
+#include "HAL.h"
+#include "Hash.h"
+#include "Index.h"
+#include "Journal.h"
+#include "Overlay.h"
+#include "FatCache.h"
+#include "DirWrite.h"
+#include "Workers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define DIFF_CHUNK_SECTORS 256        /* sectors per read of the region before the first cluster */
+#define DIFF_COMMIT_SECTORS 1024      /* sectors per CommitWrites of ApplyDelta */
+#define DIFF_MIN_JOBS_PER_THREAD 256  /* fewer jobs are not worth a thread */
+
+/*
+ * File or folder of one image
+ */
+typedef struct
+{
+    char *path;
+    uint32_t *clusters;     /* chain in file order */
+    unsigned int clusterCount;
+    unsigned int size;
+    unsigned int startCluster;
+    uint32_t modified;      /* date << 16 | time of the entry */
+    uint8_t attributes;
+    int isModified;         /* set by the first MatchTrees pass */
+    unsigned int firstJob;  /* first ClusterJob of a modified file */
+} DiffFile;
+
+/*
+ * Every file and folder of one image, sorted by path
+ */
+typedef struct
+{
+    DiffFile *items;
+    unsigned int count;
+    unsigned int capacity;
+    int isFailed;
+} DiffTree;
+
+/*
+ * Pair of clusters to compare
+ */
+typedef struct
+{
+    uint32_t oldCluster;   /* cluster of the old image */
+    uint32_t newCluster;   /* cluster of the new image */
+    uint8_t isDelta;       /* same cluster number, newCluster goes to the delta if it differs */
+    uint8_t isDifferent;
+} ClusterJob;
+
+typedef struct
+{
+    ClusterJob *items;
+    unsigned int count;
+    unsigned int capacity;
+} JobList;
+
+/*
+ * Position of a job in the order of the reads
+ */
+typedef struct
+{
+    uint32_t newCluster;
+    uint32_t oldCluster;
+    uint32_t job;
+} JobKey;
+
+/*
+ * Layout shared by both images
+ */
+typedef struct
+{
+    unsigned int bytePerSector;
+    unsigned int sectorPerCluster;
+    uint64_t dataStart;         /* first sector of the first cluster */
+    unsigned int clusterCount;
+    unsigned int fatStart;
+    unsigned int sectorPerFAT;
+    uint64_t volumeSectors;
+    uint64_t oldBase;           /* byte offset of the volume in the old image */
+    uint64_t newBase;           /* byte offset of the volume in the new image */
+} DiffGeometry;
+
+/*
+ * Share of the jobs of one thread
+ */
+typedef struct
+{
+    const char *oldName;
+    const char *newName;
+    const DiffGeometry *geometry;
+    ClusterJob *jobs;
+    const JobKey *keys;
+    unsigned int begin;
+    unsigned int end;
+    int isFailed;
+} DiffWorker;
+
+/*
+ * Run of sectors of the delta
+ */
+typedef struct
+{
+    uint64_t first;
+    uint32_t count;
+} SectorRun;
+
+typedef struct
+{
+    SectorRun *items;
+    unsigned int count;
+    unsigned int capacity;
+} RunList;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static size_t FirstDifference(const uint64_t *_a, const uint64_t *_b, size_t _count);
+
+static int CollectEntry(DirectoryEntry *entry, const char *path, void *context);
+
+static void FreeTree(DiffTree *_tree);
+
+static int CompareByPath(const void *_a, const void *_b);
+
+static int CollectTree(DiffTree *_tree);
+
+static int ReadGeometry(DiffGeometry *_geometry);
+
+static int AddJob(JobList *_jobs, uint32_t _oldCluster, uint32_t _newCluster, int _isDelta);
+
+static int QueueClusters(JobList *_jobs, DiffFile *_old, DiffFile *_new);
+
+static int IsSameEntry(const DiffFile *_old, const DiffFile *_new);
+
+static void ReportRanges(FILE *_report, const DiffFile *_old, const DiffFile *_new, const JobList *_jobs);
+
+static int IsRelocated(const DiffFile *_old, const DiffFile *_new, const JobList *_jobs);
+
+static int MatchTrees(DiffTree *_old, DiffTree *_new, JobList *_jobs, FILE *_report);
+
+static int ReadCluster(FILE *_image, uint64_t _base, const DiffGeometry *_geometry, uint32_t _cluster, uint64_t *_data);
+
+static int CompareClusters(void *_worker, int _isInline);
+
+static int CompareKeys(const void *_a, const void *_b);
+
+static int RunJobs(const char *_oldName, const char *_newName, const DiffGeometry *_geometry, JobList *_jobs);
+
+static int AddRun(RunList *_runs, uint64_t _sector, uint32_t _count);
+
+static int CompareMetadata(const char *_oldName, const char *_newName, const DiffGeometry *_geometry,
+                           RunList *_runs, uint64_t *_oldFatHash, uint64_t *_newFatHash);
+
+static int CompareClusterNumbers(const void *_a, const void *_b);
+
+static int CollectDataRuns(const JobList *_jobs, const DiffGeometry *_geometry, RunList *_runs);
+
+static int WriteRuns(FILE *_delta, FILE *_newImage, const DiffGeometry *_geometry, const RunList *_runs, uint8_t *_buffer);
+
+static int WriteDelta(const char *_deltaName, const char *_newName, const DiffGeometry *_geometry,
+                      const RunList *_dataRuns, const RunList *_metaRuns, uint64_t _oldFatHash, uint64_t _newFatHash);
+
+static int ReadDeltaRun(FILE *_delta, unsigned int _bytePerSector, uint8_t *_buffer, uint64_t *_first, uint32_t *_count);
+
+static uint64_t HashMountedFat(const DiffGeometry *_geometry);
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/*!
+ * @brief <Find the first 64-bit word that differs>
+ *
+ * Four words are folded into one test per step, a loop the compiler turns
+ * into vector compares.
+ *
+ * @param _a <first block>.
+ * @param _b <second block>.
+ * @param _count <number of words>.
+ *
+ * @return <index of the first different word, _count if the blocks are equal>.
+ */
+static size_t FirstDifference(const uint64_t *_a, const uint64_t *_b, size_t _count)
+{
+    size_t i = 0;
+
+    while ((i + 4 <= _count) &&
+           (((_a[i] ^ _b[i]) | (_a[i + 1] ^ _b[i + 1]) | (_a[i + 2] ^ _b[i + 2]) | (_a[i + 3] ^ _b[i + 3])) == 0))
+    {
+        i += 4;
+    }
+    while ((i < _count) && (_a[i] == _b[i]))
+    {
+        i++;
+    }
+
+    return i;
+}
+
+/* WalkTree visitor, remember every file and folder with its chain */
+static int CollectEntry(DirectoryEntry *entry, const char *path, void *context)
+{
+    DiffTree *tree = (DiffTree *)context;
+    DiffFile *file;
+    Extent *extents;
+    unsigned int extentCount = 0;
+    unsigned int i;
+    unsigned int j;
+
+    if (tree->count == tree->capacity)
+    {
+        unsigned int capacity = (tree->capacity == 0) ? 64 : tree->capacity * 2;
+        DiffFile *items = (DiffFile *)realloc(tree->items, capacity * sizeof(DiffFile));
+
+        if (items == NULL)
+        {
+            tree->isFailed = 1;
+            return 1;
+        }
+        tree->items = items;
+        tree->capacity = capacity;
+    }
+
+    file = &tree->items[tree->count];
+    memset(file, 0, sizeof(DiffFile));
+    file->attributes = entry->attributes;
+    file->startCluster = GetEntryCluster(entry);
+    file->size = (entry->attributes & ENTRY_DIRECTORY) ? 0 : GetSizeofFile(entry);
+    file->modified = ((uint32_t)(entry->modifiedDate[0] | (entry->modifiedDate[1] << 8)) << 16) |
+                     (uint32_t)(entry->modifiedTime[0] | (entry->modifiedTime[1] << 8));
+    file->path = (char *)malloc(strlen(path) + 1);
+
+    extents = (file->startCluster != 0) ? GetFileExtents(file->startCluster, &extentCount) : NULL;
+    for (i = 0; i < extentCount; i++)
+    {
+        file->clusterCount += extents[i].count;
+    }
+    file->clusters = (uint32_t *)malloc((file->clusterCount + 1) * sizeof(uint32_t));
+
+    if ((file->path == NULL) || (file->clusters == NULL))
+    {
+        free(file->path);
+        free(file->clusters);
+        free(extents);
+        tree->isFailed = 1;
+        return 1;
+    }
+
+    strcpy(file->path, path);
+    file->clusterCount = 0;
+    for (i = 0; i < extentCount; i++)
+    {
+        for (j = 0; j < extents[i].count; j++)
+        {
+            file->clusters[file->clusterCount++] = extents[i].cluster + j;
+        }
+    }
+    free(extents);
+    tree->count++;
+
+    return 0;
+}
+
+static void FreeTree(DiffTree *_tree)
+{
+    unsigned int i;
+
+    for (i = 0; i < _tree->count; i++)
+    {
+        free(_tree->items[i].path);
+        free(_tree->items[i].clusters);
+    }
+    free(_tree->items);
+    memset(_tree, 0, sizeof(DiffTree));
+}
+
+static int CompareByPath(const void *_a, const void *_b)
+{
+    return strcmp(((const DiffFile *)_a)->path, ((const DiffFile *)_b)->path);
+}
+
+/* walk the mounted volume, zero on success */
+static int CollectTree(DiffTree *_tree)
+{
+    /* the FAT32 root directory lives in clusters too, WalkTree does not visit it */
+    if (GetRootCluster() != 0)
+    {
+        DirectoryEntry root;
+
+        memset(&root, 0, sizeof(root));
+        root.attributes = ENTRY_DIRECTORY;
+        SetEntryCluster(&root, GetRootCluster());
+        CollectEntry(&root, "/", _tree);
+    }
+
+    WalkTree(0, "", CollectEntry, _tree);
+
+    if (_tree->count > 0)
+    {
+        qsort(_tree->items, _tree->count, sizeof(DiffFile), CompareByPath);
+    }
+
+    return _tree->isFailed;
+}
+
+/*!
+ * @brief <Read the layout of the mounted volume>
+ *
+ * @param _geometry <Pointer to a DiffGeometry object, the image offsets are not set>.
+ *
+ * @return <zero on success>.
+ */
+static int ReadGeometry(DiffGeometry *_geometry)
+{
+    uint8_t *boot = (uint8_t *)malloc(GetBytePerSector());
+
+    if (boot == NULL)
+    {
+        return 1;
+    }
+
+    _geometry->bytePerSector = GetBytePerSector();
+    _geometry->sectorPerCluster = GetSectorPerCluster();
+    _geometry->dataStart = ClusterToSector(FIRST_CLUSTER);
+    _geometry->clusterCount = GetClusterCount();
+    _geometry->fatStart = GetStartSectorFAT();
+    _geometry->sectorPerFAT = GetSectorPerFAT();
+
+    /* 16-bit total, or 32-bit total when it is 0 */
+    ReadSector(boot, 0);
+    _geometry->volumeSectors = ReadNumber(2, boot + 19);
+    if (_geometry->volumeSectors == 0)
+    {
+        _geometry->volumeSectors = ReadNumber(4, boot + 32);
+    }
+    free(boot);
+
+    return 0;
+}
+
+static int AddJob(JobList *_jobs, uint32_t _oldCluster, uint32_t _newCluster, int _isDelta)
+{
+    ClusterJob *job;
+
+    if (_jobs->count == _jobs->capacity)
+    {
+        unsigned int capacity = (_jobs->capacity == 0) ? 1024 : _jobs->capacity * 2;
+        ClusterJob *items = (ClusterJob *)realloc(_jobs->items, capacity * sizeof(ClusterJob));
+
+        if (items == NULL)
+        {
+            return 1;
+        }
+        _jobs->items = items;
+        _jobs->capacity = capacity;
+    }
+
+    job = &_jobs->items[_jobs->count++];
+    job->oldCluster = _oldCluster;
+    job->newCluster = _newCluster;
+    job->isDelta = (uint8_t)_isDelta;
+    job->isDifferent = 0;
+
+    return 0;
+}
+
+/*!
+ * @brief <Queue the compares of the clusters of a new file>
+ *
+ * Cluster i of the new chain is compared with the same cluster number of
+ * the old image (delta) and, when the chain moved, with cluster i of the
+ * old chain (report). ReportRanges reads the jobs back in the same order.
+ *
+ * @param _jobs <Pointer to a JobList object>.
+ * @param _old <the file in the old image, NULL if added>.
+ * @param _new <the file in the new image>.
+ *
+ * @return <zero on success>.
+ */
+static int QueueClusters(JobList *_jobs, DiffFile *_old, DiffFile *_new)
+{
+    const unsigned int oldCount = (_old != NULL) ? _old->clusterCount : 0;
+    unsigned int i;
+    int isFailed = 0;
+
+    _new->firstJob = _jobs->count;
+
+    for (i = 0; !isFailed && (i < _new->clusterCount); i++)
+    {
+        const uint32_t cluster = _new->clusters[i];
+
+        if ((i < oldCount) && (_old->clusters[i] != cluster))
+        {
+            isFailed = AddJob(_jobs, _old->clusters[i], cluster, 0);
+        }
+        isFailed = isFailed || AddJob(_jobs, cluster, cluster, 1);
+    }
+
+    return isFailed;
+}
+
+/* entry and chain unchanged, the content is taken as unchanged */
+static int IsSameEntry(const DiffFile *_old, const DiffFile *_new)
+{
+    return (_old->size == _new->size) && (_old->startCluster == _new->startCluster) &&
+           (_old->modified == _new->modified) && (_old->attributes == _new->attributes) &&
+           (_old->clusterCount == _new->clusterCount) &&
+           (memcmp(_old->clusters, _new->clusters, _new->clusterCount * sizeof(uint32_t)) == 0);
+}
+
+/*!
+ * @brief <Print the changed byte ranges of a modified file>
+ *
+ * A cluster is changed if its content differs from cluster i of the old
+ * chain, if the old chain is shorter, or if it holds bytes between the old
+ * and the new size. Bytes cut by a smaller size end the list.
+ *
+ * @param _report <Pointer to a FILE object>.
+ * @param _old <the file in the old image>.
+ * @param _new <the file in the new image, queued by QueueClusters>.
+ * @param _jobs <Pointer to the compared JobList>.
+ *
+ * @return <none>.
+ */
+static void ReportRanges(FILE *_report, const DiffFile *_old, const DiffFile *_new, const JobList *_jobs)
+{
+    const uint64_t clusterBytes = (uint64_t)GetBytePerSector() * GetSectorPerCluster();
+    const uint64_t lowSize = (_old->size < _new->size) ? _old->size : _new->size;
+    const uint64_t highSize = (_old->size < _new->size) ? _new->size : _old->size;
+    const ClusterJob *job = &_jobs->items[_new->firstJob];
+    uint64_t rangeStart = 0;
+    uint64_t rangeEnd = 0;
+    int rangeCount = 0;
+    unsigned int i;
+
+    for (i = 0; i <= _new->clusterCount; i++)
+    {
+        uint64_t start = (uint64_t)i * clusterBytes;
+        uint64_t end = start + clusterBytes;
+        int isChanged;
+
+        if (i == _new->clusterCount)
+        {
+            /* bytes cut from the end of the file */
+            start = _new->size;
+            end = _old->size;
+            isChanged = (_new->size < _old->size);
+        }
+        else if (i < _old->clusterCount)
+        {
+            isChanged = job->isDifferent || ((lowSize != highSize) && (end > lowSize) && (start < highSize));
+            if (!job->isDifferent && (start < lowSize))
+            {
+                /* same content, only the bytes past the smaller size */
+                start = lowSize;
+            }
+            job += (_old->clusters[i] != _new->clusters[i]) ? 2 : 1;
+        }
+        else
+        {
+            isChanged = 1;
+            job++;
+        }
+
+        if (end > highSize)
+        {
+            end = highSize;
+        }
+        if (!isChanged || (start >= end))
+        {
+            continue;
+        }
+
+        if ((rangeCount > 0) && (start <= rangeEnd))
+        {
+            rangeEnd = (end > rangeEnd) ? end : rangeEnd;
+            continue;
+        }
+        if (rangeCount > 0)
+        {
+            fprintf(_report, "%s%llu-%llu", (rangeCount > 1) ? "," : "", (unsigned long long)rangeStart,
+                    (unsigned long long)rangeEnd);
+        }
+        rangeStart = start;
+        rangeEnd = end;
+        rangeCount++;
+    }
+
+    if (rangeCount > 0)
+    {
+        fprintf(_report, "%s%llu-%llu", (rangeCount > 1) ? "," : "", (unsigned long long)rangeStart,
+                (unsigned long long)rangeEnd);
+    }
+    else
+    {
+        /* attributes or time only */
+        fputc('-', _report);
+    }
+}
+
+/*!
+ * @brief <Check that only the clusters of a modified file moved>
+ *
+ * The entry is the same but for its start cluster, and every cluster holds
+ * the content of the same cluster of the old chain.
+ *
+ * @param _old <the file in the old image>.
+ * @param _new <the file in the new image, queued by QueueClusters>.
+ * @param _jobs <Pointer to the compared JobList>.
+ *
+ * @return <non-zero if the content is unchanged>.
+ */
+static int IsRelocated(const DiffFile *_old, const DiffFile *_new, const JobList *_jobs)
+{
+    const ClusterJob *job = &_jobs->items[_new->firstJob];
+    unsigned int i;
+
+    if ((_old->size != _new->size) || (_old->modified != _new->modified) ||
+        (_old->attributes != _new->attributes) || (_old->clusterCount != _new->clusterCount))
+    {
+        return 0;
+    }
+
+    /* same walk over the jobs as ReportRanges */
+    for (i = 0; i < _new->clusterCount; i++)
+    {
+        if (job->isDifferent)
+        {
+            return 0;
+        }
+        job += (_old->clusters[i] != _new->clusters[i]) ? 2 : 1;
+    }
+
+    return 1;
+}
+
+/*!
+ * @brief <Match the files of both images by path>
+ *
+ * Called twice: without a report the clusters to compare are queued, then
+ * with the compared jobs every difference is printed in path order.
+ *
+ * @param _old <Pointer to the tree of the old image>.
+ * @param _new <Pointer to the tree of the new image>.
+ * @param _jobs <Pointer to a JobList object>.
+ * @param _report <Pointer to a FILE object, NULL for the first pass>.
+ *
+ * @return <number of differences, -1 if out of memory>.
+ */
+static int MatchTrees(DiffTree *_old, DiffTree *_new, JobList *_jobs, FILE *_report)
+{
+    unsigned int i = 0;
+    unsigned int j = 0;
+    int differences = 0;
+    int isFailed = 0;
+
+    while (!isFailed && ((i < _old->count) || (j < _new->count)))
+    {
+        DiffFile *oldFile = (i < _old->count) ? &_old->items[i] : NULL;
+        DiffFile *newFile = (j < _new->count) ? &_new->items[j] : NULL;
+        const int order = (oldFile == NULL) ? 1 : ((newFile == NULL) ? -1 : strcmp(oldFile->path, newFile->path));
+        const int isOldFolder = (oldFile != NULL) && (oldFile->attributes & ENTRY_DIRECTORY);
+        const int isNewFolder = (newFile != NULL) && (newFile->attributes & ENTRY_DIRECTORY);
+
+        /* a file that became a folder, or the reverse, is removed and added */
+        const int isRemoved = (order < 0) || ((order == 0) && (isOldFolder != isNewFolder));
+        const int isAdded = (order > 0) || ((order == 0) && (isOldFolder != isNewFolder));
+
+        if (isRemoved)
+        {
+            if (_report != NULL)
+            {
+                fprintf(_report, "REMOVED %s%s\n", oldFile->path, isOldFolder ? "/" : "");
+            }
+            differences++;
+        }
+
+        if (isAdded)
+        {
+            if (_report != NULL)
+            {
+                fprintf(_report, "ADDED %s%s\n", newFile->path, isNewFolder ? "/" : "");
+            }
+            else
+            {
+                isFailed = QueueClusters(_jobs, NULL, newFile);
+            }
+            differences++;
+        }
+        else if ((order == 0) && isNewFolder)
+        {
+            /* folders are not reported, their clusters still go to the delta */
+            if (_report == NULL)
+            {
+                isFailed = QueueClusters(_jobs, NULL, newFile);
+            }
+        }
+        else if (order == 0)
+        {
+            if (_report == NULL)
+            {
+                newFile->isModified = !IsSameEntry(oldFile, newFile);
+                isFailed = newFile->isModified && QueueClusters(_jobs, oldFile, newFile);
+            }
+            else if (newFile->isModified && IsRelocated(oldFile, newFile, _jobs))
+            {
+                /* content compared first, a defragmented file is not modified */
+                fprintf(_report, "MOVED %s\n", newFile->path);
+            }
+            else if (newFile->isModified)
+            {
+                fputs("MODIFIED ", _report);
+                ReportRanges(_report, oldFile, newFile, _jobs);
+                fprintf(_report, " %s\n", newFile->path);
+            }
+            differences += newFile->isModified;
+        }
+
+        i += (order <= 0);
+        j += (order >= 0);
+    }
+
+    return isFailed ? -1 : differences;
+}
+
+/* read one cluster of an image, bytes past the end of the file read as zero */
+static int ReadCluster(FILE *_image, uint64_t _base, const DiffGeometry *_geometry, uint32_t _cluster, uint64_t *_data)
+{
+    const size_t clusterBytes = (size_t)_geometry->bytePerSector * _geometry->sectorPerCluster;
+    const uint64_t sector = _geometry->dataStart + (uint64_t)(_cluster - FIRST_CLUSTER) * _geometry->sectorPerCluster;
+    size_t length;
+
+    if (SeekFile(_image, _base + sector * _geometry->bytePerSector) != 0)
+    {
+        return 1;
+    }
+
+    length = fread(_data, 1, clusterBytes, _image);
+    memset((uint8_t *)_data + length, 0, clusterBytes - length);
+
+    return 0;
+}
+
+/*!
+ * @brief <Compare the clusters of a share of the jobs, body of RunWorkers>
+ *
+ * Each share opens both images, the HAL is not used.
+ *
+ * @param _worker <Pointer to a DiffWorker object>.
+ * @param _isInline <non-zero on the calling thread>.
+ *
+ * @return <zero, errors are kept in the worker>.
+ */
+static int CompareClusters(void *_worker, int _isInline)
+{
+    DiffWorker *worker = (DiffWorker *)_worker;
+    const DiffGeometry *geometry = worker->geometry;
+    const size_t wordCount = (size_t)geometry->bytePerSector * geometry->sectorPerCluster / sizeof(uint64_t);
+    uint64_t *oldData = (uint64_t *)malloc(wordCount * sizeof(uint64_t));
+    uint64_t *newData = (uint64_t *)malloc(wordCount * sizeof(uint64_t));
+    FILE *oldImage = NULL;
+    FILE *newImage = NULL;
+    unsigned int i;
+
+    fopen_s(&oldImage, worker->oldName, "rb");
+    fopen_s(&newImage, worker->newName, "rb");
+    worker->isFailed = (oldData == NULL) || (newData == NULL) || (oldImage == NULL) || (newImage == NULL);
+
+    for (i = worker->begin; !worker->isFailed && (i < worker->end); i++)
+    {
+        ClusterJob *job = &worker->jobs[worker->keys[i].job];
+
+        worker->isFailed = (ReadCluster(oldImage, geometry->oldBase, geometry, job->oldCluster, oldData) != 0) ||
+                           (ReadCluster(newImage, geometry->newBase, geometry, job->newCluster, newData) != 0);
+        job->isDifferent = (FirstDifference(oldData, newData, wordCount) < wordCount);
+    }
+
+    if (oldImage != NULL)
+    {
+        fclose(oldImage);
+    }
+    if (newImage != NULL)
+    {
+        fclose(newImage);
+    }
+    free(oldData);
+    free(newData);
+
+    (void)_isInline;
+    return 0;
+}
+
+static int CompareKeys(const void *_a, const void *_b)
+{
+    const JobKey *a = (const JobKey *)_a;
+    const JobKey *b = (const JobKey *)_b;
+
+    if (a->newCluster != b->newCluster)
+    {
+        return (a->newCluster > b->newCluster) ? 1 : -1;
+    }
+
+    return (a->oldCluster > b->oldCluster) - (a->oldCluster < b->oldCluster);
+}
+
+/*!
+ * @brief <Compare the clusters of every job, in physical order, on several threads>
+ *
+ * @param _oldName <Name of the old image>.
+ * @param _newName <Name of the new image>.
+ * @param _geometry <Pointer to the DiffGeometry of both images>.
+ * @param _jobs <Pointer to the JobList, isDifferent is set>.
+ *
+ * @return <zero on success>.
+ */
+static int RunJobs(const char *_oldName, const char *_newName, const DiffGeometry *_geometry, JobList *_jobs)
+{
+    DiffWorker workers[WORKERS_MAX_THREADS];
+    JobKey *keys = (JobKey *)malloc((_jobs->count + 1) * sizeof(JobKey));
+    unsigned int threadCount;
+    unsigned int t;
+    unsigned int i;
+    int isFailed = (keys == NULL);
+
+    if (isFailed || (_jobs->count == 0))
+    {
+        free(keys);
+        return isFailed;
+    }
+
+    /* each thread reads a contiguous part of the images */
+    for (i = 0; i < _jobs->count; i++)
+    {
+        keys[i].newCluster = _jobs->items[i].newCluster;
+        keys[i].oldCluster = _jobs->items[i].oldCluster;
+        keys[i].job = i;
+    }
+    qsort(keys, _jobs->count, sizeof(JobKey), CompareKeys);
+
+    threadCount = GetWorkerCount(_jobs->count, DIFF_MIN_JOBS_PER_THREAD);
+
+    for (t = 0; t < threadCount; t++)
+    {
+        workers[t].oldName = _oldName;
+        workers[t].newName = _newName;
+        workers[t].geometry = _geometry;
+        workers[t].jobs = _jobs->items;
+        workers[t].keys = keys;
+        workers[t].begin = (unsigned int)((uint64_t)_jobs->count * t / threadCount);
+        workers[t].end = (unsigned int)((uint64_t)_jobs->count * (t + 1) / threadCount);
+        workers[t].isFailed = 0;
+    }
+
+    RunWorkers(workers, sizeof(DiffWorker), threadCount, CompareClusters);
+
+    for (t = 0; t < threadCount; t++)
+    {
+        isFailed = isFailed || workers[t].isFailed;
+    }
+
+    free(keys);
+    return isFailed;
+}
+
+/* append sectors to a list of runs, merged with the last run when they follow it */
+static int AddRun(RunList *_runs, uint64_t _sector, uint32_t _count)
+{
+    SectorRun *last = (_runs->count > 0) ? &_runs->items[_runs->count - 1] : NULL;
+
+    if ((last != NULL) && (last->first + last->count == _sector) && (last->count + _count <= DIFF_RUN_MAX_SECTORS))
+    {
+        last->count += _count;
+        return 0;
+    }
+
+    if (_runs->count == _runs->capacity)
+    {
+        unsigned int capacity = (_runs->capacity == 0) ? 64 : _runs->capacity * 2;
+        SectorRun *items = (SectorRun *)realloc(_runs->items, capacity * sizeof(SectorRun));
+
+        if (items == NULL)
+        {
+            return 1;
+        }
+        _runs->items = items;
+        _runs->capacity = capacity;
+    }
+
+    _runs->items[_runs->count].first = _sector;
+    _runs->items[_runs->count].count = _count;
+    _runs->count++;
+
+    return 0;
+}
+
+/*!
+ * @brief <Compare the sectors before the first cluster of both images>
+ *
+ * Boot sectors, FAT copies and the FAT12/16 root directory are read in
+ * chunks and compared word by word; the first FAT of each image is hashed
+ * on the way.
+ *
+ * @param _oldName <Name of the old image>.
+ * @param _newName <Name of the new image>.
+ * @param _geometry <Pointer to the DiffGeometry of both images>.
+ * @param _runs <Pointer to a RunList receiving the changed sectors>.
+ * @param _oldFatHash <Pointer to store the XXH64 of the first FAT of the old image>.
+ * @param _newFatHash <Pointer to store the XXH64 of the first FAT of the new image>.
+ *
+ * @return <zero on success>.
+ */
+static int CompareMetadata(const char *_oldName, const char *_newName, const DiffGeometry *_geometry,
+                           RunList *_runs, uint64_t *_oldFatHash, uint64_t *_newFatHash)
+{
+    const size_t chunkBytes = (size_t)DIFF_CHUNK_SECTORS * _geometry->bytePerSector;
+    const size_t sectorWords = _geometry->bytePerSector / sizeof(uint64_t);
+    uint64_t *oldData = (uint64_t *)malloc(chunkBytes);
+    uint64_t *newData = (uint64_t *)malloc(chunkBytes);
+    FILE *oldImage = NULL;
+    FILE *newImage = NULL;
+    Xxh64State oldFat;
+    Xxh64State newFat;
+    uint64_t sector = 0;
+    int isFailed;
+
+    fopen_s(&oldImage, _oldName, "rb");
+    fopen_s(&newImage, _newName, "rb");
+    isFailed = (oldData == NULL) || (newData == NULL) || (oldImage == NULL) || (newImage == NULL) ||
+               (SeekFile(oldImage, _geometry->oldBase) != 0) || (SeekFile(newImage, _geometry->newBase) != 0);
+
+    Xxh64Reset(&oldFat, 0);
+    Xxh64Reset(&newFat, 0);
+
+    while (!isFailed && (sector < _geometry->dataStart))
+    {
+        const unsigned int count = (_geometry->dataStart - sector < DIFF_CHUNK_SECTORS) ? (unsigned int)(_geometry->dataStart - sector)
+                                                                                          : DIFF_CHUNK_SECTORS;
+        const size_t words = count * sectorWords;
+        size_t word = 0;
+        unsigned int i;
+
+        isFailed = (fread(oldData, _geometry->bytePerSector, count, oldImage) != count) ||
+                   (fread(newData, _geometry->bytePerSector, count, newImage) != count);
+
+        /* jump from one difference to the next, one run per changed sector */
+        while (!isFailed && (word < words))
+        {
+            word += FirstDifference(oldData + word, newData + word, words - word);
+            if (word < words)
+            {
+                isFailed = AddRun(_runs, sector + word / sectorWords, 1);
+                word = (word / sectorWords + 1) * sectorWords;
+            }
+        }
+
+        for (i = 0; i < count; i++)
+        {
+            if ((sector + i >= _geometry->fatStart) && (sector + i < _geometry->fatStart + _geometry->sectorPerFAT))
+            {
+                Xxh64Update(&oldFat, oldData + i * sectorWords, _geometry->bytePerSector);
+                Xxh64Update(&newFat, newData + i * sectorWords, _geometry->bytePerSector);
+            }
+        }
+
+        sector += count;
+    }
+
+    *_oldFatHash = Xxh64Digest(&oldFat);
+    *_newFatHash = Xxh64Digest(&newFat);
+
+    if (oldImage != NULL)
+    {
+        fclose(oldImage);
+    }
+    if (newImage != NULL)
+    {
+        fclose(newImage);
+    }
+    free(oldData);
+    free(newData);
+
+    return isFailed;
+}
+
+static int CompareClusterNumbers(const void *_a, const void *_b)
+{
+    const uint32_t a = *(const uint32_t *)_a;
+    const uint32_t b = *(const uint32_t *)_b;
+
+    return (a > b) - (a < b);
+}
+
+/* changed clusters of the new image as runs of sectors, in physical order */
+static int CollectDataRuns(const JobList *_jobs, const DiffGeometry *_geometry, RunList *_runs)
+{
+    uint32_t *clusters = (uint32_t *)malloc((_jobs->count + 1) * sizeof(uint32_t));
+    unsigned int count = 0;
+    unsigned int i;
+    int isFailed = (clusters == NULL);
+
+    for (i = 0; !isFailed && (i < _jobs->count); i++)
+    {
+        if (_jobs->items[i].isDelta && _jobs->items[i].isDifferent)
+        {
+            clusters[count++] = _jobs->items[i].newCluster;
+        }
+    }
+
+    if (!isFailed)
+    {
+        qsort(clusters, count, sizeof(uint32_t), CompareClusterNumbers);
+    }
+    for (i = 0; !isFailed && (i < count); i++)
+    {
+        isFailed = AddRun(_runs, _geometry->dataStart + (uint64_t)(clusters[i] - FIRST_CLUSTER) * _geometry->sectorPerCluster,
+                          _geometry->sectorPerCluster);
+    }
+
+    free(clusters);
+    return isFailed;
+}
+
+/* copy runs of the new image to the delta, each with its header and CRC32C */
+static int WriteRuns(FILE *_delta, FILE *_newImage, const DiffGeometry *_geometry, const RunList *_runs, uint8_t *_buffer)
+{
+    unsigned int i;
+    int isFailed = 0;
+
+    for (i = 0; !isFailed && (i < _runs->count); i++)
+    {
+        const SectorRun *run = &_runs->items[i];
+        const size_t length = (size_t)run->count * _geometry->bytePerSector;
+        uint8_t header[DIFF_RUN_HEADER_SIZE];
+        uint32_t crc;
+        size_t read = 0;
+
+        if (SeekFile(_newImage, _geometry->newBase + run->first * _geometry->bytePerSector) == 0)
+        {
+            read = fread(_buffer, 1, length, _newImage);
+        }
+        memset(_buffer + read, 0, length - read);
+
+        crc = Crc32c(0, _buffer, length);
+        memcpy(header, &run->first, sizeof(uint64_t));
+        memcpy(header + 8, &run->count, sizeof(uint32_t));
+        memcpy(header + 12, &crc, sizeof(uint32_t));
+
+        isFailed = (fwrite(header, 1, sizeof(header), _delta) != sizeof(header)) ||
+                   (fwrite(_buffer, 1, length, _delta) != length);
+    }
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Write the delta file: header, data runs, runs before the first cluster, end record>
+ *
+ * The sectors before the first cluster come last, so a patch stopped
+ * half way leaves the old FAT describing the old files.
+ *
+ * @return <zero on success>.
+ */
+static int WriteDelta(const char *_deltaName, const char *_newName, const DiffGeometry *_geometry,
+                      const RunList *_dataRuns, const RunList *_metaRuns, uint64_t _oldFatHash, uint64_t _newFatHash)
+{
+    uint8_t header[DIFF_HEADER_SIZE];
+    uint8_t *buffer = (uint8_t *)malloc((size_t)DIFF_RUN_MAX_SECTORS * _geometry->bytePerSector);
+    FILE *delta = NULL;
+    FILE *newImage = NULL;
+    const uint64_t end = DIFF_RUN_END;
+    const uint32_t runCount = _dataRuns->count + _metaRuns->count;
+    const uint32_t noCrc = 0;
+    int isFailed;
+
+    fopen_s(&delta, _deltaName, "wb");
+    fopen_s(&newImage, _newName, "rb");
+    isFailed = (buffer == NULL) || (delta == NULL) || (newImage == NULL);
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, DIFF_MAGIC, sizeof(DIFF_MAGIC));
+    memcpy(header + 8, &_geometry->bytePerSector, sizeof(uint32_t));
+    memcpy(header + 12, &_geometry->sectorPerCluster, sizeof(uint32_t));
+    memcpy(header + 16, &_geometry->volumeSectors, sizeof(uint64_t));
+    memcpy(header + 24, &_oldFatHash, sizeof(uint64_t));
+    memcpy(header + 32, &_newFatHash, sizeof(uint64_t));
+
+    isFailed = isFailed || (fwrite(header, 1, sizeof(header), delta) != sizeof(header)) ||
+               (WriteRuns(delta, newImage, _geometry, _dataRuns, buffer) != 0) ||
+               (WriteRuns(delta, newImage, _geometry, _metaRuns, buffer) != 0);
+
+    /* the end record tells a complete delta from a truncated one */
+    memset(header, 0, DIFF_RUN_HEADER_SIZE);
+    memcpy(header, &end, sizeof(uint64_t));
+    memcpy(header + 8, &runCount, sizeof(uint32_t));
+    memcpy(header + 12, &noCrc, sizeof(uint32_t));
+    isFailed = isFailed || (fwrite(header, 1, DIFF_RUN_HEADER_SIZE, delta) != DIFF_RUN_HEADER_SIZE);
+
+    if (delta != NULL)
+    {
+        isFailed = (fclose(delta) != 0) || isFailed;
+    }
+    if (newImage != NULL)
+    {
+        fclose(newImage);
+    }
+    free(buffer);
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Compare the mounted image with a newer image of the same geometry>
+ *
+ * @param _oldName <Name of the mounted image>.
+ * @param _newName <Name of the newer image>.
+ * @param _deltaName <Name of the delta file to write, NULL for the report only>.
+ * @param _report <Pointer to a FILE object receiving the differences>.
+ *
+ * @return <number of differences, -1 if the images can not be compared>.
+ */
+int DiffImages(const char *_oldName, const char *_newName, const char *_deltaName, FILE *_report)
+{
+    DiffGeometry geometry;
+    DiffGeometry newGeometry;
+    DiffTree oldTree;
+    DiffTree newTree;
+    JobList jobs = {NULL, 0, 0};
+    RunList dataRuns = {NULL, 0, 0};
+    RunList metaRuns = {NULL, 0, 0};
+    uint64_t oldFatHash = 0;
+    uint64_t newFatHash = 0;
+    FILE *probe = NULL;
+    int differences = -1;
+    int isFailed;
+
+    memset(&oldTree, 0, sizeof(oldTree));
+    memset(&newTree, 0, sizeof(newTree));
+    memset(&geometry, 0, sizeof(geometry));
+    memset(&newGeometry, 0, sizeof(newGeometry));
+
+    /* both images are read from their files, a patched view would not match */
+    isFailed = IsOverlayOpen() || IsJournalOpen() || (ReadGeometry(&geometry) != 0) ||
+               (GetImgRange(0, 1, &geometry.oldBase) < 0);
+
+    /* FatInit does not come back when the image can not be opened */
+    if (!isFailed)
+    {
+        fopen_s(&probe, _newName, "rb");
+        isFailed = (probe == NULL);
+        if (probe != NULL)
+        {
+            fclose(probe);
+        }
+    }
+
+    isFailed = isFailed || (CollectTree(&oldTree) != 0);
+
+    if (!isFailed)
+    {
+        FatDeInit();
+        FatInit(_newName);
+        isFailed = (geometry.oldBase != 0) &&
+                   (FatMountPartition(geometry.oldBase, geometry.volumeSectors * geometry.bytePerSector) != 0);
+    }
+
+    isFailed = isFailed || (ReadGeometry(&newGeometry) != 0) ||
+               (GetImgRange(0, 1, &geometry.newBase) < 0) ||
+               (newGeometry.bytePerSector != geometry.bytePerSector) ||
+               (newGeometry.sectorPerCluster != geometry.sectorPerCluster) ||
+               (newGeometry.dataStart != geometry.dataStart) || (newGeometry.clusterCount != geometry.clusterCount) ||
+               (newGeometry.fatStart != geometry.fatStart) || (newGeometry.sectorPerFAT != geometry.sectorPerFAT) ||
+               (newGeometry.volumeSectors != geometry.volumeSectors) || (GetFatType() == FAT_TYPE_EXFAT) ||
+               (geometry.bytePerSector % sizeof(uint64_t) != 0);
+
+    isFailed = isFailed || (CollectTree(&newTree) != 0) ||
+               (CompareMetadata(_oldName, _newName, &geometry, &metaRuns, &oldFatHash, &newFatHash) != 0);
+
+    /* queue, compare, then report in path order */
+    isFailed = isFailed || (MatchTrees(&oldTree, &newTree, &jobs, NULL) < 0) ||
+               (RunJobs(_oldName, _newName, &geometry, &jobs) != 0);
+
+    if (!isFailed)
+    {
+        differences = MatchTrees(&oldTree, &newTree, &jobs, _report);
+    }
+
+    if ((differences >= 0) && (_deltaName != NULL) &&
+        ((CollectDataRuns(&jobs, &geometry, &dataRuns) != 0) ||
+         (WriteDelta(_deltaName, _newName, &geometry, &dataRuns, &metaRuns, oldFatHash, newFatHash) != 0)))
+    {
+        differences = -1;
+    }
+
+    FreeTree(&oldTree);
+    FreeTree(&newTree);
+    free(jobs.items);
+    free(dataRuns.items);
+    free(metaRuns.items);
+
+    return differences;
+}
+
+/*!
+ * @brief <Read one record of a delta file and check it>
+ *
+ * @param _delta <Pointer to the delta FILE, positioned on a record>.
+ * @param _bytePerSector <sector size of the delta>.
+ * @param _buffer <block of DIFF_RUN_MAX_SECTORS sectors>.
+ * @param _first <Pointer to store the first sector, DIFF_RUN_END for the end record>.
+ * @param _count <Pointer to store the number of sectors, or of runs for the end record>.
+ *
+ * @return <zero if the record is complete and its CRC32C matches>.
+ */
+static int ReadDeltaRun(FILE *_delta, unsigned int _bytePerSector, uint8_t *_buffer, uint64_t *_first, uint32_t *_count)
+{
+    uint8_t header[DIFF_RUN_HEADER_SIZE];
+    uint32_t crc;
+    size_t length;
+
+    if (fread(header, 1, sizeof(header), _delta) != sizeof(header))
+    {
+        return 1;
+    }
+    memcpy(_first, header, sizeof(uint64_t));
+    memcpy(_count, header + 8, sizeof(uint32_t));
+    memcpy(&crc, header + 12, sizeof(uint32_t));
+
+    if (*_first == DIFF_RUN_END)
+    {
+        return 0;
+    }
+    if ((*_count == 0) || (*_count > DIFF_RUN_MAX_SECTORS))
+    {
+        return 1;
+    }
+
+    length = (size_t)*_count * _bytePerSector;
+    return (fread(_buffer, 1, length, _delta) != length) || (Crc32c(0, _buffer, length) != crc);
+}
+
+/* XXH64 of the first FAT of the mounted volume, as CompareMetadata hashes it */
+static uint64_t HashMountedFat(const DiffGeometry *_geometry)
+{
+    uint8_t *buffer = (uint8_t *)malloc((size_t)DIFF_CHUNK_SECTORS * _geometry->bytePerSector);
+    Xxh64State hash;
+    unsigned int sector;
+
+    Xxh64Reset(&hash, 0);
+    for (sector = 0; (buffer != NULL) && (sector < _geometry->sectorPerFAT); sector += DIFF_CHUNK_SECTORS)
+    {
+        const unsigned int count = (_geometry->sectorPerFAT - sector < DIFF_CHUNK_SECTORS) ? _geometry->sectorPerFAT - sector
+                                                                                           : DIFF_CHUNK_SECTORS;
+
+        ReadNSectors(buffer, _geometry->fatStart + sector, count);
+        Xxh64Update(&hash, buffer, (size_t)count * _geometry->bytePerSector);
+    }
+    free(buffer);
+
+    return Xxh64Digest(&hash);
+}
+
+/*!
+ * @brief <Write a delta made by DiffImages to the mounted image>
+ *
+ * @param _deltaName <Name of the delta file>.
+ *
+ * @return <zero on success>.
+ */
+int ApplyDelta(const char *_deltaName)
+{
+    DiffGeometry geometry;
+    uint8_t header[DIFF_HEADER_SIZE];
+    uint8_t *buffer = NULL;
+    FILE *delta = NULL;
+    uint32_t bytePerSector = 0;
+    uint32_t sectorPerCluster = 0;
+    uint64_t volumeSectors = 0;
+    uint64_t oldFatHash = 0;
+    uint64_t newFatHash = 0;
+    uint64_t volumeFatHash;
+    uint64_t first = 0;
+    uint32_t count = 0;
+    uint32_t runCount = 0;
+    unsigned int pending = 0;
+    int pass;
+    int isFailed;
+
+    memset(&geometry, 0, sizeof(geometry));
+    fopen_s(&delta, _deltaName, "rb");
+    isFailed = (delta == NULL) || (!IsJournalOpen() && !IsOverlayOpen()) ||
+               (GetFatType() == FAT_TYPE_EXFAT) || (ReadGeometry(&geometry) != 0) ||
+               (fread(header, 1, sizeof(header), delta) != sizeof(header)) ||
+               (memcmp(header, DIFF_MAGIC, sizeof(DIFF_MAGIC)) != 0);
+
+    if (!isFailed)
+    {
+        memcpy(&bytePerSector, header + 8, sizeof(uint32_t));
+        memcpy(&sectorPerCluster, header + 12, sizeof(uint32_t));
+        memcpy(&volumeSectors, header + 16, sizeof(uint64_t));
+        memcpy(&oldFatHash, header + 24, sizeof(uint64_t));
+        memcpy(&newFatHash, header + 32, sizeof(uint64_t));
+
+        /* the old volume, or one already patched, even in part */
+        volumeFatHash = HashMountedFat(&geometry);
+        isFailed = (bytePerSector != geometry.bytePerSector) || (sectorPerCluster != geometry.sectorPerCluster) ||
+                   (volumeSectors != geometry.volumeSectors) ||
+                   ((volumeFatHash != oldFatHash) && (volumeFatHash != newFatHash));
+    }
+
+    if (!isFailed)
+    {
+        buffer = (uint8_t *)malloc((size_t)DIFF_RUN_MAX_SECTORS * bytePerSector);
+        isFailed = (buffer == NULL);
+    }
+
+    /* pass 0 checks every record, pass 1 writes */
+    for (pass = 0; !isFailed && (pass < 2); pass++)
+    {
+        isFailed = (SeekFile(delta, DIFF_HEADER_SIZE) != 0);
+        runCount = 0;
+
+        while (!isFailed)
+        {
+            unsigned int i;
+
+            isFailed = (ReadDeltaRun(delta, bytePerSector, buffer, &first, &count) != 0);
+            if (isFailed || (first == DIFF_RUN_END))
+            {
+                isFailed = isFailed || (count != runCount);
+                break;
+            }
+
+            isFailed = (first + count > volumeSectors);
+            for (i = 0; !isFailed && (pass == 1) && (i < count); i++)
+            {
+                isFailed = WriteSector(buffer + (size_t)i * bytePerSector, first + i);
+            }
+
+            /* one commit per group of sectors */
+            pending += (pass == 1) ? count : 0;
+            if (!isFailed && (pending >= DIFF_COMMIT_SECTORS))
+            {
+                isFailed = CommitWrites();
+                pending = 0;
+            }
+            runCount++;
+        }
+    }
+
+    isFailed = isFailed || (CommitWrites() != 0);
+
+    /* every decoded structure describes the volume before the patch */
+    FatCacheInvalidate();
+    SetDecodedFAT(NULL, 0);
+    DropDirectoryStates();
+    CloseIndex();
+
+    if (delta != NULL)
+    {
+        fclose(delta);
+    }
+    free(buffer);
+
+    return isFailed;
+}
\ No newline at end of file
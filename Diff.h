@@ -0,0 +1,65 @@
+#ifndef _DIFF_H_
+#define _DIFF_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define DIFF_MAGIC "FATDIF1"    /* first 8 bytes of a delta file */
+#define DIFF_HEADER_SIZE 48     /* magic, bytes per sector, sectors per cluster, volume sectors, FAT hashes, reserved */
+#define DIFF_RUN_HEADER_SIZE 16 /* first sector, sector count, CRC32C of the data */
+#define DIFF_RUN_END UINT64_MAX /* first sector field of the last record, its count field holds the number of runs */
+
+#define DIFF_RUN_MAX_SECTORS 2048
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Compare the mounted image with a newer image of the same geometry>
+ *
+ * The sectors before the first cluster (boot sectors, FAT copies, FAT12/16
+ * root directory) are compared 64-bit word by word. Both trees are walked
+ * and files are matched by path; a file whose directory entry and cluster
+ * chain are unchanged is taken as unchanged, like the quick check of rsync.
+ * The clusters of the other files and of every folder are compared by
+ * WORKERS_MAX_THREADS threads reading both image files.
+ * One line per difference, path last:
+ * "ADDED <path>", "REMOVED <path>" (folders end with '/'), and
+ * "MODIFIED <ranges> <path>" with the changed byte ranges of the new file
+ * ("0-4096,8192-8200", end excluded; '-' when only the entry changed).
+ * A file whose clusters moved with its content, size, time and attributes
+ * unchanged (a defragmented file) is reported as "MOVED <path>".
+ * The delta holds the changed sectors of the new image: data clusters
+ * first, then the sectors before the first cluster. Free clusters are
+ * not compared. The new image stays mounted on return.
+ *
+ * @param _oldName <Name of the mounted image>.
+ * @param _newName <Name of the newer image>.
+ * @param _deltaName <Name of the delta file to write, NULL for the report only>.
+ * @param _report <Pointer to a FILE object receiving the differences>.
+ *
+ * @return <number of differences, -1 if the images can not be compared,
+ * as when an overlay or a journal is attached to the mounted image>.
+ */
+int DiffImages(const char *_oldName, const char *_newName, const char *_deltaName, FILE *_report);
+
+/*!
+ * @brief <Write a delta made by DiffImages to the mounted image>
+ *
+ * Every run is checked (geometry, CRC32C, end record) before the first
+ * write, and the first FAT of the volume must be the one of the old or of
+ * the new image. Sectors go through WriteSector and are committed in
+ * groups, so a journal or an overlay must be attached; an interrupted
+ * patch is finished by running it again.
+ *
+ * @param _deltaName <Name of the delta file>.
+ *
+ * @return <zero on success>.
+ */
+int ApplyDelta(const char *_deltaName);
+
+#endif
\ No newline at end of file
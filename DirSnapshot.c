@@ -0,0 +1,452 @@
+#include "DirSnapshot.h"
+#include "FAT.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define _1KB 1024
+#define ROW_SIZE_MAX 96 /* upper bound of one rendered row */
+
+#define POOL_MIN_CAPACITY 1024
+
+#ifndef _WIN32
+#include <strings.h>
+#define _stricmp strcasecmp
+#endif
+
+#define LISTING_HEADER "    Name               | Date modified            | Type   | Size\n"
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static int GrowDirSnapshot(DirSnapshot *_snapshot);
+
+static int AddEntry(DirectoryEntry *entry, const char *path, void *context);
+
+static void DecodeName(char *_name, const DirectoryEntry *_entry);
+
+static int CompareRows(const DirSnapshot *_snapshot, SnapshotColumn _column, unsigned int _a, unsigned int _b);
+
+static size_t Advance(size_t _length, size_t _capacity, int _written);
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/* double the capacity of every column, non-zero on failure */
+static int GrowDirSnapshot(DirSnapshot *_snapshot)
+{
+    const unsigned int capacity = (_snapshot->capacity == 0) ? 64 : _snapshot->capacity * 2;
+    void *nameOffsets = realloc(_snapshot->nameOffsets, capacity * sizeof(uint32_t));
+    void *shortNames;
+    void *sizes;
+    void *startClusters;
+    void *timestamps;
+    void *attributes;
+    void *order;
+
+    if (nameOffsets == NULL)
+    {
+        return 1;
+    }
+    _snapshot->nameOffsets = (uint32_t *)nameOffsets;
+
+    shortNames = realloc(_snapshot->shortNames, capacity * SNAPSHOT_SHORT_NAME_SIZE);
+    if (shortNames == NULL)
+    {
+        return 1;
+    }
+    _snapshot->shortNames = (uint8_t(*)[SNAPSHOT_SHORT_NAME_SIZE])shortNames;
+
+    sizes = realloc(_snapshot->sizes, capacity * sizeof(uint32_t));
+    if (sizes == NULL)
+    {
+        return 1;
+    }
+    _snapshot->sizes = (uint32_t *)sizes;
+
+    startClusters = realloc(_snapshot->startClusters, capacity * sizeof(uint32_t));
+    if (startClusters == NULL)
+    {
+        return 1;
+    }
+    _snapshot->startClusters = (uint32_t *)startClusters;
+
+    timestamps = realloc(_snapshot->timestamps, capacity * sizeof(uint32_t));
+    if (timestamps == NULL)
+    {
+        return 1;
+    }
+    _snapshot->timestamps = (uint32_t *)timestamps;
+
+    attributes = realloc(_snapshot->attributes, capacity);
+    if (attributes == NULL)
+    {
+        return 1;
+    }
+    _snapshot->attributes = (uint8_t *)attributes;
+
+    order = realloc(_snapshot->order, capacity * sizeof(unsigned int));
+    if (order == NULL)
+    {
+        return 1;
+    }
+    _snapshot->order = (unsigned int *)order;
+
+    _snapshot->capacity = capacity;
+    return 0;
+}
+
+/* "NAME.EXT", "NAME" for folders and files without extension */
+static void DecodeName(char *_name, const DirectoryEntry *_entry)
+{
+    int length = 8;
+    int extLength = 3;
+
+    while ((length > 0) && (_entry->name[length - 1] == ' '))
+    {
+        length--;
+    }
+    memcpy(_name, _entry->name, length);
+
+    if (_entry->name[0] == ENTRY_E5)
+    {
+        _name[0] = (char)ENTRY_DELETED;
+    }
+
+    while ((extLength > 0) && (_entry->extension[extLength - 1] == ' '))
+    {
+        extLength--;
+    }
+
+    if ((extLength > 0) && !(_entry->attributes & ENTRY_DIRECTORY))
+    {
+        _name[length++] = '.';
+        memcpy(_name + length, _entry->extension, extLength);
+        length += extLength;
+    }
+
+    _name[length] = '\0';
+}
+
+/* ScanDirectory visitor, append one row to every column */
+static int AddEntry(DirectoryEntry *entry, const char *path, void *context)
+{
+    DirSnapshot *snapshot = (DirSnapshot *)context;
+    unsigned int row = snapshot->count;
+    char shortName[SNAPSHOT_NAME_SIZE];
+    size_t length;
+
+    if ((entry->attributes == ENTRY_NAME) ||
+        (entry->name[0] == ENTRY_EMPTY) ||
+        (entry->name[0] == ENTRY_DELETED))
+    {
+        return 0;
+    }
+
+    if ((row == snapshot->capacity) && (GrowDirSnapshot(snapshot) != 0))
+    {
+        return 1;
+    }
+
+    if (path == NULL)
+    {
+        DecodeName(shortName, entry);
+        path = shortName;
+    }
+
+    /* names are appended to the pool, offsets stay valid when it grows */
+    length = strlen(path) + 1;
+    if (snapshot->poolSize + length > snapshot->poolCapacity)
+    {
+        size_t capacity = (snapshot->poolCapacity == 0) ? POOL_MIN_CAPACITY : snapshot->poolCapacity;
+        char *pool;
+
+        while (snapshot->poolSize + length > capacity)
+        {
+            capacity *= 2;
+        }
+        pool = (char *)realloc(snapshot->namePool, capacity);
+        if (pool == NULL)
+        {
+            return 1;
+        }
+        snapshot->namePool = pool;
+        snapshot->poolCapacity = capacity;
+    }
+    memcpy(snapshot->namePool + snapshot->poolSize, path, length);
+    snapshot->nameOffsets[row] = (uint32_t)snapshot->poolSize;
+    snapshot->poolSize += length;
+
+    memcpy(snapshot->shortNames[row], entry->name, sizeof(entry->name));
+    memcpy(snapshot->shortNames[row] + sizeof(entry->name), entry->extension, sizeof(entry->extension));
+    snapshot->sizes[row] = (uint32_t)ReadNumber(4, entry->size);
+    snapshot->startClusters[row] = GetEntryCluster(entry);
+    snapshot->timestamps[row] = ((uint32_t)ReadNumber(2, entry->modifiedDate) << 16) |
+                                (uint32_t)ReadNumber(2, entry->modifiedTime);
+    snapshot->attributes[row] = entry->attributes;
+    snapshot->order[row] = row;
+    snapshot->count++;
+
+    return 0;
+}
+
+/*!
+ * @brief <Decode every visible entry of a directory>
+ *
+ * @param _snapshot <Pointer to a DirSnapshot object, previous content is freed>.
+ * @param _startCluster <Start cluster of the directory, 0 for root directory>.
+ *
+ * @return <number of entries, -1 if out of memory>.
+ */
+int LoadDirSnapshot(DirSnapshot *_snapshot, unsigned int _startCluster)
+{
+    memset(_snapshot, 0, sizeof(DirSnapshot));
+
+    if (ScanDirectory(_startCluster, AddEntry, _snapshot) != 0)
+    {
+        FreeDirSnapshot(_snapshot);
+        return -1;
+    }
+
+    return (int)_snapshot->count;
+}
+
+/*!
+ * @brief <Release the memory of a snapshot>
+ *
+ * @param _snapshot <Pointer to a DirSnapshot object>.
+ *
+ * @return <none>.
+ */
+void FreeDirSnapshot(DirSnapshot *_snapshot)
+{
+    free(_snapshot->nameOffsets);
+    free(_snapshot->namePool);
+    free(_snapshot->shortNames);
+    free(_snapshot->sizes);
+    free(_snapshot->startClusters);
+    free(_snapshot->timestamps);
+    free(_snapshot->attributes);
+    free(_snapshot->order);
+    memset(_snapshot, 0, sizeof(DirSnapshot));
+}
+
+/* <0, 0, >0 like strcmp */
+static int CompareRows(const DirSnapshot *_snapshot, SnapshotColumn _column, unsigned int _a, unsigned int _b)
+{
+    uint32_t a;
+    uint32_t b;
+
+    switch (_column)
+    {
+    case SORT_BY_NAME:
+        return _stricmp(_snapshot->namePool + _snapshot->nameOffsets[_a], _snapshot->namePool + _snapshot->nameOffsets[_b]);
+    case SORT_BY_SIZE:
+        a = _snapshot->sizes[_a];
+        b = _snapshot->sizes[_b];
+        break;
+    case SORT_BY_CLUSTER:
+        a = _snapshot->startClusters[_a];
+        b = _snapshot->startClusters[_b];
+        break;
+    case SORT_BY_TIME:
+        a = _snapshot->timestamps[_a];
+        b = _snapshot->timestamps[_b];
+        break;
+    case SORT_BY_ATTRIBUTES:
+        a = _snapshot->attributes[_a];
+        b = _snapshot->attributes[_b];
+        break;
+    default:
+        a = _a;
+        b = _b;
+        break;
+    }
+
+    return (a > b) - (a < b);
+}
+
+/*!
+ * @brief <Set the display order of a snapshot, ties keep the disk order>
+ *
+ * Bottom-up merge sort of the order array, only one column is touched.
+ *
+ * @param _snapshot <Pointer to a DirSnapshot object>.
+ * @param _column <column to sort by>.
+ * @param _descending <non-zero for descending order>.
+ *
+ * @return <none>.
+ */
+void SortDirSnapshot(DirSnapshot *_snapshot, SnapshotColumn _column, int _descending)
+{
+    const unsigned int count = _snapshot->count;
+    unsigned int *src = _snapshot->order;
+    unsigned int *dst;
+    unsigned int width;
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+    {
+        src[i] = i;
+    }
+
+    dst = (unsigned int *)malloc(count * sizeof(unsigned int));
+    if ((dst == NULL) || (_column == SORT_BY_DISK_ORDER))
+    {
+        free(dst);
+        dst = NULL;
+    }
+
+    for (width = 1; (dst != NULL) && (width < count); width *= 2)
+    {
+        unsigned int *swap;
+
+        for (i = 0; i < count; i += 2 * width)
+        {
+            unsigned int left = i;
+            unsigned int mid = (i + width < count) ? i + width : count;
+            unsigned int end = (i + 2 * width < count) ? i + 2 * width : count;
+            unsigned int right = mid;
+            unsigned int k = i;
+
+            while ((left < mid) && (right < end))
+            {
+                int cmp = CompareRows(_snapshot, _column, src[left], src[right]);
+
+                if (_descending)
+                {
+                    cmp = -cmp;
+                }
+                dst[k++] = (cmp <= 0) ? src[left++] : src[right++];
+            }
+            while (left < mid)
+            {
+                dst[k++] = src[left++];
+            }
+            while (right < end)
+            {
+                dst[k++] = src[right++];
+            }
+        }
+
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    /* result may have ended in the scratch array */
+    if (src != _snapshot->order)
+    {
+        memcpy(_snapshot->order, src, count * sizeof(unsigned int));
+        dst = src;
+    }
+    free(dst);
+}
+
+/*!
+ * @brief <Rebuild the directory entry of a row>
+ *
+ * @param _snapshot <Pointer to a DirSnapshot object>.
+ * @param _row <row in disk order, see order[] for the display order>.
+ * @param _entry <Pointer to a DirectoryEntry object to fill>.
+ *
+ * @return <none>.
+ */
+void GetSnapshotEntry(const DirSnapshot *_snapshot, unsigned int _row, DirectoryEntry *_entry)
+{
+    const uint32_t size = _snapshot->sizes[_row];
+    const uint32_t timestamp = _snapshot->timestamps[_row];
+
+    memset(_entry, 0, sizeof(DirectoryEntry));
+    memcpy(_entry->name, _snapshot->shortNames[_row], sizeof(_entry->name));
+    memcpy(_entry->extension, _snapshot->shortNames[_row] + sizeof(_entry->name), sizeof(_entry->extension));
+    _entry->attributes = _snapshot->attributes[_row];
+    _entry->size[0] = (uint8_t)size;
+    _entry->size[1] = (uint8_t)(size >> 8);
+    _entry->size[2] = (uint8_t)(size >> 16);
+    _entry->size[3] = (uint8_t)(size >> 24);
+    _entry->modifiedTime[0] = (uint8_t)timestamp;
+    _entry->modifiedTime[1] = (uint8_t)(timestamp >> 8);
+    _entry->modifiedDate[0] = (uint8_t)(timestamp >> 16);
+    _entry->modifiedDate[1] = (uint8_t)(timestamp >> 24);
+    SetEntryCluster(_entry, _snapshot->startClusters[_row]);
+}
+
+/* length after _written bytes of snprintf, the end of the buffer when they did not fit */
+static size_t Advance(size_t _length, size_t _capacity, int _written)
+{
+    if ((_written < 0) || ((size_t)_written >= _capacity - _length))
+    {
+        return _capacity - 1;
+    }
+    return _length + (size_t)_written;
+}
+
+/*!
+ * @brief <Render the listing of a snapshot in display order into one buffer>
+ *
+ * @param _snapshot <Pointer to a DirSnapshot object>.
+ * @param _length <Pointer to store the length of the text>.
+ *
+ * @return <'\0' terminated text to free() by the caller, NULL if out of memory>.
+ */
+char *RenderDirSnapshot(const DirSnapshot *_snapshot, size_t *_length)
+{
+    const size_t capacity = sizeof(LISTING_HEADER) + (size_t)_snapshot->count * ROW_SIZE_MAX + _snapshot->poolSize;
+    char *text = (char *)malloc(capacity);
+    size_t length;
+    unsigned int i;
+
+    if (text == NULL)
+    {
+        return NULL;
+    }
+
+    memcpy(text, LISTING_HEADER, sizeof(LISTING_HEADER));
+    length = sizeof(LISTING_HEADER) - 1;
+
+    /* a full buffer cuts the listing, it is never written past */
+    for (i = 0; (i < _snapshot->count) && (length < capacity - 1); i++)
+    {
+        const unsigned int row = _snapshot->order[i];
+        const char *name = _snapshot->namePool + _snapshot->nameOffsets[row];
+        const uint16_t date = (uint16_t)(_snapshot->timestamps[row] >> 16);
+        const uint16_t time = (uint16_t)(_snapshot->timestamps[row] & 0xFFFF);
+        const unsigned int hours = time >> 11;
+        const unsigned int minutes = (time >> 5) & 0x3F;
+
+        length = Advance(length, capacity,
+                         snprintf(text + length, capacity - length,
+                                  "%2u. %-20s %02u/%02u/%u  %02u:%02u %s       ",
+                                  i + 1, name,
+                                  date & 0x1F, (date >> 5) & 0x0F, (date >> 9) + YEAR_OFFSET,
+                                  hours, minutes, (hours < 12) ? "AM" : "PM"));
+
+        if (_snapshot->attributes[row] & ENTRY_DIRECTORY)
+        {
+            length = Advance(length, capacity, snprintf(text + length, capacity - length, "%-8s\n", "Folder"));
+        }
+        else
+        {
+            const char *dot = strrchr(name, '.');
+            unsigned int size = _snapshot->sizes[row] / _1KB;
+
+            if (size == 0)
+            {
+                size = 1;
+            }
+            /* the extension of a long name is cut to the Type column, ROW_SIZE_MAX counts 8 bytes */
+            length = Advance(length, capacity,
+                             snprintf(text + length, capacity - length, "%-8.8s %6u KB\n",
+                                      (dot != NULL) ? dot + 1 : "", size));
+        }
+    }
+
+    *_length = length;
+    return text;
+}
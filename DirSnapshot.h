@@ -0,0 +1,109 @@
+#ifndef _DIRSNAPSHOT_H_
+#define _DIRSNAPSHOT_H_
+
+#include "FAT.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define SNAPSHOT_NAME_SIZE 13 /* "NAME.EXT" + '\0' of the 8.3 name, long names go to namePool */
+#define SNAPSHOT_SHORT_NAME_SIZE 11 /* name and extension as stored on disk */
+
+/*
+ * Columns a snapshot can be sorted by
+ */
+typedef enum
+{
+    SORT_BY_DISK_ORDER,
+    SORT_BY_NAME,
+    SORT_BY_SIZE,
+    SORT_BY_CLUSTER,
+    SORT_BY_TIME,
+    SORT_BY_ATTRIBUTES
+} SnapshotColumn;
+
+/*
+ * All entries of one directory decoded at once, one array per field.
+ * Row i of every column describes the same entry, rows are in disk order;
+ * order[] gives the display order set by SortDirSnapshot.
+ * The name of row i is namePool + nameOffsets[i]: the long name if the entry
+ * has one, "NAME.EXT" otherwise.
+ */
+typedef struct
+{
+    unsigned int count;
+    unsigned int capacity;
+    uint32_t *nameOffsets;
+    char *namePool;
+    size_t poolSize;
+    size_t poolCapacity;
+    uint8_t (*shortNames)[SNAPSHOT_SHORT_NAME_SIZE];
+    uint32_t *sizes;
+    uint32_t *startClusters;
+    uint32_t *timestamps; /* modified date << 16 | modified time, as stored on disk */
+    uint8_t *attributes;
+    unsigned int *order;
+} DirSnapshot;
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Decode every visible entry of a directory>
+ *
+ * Long name slots, deleted and empty entries are skipped.
+ *
+ * @param _snapshot <Pointer to a DirSnapshot object, previous content is freed>.
+ * @param _startCluster <Start cluster of the directory, 0 for root directory>.
+ *
+ * @return <number of entries, -1 if out of memory>.
+ */
+int LoadDirSnapshot(DirSnapshot *_snapshot, unsigned int _startCluster);
+
+/*!
+ * @brief <Release the memory of a snapshot>
+ *
+ * @param _snapshot <Pointer to a DirSnapshot object>.
+ *
+ * @return <none>.
+ */
+void FreeDirSnapshot(DirSnapshot *_snapshot);
+
+/*!
+ * @brief <Set the display order of a snapshot, ties keep the disk order>
+ *
+ * Names are compared like _stricmp, ASCII letters without case.
+ *
+ * @param _snapshot <Pointer to a DirSnapshot object>.
+ * @param _column <column to sort by>.
+ * @param _descending <non-zero for descending order>.
+ *
+ * @return <none>.
+ */
+void SortDirSnapshot(DirSnapshot *_snapshot, SnapshotColumn _column, int _descending);
+
+/*!
+ * @brief <Rebuild the directory entry of a row>
+ *
+ * @param _snapshot <Pointer to a DirSnapshot object>.
+ * @param _row <row in disk order, see order[] for the display order>.
+ * @param _entry <Pointer to a DirectoryEntry object to fill>.
+ *
+ * @return <none>.
+ */
+void GetSnapshotEntry(const DirSnapshot *_snapshot, unsigned int _row, DirectoryEntry *_entry);
+
+/*!
+ * @brief <Render the listing of a snapshot in display order into one buffer>
+ *
+ * @param _snapshot <Pointer to a DirSnapshot object>.
+ * @param _length <Pointer to store the length of the text>.
+ *
+ * @return <'\0' terminated text to free() by the caller, NULL if out of memory>.
+ */
+char *RenderDirSnapshot(const DirSnapshot *_snapshot, size_t *_length);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,1649 @@
+#include "DirWrite.h"
+#include "FAT.h"
+#include "HAL.h"
+#include "Index.h"
+#include "Journal.h"
+#include "Overlay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define SLOT_SIZE 32              /* bytes of a directory slot */
+#define LFN_CHARS 13              /* UTF-16 characters per long name slot */
+#define LFN_LAST 0x40             /* order byte of the first slot on disk, holding the end of the name */
+#define LFN_ORDER_MASK 0x3F
+#define LFN_CHECKSUM_OFFSET 13
+
+#define NAME_FREE 0xFFFFFFFFU     /* NameItem.record of an item never used */
+#define NAME_DELETED 0xFFFFFFFEU  /* NameItem.record of a removed name */
+#define NAME_MIN_CAPACITY 64      /* must be a power of two */
+#define RUN_END (-1)
+#define ALIAS_SIMPLE_TAILS 4      /* "~1" to "~4" before the hashed aliases */
+#define ALIAS_MAX_TRIES 65536
+
+#define DIR_KEY_FIXED_ROOT 0      /* DirState.startCluster of a FAT12/16 root directory */
+
+/*
+ * Entry set in use, found by the first scan or written since
+ */
+typedef struct
+{
+    uint32_t firstSlot;   /* first slot of the set, long name slots included */
+    uint32_t startCluster;
+    uint32_t nameOffset;  /* upper case long name in DirState.names */
+    uint16_t nameLength;  /* UTF-16 characters of the long name, 0 without one */
+    uint8_t slotCount;
+    uint8_t attributes;
+    uint8_t shortName[11];
+    uint8_t isUsed;
+} NameRecord;
+
+/*
+ * One item of a name table, open addressing with linear probing
+ */
+typedef struct
+{
+    uint32_t hash;
+    uint32_t record; /* index in DirState.records, NAME_FREE or NAME_DELETED */
+} NameItem;
+
+typedef struct
+{
+    NameItem *items;
+    unsigned int capacity;
+    unsigned int used; /* records and deleted marks */
+} NameTable;
+
+/*
+ * Run of contiguous free slots, linked in the bucket of its length
+ */
+typedef struct
+{
+    uint32_t first;
+    uint32_t count;
+    int32_t next; /* next run of the bucket, or next unused node */
+} FreeRun;
+
+/*
+ * Decoded directory
+ */
+typedef struct
+{
+    unsigned int startCluster; /* DIR_KEY_FIXED_ROOT for a FAT12/16 root directory */
+    uint64_t lastUse;
+    int isPinned;              /* in use by the current operation, not evicted */
+
+    unsigned int *clusters;    /* chain of the directory, empty for a fixed root */
+    unsigned int clusterCount;
+    unsigned int slotCount;    /* slots in the allocated space */
+    unsigned int endSlot;      /* first slot after the last one ever used */
+
+    NameRecord *records;
+    unsigned int recordCount;
+    unsigned int recordCapacity;
+    unsigned int liveCount;    /* records in use */
+    uint16_t *names;
+    unsigned int nameLength;
+    unsigned int nameCapacity;
+    NameTable longNames;       /* upper case long name -> record */
+    NameTable shortNames;      /* 11 bytes short name -> record */
+
+    FreeRun *runs;
+    unsigned int runCount;
+    unsigned int runCapacity;
+    int32_t unusedRun;                          /* list of unused nodes */
+    int32_t buckets[DIR_MAX_SET_SLOTS + 1];     /* runs of n slots, the last one n and more */
+} DirState;
+
+/*
+ * State of the first scan of a directory
+ */
+typedef struct
+{
+    DirState *dir;
+    unsigned int slot;      /* index of the visited slot */
+    unsigned int setFirst;  /* first slot of the long name being read */
+    unsigned int setCount;  /* long name slots of the set, 0 if none */
+    unsigned int setNext;   /* order expected next, 0 once complete */
+    uint8_t checksum;
+    uint16_t name[DIR_MAX_SET_SLOTS * LFN_CHARS];
+    unsigned int freeFirst; /* run of deleted slots being read */
+    unsigned int freeCount;
+    int isFailed;
+} ScanState;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static uint32_t HashUnits(const uint16_t *_units, unsigned int _length);
+
+static uint32_t HashShortName(const uint8_t *_shortName);
+
+static int FindName(const DirState *_dir, int _isShort, const void *_key, unsigned int _length);
+
+static int InsertName(DirState *_dir, int _isShort, uint32_t _hash, uint32_t _record);
+
+static void RemoveName(DirState *_dir, int _isShort, uint32_t _hash, uint32_t _record);
+
+static int AddRecord(DirState *_dir, const NameRecord *_record, const uint16_t *_name);
+
+static void DeleteRecord(DirState *_dir, unsigned int _record);
+
+static int AddFreeRun(DirState *_dir, uint32_t _first, uint32_t _count);
+
+static int AllocateSlots(DirState *_dir, unsigned int _count, uint32_t *_first, int *_isTail);
+
+static int GrowDirectory(DirState *_dir);
+
+static uint64_t SlotSector(const DirState *_dir, uint32_t _slot);
+
+static int WriteSlots(const DirState *_dir, uint32_t _first, unsigned int _count, const uint8_t *_data, int _isTail);
+
+static int ReadSlot(const DirState *_dir, uint32_t _slot, uint8_t *_data);
+
+static int ScanSlot(DirectoryEntry *entry, const char *path, void *context);
+
+static void FreeState(DirState *_dir);
+
+static DirState *GetDirState(unsigned int _startCluster);
+
+static void DropDirState(unsigned int _startCluster);
+
+static unsigned int FoldChar(unsigned int _char);
+
+static int DecodeName(const char *_name, size_t _length, uint16_t *_units, unsigned int *_unitCount);
+
+static int IsShortChar(unsigned int _char);
+
+static int ToShortName(const uint16_t *_units, unsigned int _length, uint8_t *_shortName);
+
+static int MakeAlias(const DirState *_dir, const uint16_t *_units, unsigned int _length, uint8_t *_shortName);
+
+static uint8_t LfnChecksum(const uint8_t *_shortName);
+
+static int Lookup(const DirState *_dir, const uint16_t *_units, unsigned int _length);
+
+static int ResolveParent(const char *_path, DirState **_parent, uint16_t *_units, unsigned int *_length);
+
+static void GetDosTime(uint16_t *_date, uint16_t *_time);
+
+static int InsertEntry(DirState *_dir, const uint16_t *_units, unsigned int _length, const DirectoryEntry *_entry);
+
+static int BeginChange();
+
+static int CreateEntry(const char *_path, int _isDirectory);
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static DirState *s_states[DIR_STATE_SLOTS];
+static uint64_t s_useClock = 0;
+
+static const char *const s_resultText[] = {
+    "ok", "no such file or folder", "already exists", "folder not empty",
+    "no space left", "invalid name or operation", "write failed"};
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/* FNV-1a over the characters of a folded long name */
+static uint32_t HashUnits(const uint16_t *_units, unsigned int _length)
+{
+    uint32_t hash = 2166136261U;
+    unsigned int i;
+
+    for (i = 0; i < _length; i++)
+    {
+        hash = (hash ^ (_units[i] & 0xFF)) * 16777619U;
+        hash = (hash ^ (_units[i] >> 8)) * 16777619U;
+    }
+
+    return hash;
+}
+
+static uint32_t HashShortName(const uint8_t *_shortName)
+{
+    uint32_t hash = 2166136261U;
+    unsigned int i;
+
+    for (i = 0; i < 11; i++)
+    {
+        hash = (hash ^ _shortName[i]) * 16777619U;
+    }
+
+    return hash;
+}
+
+/*!
+ * @brief <Find a record by folded long name or by short name>
+ *
+ * @param _dir <Pointer to a DirState object>.
+ * @param _isShort <non-zero to search the short names, _key is then 11 bytes>.
+ * @param _key <folded long name or short name>.
+ * @param _length <UTF-16 characters of a long name>.
+ *
+ * @return <record, -1 if not found>.
+ */
+static int FindName(const DirState *_dir, int _isShort, const void *_key, unsigned int _length)
+{
+    const NameTable *table = _isShort ? &_dir->shortNames : &_dir->longNames;
+    const uint32_t hash = _isShort ? HashShortName((const uint8_t *)_key) : HashUnits((const uint16_t *)_key, _length);
+    unsigned int i;
+
+    if (table->capacity == 0)
+    {
+        return -1;
+    }
+
+    i = (hash * 2654435761U) & (table->capacity - 1);
+    while (table->items[i].record != NAME_FREE)
+    {
+        const uint32_t record = table->items[i].record;
+
+        if ((record != NAME_DELETED) && (table->items[i].hash == hash))
+        {
+            const NameRecord *found = &_dir->records[record];
+
+            if (_isShort ? (memcmp(found->shortName, _key, 11) == 0)
+                         : ((found->nameLength == _length) &&
+                            (memcmp(_dir->names + found->nameOffset, _key, _length * sizeof(uint16_t)) == 0)))
+            {
+                return (int)record;
+            }
+        }
+        i = (i + 1) & (table->capacity - 1);
+    }
+
+    return -1;
+}
+
+/* add a record to a name table, grown at 70% load, zero on success */
+static int InsertName(DirState *_dir, int _isShort, uint32_t _hash, uint32_t _record)
+{
+    NameTable *table = _isShort ? &_dir->shortNames : &_dir->longNames;
+    unsigned int i;
+
+    if ((table->used + 1) * 10 > table->capacity * 7)
+    {
+        const unsigned int capacity = (table->capacity == 0) ? NAME_MIN_CAPACITY : table->capacity * 2;
+        NameItem *items = (NameItem *)malloc(capacity * sizeof(NameItem));
+
+        if (items == NULL)
+        {
+            return 1;
+        }
+        memset(items, 0xFF, capacity * sizeof(NameItem));
+
+        /* deleted marks are dropped */
+        table->used = 0;
+        for (i = 0; i < table->capacity; i++)
+        {
+            if (table->items[i].record < NAME_DELETED)
+            {
+                unsigned int j = (table->items[i].hash * 2654435761U) & (capacity - 1);
+
+                while (items[j].record != NAME_FREE)
+                {
+                    j = (j + 1) & (capacity - 1);
+                }
+                items[j] = table->items[i];
+                table->used++;
+            }
+        }
+
+        free(table->items);
+        table->items = items;
+        table->capacity = capacity;
+    }
+
+    i = (_hash * 2654435761U) & (table->capacity - 1);
+    while (table->items[i].record < NAME_DELETED)
+    {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    if (table->items[i].record == NAME_FREE)
+    {
+        table->used++;
+    }
+    table->items[i].hash = _hash;
+    table->items[i].record = _record;
+
+    return 0;
+}
+
+static void RemoveName(DirState *_dir, int _isShort, uint32_t _hash, uint32_t _record)
+{
+    NameTable *table = _isShort ? &_dir->shortNames : &_dir->longNames;
+    unsigned int i;
+
+    if (table->capacity == 0)
+    {
+        return;
+    }
+
+    i = (_hash * 2654435761U) & (table->capacity - 1);
+    while (table->items[i].record != NAME_FREE)
+    {
+        if (table->items[i].record == _record)
+        {
+            /* the chain of probes stays intact */
+            table->items[i].record = NAME_DELETED;
+            return;
+        }
+        i = (i + 1) & (table->capacity - 1);
+    }
+}
+
+/* keep an entry set and index its names, zero on success */
+static int AddRecord(DirState *_dir, const NameRecord *_record, const uint16_t *_name)
+{
+    NameRecord *record;
+    const uint32_t index = _dir->recordCount;
+
+    if (_dir->recordCount == _dir->recordCapacity)
+    {
+        const unsigned int capacity = (_dir->recordCapacity == 0) ? NAME_MIN_CAPACITY : _dir->recordCapacity * 2;
+        NameRecord *records = (NameRecord *)realloc(_dir->records, capacity * sizeof(NameRecord));
+
+        if (records == NULL)
+        {
+            return 1;
+        }
+        _dir->records = records;
+        _dir->recordCapacity = capacity;
+    }
+
+    if (_dir->nameLength + _record->nameLength > _dir->nameCapacity)
+    {
+        unsigned int capacity = (_dir->nameCapacity == 0) ? NAME_MIN_CAPACITY * LFN_CHARS : _dir->nameCapacity;
+        uint16_t *names;
+
+        while (_dir->nameLength + _record->nameLength > capacity)
+        {
+            capacity *= 2;
+        }
+        names = (uint16_t *)realloc(_dir->names, capacity * sizeof(uint16_t));
+        if (names == NULL)
+        {
+            return 1;
+        }
+        _dir->names = names;
+        _dir->nameCapacity = capacity;
+    }
+
+    record = &_dir->records[index];
+    *record = *_record;
+    record->nameOffset = _dir->nameLength;
+    record->isUsed = 1;
+    memcpy(_dir->names + _dir->nameLength, _name, _record->nameLength * sizeof(uint16_t));
+    _dir->nameLength += _record->nameLength;
+
+    if ((InsertName(_dir, 1, HashShortName(record->shortName), index) != 0) ||
+        ((record->nameLength > 0) &&
+         (InsertName(_dir, 0, HashUnits(_dir->names + record->nameOffset, record->nameLength), index) != 0)))
+    {
+        RemoveName(_dir, 1, HashShortName(record->shortName), index);
+        return 1;
+    }
+
+    _dir->recordCount++;
+    _dir->liveCount++;
+    return 0;
+}
+
+/* unindex an entry set, its slots are given back by the caller */
+static void DeleteRecord(DirState *_dir, unsigned int _record)
+{
+    NameRecord *record = &_dir->records[_record];
+
+    RemoveName(_dir, 1, HashShortName(record->shortName), _record);
+    if (record->nameLength > 0)
+    {
+        RemoveName(_dir, 0, HashUnits(_dir->names + record->nameOffset, record->nameLength), _record);
+    }
+    record->isUsed = 0;
+    _dir->liveCount--;
+}
+
+/* put a run of free slots in the bucket of its length, zero on success */
+static int AddFreeRun(DirState *_dir, uint32_t _first, uint32_t _count)
+{
+    const unsigned int bucket = (_count > DIR_MAX_SET_SLOTS) ? DIR_MAX_SET_SLOTS : _count;
+    int32_t node = _dir->unusedRun;
+
+    if (_count == 0)
+    {
+        return 0;
+    }
+
+    if (node == RUN_END)
+    {
+        if (_dir->runCount == _dir->runCapacity)
+        {
+            const unsigned int capacity = (_dir->runCapacity == 0) ? NAME_MIN_CAPACITY : _dir->runCapacity * 2;
+            FreeRun *runs = (FreeRun *)realloc(_dir->runs, capacity * sizeof(FreeRun));
+
+            if (runs == NULL)
+            {
+                return 1;
+            }
+            _dir->runs = runs;
+            _dir->runCapacity = capacity;
+        }
+        node = (int32_t)_dir->runCount++;
+    }
+    else
+    {
+        _dir->unusedRun = _dir->runs[node].next;
+    }
+
+    _dir->runs[node].first = _first;
+    _dir->runs[node].count = _count;
+    _dir->runs[node].next = _dir->buckets[bucket];
+    _dir->buckets[bucket] = node;
+
+    return 0;
+}
+
+/*!
+ * @brief <Find _count contiguous free slots>
+ *
+ * The smallest bucket holding runs of at least _count slots is used, the
+ * rest of the run goes back to the bucket of its new length; without one,
+ * slots are taken after the last used one, growing the directory.
+ *
+ * @param _dir <Pointer to a DirState object>.
+ * @param _count <number of slots, 1 to DIR_MAX_SET_SLOTS>.
+ * @param _first <Pointer to store the first slot>.
+ * @param _isTail <Pointer to store non-zero if the slots were taken after the last used one>.
+ *
+ * @return <DIR_OK, DIR_ERR_FULL or DIR_ERR_IO>.
+ */
+static int AllocateSlots(DirState *_dir, unsigned int _count, uint32_t *_first, int *_isTail)
+{
+    unsigned int bucket;
+    int result = DIR_OK;
+
+    for (bucket = _count; bucket <= DIR_MAX_SET_SLOTS; bucket++)
+    {
+        const int32_t node = _dir->buckets[bucket];
+
+        if (node != RUN_END)
+        {
+            FreeRun *run = &_dir->runs[node];
+
+            _dir->buckets[bucket] = run->next;
+            *_first = run->first;
+            *_isTail = 0;
+
+            run->next = _dir->unusedRun;
+            _dir->unusedRun = node;
+
+            return (AddFreeRun(_dir, run->first + _count, run->count - _count) == 0) ? DIR_OK : DIR_ERR_IO;
+        }
+    }
+
+    while ((result == DIR_OK) && (_dir->endSlot + _count > _dir->slotCount))
+    {
+        result = GrowDirectory(_dir);
+    }
+
+    if (result == DIR_OK)
+    {
+        *_first = _dir->endSlot;
+        *_isTail = 1;
+        _dir->endSlot += _count;
+    }
+
+    return result;
+}
+
+/* chain a zeroed cluster to the directory */
+static int GrowDirectory(DirState *_dir)
+{
+    const unsigned int sectorPerCluster = GetSectorPerCluster();
+    const unsigned int slotPerCluster = sectorPerCluster * GetBytePerSector() / SLOT_SIZE;
+    uint8_t *zero;
+    unsigned int *clusters;
+    unsigned int cluster;
+    unsigned int i;
+    int isFailed = 0;
+
+    /* the root directory of FAT12/16 has a fixed size */
+    if ((_dir->startCluster == DIR_KEY_FIXED_ROOT) || (_dir->slotCount + slotPerCluster > DIR_MAX_SLOTS))
+    {
+        return DIR_ERR_FULL;
+    }
+
+    clusters = (unsigned int *)realloc(_dir->clusters, (_dir->clusterCount + 1) * sizeof(unsigned int));
+    zero = (uint8_t *)calloc(1, GetBytePerSector());
+    if (clusters != NULL)
+    {
+        _dir->clusters = clusters;
+    }
+    if ((clusters == NULL) || (zero == NULL))
+    {
+        free(zero);
+        return DIR_ERR_IO;
+    }
+
+    cluster = AllocateCluster(_dir->clusters[_dir->clusterCount - 1]);
+    if (cluster == 0)
+    {
+        free(zero);
+        return DIR_ERR_FULL;
+    }
+
+    /* zeroed slots read as the end of the directory */
+    for (i = 0; !isFailed && (i < sectorPerCluster); i++)
+    {
+        isFailed = WriteSector(zero, ClusterToSector(cluster) + i);
+    }
+    free(zero);
+
+    _dir->clusters[_dir->clusterCount++] = cluster;
+    _dir->slotCount += slotPerCluster;
+
+    return isFailed ? DIR_ERR_IO : DIR_OK;
+}
+
+static uint64_t SlotSector(const DirState *_dir, uint32_t _slot)
+{
+    const unsigned int slotPerSector = GetBytePerSector() / SLOT_SIZE;
+    const unsigned int slotPerCluster = slotPerSector * GetSectorPerCluster();
+
+    if (_dir->startCluster == DIR_KEY_FIXED_ROOT)
+    {
+        return GetStartSectorRoot() + _slot / slotPerSector;
+    }
+
+    return ClusterToSector(_dir->clusters[_slot / slotPerCluster]) + (_slot % slotPerCluster) / slotPerSector;
+}
+
+/*!
+ * @brief <Write consecutive slots, one read and one write per sector>
+ *
+ * @param _dir <Pointer to a DirState object>.
+ * @param _first <first slot>.
+ * @param _count <number of slots>.
+ * @param _data <_count slots to write, NULL to mark them deleted>.
+ * @param _isTail <non-zero if the slots were taken after the last used one,
+ * the next slot is then marked as the end of the directory>.
+ *
+ * @return <zero on success>.
+ */
+static int WriteSlots(const DirState *_dir, uint32_t _first, unsigned int _count, const uint8_t *_data, int _isTail)
+{
+    const unsigned int slotPerSector = GetBytePerSector() / SLOT_SIZE;
+    const uint32_t last = _first + _count;
+    const uint32_t end = (_isTail && (last < _dir->slotCount)) ? last + 1 : last;
+    uint8_t *sector = (uint8_t *)malloc(GetBytePerSector());
+    uint32_t slot = _first;
+    int isFailed = (sector == NULL);
+
+    while (!isFailed && (slot < end))
+    {
+        const uint64_t sectorPosition = SlotSector(_dir, slot);
+
+        ReadSector(sector, sectorPosition);
+        do
+        {
+            uint8_t *target = sector + (slot % slotPerSector) * SLOT_SIZE;
+
+            if (slot == last)
+            {
+                /* slots after the end may hold old data, it must stay hidden */
+                target[0] = ENTRY_EMPTY;
+            }
+            else if (_data != NULL)
+            {
+                memcpy(target, _data + (size_t)(slot - _first) * SLOT_SIZE, SLOT_SIZE);
+            }
+            else
+            {
+                target[0] = ENTRY_DELETED;
+            }
+            slot++;
+        } while ((slot < end) && (slot % slotPerSector != 0));
+
+        isFailed = WriteSector(sector, sectorPosition);
+    }
+
+    free(sector);
+    return isFailed;
+}
+
+static int ReadSlot(const DirState *_dir, uint32_t _slot, uint8_t *_data)
+{
+    uint8_t *sector = (uint8_t *)malloc(GetBytePerSector());
+
+    if (sector == NULL)
+    {
+        return 1;
+    }
+
+    ReadSector(sector, SlotSector(_dir, _slot));
+    memcpy(_data, sector + (_slot % (GetBytePerSector() / SLOT_SIZE)) * SLOT_SIZE, SLOT_SIZE);
+    free(sector);
+
+    return 0;
+}
+
+/*!
+ * @brief <ScanDirectory visitor of the first scan: entry sets, long names and free runs>
+ *
+ * @param entry <Pointer to the slot>.
+ * @param path <unused, NULL on FAT12/16/32>.
+ * @param context <Pointer to a ScanState object>.
+ *
+ * @return <non-zero to stop the scan, out of memory>.
+ */
+static int ScanSlot(DirectoryEntry *entry, const char *path, void *context)
+{
+    ScanState *scan = (ScanState *)context;
+    const uint8_t *raw = (const uint8_t *)entry;
+    const unsigned int slot = scan->slot++;
+    unsigned int i;
+
+    (void)path;
+
+    if ((raw[0] == ENTRY_DELETED) || (raw[0] == ENTRY_EMPTY))
+    {
+        scan->setCount = 0;
+        if (raw[0] == ENTRY_EMPTY)
+        {
+            /* everything from here is free, see AllocateSlots */
+            scan->dir->endSlot = slot;
+        }
+        else if ((scan->freeCount > 0) && (scan->freeFirst + scan->freeCount == slot))
+        {
+            scan->freeCount++;
+        }
+        else
+        {
+            scan->isFailed = scan->isFailed || (AddFreeRun(scan->dir, scan->freeFirst, scan->freeCount) != 0);
+            scan->freeFirst = slot;
+            scan->freeCount = 1;
+        }
+        return scan->isFailed;
+    }
+
+    if (entry->attributes == ENTRY_NAME)
+    {
+        const unsigned int order = raw[0] & LFN_ORDER_MASK;
+        uint16_t *chars;
+
+        if ((raw[0] & LFN_LAST) && (order >= 1) && (order < DIR_MAX_SET_SLOTS))
+        {
+            scan->setFirst = slot;
+            scan->setCount = order;
+            scan->setNext = order;
+            scan->checksum = raw[LFN_CHECKSUM_OFFSET];
+        }
+
+        if ((scan->setCount == 0) || (order != scan->setNext) || (raw[LFN_CHECKSUM_OFFSET] != scan->checksum))
+        {
+            /* broken long name, the short entry is kept alone */
+            scan->setCount = 0;
+            return 0;
+        }
+
+        /* characters at bytes 1-10, 14-25 and 28-31 */
+        chars = scan->name + (order - 1) * LFN_CHARS;
+        for (i = 0; i < 5; i++)
+        {
+            chars[i] = (uint16_t)(raw[1 + 2 * i] | (raw[2 + 2 * i] << 8));
+        }
+        for (i = 0; i < 6; i++)
+        {
+            chars[5 + i] = (uint16_t)(raw[14 + 2 * i] | (raw[15 + 2 * i] << 8));
+        }
+        for (i = 0; i < 2; i++)
+        {
+            chars[11 + i] = (uint16_t)(raw[28 + 2 * i] | (raw[29 + 2 * i] << 8));
+        }
+        scan->setNext--;
+        return 0;
+    }
+
+    if (!(entry->attributes & ENTRY_VOLUME) && (raw[0] != ENTRY_DOT))
+    {
+        NameRecord record;
+        uint16_t *name = scan->name;
+
+        memset(&record, 0, sizeof(record));
+        memcpy(record.shortName, raw, 11);
+        record.firstSlot = slot;
+        record.slotCount = 1;
+        record.attributes = entry->attributes;
+        record.startCluster = GetEntryCluster(entry);
+
+        if ((scan->setCount > 0) && (scan->setNext == 0) && (scan->setFirst + scan->setCount == slot) &&
+            (LfnChecksum(raw) == scan->checksum))
+        {
+            record.firstSlot = scan->setFirst;
+            record.slotCount = (uint8_t)(scan->setCount + 1);
+            while ((record.nameLength < scan->setCount * LFN_CHARS) && (name[record.nameLength] != 0x0000))
+            {
+                name[record.nameLength] = (uint16_t)FoldChar(name[record.nameLength]);
+                record.nameLength++;
+            }
+        }
+
+        scan->isFailed = (AddRecord(scan->dir, &record, name) != 0);
+    }
+
+    scan->setCount = 0;
+    return scan->isFailed;
+}
+
+static void FreeState(DirState *_dir)
+{
+    if (_dir != NULL)
+    {
+        free(_dir->clusters);
+        free(_dir->records);
+        free(_dir->names);
+        free(_dir->longNames.items);
+        free(_dir->shortNames.items);
+        free(_dir->runs);
+        free(_dir);
+    }
+}
+
+/*!
+ * @brief <Get the decoded directory, scan it on first use>
+ *
+ * @param _startCluster <Start cluster of the directory, 0 for root directory>.
+ *
+ * @return <Pointer to the state, NULL if out of memory or not a directory>.
+ */
+static DirState *GetDirState(unsigned int _startCluster)
+{
+    const unsigned int key = (_startCluster == 0) ? GetRootCluster() : _startCluster;
+    ScanState *scan;
+    DirState *dir;
+    unsigned int victim = DIR_STATE_SLOTS;
+    unsigned int i;
+    int isFailed;
+
+    for (i = 0; i < DIR_STATE_SLOTS; i++)
+    {
+        if ((s_states[i] != NULL) && (s_states[i]->startCluster == key))
+        {
+            s_states[i]->lastUse = ++s_useClock;
+            return s_states[i];
+        }
+
+        /* least recently used, an empty slot first */
+        if ((s_states[i] == NULL) ||
+            (!s_states[i]->isPinned &&
+             ((victim == DIR_STATE_SLOTS) ||
+              ((s_states[victim] != NULL) && (s_states[i]->lastUse < s_states[victim]->lastUse)))))
+        {
+            victim = (victim < DIR_STATE_SLOTS) && (s_states[victim] == NULL) ? victim : i;
+        }
+    }
+
+    if ((victim == DIR_STATE_SLOTS) || ((key != DIR_KEY_FIXED_ROOT) && !IsValidCluster(key)))
+    {
+        return NULL;
+    }
+
+    dir = (DirState *)calloc(1, sizeof(DirState));
+    scan = (ScanState *)calloc(1, sizeof(ScanState));
+    isFailed = (dir == NULL) || (scan == NULL);
+
+    if (!isFailed)
+    {
+        dir->startCluster = key;
+        dir->unusedRun = RUN_END;
+        for (i = 0; i <= DIR_MAX_SET_SLOTS; i++)
+        {
+            dir->buckets[i] = RUN_END;
+        }
+
+        if (key == DIR_KEY_FIXED_ROOT)
+        {
+            dir->slotCount = SectorPerRoot() * (GetBytePerSector() / SLOT_SIZE);
+        }
+        else
+        {
+            unsigned int extentCount = 0;
+            Extent *extents = GetFileExtents(key, &extentCount);
+            unsigned int j;
+
+            for (i = 0; i < extentCount; i++)
+            {
+                dir->clusterCount += extents[i].count;
+            }
+            dir->clusters = (unsigned int *)malloc((dir->clusterCount + 1) * sizeof(unsigned int));
+            isFailed = (dir->clusters == NULL);
+
+            dir->clusterCount = 0;
+            for (i = 0; !isFailed && (i < extentCount); i++)
+            {
+                for (j = 0; j < extents[i].count; j++)
+                {
+                    dir->clusters[dir->clusterCount++] = extents[i].cluster + j;
+                }
+            }
+            dir->slotCount = dir->clusterCount * GetSectorPerCluster() * (GetBytePerSector() / SLOT_SIZE);
+            free(extents);
+        }
+    }
+
+    if (!isFailed)
+    {
+        /* one pass: names, long names and runs of deleted slots */
+        scan->dir = dir;
+        dir->endSlot = dir->slotCount;
+        ScanDirectory(key, ScanSlot, scan);
+        isFailed = scan->isFailed || (AddFreeRun(dir, scan->freeFirst, scan->freeCount) != 0);
+    }
+
+    free(scan);
+    if (isFailed)
+    {
+        FreeState(dir);
+        return NULL;
+    }
+
+    FreeState(s_states[victim]);
+    s_states[victim] = dir;
+    dir->lastUse = ++s_useClock;
+
+    return dir;
+}
+
+static void DropDirState(unsigned int _startCluster)
+{
+    unsigned int i;
+
+    for (i = 0; i < DIR_STATE_SLOTS; i++)
+    {
+        if ((s_states[i] != NULL) && (s_states[i]->startCluster == _startCluster))
+        {
+            FreeState(s_states[i]);
+            s_states[i] = NULL;
+        }
+    }
+}
+
+/* upper case of ASCII and Latin-1 letters */
+static unsigned int FoldChar(unsigned int _char)
+{
+    if (((_char >= 'a') && (_char <= 'z')) || ((_char >= 0xE0) && (_char <= 0xFE) && (_char != 0xF7)))
+    {
+        return _char - 0x20;
+    }
+
+    return (_char == 0xFF) ? 0x178 : _char;
+}
+
+/*!
+ * @brief <Convert one UTF-8 path component to UTF-16 and check it can be a FAT name>
+ *
+ * @param _name <first byte of the component>.
+ * @param _length <bytes of the component>.
+ * @param _units <array of at least DIR_NAME_MAX items>.
+ * @param _unitCount <Pointer to store the number of UTF-16 characters>.
+ *
+ * @return <zero if the name is valid>.
+ */
+static int DecodeName(const char *_name, size_t _length, uint16_t *_units, unsigned int *_unitCount)
+{
+    const uint8_t *p = (const uint8_t *)_name;
+    const uint8_t *end = p + _length;
+    unsigned int count = 0;
+
+    while (p < end)
+    {
+        unsigned int code = *p;
+        unsigned int extra = (code >= 0xF0) ? 3 : (code >= 0xE0) ? 2 : (code >= 0xC0) ? 1 : 0;
+        unsigned int i;
+
+        if ((code >= 0x80) && (code < 0xC0))
+        {
+            return 1;
+        }
+        code &= (extra == 0) ? 0x7F : (0x3F >> extra);
+        if ((size_t)(end - p) <= extra)
+        {
+            return 1;
+        }
+        for (i = 1; i <= extra; i++)
+        {
+            if ((p[i] & 0xC0) != 0x80)
+            {
+                return 1;
+            }
+            code = (code << 6) | (p[i] & 0x3F);
+        }
+        p += extra + 1;
+
+        /* control characters and the ones FAT reserves */
+        if ((code < 0x20) || (strchr("\"*/:<>?\\|", (int)code) != NULL && code < 0x80) || (code > 0x10FFFF))
+        {
+            return 1;
+        }
+
+        if (code >= 0x10000)
+        {
+            if (count + 2 > DIR_NAME_MAX)
+            {
+                return 1;
+            }
+            code -= 0x10000;
+            _units[count++] = (uint16_t)(0xD800 | (code >> 10));
+            _units[count++] = (uint16_t)(0xDC00 | (code & 0x3FF));
+        }
+        else
+        {
+            if (count + 1 > DIR_NAME_MAX)
+            {
+                return 1;
+            }
+            _units[count++] = (uint16_t)code;
+        }
+    }
+
+    *_unitCount = count;
+
+    /* "." and "..", and the trailing dots and spaces other systems strip */
+    return (count == 0) || (_units[count - 1] == '.') || (_units[count - 1] == ' ');
+}
+
+/* characters of a short name besides letters and digits */
+static int IsShortChar(unsigned int _char)
+{
+    return ((_char >= 'A') && (_char <= 'Z')) || ((_char >= '0') && (_char <= '9')) ||
+           ((_char > 0x20) && (_char < 0x80) && (strchr("!#$%&'()-@^_`{}~", (int)_char) != NULL));
+}
+
+/*!
+ * @brief <Convert a name to the 11 bytes of a short entry if it is a valid upper case 8.3 name>
+ *
+ * @param _units <UTF-16 name>.
+ * @param _length <UTF-16 characters>.
+ * @param _shortName <array of 11 bytes>.
+ *
+ * @return <non-zero if the name needs no long name slots>.
+ */
+static int ToShortName(const uint16_t *_units, unsigned int _length, uint8_t *_shortName)
+{
+    unsigned int baseLength = 0;
+    unsigned int extLength = 0;
+    int isExt = 0;
+    unsigned int i;
+
+    memset(_shortName, ' ', 11);
+
+    for (i = 0; i < _length; i++)
+    {
+        if ((_units[i] == '.') && !isExt && (i > 0))
+        {
+            isExt = 1;
+        }
+        else if (!IsShortChar(_units[i]) || (isExt ? (extLength == 3) : (baseLength == 8)))
+        {
+            return 0;
+        }
+        else if (isExt)
+        {
+            _shortName[8 + extLength++] = (uint8_t)_units[i];
+        }
+        else
+        {
+            _shortName[baseLength++] = (uint8_t)_units[i];
+        }
+    }
+
+    /* "NAME." is not a short name, 0xE5 would read as deleted */
+    if ((baseLength == 0) || (isExt && (extLength == 0)))
+    {
+        return 0;
+    }
+    if (_shortName[0] == ENTRY_DELETED)
+    {
+        _shortName[0] = ENTRY_E5;
+    }
+
+    return 1;
+}
+
+/*!
+ * @brief <Build a short alias not used in the directory>
+ *
+ * "BASIS~1" to "BASIS~4" like other systems, then two characters, four hex
+ * digits of a hash of the name and "~n", so that many names with the same
+ * start do not probe a long series of aliases.
+ *
+ * @param _dir <Pointer to a DirState object>.
+ * @param _units <folded UTF-16 name>.
+ * @param _length <UTF-16 characters>.
+ * @param _shortName <array of 11 bytes>.
+ *
+ * @return <zero on success, non-zero if every alias is taken>.
+ */
+static int MakeAlias(const DirState *_dir, const uint16_t *_units, unsigned int _length, uint8_t *_shortName)
+{
+    uint8_t basis[8];
+    unsigned int baseLength = 0;
+    unsigned int extLength = 0;
+    unsigned int lastDot = _length;
+    const uint32_t hash = HashUnits(_units, _length);
+    unsigned int attempt;
+    unsigned int i;
+
+    for (i = 1; i < _length; i++)
+    {
+        if (_units[i] == '.')
+        {
+            lastDot = i;
+        }
+    }
+
+    memset(_shortName, ' ', 11);
+    for (i = 0; i < _length; i++)
+    {
+        const unsigned int c = _units[i];
+        const uint8_t shortChar = IsShortChar(c) ? (uint8_t)c : '_';
+
+        /* spaces and dots are dropped, other characters become '_' */
+        if ((c == ' ') || ((c == '.') && (i != lastDot)))
+        {
+            continue;
+        }
+        if (i < lastDot)
+        {
+            if (baseLength < 8)
+            {
+                basis[baseLength++] = shortChar;
+            }
+        }
+        else if ((i > lastDot) && (extLength < 3))
+        {
+            _shortName[8 + extLength++] = shortChar;
+        }
+    }
+    if (baseLength == 0)
+    {
+        basis[baseLength++] = '_';
+    }
+
+    for (attempt = 0; attempt < ALIAS_MAX_TRIES; attempt++)
+    {
+        char tail[8];
+        unsigned int keep;
+        unsigned int tailLength;
+
+        if (attempt < ALIAS_SIMPLE_TAILS)
+        {
+            tailLength = (unsigned int)sprintf(tail, "~%u", attempt + 1);
+            keep = (baseLength + tailLength > 8) ? 8 - tailLength : baseLength;
+        }
+        else
+        {
+            /* the hash walks with the attempts, "~1" to "~9" at each value */
+            const unsigned int step = attempt - ALIAS_SIMPLE_TAILS;
+
+            tailLength = (unsigned int)sprintf(tail, "%04X~%u", (unsigned int)((hash + step / 9) & 0xFFFF), step % 9 + 1);
+            keep = (baseLength < 2) ? baseLength : 2;
+        }
+
+        memcpy(_shortName, basis, keep);
+        memcpy(_shortName + keep, tail, tailLength);
+        memset(_shortName + keep + tailLength, ' ', 8 - keep - tailLength);
+        if (_shortName[0] == ENTRY_DELETED)
+        {
+            _shortName[0] = ENTRY_E5;
+        }
+
+        if (FindName(_dir, 1, _shortName, 11) < 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* checksum of the short name stored in every long name slot */
+static uint8_t LfnChecksum(const uint8_t *_shortName)
+{
+    uint8_t sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < 11; i++)
+    {
+        sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + _shortName[i]);
+    }
+
+    return sum;
+}
+
+/* record of a name, matched against long names and short names, -1 if not found */
+static int Lookup(const DirState *_dir, const uint16_t *_units, unsigned int _length)
+{
+    uint16_t folded[DIR_NAME_MAX] = {0};
+    uint8_t shortName[11];
+    unsigned int i;
+    int record;
+
+    for (i = 0; i < _length; i++)
+    {
+        folded[i] = (uint16_t)FoldChar(_units[i]);
+    }
+
+    record = FindName(_dir, 0, folded, _length);
+    if ((record < 0) && ToShortName(folded, _length, shortName))
+    {
+        record = FindName(_dir, 1, shortName, 11);
+    }
+
+    return record;
+}
+
+/*!
+ * @brief <Find the folder holding the last component of a path>
+ *
+ * @param _path <absolute path, UTF-8>.
+ * @param _parent <Pointer to store the decoded parent folder>.
+ * @param _units <array of DIR_NAME_MAX items to store the last component>.
+ * @param _length <Pointer to store the UTF-16 characters of the last component>.
+ *
+ * @return <DIR_OK or one of the DIR_ERR_ values>.
+ */
+static int ResolveParent(const char *_path, DirState **_parent, uint16_t *_units, unsigned int *_length)
+{
+    const char *p = _path;
+    DirState *dir = GetDirState(0);
+
+    while (dir != NULL)
+    {
+        const char *component;
+        size_t componentLength;
+
+        while (*p == '/')
+        {
+            p++;
+        }
+        component = p;
+        while ((*p != '\0') && (*p != '/'))
+        {
+            p++;
+        }
+        componentLength = (size_t)(p - component);
+        while (*p == '/')
+        {
+            p++;
+        }
+
+        if (DecodeName(component, componentLength, _units, _length) != 0)
+        {
+            return DIR_ERR_INVALID;
+        }
+
+        if (*p == '\0')
+        {
+            /* last component, the parent is found */
+            *_parent = dir;
+            return DIR_OK;
+        }
+        else
+        {
+            const int record = Lookup(dir, _units, *_length);
+
+            if ((record < 0) || !(dir->records[record].attributes & ENTRY_DIRECTORY))
+            {
+                return DIR_ERR_NOT_FOUND;
+            }
+            dir = GetDirState(dir->records[record].startCluster);
+        }
+    }
+
+    return DIR_ERR_IO;
+}
+
+/* local time in the DOS format of directory entries */
+static void GetDosTime(uint16_t *_date, uint16_t *_time)
+{
+    const time_t now = time(NULL);
+    struct tm local;
+
+#ifdef _WIN32
+    localtime_s(&local, &now);
+#else
+    localtime_r(&now, &local);
+#endif
+
+    *_date = (uint16_t)(((local.tm_year + 1900 - YEAR_OFFSET) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday);
+    *_time = (uint16_t)((local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2));
+}
+
+/*!
+ * @brief <Write the entry set of a new name: long name slots if needed, then the short entry>
+ *
+ * @param _dir <Pointer to the DirState of the folder>.
+ * @param _units <UTF-16 name, not in the folder yet>.
+ * @param _length <UTF-16 characters>.
+ * @param _entry <short entry to store, its name is set here>.
+ *
+ * @return <DIR_OK or one of the DIR_ERR_ values>.
+ */
+static int InsertEntry(DirState *_dir, const uint16_t *_units, unsigned int _length, const DirectoryEntry *_entry)
+{
+    uint8_t set[DIR_MAX_SET_SLOTS * SLOT_SIZE];
+    uint16_t folded[DIR_NAME_MAX] = {0};
+    NameRecord record;
+    DirectoryEntry *entry;
+    unsigned int lfnCount = 0;
+    unsigned int i;
+    uint32_t first = 0;
+    int isTail = 0;
+    int result;
+
+    memset(&record, 0, sizeof(record));
+    for (i = 0; i < _length; i++)
+    {
+        folded[i] = (uint16_t)FoldChar(_units[i]);
+    }
+
+    /* a name that is its own short name keeps a single slot */
+    if (!ToShortName(_units, _length, record.shortName) || (FindName(_dir, 1, record.shortName, 11) >= 0))
+    {
+        if (MakeAlias(_dir, folded, _length, record.shortName) != 0)
+        {
+            return DIR_ERR_FULL;
+        }
+        lfnCount = (_length + LFN_CHARS - 1) / LFN_CHARS;
+        record.nameLength = (uint16_t)_length;
+    }
+    record.slotCount = (uint8_t)(lfnCount + 1);
+
+    /* long name slots are stored last part first, then the short entry */
+    memset(set, 0, sizeof(set));
+    for (i = 0; i < lfnCount; i++)
+    {
+        const unsigned int order = lfnCount - i;
+        uint8_t *slot = set + i * SLOT_SIZE;
+        unsigned int j;
+
+        slot[0] = (uint8_t)(order | ((i == 0) ? LFN_LAST : 0));
+        slot[11] = ENTRY_NAME;
+        slot[LFN_CHECKSUM_OFFSET] = LfnChecksum(record.shortName);
+
+        for (j = 0; j < LFN_CHARS; j++)
+        {
+            static const uint8_t offsets[LFN_CHARS] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+            const unsigned int index = (order - 1) * LFN_CHARS + j;
+            /* one 0x0000 after the name, then 0xFFFF padding */
+            const uint16_t c = (index < _length) ? _units[index] : ((index == _length) ? 0x0000 : 0xFFFF);
+
+            slot[offsets[j]] = (uint8_t)c;
+            slot[offsets[j] + 1] = (uint8_t)(c >> 8);
+        }
+    }
+
+    entry = (DirectoryEntry *)(set + lfnCount * SLOT_SIZE);
+    memcpy(entry, _entry, sizeof(DirectoryEntry));
+    memcpy(entry->name, record.shortName, 11);
+    record.attributes = entry->attributes;
+    record.startCluster = GetEntryCluster(entry);
+
+    result = AllocateSlots(_dir, record.slotCount, &first, &isTail);
+    if (result == DIR_OK)
+    {
+        record.firstSlot = first;
+        result = (WriteSlots(_dir, first, record.slotCount, set, isTail) != 0) ? DIR_ERR_IO : DIR_OK;
+    }
+    if (result == DIR_OK)
+    {
+        result = (AddRecord(_dir, &record, folded) != 0) ? DIR_ERR_IO : DIR_OK;
+    }
+
+    return result;
+}
+
+/* checks shared by every change, zero if the volume can be changed */
+static int BeginChange()
+{
+    if (GetFatType() == FAT_TYPE_EXFAT)
+    {
+        return DIR_ERR_INVALID;
+    }
+
+    /* the image itself is only written by a journal checkpoint */
+    if (!IsJournalOpen() && !IsOverlayOpen())
+    {
+        return DIR_ERR_IO;
+    }
+
+    /* an index describes the volume before the change */
+    CloseIndex();
+    return DIR_OK;
+}
+
+/* new file or folder for FatCreateFile and FatMkdir */
+static int CreateEntry(const char *_path, int _isDirectory)
+{
+    uint16_t units[DIR_NAME_MAX];
+    unsigned int length = 0;
+    DirState *parent = NULL;
+    DirectoryEntry entry;
+    uint16_t date;
+    uint16_t time;
+    unsigned int cluster = 0;
+    int result = BeginChange();
+
+    if (result == DIR_OK)
+    {
+        result = ResolveParent(_path, &parent, units, &length);
+    }
+    if ((result == DIR_OK) && (Lookup(parent, units, length) >= 0))
+    {
+        result = DIR_ERR_EXISTS;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    GetDosTime(&date, &time);
+    entry.attributes = _isDirectory ? ENTRY_DIRECTORY : ENTRY_ARCHIVE;
+    entry.creatTime[0] = entry.modifiedTime[0] = (uint8_t)time;
+    entry.creatTime[1] = entry.modifiedTime[1] = (uint8_t)(time >> 8);
+    entry.creatDate[0] = entry.modifiedDate[0] = entry.dontCare3[0] = (uint8_t)date;
+    entry.creatDate[1] = entry.modifiedDate[1] = entry.dontCare3[1] = (uint8_t)(date >> 8);
+
+    if ((result == DIR_OK) && _isDirectory)
+    {
+        const unsigned int sectorPerCluster = GetSectorPerCluster();
+        uint8_t *sector = (uint8_t *)calloc(1, GetBytePerSector());
+        DirectoryEntry *dots = (DirectoryEntry *)sector;
+        unsigned int i;
+
+        cluster = AllocateCluster(0);
+        result = (sector == NULL) ? DIR_ERR_IO : ((cluster == 0) ? DIR_ERR_FULL : DIR_OK);
+
+        if (result == DIR_OK)
+        {
+            /* "." is the folder itself, ".." its parent with 0 for the root directory */
+            dots[0] = entry;
+            dots[1] = entry;
+            memset(dots[0].name, ' ', 11);
+            memset(dots[1].name, ' ', 11);
+            dots[0].name[0] = ENTRY_DOT;
+            dots[1].name[0] = ENTRY_DOT;
+            dots[1].name[1] = ENTRY_DOT;
+            SetEntryCluster(&dots[0], cluster);
+            SetEntryCluster(&dots[1], (parent->startCluster == GetRootCluster()) ? 0 : parent->startCluster);
+
+            for (i = 0; (result == DIR_OK) && (i < sectorPerCluster); i++)
+            {
+                result = (WriteSector(sector, ClusterToSector(cluster) + i) != 0) ? DIR_ERR_IO : DIR_OK;
+                memset(sector, 0, 2 * sizeof(DirectoryEntry));
+            }
+        }
+
+        free(sector);
+        SetEntryCluster(&entry, cluster);
+    }
+
+    if (result == DIR_OK)
+    {
+        result = InsertEntry(parent, units, length, &entry);
+    }
+    if ((result != DIR_OK) && (cluster != 0))
+    {
+        FreeClusterChain(cluster);
+    }
+
+    return result;
+}
+
+/*!
+ * @brief <Create an empty file>
+ *
+ * @param _path <absolute path, UTF-8, the parent folder must exist>.
+ *
+ * @return <DIR_OK or one of the DIR_ERR_ values>.
+ */
+int FatCreateFile(const char *_path)
+{
+    return CreateEntry(_path, 0);
+}
+
+/*!
+ * @brief <Create a folder with its "." and ".." entries>
+ *
+ * @param _path <absolute path, UTF-8, the parent folder must exist>.
+ *
+ * @return <DIR_OK or one of the DIR_ERR_ values>.
+ */
+int FatMkdir(const char *_path)
+{
+    return CreateEntry(_path, 1);
+}
+
+/*!
+ * @brief <Delete a file or an empty folder and free its clusters>
+ *
+ * @param _path <absolute path, UTF-8>.
+ *
+ * @return <DIR_OK or one of the DIR_ERR_ values>.
+ */
+int FatUnlink(const char *_path)
+{
+    uint16_t units[DIR_NAME_MAX];
+    unsigned int length = 0;
+    DirState *parent = NULL;
+    NameRecord record;
+    int index = -1;
+    int result = BeginChange();
+
+    if (result == DIR_OK)
+    {
+        result = ResolveParent(_path, &parent, units, &length);
+    }
+    if (result == DIR_OK)
+    {
+        index = Lookup(parent, units, length);
+        result = (index < 0) ? DIR_ERR_NOT_FOUND : DIR_OK;
+    }
+    if (result == DIR_OK)
+    {
+        record = parent->records[index];
+
+        if (record.attributes & ENTRY_DIRECTORY)
+        {
+            const DirState *child;
+
+            parent->isPinned = 1;
+            child = GetDirState(record.startCluster);
+            parent->isPinned = 0;
+
+            result = (child == NULL) ? DIR_ERR_IO : ((child->liveCount > 0) ? DIR_ERR_NOT_EMPTY : DIR_OK);
+        }
+    }
+
+    if (result == DIR_OK)
+    {
+        result = (WriteSlots(parent, record.firstSlot, record.slotCount, NULL, 0) != 0) ? DIR_ERR_IO : DIR_OK;
+    }
+    if (result == DIR_OK)
+    {
+        DeleteRecord(parent, (unsigned int)index);
+        AddFreeRun(parent, record.firstSlot, record.slotCount);
+
+        if (record.attributes & ENTRY_DIRECTORY)
+        {
+            DropDirState(record.startCluster);
+        }
+        result = (FreeClusterChain(record.startCluster) != 0) ? DIR_ERR_IO : DIR_OK;
+    }
+
+    return result;
+}
+
+/*!
+ * @brief <Rename or move a file or a folder>
+ *
+ * @param _oldPath <absolute path of the entry, UTF-8>.
+ * @param _newPath <absolute new path, UTF-8, the parent folder must exist>.
+ *
+ * @return <DIR_OK or one of the DIR_ERR_ values>.
+ */
+int FatRename(const char *_oldPath, const char *_newPath)
+{
+    uint16_t oldUnits[DIR_NAME_MAX];
+    uint16_t newUnits[DIR_NAME_MAX];
+    unsigned int oldLength = 0;
+    unsigned int newLength = 0;
+    DirState *oldParent = NULL;
+    DirState *newParent = NULL;
+    NameRecord record;
+    uint8_t entry[SLOT_SIZE];
+    int index = -1;
+    int existing;
+    int result = BeginChange();
+
+    if (result == DIR_OK)
+    {
+        result = ResolveParent(_oldPath, &oldParent, oldUnits, &oldLength);
+    }
+    if (result == DIR_OK)
+    {
+        index = Lookup(oldParent, oldUnits, oldLength);
+        result = (index < 0) ? DIR_ERR_NOT_FOUND : DIR_OK;
+    }
+    if (result == DIR_OK)
+    {
+        record = oldParent->records[index];
+        result = (ReadSlot(oldParent, record.firstSlot + record.slotCount - 1, entry) != 0) ? DIR_ERR_IO : DIR_OK;
+    }
+    if (result == DIR_OK)
+    {
+        oldParent->isPinned = 1;
+        result = ResolveParent(_newPath, &newParent, newUnits, &newLength);
+        oldParent->isPinned = 0;
+    }
+    if (result == DIR_OK)
+    {
+        /* a change of case only finds the entry itself */
+        existing = Lookup(newParent, newUnits, newLength);
+        if ((existing >= 0) && !((newParent == oldParent) && (existing == index)))
+        {
+            result = DIR_ERR_EXISTS;
+        }
+    }
+
+    if ((result == DIR_OK) && (record.attributes & ENTRY_DIRECTORY) && (newParent != oldParent))
+    {
+        /* the new parent must not be the folder or one of its folders: follow ".." up */
+        unsigned int cluster = newParent->startCluster;
+        unsigned int depth;
+
+        for (depth = 0; (result == DIR_OK) && IsValidCluster(cluster) && (depth < DIR_MAX_SLOTS); depth++)
+        {
+            DirectoryEntry dots[2];
+            uint8_t *sector = (uint8_t *)malloc(GetBytePerSector());
+
+            if (cluster == record.startCluster)
+            {
+                result = DIR_ERR_INVALID;
+            }
+            else if (sector == NULL)
+            {
+                result = DIR_ERR_IO;
+            }
+            else
+            {
+                ReadSector(sector, ClusterToSector(cluster));
+                memcpy(dots, sector, sizeof(dots));
+                cluster = (dots[1].name[0] == ENTRY_DOT) ? GetEntryCluster(&dots[1]) : 0;
+            }
+            free(sector);
+        }
+    }
+
+    /* the new set is written before the old one is deleted */
+    if (result == DIR_OK)
+    {
+        DeleteRecord(oldParent, (unsigned int)index);
+        oldParent->isPinned = 1;
+        result = InsertEntry(newParent, newUnits, newLength, (const DirectoryEntry *)entry);
+        oldParent->isPinned = 0;
+
+        if (result != DIR_OK)
+        {
+            AddRecord(oldParent, &record, oldParent->names + record.nameOffset);
+        }
+    }
+    if (result == DIR_OK)
+    {
+        result = (WriteSlots(oldParent, record.firstSlot, record.slotCount, NULL, 0) != 0) ? DIR_ERR_IO : DIR_OK;
+        AddFreeRun(oldParent, record.firstSlot, record.slotCount);
+    }
+
+    if ((result == DIR_OK) && (record.attributes & ENTRY_DIRECTORY) && (newParent != oldParent))
+    {
+        uint8_t *sector = (uint8_t *)malloc(GetBytePerSector());
+        const uint64_t sectorPosition = ClusterToSector(record.startCluster);
+
+        result = (sector == NULL) ? DIR_ERR_IO : DIR_OK;
+        if (result == DIR_OK)
+        {
+            DirectoryEntry *dots = (DirectoryEntry *)sector;
+
+            ReadSector(sector, sectorPosition);
+            if (dots[1].name[0] == ENTRY_DOT)
+            {
+                SetEntryCluster(&dots[1], (newParent->startCluster == GetRootCluster()) ? 0 : newParent->startCluster);
+                result = (WriteSector(sector, sectorPosition) != 0) ? DIR_ERR_IO : DIR_OK;
+            }
+        }
+        free(sector);
+    }
+
+    return result;
+}
+
+/*!
+ * @brief <Get a short description of a result>
+ *
+ * @param _result <DIR_OK or one of the DIR_ERR_ values>.
+ *
+ * @return <static string>.
+ */
+const char *GetDirResultText(int _result)
+{
+    if ((_result < 0) || (_result >= (int)(sizeof(s_resultText) / sizeof(s_resultText[0]))))
+    {
+        return "unknown error";
+    }
+
+    return s_resultText[_result];
+}
+
+/*!
+ * @brief <Forget every decoded directory, called when a volume is mounted or unmounted>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void DropDirectoryStates()
+{
+    unsigned int i;
+
+    for (i = 0; i < DIR_STATE_SLOTS; i++)
+    {
+        FreeState(s_states[i]);
+        s_states[i] = NULL;
+    }
+}
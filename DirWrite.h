@@ -0,0 +1,96 @@
+#ifndef _DIRWRITE_H_
+#define _DIRWRITE_H_
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define DIR_NAME_MAX 255      /* UTF-16 characters of a long name */
+#define DIR_MAX_SET_SLOTS 21  /* 20 long name slots and the short entry */
+#define DIR_MAX_SLOTS 65536   /* slots of a directory allowed by FAT */
+#define DIR_STATE_SLOTS 16    /* directories kept decoded between operations */
+
+/* results of FatCreateFile, FatMkdir, FatUnlink and FatRename */
+#define DIR_OK 0
+#define DIR_ERR_NOT_FOUND 1 /* a folder of the path or the entry does not exist */
+#define DIR_ERR_EXISTS 2    /* the new name is taken */
+#define DIR_ERR_NOT_EMPTY 3 /* FatUnlink of a folder with entries */
+#define DIR_ERR_FULL 4      /* no free cluster, or no room in a directory */
+#define DIR_ERR_INVALID 5   /* bad name, exFAT volume, or a folder moved below itself */
+#define DIR_ERR_IO 6        /* out of memory, or no journal nor overlay to write to */
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Create an empty file>
+ *
+ * Directories are decoded on first use and kept (DIR_STATE_SLOTS of them):
+ * a hash table of the long and short names, and the runs of free slots in
+ * buckets by length, so a new entry set of n slots is placed without
+ * scanning the directory. Without a free run the slots come from the end
+ * of the directory, which grows by one zeroed cluster when it is full.
+ * Names that are not valid upper case 8.3 names get long name slots and a
+ * "~n" short alias. Writes go through WriteSector and are not committed,
+ * call CommitWrites to make a group of operations durable.
+ * FAT12/16/32 only.
+ *
+ * @param _path <absolute path, UTF-8, the parent folder must exist>.
+ *
+ * @return <DIR_OK or one of the DIR_ERR_ values>.
+ */
+int FatCreateFile(const char *_path);
+
+/*!
+ * @brief <Create a folder with its "." and ".." entries>
+ *
+ * @param _path <absolute path, UTF-8, the parent folder must exist>.
+ *
+ * @return <DIR_OK or one of the DIR_ERR_ values>.
+ */
+int FatMkdir(const char *_path);
+
+/*!
+ * @brief <Delete a file or an empty folder and free its clusters>
+ *
+ * The slots of the entry set become a free run reused by the next entries.
+ *
+ * @param _path <absolute path, UTF-8>.
+ *
+ * @return <DIR_OK or one of the DIR_ERR_ values>.
+ */
+int FatUnlink(const char *_path);
+
+/*!
+ * @brief <Rename or move a file or a folder>
+ *
+ * The clusters do not move, a new entry set is written in the target
+ * folder and the old one is deleted; a moved folder gets its ".." entry
+ * updated. An existing target is not replaced.
+ *
+ * @param _oldPath <absolute path of the entry, UTF-8>.
+ * @param _newPath <absolute new path, UTF-8, the parent folder must exist>.
+ *
+ * @return <DIR_OK or one of the DIR_ERR_ values>.
+ */
+int FatRename(const char *_oldPath, const char *_newPath);
+
+/*!
+ * @brief <Get a short description of a result>
+ *
+ * @param _result <DIR_OK or one of the DIR_ERR_ values>.
+ *
+ * @return <static string>.
+ */
+const char *GetDirResultText(int _result);
+
+/*!
+ * @brief <Forget every decoded directory, called when a volume is mounted or unmounted>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void DropDirectoryStates();
+
+#endif
\ No newline at end of file
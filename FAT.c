@@ -1,5 +1,11 @@
 #include "FAT.h"
 #include "HAL.h"
+#include "Trace.h"
+#include "Stats.h"
+#include "FatCache.h"
+#include "Partition.h"
+#include "FileTable.h"
+#include "DirWrite.h"
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
@@ -19,17 +25,208 @@
 #define MINUTES_SHIFT 5
 #define HOURS_SHIFT 11
 #define SECONDS_MASK (0x1F << SECONDS_SHIFT)
-#define MINUTES_MASK (0X1F << MINUTES_SHIFT)
-#define HOURS_MASK (0X7F << HOURS_SHIFT)
+#define MINUTES_MASK (0X3F << MINUTES_SHIFT)
+#define HOURS_MASK (0X1F << HOURS_SHIFT)
+
+#define FAT12_MAX_CLUSTERS 4085  /* volumes with fewer clusters are FAT12 */
+#define FAT16_MAX_CLUSTERS 65525 /* volumes with fewer clusters are FAT16, the others FAT32 */
+
+/* exFAT boot sector */
+#define EXFAT_NAME_OFFSET 0x03 /* file system name, "EXFAT   " */
+#define EXFAT_FAT_OFFSET 0x50
+#define EXFAT_FAT_LENGTH 0x54
+#define EXFAT_HEAP_OFFSET 0x58
+#define EXFAT_CLUSTER_COUNT 0x5C
+#define EXFAT_ROOT_CLUSTER 0x60
+#define EXFAT_SECTOR_SHIFT 0x6C
+#define EXFAT_CLUSTER_SHIFT 0x6D
+#define EXFAT_NUM_FAT 0x6E
+#define EXFAT_MIN_SECTOR_SHIFT 9  /* 512 bytes per sector */
+#define EXFAT_MAX_SECTOR_SHIFT 12 /* 4096 bytes per sector */
+#define EXFAT_MAX_CLUSTER_BYTES_SHIFT 25 /* 32 MiB per cluster */
+
+/* exFAT directory entry types */
+#define EXFAT_ENTRY_END 0x00
+#define EXFAT_ENTRY_IN_USE 0x80
+#define EXFAT_ENTRY_BITMAP 0x81
+#define EXFAT_ENTRY_UPCASE 0x82
+#define EXFAT_ENTRY_FILE 0x85
+#define EXFAT_ENTRY_STREAM 0xC0
+#define EXFAT_ENTRY_NAME 0xC1
+
+#define EXFAT_NO_FAT_CHAIN 0x02  /* stream flags, clusters are contiguous and not linked in the FAT */
+#define EXFAT_NAME_CHARS 15      /* UTF-16 characters per file name entry */
+#define EXFAT_NAME_MAX 255       /* UTF-16 characters of a file name */
+#define EXFAT_ATTRIBUTES 0x37    /* attributes shared with FAT */
+#define EXFAT_UPCASE_CHARS 65536 /* entries of the decompressed up-case table */
+
+/* long name slots of FAT12/16/32, in front of their short entry */
+#define LFN_CHARS 13             /* UTF-16 characters per long name slot */
+#define LFN_MAX_SLOTS 20         /* 255 characters and the terminator */
+#define LFN_LAST 0x40            /* order byte of the first slot on disk, holding the end of the name */
+#define LFN_ORDER_MASK 0x3F
+#define LFN_CHECKSUM_OFFSET 13
+
+#define STREAM_CHUNK_SECTORS 128 /* sectors per ReadNSectors call in StreamFile */
+
+#define FSINFO_SIGNATURE 0x41615252 /* first 4 bytes of the FAT32 FS information sector */
+#define FSINFO_FREE_COUNT 488       /* free clusters, 0xFFFFFFFF when unknown */
+
+/*
+ * Layout of the mounted volume, decoded once from the boot sector
+ */
+typedef struct
+{
+	unsigned int fatType;
+	unsigned int bytePerSector;
+	unsigned int sectorPerCluster;
+	unsigned int startSectorFAT;
+	unsigned int sectorPerFAT;
+	unsigned int numFAT;
+	unsigned int startSectorRoot;  /* fixed root region (FAT12/16), first data sector otherwise */
+	unsigned int sectorPerRoot;    /* 0 when the root directory is a cluster chain */
+	unsigned int clusterCount;
+	unsigned int rootCluster;      /* 0 when the root directory has a fixed region */
+	unsigned int bitmapCluster;    /* exFAT allocation bitmap */
+	uint64_t bitmapLength;
+} VolumeGeometry;
+
+/*
+ * exFAT File directory entry, first entry of an entry set
+ */
+typedef struct
+{
+	uint8_t entryType;
+	uint8_t secondaryCount;      /* entries following this one in the set */
+	uint8_t setChecksum[2];
+	uint8_t attributes[2];
+	uint8_t reserved1[2];
+	uint8_t createTimestamp[4];  /* DOS date << 16 | DOS time */
+	uint8_t modifiedTimestamp[4];
+	uint8_t accessedTimestamp[4];
+	uint8_t reserved2[12];
+} ExFatFileEntry;
+
+/*
+ * exFAT Stream Extension directory entry, second entry of a file entry set
+ */
+typedef struct
+{
+	uint8_t entryType;
+	uint8_t flags;
+	uint8_t reserved1;
+	uint8_t nameLength;
+	uint8_t nameHash[2];
+	uint8_t reserved2[2];
+	uint8_t validDataLength[8];
+	uint8_t reserved3[4];
+	uint8_t firstCluster[4];
+	uint8_t dataLength[8];
+} ExFatStreamEntry;
+
+/*
+ * exFAT Allocation Bitmap and Up-case Table directory entries
+ */
+typedef struct
+{
+	uint8_t entryType;
+	uint8_t flags;
+	uint8_t reserved[18];
+	uint8_t firstCluster[4];
+	uint8_t dataLength[8];
+} ExFatMetaEntry;
+
+/*
+ * State of WalkTree for one directory
+ */
+typedef struct
+{
+	const char* path;
+	EntryVisitor visitor;
+	void* context;
+	unsigned int depth;
+	unsigned int maxDepth;
+	const VolumeSource* source; /* WalkTreeFrom, NULL for the mounted volume */
+} WalkContext;
+
+/*
+ * Long name slots seen by ScanFatDirectory since the last short entry
+ */
+typedef struct
+{
+	uint16_t units[LFN_MAX_SLOTS * LFN_CHARS];
+	unsigned int slotCount; /* slots of the set, 0 if there is no valid set */
+	unsigned int next;      /* order of the next slot, 0 once the set is complete */
+	uint8_t checksum;
+} LongNameSet;
+
+/*
+ * State of GetEntry on exFAT, the entry sets are counted from 1
+ */
+typedef struct
+{
+	unsigned int target;
+	unsigned int count;
+	DirectoryEntry* entry;
+} EntryCounter;
  /*******************************************************************************
   * Prototypes
   ******************************************************************************/
+static int WalkVisitor(DirectoryEntry* entry, const char* path, void* context);
+
+static int WalkDirectory(unsigned int _startCluster, const char* _path, const WalkContext* _walk, unsigned int _depth);
+
+static void LoadBIOSParam();
+
+static void MountVolume();
+
+static void LoadExFatMetadata();
+
+static uint8_t* ReadChainData(unsigned int _startCluster, uint64_t _length, size_t* _size);
+
+static unsigned int UpcaseChar(unsigned int _char);
+
+static uint16_t EntrySetChecksum(const uint8_t* _set, unsigned int _entryCount);
+
+static uint8_t ShortNameChar(unsigned int _char);
+
+static void MakeShortName(DirectoryEntry* entry, const uint16_t* _name, unsigned int _length);
+
+static int DecodeEntrySet(const uint8_t* _set, unsigned int _entryCount, DirectoryEntry* entry, char* _name);
+
+static int ScanFatDirectory(unsigned int _startCluster, const VolumeSource* _source,
+	EntryVisitor _visitor, void* _context);
+
+static unsigned int EntryCluster(const DirectoryEntry* entry, unsigned int _fatType);
+
+static const char* TakeLongName(LongNameSet* _set, const DirectoryEntry* entry, char* _name);
+
+static size_t EncodeUtf8(char* _name, const uint16_t* _units, unsigned int _count);
+
+static int ScanExFatDirectory(unsigned int _startCluster, EntryVisitor _visitor, void* _context);
+
+static int CountEntry(DirectoryEntry* entry, const char* path, void* context);
+
+static unsigned int FatEntryOffset(unsigned int _cluster);
+
+static void EncodeEntry(uint8_t* _entry, unsigned int _cluster, unsigned int _next);
+
+static void InvalidateFreeCount();
 
   /*******************************************************************************
    * Variables
    ******************************************************************************/
 BIOSParam g_biosParam;
 
+static VolumeGeometry s_volume;
+static uint16_t* s_upcase = NULL; /* exFAT up-case table, NULL for the ASCII rule */
+
+static const uint32_t* s_decodedFAT = NULL;
+static unsigned int s_decodedFATCount = 0;
+
+static unsigned int s_nextFree = FIRST_CLUSTER; /* where AllocateCluster starts looking */
+static int s_isFreeCountStale = 0;               /* FS information sector already marked */
+
 /*******************************************************************************
  * Code
  ******************************************************************************/
@@ -178,14 +375,8 @@ uint64_t ReadNumber(int _count, const void* _source)
  */
 unsigned int GetStartSectorRoot()
 {
-	unsigned int index;
-	unsigned int numFAT = g_biosParam.numFAT;
-	unsigned int sectorPerFAT = ReadNumber(2, g_biosParam.sectorPerFAT);
-	unsigned int numReservedSector = ReadNumber(2, g_biosParam.numReservedSector);
-
-	index = numReservedSector + numFAT * sectorPerFAT;
-
-	return index;
+	/* FAT32 and exFAT have no fixed root region, this is the start of cluster 2 */
+	return s_volume.startSectorRoot;
 }
 
 /*!
@@ -199,12 +390,23 @@ File* OpenFile(DirectoryEntry* entry)
 {
 	File* _file = (File*)malloc(sizeof(File));
 
+	if (_file == NULL)
+	{
+		return NULL;
+	}
+
+	_file->position = 0;
 	_file->currentByte = 0;
 	_file->currentSector = 0;
-	_file->startCluster = ReadNumber(2, entry->startClusters);
+	_file->startCluster = GetEntryCluster(entry);
 	_file->currentCluster = _file->startCluster;
+	_file->runEnd = 0;
+	_file->runIndex = 0;
+	_file->runFirst = 0;
+
+	/* first cluster and its run */
+	Fseek(_file, 0, F_SEEK_SET);
 
-	
 	return _file;
 }
 
@@ -217,8 +419,6 @@ File* OpenFile(DirectoryEntry* entry)
  */
 void CloseFile(File* _file)
 {
-	/*do something*/
-
 	free(_file);
 }
 
@@ -231,12 +431,7 @@ void CloseFile(File* _file)
  */
 unsigned int SectorPerRoot()
 {
-	const unsigned int bytePerSector = ReadNumber(2, g_biosParam.bytePerSector);
-	const unsigned int maxNumRootEntry = ReadNumber(2, g_biosParam.maxNumRootEntry);
-	unsigned int nSectorRoot;
-
-	nSectorRoot = 1 + ((sizeof(DirectoryEntry) * maxNumRootEntry) - 1) / bytePerSector;
-	return nSectorRoot;
+	return s_volume.sectorPerRoot;
 }
 
 /*!
@@ -257,55 +452,64 @@ unsigned int SectorPerRoot()
 unsigned int Fread(void* _Buffer, unsigned int _ElementSize, unsigned int _ElementCount, File* _file)
 {
 	int isNotEOF = 1;
-
-	/* BIOS Parameter */
-	const unsigned int numReservedSector = ReadNumber(2, g_biosParam.numReservedSector);
-	const unsigned int sectorPerFAT = ReadNumber(2, g_biosParam.sectorPerFAT);
-	const unsigned int numFAT = g_biosParam.numFAT;
-	const unsigned int sectorPerCluster = g_biosParam.secPerCluster;
-
-	const unsigned int startSectorOfCluster2 = numReservedSector + numFAT * sectorPerFAT + SectorPerRoot();
+	const unsigned int bytePerSec = GetBytePerSector();
 
 	uint8_t* buffer = (uint8_t*)_Buffer;
 	const unsigned int size = _ElementSize * _ElementCount;
 	unsigned int i = 0;
+	TRACE_BEGIN();
 
 	while ((i < size) && isNotEOF)
 	{
-		unsigned int sectorStart;
-		unsigned int sectorIndex;
-		unsigned int currentSectorInCluster = _file->currentSector;
+		uint64_t sectorIndex;
+		unsigned int span;
 		const uint8_t* sector;
 
-		/**/
-		if (_file->currentCluster != EOC)
+		if ((_file->currentCluster != EOC) && (_file->currentByte == 0) &&
+			(size - i >= bytePerSec) && (_file->runEnd > _file->currentCluster))
 		{
-			sectorStart = startSectorOfCluster2 +
-				(_file->currentCluster - 2) * sectorPerCluster;
+			/* whole sectors up to the end of the run, straight into the caller buffer */
+			const uint64_t runSectors = (uint64_t)(_file->runEnd - _file->currentCluster) *
+				GetSectorPerCluster() - _file->currentSector;
+			unsigned int n = (size - i) / bytePerSec;
+
+			if (n > runSectors)
+			{
+				n = (unsigned int)runSectors;
+			}
 
-			sectorIndex = sectorStart + currentSectorInCluster;
+			sectorIndex = ClusterToSector(_file->currentCluster) + _file->currentSector;
+			ReadNSectors(buffer + i, sectorIndex, n);
 
+			span = n * bytePerSec;
+			i += span;
+			Fseek(_file, span, F_SEEK_CUR);
+		}
+		/* copy the rest of the current sector in one go */
+		else if (_file->currentCluster != EOC)
+		{
+			sectorIndex = ClusterToSector(_file->currentCluster) + _file->currentSector;
 			sector = (const uint8_t*)GetSector(sectorIndex);
 
-			while ((i < size) && (_file->currentSector == currentSectorInCluster))
+			span = bytePerSec - _file->currentByte;
+			if (span > size - i)
 			{
-				buffer[i] = sector[_file->currentByte];
-				i++;
-				Fseek(_file, 1, F_SEEK_CUR);
+				span = size - i;
 			}
+
+			memcpy(buffer + i, sector + _file->currentByte, span);
+			i += span;
+			Fseek(_file, span, F_SEEK_CUR);
 		}
 		else
 		{
-			while (i < size)
-			{
-				buffer[i] = 0;
-				i++;
-			}
-
+			memset(buffer + i, 0, size - i);
+			i = size;
 			isNotEOF = 0;
 		}
 	}
 
+	TRACE_END(TRACE_CAT_FAT, "Fread");
 	return isNotEOF;
 }
 
@@ -322,189 +526,1826 @@ unsigned int Fread(void* _Buffer, unsigned int _ElementSize, unsigned int _Eleme
  */
 void Fseek(File* _file, unsigned int _offset, int _origin)
 {
-	const unsigned int bytePerSec = ReadNumber(2, g_biosParam.bytePerSector);
-	int i = 0;
+	const unsigned int bytePerSec = GetBytePerSector();
+	const unsigned int bytePerCluster = bytePerSec * GetSectorPerCluster();
+	const Extent* runs;
+	unsigned int runCount;
+	unsigned int position;
+	unsigned int clusterIndex;
+	unsigned int r;
+	unsigned int runsWalked = 0;
+	TRACE_BEGIN();
+
+	position = (_origin == F_SEEK_SET) ? _offset : _file->position + _offset;
+	clusterIndex = position / bytePerCluster;
+
+	/* locate the cluster from the runs of the chain, not cluster by cluster */
+	runs = GetChainRuns(_file->startCluster, &runCount);
+	r = 0;
+
+	/* forward from the current run, sequential access walks no run twice */
+	if ((_file->currentCluster != EOC) && (clusterIndex >= _file->runFirst) && (_file->runIndex < runCount) &&
+		(runs[_file->runIndex].cluster + runs[_file->runIndex].count == _file->runEnd))
+	{
+		r = _file->runIndex;
+		clusterIndex -= _file->runFirst;
+	}
+
+	_file->currentCluster = EOC;
+	_file->runEnd = 0;
+	_file->runFirst = position / bytePerCluster - clusterIndex;
+
+	for (; r < runCount; r++)
+	{
+		runsWalked++;
+		if (clusterIndex < runs[r].count)
+		{
+			_file->currentCluster = runs[r].cluster + clusterIndex;
+			_file->runEnd = runs[r].cluster + runs[r].count;
+			_file->runIndex = r;
+			break;
+		}
+		clusterIndex -= runs[r].count;
+		_file->runFirst += runs[r].count;
+	}
+
+	_file->position = position;
+	_file->currentSector = (position % bytePerCluster) / bytePerSec;
+	_file->currentByte = position % bytePerSec;
+
+	HistogramAdd(&GetVolumeStats()->runsPerFseek, runsWalked);
+	TRACE_END(TRACE_CAT_FAT, "Fseek");
+}
+
+/* decode the layout of the volume from the boot sector and find the FAT type */
+static void LoadBIOSParam()
+{
+	const uint8_t* bootSector = (const uint8_t*)GetSector(0);
+	VolumeGeometry* volume = &s_volume;
+
+	memset(volume, 0, sizeof(VolumeGeometry));
+	memcpy(&g_biosParam, bootSector + BIOS_PARAM_OFFSET, sizeof(BIOSParam));
+
+	if (memcmp(bootSector + EXFAT_NAME_OFFSET, "EXFAT   ", 8) == 0)
+	{
+		const unsigned int sectorShift = bootSector[EXFAT_SECTOR_SHIFT];
+		const unsigned int clusterShift = bootSector[EXFAT_CLUSTER_SHIFT];
+
+		/* sizes are powers of two, the FAT and the cluster heap are placed freely */
+		volume->fatType = FAT_TYPE_EXFAT;
+		volume->bytePerSector = 1U << EXFAT_MIN_SECTOR_SHIFT;
+		volume->sectorPerCluster = 1;
+
+		/* shifts outside of the specification, the volume is mounted without clusters */
+		if ((sectorShift < EXFAT_MIN_SECTOR_SHIFT) || (sectorShift > EXFAT_MAX_SECTOR_SHIFT) ||
+			(clusterShift > EXFAT_MAX_CLUSTER_BYTES_SHIFT - sectorShift))
+		{
+			return;
+		}
+
+		volume->bytePerSector = 1U << sectorShift;
+		volume->sectorPerCluster = 1U << clusterShift;
+		volume->startSectorFAT = (unsigned int)ReadNumber(4, bootSector + EXFAT_FAT_OFFSET);
+		volume->sectorPerFAT = (unsigned int)ReadNumber(4, bootSector + EXFAT_FAT_LENGTH);
+		volume->numFAT = bootSector[EXFAT_NUM_FAT];
+		volume->startSectorRoot = (unsigned int)ReadNumber(4, bootSector + EXFAT_HEAP_OFFSET);
+		volume->sectorPerRoot = 0;
+		volume->clusterCount = (unsigned int)ReadNumber(4, bootSector + EXFAT_CLUSTER_COUNT);
+		volume->rootCluster = (unsigned int)ReadNumber(4, bootSector + EXFAT_ROOT_CLUSTER);
+	}
+	else
+	{
+		const unsigned int maxNumRootEntry = ReadNumber(2, g_biosParam.maxNumRootEntry);
+		unsigned int totalSectors = ReadNumber(2, g_biosParam.totalSectors);
+		unsigned int startSectorOfCluster2;
+
+		volume->bytePerSector = ReadNumber(2, g_biosParam.bytePerSector);
+		volume->sectorPerCluster = g_biosParam.secPerCluster;
+		volume->startSectorFAT = ReadNumber(2, g_biosParam.numReservedSector);
+		volume->sectorPerFAT = ReadNumber(2, g_biosParam.sectorPerFAT);
+		volume->numFAT = g_biosParam.numFAT;
+
+		if (volume->sectorPerFAT == 0)
+		{
+			volume->sectorPerFAT = ReadNumber(4, g_biosParam.sectorPerFAT32);
+		}
+
+		/* FAT32, the root directory is a cluster chain */
+		volume->startSectorRoot = volume->startSectorFAT + volume->numFAT * volume->sectorPerFAT;
+		if ((maxNumRootEntry != 0) && (volume->bytePerSector != 0))
+		{
+			volume->sectorPerRoot = 1 + ((sizeof(DirectoryEntry) * maxNumRootEntry) - 1) / volume->bytePerSector;
+		}
+
+		if (totalSectors == 0)
+		{
+			totalSectors = ReadNumber(4, g_biosParam.numSectors);
+		}
+
+		startSectorOfCluster2 = volume->startSectorRoot + volume->sectorPerRoot;
+		if ((totalSectors > startSectorOfCluster2) && (volume->sectorPerCluster != 0))
+		{
+			volume->clusterCount = (totalSectors - startSectorOfCluster2) / volume->sectorPerCluster;
+		}
+
+		/* the type depends on the number of clusters only, see the FAT specification */
+		volume->fatType = FAT_TYPE_12;
+		if (volume->clusterCount >= FAT16_MAX_CLUSTERS)
+		{
+			volume->fatType = FAT_TYPE_32;
+			volume->rootCluster = (unsigned int)ReadNumber(4, g_biosParam.rootCluster);
+		}
+		else if (volume->clusterCount >= FAT12_MAX_CLUSTERS)
+		{
+			volume->fatType = FAT_TYPE_16;
+		}
+	}
+}
+
+/* find the allocation bitmap and the up-case table in the exFAT root directory */
+static void LoadExFatMetadata()
+{
+	const uint64_t bytePerCluster = (uint64_t)GetBytePerSector() * GetSectorPerCluster();
+	uint8_t* root = NULL;
+	size_t size = 0;
+	size_t offset;
+	int isEnd = 0;
+	TRACE_BEGIN();
+
+	free(s_upcase);
+	s_upcase = NULL;
 
-	if (_origin == F_SEEK_SET)
+	if (s_volume.fatType == FAT_TYPE_EXFAT)
 	{
-		_file->currentByte = 0;
-		_file->currentSector = 0;
-		_file->startCluster = _file->startCluster;
+		root = ReadChainData(s_volume.rootCluster, 0, &size);
 	}
 
-	for (i = 0; i < _offset; i++)
+	for (offset = 0; (root != NULL) && !isEnd && (offset + sizeof(ExFatMetaEntry) <= size); offset += sizeof(ExFatMetaEntry))
 	{
-		if (_file->currentByte < bytePerSec - 1)
+		const ExFatMetaEntry* meta = (const ExFatMetaEntry*)(root + offset);
+		const unsigned int firstCluster = (unsigned int)ReadNumber(4, meta->firstCluster);
+		const uint64_t length = ReadNumber(8, meta->dataLength);
+
+		/* some formatters leave the FAT of the metadata free, it is contiguous then */
+		if (((meta->entryType == EXFAT_ENTRY_BITMAP) || (meta->entryType == EXFAT_ENTRY_UPCASE)) &&
+			IsValidCluster(firstCluster) && (GetNextCluster(firstCluster) == 0))
 		{
-			(_file->currentByte)++;
+			FatCacheSetContiguous(firstCluster, (unsigned int)((length + bytePerCluster - 1) / bytePerCluster));
 		}
-		else
+
+		if (meta->entryType == EXFAT_ENTRY_END)
+		{
+			isEnd = 1;
+		}
+		else if ((meta->entryType == EXFAT_ENTRY_BITMAP) && (s_volume.bitmapCluster == 0))
+		{
+			/* the first bitmap, the second one only exists on TexFAT volumes */
+			s_volume.bitmapCluster = firstCluster;
+			s_volume.bitmapLength = length;
+		}
+		else if ((meta->entryType == EXFAT_ENTRY_UPCASE) && (s_upcase == NULL) && (length >= 2))
 		{
-			_file->currentByte = 0;
+			size_t tableSize = 0;
+			uint8_t* table = ReadChainData(firstCluster, length, &tableSize);
 
-			if (_file->currentSector < g_biosParam.secPerCluster - 1)
-			{
-				(_file->currentSector)++;
-			}
-			else
+			s_upcase = (uint16_t*)malloc(EXFAT_UPCASE_CHARS * sizeof(uint16_t));
+			if ((table != NULL) && (s_upcase != NULL))
 			{
-				_file->currentSector = 0;
+				unsigned int character;
+				size_t i;
 
-				if (_file->currentCluster != EOC)
+				for (character = 0; character < EXFAT_UPCASE_CHARS; character++)
 				{
-					_file->currentCluster = GetNextCluster(_file->currentCluster);
+					s_upcase[character] = (uint16_t)character;
 				}
 
+				/* compressed table, 0xFFFF followed by a count skips identity mappings */
+				character = 0;
+				for (i = 0; (i + 1 < tableSize) && (character < EXFAT_UPCASE_CHARS); i += 2)
+				{
+					const unsigned int value = (unsigned int)ReadNumber(2, table + i);
+
+					if ((value == 0xFFFF) && (i + 3 < tableSize))
+					{
+						i += 2;
+						character += (unsigned int)ReadNumber(2, table + i);
+					}
+					else
+					{
+						s_upcase[character++] = (uint16_t)value;
+					}
+				}
+			}
+			else
+			{
+				free(s_upcase);
+				s_upcase = NULL;
 			}
+
+			free(table);
 		}
 	}
+
+	free(root);
+	TRACE_END(TRACE_CAT_FAT, "LoadExFatMetadata");
+}
+
+/* decode the boot sector, FAT cache and exFAT metadata of the volume seen by the HAL */
+static void MountVolume()
+{
+	/* open files and decoded directories belong to the previous volume */
+	CloseAllHandles();
+	DropDirectoryStates();
+	s_nextFree = FIRST_CLUSTER;
+	s_isFreeCountStale = 0;
+	LoadBIOSParam();
+	FatCacheInit(FAT_CACHE_DEFAULT_BUDGET, CHAIN_CACHE_DEFAULT_BUDGET);
+	LoadExFatMetadata();
 }
 
 void FatInit(const char* _imgName)
 {
-	uint8_t* sector;
-	uint8_t* buffer = (uint8_t*)&g_biosParam;
-	int i;
+	Partition partition;
+	TRACE_BEGIN();
 
 	OpenImg(_imgName);
-	sector = (uint8_t*)GetSector(0);
-	for (i = 0; i < sizeof(BIOSParam); i++)
+
+	/* full disk image, the first FAT partition is mounted */
+	if (FindPartitions(&partition, 1) > 0)
+	{
+		SetPartition(partition.offset, partition.size);
+	}
+	MountVolume();
+
+	TRACE_END(TRACE_CAT_FAT, "FatInit");
+}
+
+/*!
+ * @brief <Mount another partition of the opened image>
+ *
+ * @param _offset <byte offset of the boot sector in the image>.
+ * @param _size <bytes of the partition, 0 up to the end of the image>.
+ *
+ * @return <zero on success, non-zero if an overlay is attached>.
+ */
+int FatMountPartition(uint64_t _offset, uint64_t _size)
+{
+	int isFailed = SetPartition(_offset, _size);
+
+	if (!isFailed)
 	{
-		buffer[i] = sector[BIOS_PARAM_OFFSET + i];
+		/* a decoded FAT belongs to the previous partition */
+		SetDecodedFAT(NULL, 0);
+		MountVolume();
 	}
+
+	return isFailed;
 }
 
 void FatDeInit()
 {
+	free(s_upcase);
+	s_upcase = NULL;
+
+	FatCacheDeInit();
+	CloseAllHandles();
+	DropDirectoryStates();
 	CloseImg();
 }
 
-unsigned int GetNextCluster(unsigned int current)
+/*!
+ * @brief <Mount a copy-on-write overlay on the opened image>
+ *
+ * @param _deltaName <Name of the delta file, created if it does not exist>.
+ *
+ * @return <zero on success>.
+ */
+int FatAttachOverlay(const char* _deltaName)
 {
-	int next;
-	const uint8_t* sector;
-
-	/* BIOS Param */
-	const unsigned int bytePerSector = ReadNumber(2, g_biosParam.bytePerSector);
-	const unsigned int numReservedSector = ReadNumber(2, g_biosParam.numReservedSector);
-	const unsigned int secPerCluster = g_biosParam.secPerCluster;
+	int isFailed = AttachOverlay(_deltaName);
 
-	unsigned int offset_FAT; /* vi tri cua phan tu can doc trong bang FAT */
-	unsigned int odd;
-	unsigned int offset_sector; /* vi tri cua phan tu can doc trong sector */
-	unsigned int byte_l;
-	unsigned int byte_h;
-	unsigned int offset_sector_FAT; /* vi tri cua sector trong bang FAT*/
+	if (!isFailed)
+	{
+		/* boot sector and FAT as seen through the overlay */
+		MountVolume();
+	}
 
-	/**/
-	odd = (current * 3) % 2;
-	offset_FAT = (current * 3) / 2;
-	offset_sector_FAT = offset_FAT / bytePerSector;	
-	offset_sector = offset_FAT % bytePerSector;
+	return isFailed;
+}
 
-	/* get byte low, byte hight */
-	sector = (uint8_t*)GetSector(numReservedSector + offset_sector_FAT);
-	byte_l = sector[offset_sector];
+/*!
+ * @brief <Log later writes in a write-ahead journal on the opened image>
+ *
+ * @param _journalName <Name of the journal file, created if it does not exist>.
+ *
+ * @return <zero on success>.
+ */
+int FatAttachJournal(const char* _journalName)
+{
+	int isFailed = AttachJournal(_journalName);
 
-	if (offset_sector == bytePerSector - 1)
+	if (!isFailed)
 	{
-		sector = (const uint8_t*)GetSector(numReservedSector + offset_sector_FAT + 1);
-		byte_h = sector[0];
+		/* a replayed journal may have changed the boot sector or the FAT */
+		MountVolume();
 	}
-	else
+
+	return isFailed;
+}
+
+unsigned int GetNextCluster(unsigned int current)
+{
+	uint32_t next = EOC;
+	unsigned int cached;
+
+	/* decoded table of a loaded index, no sector access */
+	if ((s_decodedFAT != NULL) && (current < s_decodedFATCount))
 	{
-		byte_h = sector[offset_sector + 1];
+		return s_decodedFAT[current];
 	}
 
-	/**/
-	if (odd == 1)
+	/* decoded page of the FAT cache */
+	if (FatCacheGetNext(current, &cached) == 0)
 	{
-		next = (byte_h << 4) | ((byte_l & 0xF0) >> 4);
+		return cached;
 	}
-	else
+
+	TRACE_BEGIN();
+
+	if (current < GetClusterCount() + FIRST_CLUSTER)
 	{
-		next = byte_l | ((byte_h & 0x0F) << 8);
+		DecodeFATEntries(current, 1, &next);
 	}
 
-	/**/
+	TRACE_END(TRACE_CAT_FAT, "GetNextCluster");
 	return next;
 }
 
 int GetEntry(void* entry, unsigned int entryIndex, unsigned int startCluster)
 {
-	unsigned int bytePerSec = ReadNumber(2, g_biosParam.bytePerSector);
+	unsigned int bytePerSec = GetBytePerSector();
 
 	unsigned int byteOffset = 0;
-	unsigned int SecOffset;
+	uint64_t SecOffset;
 	unsigned int i = 0;
 
-	unsigned int endSector = 0;
+	uint64_t endSector = 0;
 	DirectoryEntry* tempEntry;
 	uint8_t* sector;
 
 	int isEntryNotFound = 1;
+	TRACE_BEGIN();
 
-	if (startCluster == 0) /*Root Directory*/
+	/* exFAT entry sets do not map to slots, they are counted by ScanDirectory */
+	if (s_volume.fatType == FAT_TYPE_EXFAT)
 	{
-		SecOffset = GetStartSectorRoot();
-		endSector = SecOffset + SectorPerRoot();
+		EntryCounter counter;
+
+		counter.target = entryIndex;
+		counter.count = 0;
+		counter.entry = (DirectoryEntry*)entry;
+		isEntryNotFound = (ScanDirectory(startCluster, CountEntry, &counter) == 0);
 	}
 	else
 	{
-		const unsigned int numReservedSector = ReadNumber(2, g_biosParam.numReservedSector);
-		const unsigned int sectorPerFAT = ReadNumber(2, g_biosParam.sectorPerFAT);
-		const unsigned int numFAT = g_biosParam.numFAT;
-
-		const unsigned int sectorPerCluster = g_biosParam.secPerCluster;
-		const unsigned int bytePerCluster = sectorPerCluster * bytePerSec;
-		SecOffset = numReservedSector +
-			numFAT * sectorPerFAT + SectorPerRoot() +
-			(startCluster - 2) * sectorPerCluster;
-		endSector = SecOffset + g_biosParam.secPerCluster;
-	}
-
-	sector = (uint8_t*)GetSector(SecOffset);
-	tempEntry = (DirectoryEntry*)sector;
+		if (startCluster == 0)
+		{
+			startCluster = GetRootCluster();
+		}
 
-	while (isEntryNotFound && (SecOffset <= endSector))
-	{
-		if (byteOffset > bytePerSec)
+		if (startCluster == 0) /*Root Directory*/
 		{
-			SecOffset++;
-			byteOffset = 0;
-			sector = (uint8_t*)GetSector(SecOffset);
-			tempEntry = (DirectoryEntry*)sector;
+			SecOffset = GetStartSectorRoot();
+			endSector = SecOffset + SectorPerRoot();
 		}
 		else
 		{
-			byteOffset += sizeof(DirectoryEntry);
+			SecOffset = ClusterToSector(startCluster);
+			endSector = SecOffset + GetSectorPerCluster();
+		}
 
-			if (tempEntry->attributes != ENTRY_NAME) /*length name of file*/
-			{
-				i++;
-			}
+		sector = (uint8_t*)GetSector(SecOffset);
+		tempEntry = (DirectoryEntry*)sector;
 
-			if (i < entryIndex)
+		while (isEntryNotFound && (SecOffset <= endSector))
+		{
+			if (byteOffset > bytePerSec)
 			{
-				tempEntry++;
-				
+				SecOffset++;
+				byteOffset = 0;
+				sector = (uint8_t*)GetSector(SecOffset);
+				tempEntry = (DirectoryEntry*)sector;
 			}
 			else
 			{
-				int j;
-				uint8_t* tempBuffer = (uint8_t*)tempEntry;
-				uint8_t* buffer = (uint8_t*)entry;
-				for (j = 0; j < sizeof(DirectoryEntry); j++)
+				byteOffset += sizeof(DirectoryEntry);
+				GetVolumeStats()->dirEntriesScanned++;
+
+				if (tempEntry->attributes != ENTRY_NAME) /*length name of file*/
 				{
-					buffer[j] = tempBuffer[j];
+					i++;
 				}
 
-				isEntryNotFound = 0;
+				if (i < entryIndex)
+				{
+					tempEntry++;
+				
+				}
+				else
+				{
+					int j;
+					uint8_t* tempBuffer = (uint8_t*)tempEntry;
+					uint8_t* buffer = (uint8_t*)entry;
+					for (j = 0; j < sizeof(DirectoryEntry); j++)
+					{
+						buffer[j] = tempBuffer[j];
+					}
+
+					isEntryNotFound = 0;
+				}
 			}
 		}
 	}
 
+	TRACE_END(TRACE_CAT_FAT, "GetEntry");
+	return isEntryNotFound;
+}
 
+/*!
+ * @brief <Get number of bytes per sector>
+ *
+ * @param <none>.
+ *
+ * @return <bytes per sector>.
+ */
+unsigned int GetBytePerSector()
+{
+	return s_volume.bytePerSector;
+}
 
-	return isEntryNotFound;
+/*!
+ * @brief <Get number of sectors per cluster>
+ *
+ * @param <none>.
+ *
+ * @return <sectors per cluster>.
+ */
+unsigned int GetSectorPerCluster()
+{
+	return s_volume.sectorPerCluster;
+}
+
+/*!
+ * @brief <Get first sector of the first FAT>
+ *
+ * @param <none>.
+ *
+ * @return <Position of first sector of FAT number 0>.
+ */
+unsigned int GetStartSectorFAT()
+{
+	return s_volume.startSectorFAT;
+}
+
+/*!
+ * @brief <Get number of sectors of one FAT>
+ *
+ * @param <none>.
+ *
+ * @return <sectors per FAT>.
+ */
+unsigned int GetSectorPerFAT()
+{
+	return s_volume.sectorPerFAT;
+}
+
+/*!
+ * @brief <Get number of copies of the FAT>
+ *
+ * @param <none>.
+ *
+ * @return <number of FATs>.
+ */
+unsigned int GetNumFAT()
+{
+	return s_volume.numFAT;
+}
+
+/*!
+ * @brief <Get the type of the mounted FAT>
+ *
+ * @param <none>.
+ *
+ * @return <FAT_TYPE_12, FAT_TYPE_16 or FAT_TYPE_32>.
+ */
+unsigned int GetFatType()
+{
+	return s_volume.fatType;
+}
+
+/*!
+ * @brief <Get first cluster of the root directory>
+ *
+ * @param <none>.
+ *
+ * @return <root cluster on FAT32, 0 when the root directory has a fixed region (FAT12/16)>.
+ */
+unsigned int GetRootCluster()
+{
+	return s_volume.rootCluster;
+}
+
+/*!
+ * @brief <Get starting cluster of a directory entry>
+ *
+ * @param entry <Pointer to a entry object>.
+ *
+ * @return <starting cluster, the high 16 bits are used on FAT32 only>.
+ */
+unsigned int GetEntryCluster(const DirectoryEntry* entry)
+{
+	return EntryCluster(entry, s_volume.fatType);
+}
+
+/* starting cluster of a directory entry of a volume of type _fatType */
+static unsigned int EntryCluster(const DirectoryEntry* entry, unsigned int _fatType)
+{
+	unsigned int cluster = ReadNumber(2, entry->startClusters);
+
+	/* FAT12/16 keep other data in the high word */
+	if ((_fatType == FAT_TYPE_32) || (_fatType == FAT_TYPE_EXFAT))
+	{
+		cluster |= (unsigned int)ReadNumber(2, entry->startClustersHigh) << 16;
+	}
+
+	return cluster;
 }
+
+/*!
+ * @brief <Set starting cluster of a directory entry>
+ *
+ * @param entry <Pointer to a entry object>.
+ * @param _cluster <starting cluster>.
+ *
+ * @return <none>.
+ */
+void SetEntryCluster(DirectoryEntry* entry, unsigned int _cluster)
+{
+	entry->startClusters[0] = (uint8_t)_cluster;
+	entry->startClusters[1] = (uint8_t)(_cluster >> 8);
+
+	if ((s_volume.fatType == FAT_TYPE_32) || (s_volume.fatType == FAT_TYPE_EXFAT))
+	{
+		entry->startClustersHigh[0] = (uint8_t)(_cluster >> 16);
+		entry->startClustersHigh[1] = (uint8_t)(_cluster >> 24);
+	}
+}
+
+/*!
+ * @brief <Get number of clusters in the data region>
+ *
+ * @param <none>.
+ *
+ * @return <number of data clusters, valid clusters are FIRST_CLUSTER to count + 1>.
+ */
+unsigned int GetClusterCount()
+{
+	return s_volume.clusterCount;
+}
+
+/*!
+ * @brief <Get first sector of a cluster>
+ *
+ * @param _cluster <cluster number, at least FIRST_CLUSTER>.
+ *
+ * @return <Position of first sector of the cluster>.
+ */
+uint64_t ClusterToSector(unsigned int _cluster)
+{
+	return (uint64_t)s_volume.startSectorRoot + s_volume.sectorPerRoot +
+		(uint64_t)(_cluster - FIRST_CLUSTER) * s_volume.sectorPerCluster;
+}
+
+/*!
+ * @brief <Check that a cluster number points inside the data region>
+ *
+ * @param _cluster <cluster number>.
+ *
+ * @return <non-zero if the cluster is valid>.
+ */
+int IsValidCluster(unsigned int _cluster)
+{
+	return (_cluster >= FIRST_CLUSTER) && (_cluster < GetClusterCount() + FIRST_CLUSTER);
+}
+
+/*!
+ * @brief <Get the runs of contiguous clusters of a chain, in file order>
+ *
+ * @param _startCluster <first cluster of the chain>.
+ * @param _extentCount <Pointer to store number of runs>.
+ *
+ * @return <array of runs to free() by the caller, NULL if the chain is empty>.
+ */
+Extent* GetFileExtents(unsigned int _startCluster, unsigned int* _extentCount)
+{
+	unsigned int count = 0;
+	const Extent* runs = GetChainRuns(_startCluster, &count);
+	Extent* extents = NULL;
+
+	if (count > 0)
+	{
+		extents = (Extent*)malloc(count * sizeof(Extent));
+		if (extents == NULL)
+		{
+			count = 0;
+		}
+		else
+		{
+			memcpy(extents, runs, count * sizeof(Extent));
+		}
+	}
+
+	*_extentCount = count;
+	return extents;
+}
+
+/*!
+ * @brief <Call _visitor for every 32 bytes slot of a directory>
+ *
+ * @param _startCluster <Start cluster of the directory, 0 for root directory>.
+ * @param _visitor <function called for every slot, path parameter is the UTF-8 name of
+ * the entry set on exFAT, the UTF-8 long name of a short entry on FAT12/16/32, NULL otherwise>.
+ * @param _context <passed to _visitor>.
+ *
+ * @return <non-zero if stopped by _visitor>.
+ */
+int ScanDirectory(unsigned int _startCluster, EntryVisitor _visitor, void* _context)
+{
+	int isStopped;
+
+	if (s_volume.fatType == FAT_TYPE_EXFAT)
+	{
+		isStopped = ScanExFatDirectory(_startCluster, _visitor, _context);
+	}
+	else
+	{
+		VolumeSource source;
+
+		GetVolumeSource(&source, NULL, NULL);
+		isStopped = ScanFatDirectory(_startCluster, &source, _visitor, _context);
+	}
+
+	return isStopped;
+}
+
+/* slots of a FAT12/16/32 directory of _source, see ScanDirectory */
+static int ScanFatDirectory(unsigned int _startCluster, const VolumeSource* _source,
+	EntryVisitor _visitor, void* _context)
+{
+	const unsigned int bytePerSec = _source->bytePerSector;
+	const unsigned int entryPerSector = bytePerSec / sizeof(DirectoryEntry);
+	const unsigned int clusterCount = _source->clusterCount;
+	uint8_t* sector = (uint8_t*)malloc(bytePerSec);
+	LongNameSet* longName = (LongNameSet*)malloc(sizeof(LongNameSet));
+	char name[EXFAT_NAME_MAX * 3 + 1];
+
+	/* on FAT32 the root directory is a chain like any other directory */
+	unsigned int cluster = (_startCluster == 0) ? _source->rootCluster : _startCluster;
+	const int isFixedRoot = (cluster == 0);
+	uint64_t sectorIndex;
+	uint64_t endSector;
+	unsigned int steps = 0;
+	unsigned int i;
+	int isStopped = 0;
+	int isEnd = (sector == NULL) || (longName == NULL);
+
+	if (longName != NULL)
+	{
+		longName->slotCount = 0;
+	}
+
+	if (isFixedRoot) /*Root Directory*/
+	{
+		sectorIndex = _source->startSectorRoot;
+		endSector = sectorIndex + _source->sectorPerRoot;
+	}
+	else
+	{
+		isEnd = isEnd || (cluster < FIRST_CLUSTER) || (cluster >= clusterCount + FIRST_CLUSTER);
+		sectorIndex = (uint64_t)_source->startSectorRoot + _source->sectorPerRoot +
+			(uint64_t)(cluster - FIRST_CLUSTER) * _source->sectorPerCluster;
+		endSector = sectorIndex + _source->sectorPerCluster;
+	}
+
+	while (!isStopped && !isEnd)
+	{
+		if (sectorIndex == endSector)
+		{
+			/* root directory has a fixed size, sub directories follow their chain */
+			if (isFixedRoot)
+			{
+				isEnd = 1;
+			}
+			else
+			{
+				cluster = (_source->fat != NULL) ? _source->fat[cluster] : GetNextCluster(cluster);
+				steps++;
+
+				if ((cluster < FIRST_CLUSTER) || (cluster >= clusterCount + FIRST_CLUSTER) || (steps >= clusterCount))
+				{
+					isEnd = 1;
+				}
+				else
+				{
+					sectorIndex = (uint64_t)_source->startSectorRoot + _source->sectorPerRoot +
+						(uint64_t)(cluster - FIRST_CLUSTER) * _source->sectorPerCluster;
+					endSector = sectorIndex + _source->sectorPerCluster;
+				}
+			}
+		}
+		else
+		{
+			/* private copy, _visitor may read other sectors */
+			if (_source->reader != NULL)
+			{
+				ReadImgFrom(_source->reader, sector, _source->offset + sectorIndex * bytePerSec, bytePerSec);
+			}
+			else
+			{
+				ReadSector(sector, sectorIndex);
+			}
+
+			for (i = 0; (i < entryPerSector) && !isStopped && !isEnd; i++)
+			{
+				DirectoryEntry* entry = (DirectoryEntry*)sector + i;
+
+				if (_source->reader == NULL)
+				{
+					GetVolumeStats()->dirEntriesScanned++;
+				}
+				isStopped = _visitor(entry, TakeLongName(longName, entry, name), _context);
+
+				if (entry->name[0] == ENTRY_EMPTY)
+				{
+					isEnd = 1;
+				}
+			}
+
+			sectorIndex++;
+		}
+	}
+
+	free(sector);
+	free(longName);
+	return isStopped;
+}
+
+/*
+ * Add a slot to the long name set, return the UTF-8 long name of _name when
+ * entry is the short entry closing a valid set, NULL otherwise
+ */
+static const char* TakeLongName(LongNameSet* _set, const DirectoryEntry* entry, char* _name)
+{
+	const uint8_t* raw = (const uint8_t*)entry;
+	unsigned int length = 0;
+	uint8_t checksum = 0;
+	unsigned int i;
+
+	if ((raw[0] == ENTRY_DELETED) || (raw[0] == ENTRY_EMPTY))
+	{
+		_set->slotCount = 0;
+		return NULL;
+	}
+
+	if (entry->attributes == ENTRY_NAME)
+	{
+		const unsigned int order = raw[0] & LFN_ORDER_MASK;
+		uint16_t* units;
+
+		if ((raw[0] & LFN_LAST) && (order >= 1) && (order <= LFN_MAX_SLOTS))
+		{
+			_set->slotCount = order;
+			_set->next = order;
+			_set->checksum = raw[LFN_CHECKSUM_OFFSET];
+		}
+
+		if ((_set->slotCount == 0) || (order != _set->next) || (raw[LFN_CHECKSUM_OFFSET] != _set->checksum))
+		{
+			/* orphan or broken slot, the short entry is kept alone */
+			_set->slotCount = 0;
+			return NULL;
+		}
+
+		/* characters at bytes 1-10, 14-25 and 28-31 */
+		units = _set->units + (order - 1) * LFN_CHARS;
+		for (i = 0; i < 5; i++)
+		{
+			units[i] = (uint16_t)(raw[1 + 2 * i] | (raw[2 + 2 * i] << 8));
+		}
+		for (i = 0; i < 6; i++)
+		{
+			units[5 + i] = (uint16_t)(raw[14 + 2 * i] | (raw[15 + 2 * i] << 8));
+		}
+		for (i = 0; i < 2; i++)
+		{
+			units[11 + i] = (uint16_t)(raw[28 + 2 * i] | (raw[29 + 2 * i] << 8));
+		}
+		_set->next--;
+		return NULL;
+	}
+
+	/* the set belongs to this entry if it is complete and the checksum of the short name matches */
+	for (i = 0; i < 11; i++)
+	{
+		checksum = (uint8_t)(((checksum & 1) << 7) + (checksum >> 1) + raw[i]);
+	}
+
+	if ((_set->slotCount == 0) || (_set->next != 0) || (checksum != _set->checksum) ||
+		(entry->attributes & ENTRY_VOLUME))
+	{
+		_set->slotCount = 0;
+		return NULL;
+	}
+
+	/* the name ends with 0x0000 unless it fills the last slot */
+	while ((length < _set->slotCount * LFN_CHARS) && (length < EXFAT_NAME_MAX) && (_set->units[length] != 0x0000))
+	{
+		length++;
+	}
+	_set->slotCount = 0;
+
+	if (length == 0)
+	{
+		return NULL;
+	}
+
+	_name[EncodeUtf8(_name, _set->units, length)] = '\0';
+	return _name;
+}
+
+/* UTF-16 to UTF-8 without terminator, surrogate pairs are joined; 3 bytes per unit at most */
+static size_t EncodeUtf8(char* _name, const uint16_t* _units, unsigned int _count)
+{
+	size_t out = 0;
+	unsigned int i;
+
+	for (i = 0; i < _count; i++)
+	{
+		unsigned int codePoint = _units[i];
+
+		if ((codePoint >= 0xD800) && (codePoint < 0xDC00) && (i + 1 < _count) &&
+			(_units[i + 1] >= 0xDC00) && (_units[i + 1] < 0xE000))
+		{
+			codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (_units[i + 1] - 0xDC00);
+			i++;
+		}
+
+		if (codePoint < 0x80)
+		{
+			_name[out++] = (char)codePoint;
+		}
+		else if (codePoint < 0x800)
+		{
+			_name[out++] = (char)(0xC0 | (codePoint >> 6));
+			_name[out++] = (char)(0x80 | (codePoint & 0x3F));
+		}
+		else if (codePoint < 0x10000)
+		{
+			_name[out++] = (char)(0xE0 | (codePoint >> 12));
+			_name[out++] = (char)(0x80 | ((codePoint >> 6) & 0x3F));
+			_name[out++] = (char)(0x80 | (codePoint & 0x3F));
+		}
+		else
+		{
+			_name[out++] = (char)(0xF0 | (codePoint >> 18));
+			_name[out++] = (char)(0x80 | ((codePoint >> 12) & 0x3F));
+			_name[out++] = (char)(0x80 | ((codePoint >> 6) & 0x3F));
+			_name[out++] = (char)(0x80 | (codePoint & 0x3F));
+		}
+	}
+
+	return out;
+}
+
+/* read a whole chain into memory, zero filled up to _length bytes when _length is not zero */
+static uint8_t* ReadChainData(unsigned int _startCluster, uint64_t _length, size_t* _size)
+{
+	const unsigned int sectorPerCluster = GetSectorPerCluster();
+	const uint64_t bytePerCluster = (uint64_t)GetBytePerSector() * sectorPerCluster;
+	unsigned int extentCount = 0;
+	Extent* extents = GetFileExtents(_startCluster, &extentCount);
+	uint64_t chainBytes = 0;
+	uint64_t bufferBytes;
+	uint64_t offset = 0;
+	uint8_t* data = NULL;
+	unsigned int e;
+
+	for (e = 0; e < extentCount; e++)
+	{
+		chainBytes += extents[e].count * bytePerCluster;
+	}
+
+	/* whole clusters are read, the last one may go past _length */
+	bufferBytes = chainBytes;
+	if (_length != 0)
+	{
+		bufferBytes = ((_length + bytePerCluster - 1) / bytePerCluster) * bytePerCluster;
+	}
+
+	if ((bufferBytes > 0) && (bufferBytes <= (size_t)-1))
+	{
+		data = (uint8_t*)calloc((size_t)bufferBytes, 1);
+	}
+
+	for (e = 0; (data != NULL) && (e < extentCount) && (offset < bufferBytes); e++)
+	{
+		uint64_t runBytes = extents[e].count * bytePerCluster;
+
+		if (runBytes > bufferBytes - offset)
+		{
+			runBytes = bufferBytes - offset;
+		}
+
+		ReadNSectors(data + offset, ClusterToSector(extents[e].cluster),
+			(unsigned int)(runBytes / GetBytePerSector()));
+		offset += runBytes;
+	}
+
+	free(extents);
+
+	*_size = (data == NULL) ? 0 : (size_t)((_length != 0) ? _length : chainBytes);
+	return data;
+}
+
+/* up-case a UTF-16 character with the table of the volume */
+static unsigned int UpcaseChar(unsigned int _char)
+{
+	unsigned int upper = _char;
+
+	if ((s_upcase != NULL) && (_char < EXFAT_UPCASE_CHARS))
+	{
+		upper = s_upcase[_char];
+	}
+	else if ((_char >= 'a') && (_char <= 'z'))
+	{
+		upper = _char - 'a' + 'A';
+	}
+
+	return upper;
+}
+
+/* SetChecksum of an exFAT entry set, the checksum field itself is skipped */
+static uint16_t EntrySetChecksum(const uint8_t* _set, unsigned int _entryCount)
+{
+	const unsigned int length = _entryCount * sizeof(DirectoryEntry);
+	uint16_t checksum = 0;
+	unsigned int i;
+
+	for (i = 0; i < length; i++)
+	{
+		if ((i != 2) && (i != 3))
+		{
+			checksum = (uint16_t)(((checksum & 1) ? 0x8000 : 0) + (checksum >> 1) + _set[i]);
+		}
+	}
+
+	return checksum;
+}
+
+/* character of an 8.3 alias, the ones out of the short name set become '_' */
+static uint8_t ShortNameChar(unsigned int _char)
+{
+	const unsigned int upper = UpcaseChar(_char);
+	uint8_t shortChar = '_';
+
+	if ((upper > ' ') && (upper < 0x7F) && (strchr("\"*+,./:;<=>?[\\]|", (int)upper) == NULL))
+	{
+		shortChar = (uint8_t)upper;
+	}
+
+	return shortChar;
+}
+
+/* build the 8.3 alias of an exFAT name, leading dots are removed */
+static void MakeShortName(DirectoryEntry* entry, const uint16_t* _name, unsigned int _length)
+{
+	unsigned int start = 0;
+	unsigned int dot = _length;
+	unsigned int count;
+	unsigned int i;
+
+	memset(entry->name, ' ', sizeof(entry->name));
+	memset(entry->extension, ' ', sizeof(entry->extension));
+
+	while ((start < _length) && (_name[start] == '.'))
+	{
+		start++;
+	}
+
+	for (i = start; i < _length; i++)
+	{
+		if (_name[i] == '.')
+		{
+			dot = i;
+		}
+	}
+
+	for (i = start, count = 0; (i < dot) && (count < sizeof(entry->name)); i++)
+	{
+		entry->name[count++] = ShortNameChar(_name[i]);
+	}
+
+	for (i = dot + 1, count = 0; (i < _length) && (count < sizeof(entry->extension)); i++)
+	{
+		entry->extension[count++] = ShortNameChar(_name[i]);
+	}
+
+	if (entry->name[0] == ' ')
+	{
+		entry->name[0] = '_';
+	}
+}
+
+/*
+ * Check an exFAT file entry set and convert it to a DirectoryEntry and a UTF-8 name
+ * of EXFAT_NAME_MAX * 3 + 1 bytes at most, return non-zero if the set is not valid
+ */
+static int DecodeEntrySet(const uint8_t* _set, unsigned int _entryCount, DirectoryEntry* entry, char* _name)
+{
+	const ExFatFileEntry* file = (const ExFatFileEntry*)_set;
+	const ExFatStreamEntry* stream = (const ExFatStreamEntry*)(_set + sizeof(DirectoryEntry));
+	const unsigned int nameLength = stream->nameLength;
+	uint16_t name[EXFAT_NAME_MAX];
+	uint16_t hash = 0;
+	unsigned int count = 0;
+	unsigned int i;
+	int isFailed = (_entryCount < 3) ||
+		(stream->entryType != EXFAT_ENTRY_STREAM) ||
+		(nameLength == 0) ||
+		(nameLength > (_entryCount - 2) * EXFAT_NAME_CHARS) ||
+		(EntrySetChecksum(_set, _entryCount) != ReadNumber(2, file->setChecksum));
+
+	/* name entries follow the stream entry, 15 characters each */
+	for (i = 2; !isFailed && (i < _entryCount) && (count < nameLength); i++)
+	{
+		const uint8_t* nameEntry = _set + i * sizeof(DirectoryEntry);
+		unsigned int c;
+
+		isFailed = (nameEntry[0] != EXFAT_ENTRY_NAME);
+		for (c = 0; !isFailed && (c < EXFAT_NAME_CHARS) && (count < nameLength); c++)
+		{
+			name[count++] = (uint16_t)ReadNumber(2, nameEntry + 2 + c * 2);
+		}
+	}
+
+	isFailed = isFailed || (count != nameLength);
+
+	for (i = 0; !isFailed && (i < nameLength); i++)
+	{
+		const unsigned int upper = UpcaseChar(name[i]);
+
+		hash = (uint16_t)(((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (upper & 0xFF));
+		hash = (uint16_t)(((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (upper >> 8));
+	}
+
+	isFailed = isFailed || (hash != ReadNumber(2, stream->nameHash));
+
+	if (!isFailed)
+	{
+		const uint32_t created = (uint32_t)ReadNumber(4, file->createTimestamp);
+		const uint32_t modified = (uint32_t)ReadNumber(4, file->modifiedTimestamp);
+		const unsigned int firstCluster = (unsigned int)ReadNumber(4, stream->firstCluster);
+		const uint64_t dataLength = ReadNumber(8, stream->dataLength);
+		const uint64_t bytePerCluster = (uint64_t)GetBytePerSector() * GetSectorPerCluster();
+		const uint32_t size = (dataLength > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t)dataLength;
+
+		memset(entry, 0, sizeof(DirectoryEntry));
+		MakeShortName(entry, name, nameLength);
+		entry->attributes = (uint8_t)(ReadNumber(2, file->attributes) & EXFAT_ATTRIBUTES);
+
+		/* timestamps are a DOS date and time pair */
+		entry->creatTime[0] = (uint8_t)created;
+		entry->creatTime[1] = (uint8_t)(created >> 8);
+		entry->creatDate[0] = (uint8_t)(created >> 16);
+		entry->creatDate[1] = (uint8_t)(created >> 24);
+		entry->modifiedTime[0] = (uint8_t)modified;
+		entry->modifiedTime[1] = (uint8_t)(modified >> 8);
+		entry->modifiedDate[0] = (uint8_t)(modified >> 16);
+		entry->modifiedDate[1] = (uint8_t)(modified >> 24);
+
+		SetEntryCluster(entry, firstCluster);
+
+		/* directories have no size in a FAT entry */
+		if (!(entry->attributes & ENTRY_DIRECTORY))
+		{
+			entry->size[0] = (uint8_t)size;
+			entry->size[1] = (uint8_t)(size >> 8);
+			entry->size[2] = (uint8_t)(size >> 16);
+			entry->size[3] = (uint8_t)(size >> 24);
+		}
+
+		/* no FAT lookup for this chain, GetChainRuns returns one run */
+		if ((stream->flags & EXFAT_NO_FAT_CHAIN) && (dataLength > 0))
+		{
+			FatCacheSetContiguous(firstCluster, (unsigned int)((dataLength + bytePerCluster - 1) / bytePerCluster));
+		}
+
+		_name[EncodeUtf8(_name, name, nameLength)] = '\0';
+	}
+
+	return isFailed;
+}
+
+/* file entry sets of an exFAT directory, see ScanDirectory */
+static int ScanExFatDirectory(unsigned int _startCluster, EntryVisitor _visitor, void* _context)
+{
+	const unsigned int cluster = (_startCluster == 0) ? GetRootCluster() : _startCluster;
+	size_t size = 0;
+	uint8_t* data = ReadChainData(cluster, 0, &size);
+	const size_t slotCount = size / sizeof(DirectoryEntry);
+	size_t slot = 0;
+	char name[EXFAT_NAME_MAX * 3 + 1];
+	DirectoryEntry entry;
+	int isStopped = 0;
+	int isEnd = (data == NULL);
+
+	while (!isStopped && !isEnd && (slot < slotCount))
+	{
+		const uint8_t* set = data + slot * sizeof(DirectoryEntry);
+		const unsigned int entryCount = set[1] + 1;
+
+		GetVolumeStats()->dirEntriesScanned++;
+
+		if (set[0] == EXFAT_ENTRY_END)
+		{
+			isEnd = 1;
+		}
+		else if ((set[0] == EXFAT_ENTRY_FILE) && (slot + entryCount <= slotCount) &&
+			(DecodeEntrySet(set, entryCount, &entry, name) == 0))
+		{
+			isStopped = _visitor(&entry, name, _context);
+			slot += entryCount;
+		}
+		else
+		{
+			/* deleted, metadata or damaged entry */
+			slot++;
+		}
+	}
+
+	free(data);
+	return isStopped;
+}
+
+/* ScanDirectory visitor of GetEntry on exFAT */
+static int CountEntry(DirectoryEntry* entry, const char* path, void* context)
+{
+	EntryCounter* counter = (EntryCounter*)context;
+	int isFound;
+
+	(void)path;
+	counter->count++;
+	isFound = (counter->count == counter->target);
+	if (isFound)
+	{
+		memcpy(counter->entry, entry, sizeof(DirectoryEntry));
+	}
+
+	return isFound;
+}
+
+/*!
+ * @brief <Filter one slot of a directory and forward it to the WalkTree visitor>
+ *
+ * @param entry <Pointer to a entry object>.
+ * @param path <UTF-8 long name of the entry, NULL if it only has a short name>.
+ * @param context <Pointer to a WalkContext object>.
+ *
+ * @return <non-zero to stop the walk>.
+ */
+static int WalkVisitor(DirectoryEntry* entry, const char* path, void* context)
+{
+	WalkContext* walk = (WalkContext*)context;
+	char shortName[14];
+	const char* name = path;
+	char fullPath[FAT_MAX_PATH];
+	size_t length;
+	int isStopped = 0;
+
+	if ((entry->name[0] == ENTRY_EMPTY) ||
+		(entry->name[0] == ENTRY_DELETED) ||
+		(entry->name[0] == ENTRY_DOT) ||
+		(entry->attributes == ENTRY_NAME) ||
+		(entry->attributes & ENTRY_VOLUME))
+	{
+		return 0;
+	}
+
+	/* long name of the exFAT entry set or of the FAT long name slots */
+	if (name == NULL)
+	{
+		GetName(shortName, entry);
+		if (entry->name[0] == ENTRY_E5)
+		{
+			shortName[0] = (char)ENTRY_DELETED;
+		}
+
+		/* file without extension */
+		length = strlen(shortName);
+		if ((length > 0) && (shortName[length - 1] == '.'))
+		{
+			shortName[length - 1] = '\0';
+		}
+		name = shortName;
+	}
+
+	if (strlen(walk->path) + 1 + strlen(name) >= FAT_MAX_PATH)
+	{
+		return 0;
+	}
+	strcpy(fullPath, walk->path);
+	strcat(fullPath, "/");
+	strcat(fullPath, name);
+
+	isStopped = walk->visitor(entry, fullPath, walk->context);
+
+	if (!isStopped && (entry->attributes & ENTRY_DIRECTORY))
+	{
+		const unsigned int cluster = (walk->source != NULL) ? EntryCluster(entry, walk->source->fatType) : GetEntryCluster(entry);
+
+		isStopped = WalkDirectory(cluster, fullPath, walk, walk->depth + 1);
+	}
+
+	return isStopped;
+}
+
+/*!
+ * @brief <WalkTree with the current depth of recursion>
+ */
+static int WalkDirectory(unsigned int _startCluster, const char* _path, const WalkContext* _walk, unsigned int _depth)
+{
+	WalkContext walk = *_walk;
+
+	if (_depth > _walk->maxDepth)
+	{
+		return 0;
+	}
+
+	walk.path = _path;
+	walk.depth = _depth;
+
+	if (walk.source != NULL)
+	{
+		return ScanFatDirectory(_startCluster, walk.source, WalkVisitor, &walk);
+	}
+
+	return ScanDirectory(_startCluster, WalkVisitor, &walk);
+}
+
+/*!
+ * @brief <Call _visitor for every file and folder below a directory>
+ *
+ * @param _startCluster <Start cluster of the directory, 0 for root directory>.
+ * @param _path <path of the directory, "" for root directory>.
+ * @param _visitor <function called with the entry and its full path>.
+ * @param _context <passed to _visitor>.
+ *
+ * @return <non-zero if stopped by _visitor>.
+ */
+int WalkTree(unsigned int _startCluster, const char* _path, EntryVisitor _visitor, void* _context)
+{
+	return WalkTreeFrom(NULL, _startCluster, _path, WALK_MAX_DEPTH, _visitor, _context);
+}
+
+/*!
+ * @brief <Describe the mounted volume for WalkTreeFrom>
+ *
+ * @param _source <Pointer to a VolumeSource object to fill>.
+ * @param _reader <handle of OpenImgReader, NULL to read through the HAL>.
+ * @param _fat <next cluster of every cluster from DecodeFATEntries(0, ...), NULL for GetNextCluster>.
+ *
+ * @return <zero on success, non-zero on exFAT>.
+ */
+int GetVolumeSource(VolumeSource* _source, FILE* _reader, const uint32_t* _fat)
+{
+	_source->reader = _reader;
+	_source->fat = _fat;
+	_source->offset = GetPartitionOffset();
+	_source->fatType = s_volume.fatType;
+	_source->bytePerSector = s_volume.bytePerSector;
+	_source->sectorPerCluster = s_volume.sectorPerCluster;
+	_source->startSectorRoot = s_volume.startSectorRoot;
+	_source->sectorPerRoot = s_volume.sectorPerRoot;
+	_source->clusterCount = s_volume.clusterCount;
+	_source->rootCluster = s_volume.rootCluster;
+
+	return (s_volume.fatType == FAT_TYPE_EXFAT);
+}
+
+/*!
+ * @brief <WalkTree over a volume described by GetVolumeSource>
+ *
+ * @param _source <Pointer to a VolumeSource object, NULL for the mounted volume>.
+ * @param _startCluster <Start cluster of the directory, 0 for root directory>.
+ * @param _path <path of the directory, "" for root directory>.
+ * @param _maxDepth <levels of folders below the directory to visit, 0 for its own entries only>.
+ * @param _visitor <function called with the entry and its full path>.
+ * @param _context <passed to _visitor>.
+ *
+ * @return <non-zero if stopped by _visitor, -1 if _source is an exFAT volume>.
+ */
+int WalkTreeFrom(const VolumeSource* _source, unsigned int _startCluster, const char* _path,
+	unsigned int _maxDepth, EntryVisitor _visitor, void* _context)
+{
+	WalkContext walk;
+
+	if ((_source != NULL) && (_source->fatType == FAT_TYPE_EXFAT))
+	{
+		return -1;
+	}
+
+	walk.path = _path;
+	walk.visitor = _visitor;
+	walk.context = _context;
+	walk.depth = 0;
+	walk.maxDepth = _maxDepth;
+	walk.source = _source;
+
+	return WalkDirectory(_startCluster, _path, &walk, 0);
+}
+
+/*!
+ * @brief <Read the data of a file run by run with large ReadNSectors calls>
+ *
+ * @param entry <Pointer to a entry object>.
+ * @param _visitor <function called for every chunk, truncated to the file size>.
+ * @param _context <passed to _visitor>.
+ *
+ * @return <number of bytes delivered to _visitor>.
+ */
+unsigned int StreamFile(DirectoryEntry* entry, DataVisitor _visitor, void* _context)
+{
+	const unsigned int size = GetSizeofFile(entry);
+	unsigned int extentCount = 0;
+	unsigned int done;
+	Extent* extents;
+
+	if (size == 0)
+	{
+		return 0;
+	}
+
+	extents = GetFileExtents(GetEntryCluster(entry), &extentCount);
+	done = StreamExtents(NULL, extents, extentCount, size, _visitor, _context);
+
+	free(extents);
+	return done;
+}
+
+/*!
+ * @brief <Read the data of a file from runs collected by GetFileExtents>
+ *
+ * @param _reader <handle of OpenImgReader, NULL to read through the HAL>.
+ * @param _extents <runs of the file, in file order>.
+ * @param _extentCount <number of runs>.
+ * @param _size <size of the file in bytes>.
+ * @param _visitor <function called for every chunk, truncated to _size>.
+ * @param _context <passed to _visitor>.
+ *
+ * @return <number of bytes delivered to _visitor>.
+ */
+unsigned int StreamExtents(FILE* _reader, const Extent* _extents, unsigned int _extentCount, unsigned int _size,
+	DataVisitor _visitor, void* _context)
+{
+	const unsigned int bytePerSec = GetBytePerSector();
+	const unsigned int sectorPerCluster = GetSectorPerCluster();
+	unsigned int done = 0;
+	unsigned int e;
+	int isStopped = 0;
+	uint8_t* buffer;
+
+	if (_size == 0)
+	{
+		return 0;
+	}
+
+	buffer = (uint8_t*)malloc(STREAM_CHUNK_SECTORS * bytePerSec);
+
+	for (e = 0; (buffer != NULL) && (e < _extentCount) && (done < _size) && !isStopped; e++)
+	{
+		uint64_t sectorIndex = ClusterToSector(_extents[e].cluster);
+		uint64_t sectorLeft = (uint64_t)_extents[e].count * sectorPerCluster;
+
+		while ((sectorLeft > 0) && (done < _size) && !isStopped)
+		{
+			/* in 64-bit: the rounding up wraps for files of 4 GiB - 511 bytes and more */
+			const uint64_t remaining = (uint64_t)_size - done;
+			const uint64_t sectorNeeded = (remaining + bytePerSec - 1) / bytePerSec;
+			unsigned int n = STREAM_CHUNK_SECTORS;
+			unsigned int length;
+
+			if (n > sectorLeft)
+			{
+				n = (unsigned int)sectorLeft;
+			}
+			if (n > sectorNeeded)
+			{
+				n = (unsigned int)sectorNeeded;
+			}
+
+			length = n * bytePerSec;
+			if (length > remaining)
+			{
+				length = (unsigned int)remaining;
+			}
+
+			if (_reader != NULL)
+			{
+				ReadSectorsFrom(_reader, buffer, sectorIndex, n);
+			}
+			else
+			{
+				ReadNSectors(buffer, sectorIndex, n);
+			}
+			isStopped = _visitor(buffer, length, done, _context);
+
+			done += length;
+			sectorIndex += n;
+			sectorLeft -= n;
+		}
+	}
+
+	free(buffer);
+	return done;
+}
+
+/*!
+ * @brief <Serve GetNextCluster from an already decoded FAT>
+ *
+ * @param _table <next cluster of every cluster, NULL to read the FAT from the image again>.
+ * @param _count <number of items in _table>.
+ *
+ * @return <none>.
+ */
+void SetDecodedFAT(const uint32_t* _table, unsigned int _count)
+{
+	s_decodedFAT = _table;
+	s_decodedFATCount = (_table != NULL) ? _count : 0;
+}
+
+/* byte offset of the entry of a cluster from the start of the FAT */
+static unsigned int FatEntryOffset(unsigned int _cluster)
+{
+	unsigned int offset;
+
+	switch (s_volume.fatType)
+	{
+	case FAT_TYPE_32:
+	case FAT_TYPE_EXFAT:
+		offset = _cluster * 4;
+		break;
+	case FAT_TYPE_16:
+		offset = _cluster * 2;
+		break;
+	default:
+		offset = (_cluster * 3) / 2;
+		break;
+	}
+
+	return offset;
+}
+
+/*!
+ * @brief <Decode consecutive FAT entries with one read of the FAT sectors>
+ *
+ * @param _first <first cluster to decode>.
+ * @param _count <number of clusters to decode>.
+ * @param _next <array of _count items to store the next cluster of every cluster>.
+ *
+ * @return <none>.
+ */
+void DecodeFATEntries(unsigned int _first, unsigned int _count, uint32_t* _next)
+{
+	const unsigned int bytePerSector = GetBytePerSector();
+	const unsigned int entryLast = (FatEntryOffset(1) == 4) ? 3 : 1; /* last byte of an entry */
+	const unsigned int firstSector = FatEntryOffset(_first) / bytePerSector;
+	const unsigned int lastSector = (FatEntryOffset(_first + _count - 1) + entryLast) / bytePerSector;
+	const unsigned int sectorCount = lastSector - firstSector + 1;
+	const unsigned int base = firstSector * bytePerSector;
+	uint8_t* fat;
+	unsigned int i;
+	TRACE_BEGIN();
+
+	fat = (uint8_t*)malloc((size_t)sectorCount * bytePerSector);
+	if (fat == NULL)
+	{
+		for (i = 0; i < _count; i++)
+		{
+			_next[i] = EOC;
+		}
+	}
+	else
+	{
+		ReadNSectors(fat, GetStartSectorFAT() + firstSector, sectorCount);
+
+		for (i = 0; i < _count; i++)
+		{
+			const unsigned int cluster = _first + i;
+			const uint8_t* entry = fat + FatEntryOffset(cluster) - base;
+			uint32_t next;
+
+			/* reserved values (end of chain, bad cluster) are widened to FAT32 */
+			if (s_volume.fatType == FAT_TYPE_32)
+			{
+				next = (uint32_t)ReadNumber(4, entry) & EOC;
+			}
+			else if (s_volume.fatType == FAT_TYPE_EXFAT)
+			{
+				next = (uint32_t)ReadNumber(4, entry);
+				next = (next >= 0xFFFFFFF7) ? (next & EOC) : next;
+			}
+			else if (s_volume.fatType == FAT_TYPE_16)
+			{
+				next = entry[0] | (entry[1] << 8);
+				next = (next >= 0xFFF0) ? (next | 0x0FFF0000) : next;
+			}
+			else
+			{
+				const unsigned int pair = entry[0] | (entry[1] << 8);
+
+				next = (cluster & 1) ? (pair >> 4) : (pair & 0xFFF);
+				next = (next >= 0xFF0) ? (next | 0x0FFFF000) : next;
+			}
+
+			_next[i] = next;
+		}
+
+		free(fat);
+	}
+
+	GetVolumeStats()->fatEntriesDecoded += _count;
+
+	TRACE_END(TRACE_CAT_FAT, "DecodeFATEntries");
+}
+
+/*!
+ * @brief <Store one entry in a raw copy of the FAT>
+ *
+ * @param _fat <first byte of the FAT>.
+ * @param _cluster <cluster number>.
+ * @param _next <next cluster of _cluster, 0 for free or EOC>.
+ *
+ * @return <none>.
+ */
+void EncodeFATEntry(uint8_t* _fat, unsigned int _cluster, unsigned int _next)
+{
+	EncodeEntry(_fat + FatEntryOffset(_cluster), _cluster, _next);
+}
+
+/* store the next cluster of _cluster at the first byte of its FAT entry */
+static void EncodeEntry(uint8_t* entry, unsigned int _cluster, unsigned int _next)
+{
+	if ((s_volume.fatType == FAT_TYPE_32) || (s_volume.fatType == FAT_TYPE_EXFAT))
+	{
+		if (s_volume.fatType == FAT_TYPE_32)
+		{
+			/* the high 4 bits are reserved and kept */
+			_next = (_next & EOC) | ((uint32_t)(entry[3] & 0xF0) << 24);
+		}
+		else if (_next >= BAD_CLUSTER)
+		{
+			/* exFAT marks use all 32 bits */
+			_next |= 0xF0000000U;
+		}
+		entry[0] = (uint8_t)_next;
+		entry[1] = (uint8_t)(_next >> 8);
+		entry[2] = (uint8_t)(_next >> 16);
+		entry[3] = (uint8_t)(_next >> 24);
+	}
+	else if (s_volume.fatType == FAT_TYPE_16)
+	{
+		entry[0] = (uint8_t)_next;
+		entry[1] = (uint8_t)(_next >> 8);
+	}
+	else if (_cluster & 1)
+	{
+		entry[0] = (uint8_t)((entry[0] & 0x0F) | ((_next & 0x0F) << 4));
+		entry[1] = (uint8_t)(_next >> 4);
+	}
+	else
+	{
+		entry[0] = (uint8_t)_next;
+		entry[1] = (uint8_t)((entry[1] & 0xF0) | ((_next >> 8) & 0x0F));
+	}
+}
+
+/*!
+ * @brief <Get which clusters of the data region are allocated>
+ *
+ * @param <none>.
+ *
+ * @return <one bit per cluster from FIRST_CLUSTER, set if allocated, to free() by the caller;
+ * NULL if out of memory>.
+ */
+uint8_t* LoadAllocationBitmap()
+{
+	const unsigned int clusterCount = GetClusterCount();
+	const size_t byteCount = ((size_t)clusterCount + 7) / 8;
+	uint8_t* bitmap = NULL;
+	TRACE_BEGIN();
+
+	if (s_volume.fatType == FAT_TYPE_EXFAT)
+	{
+		size_t size = 0;
+
+		if ((s_volume.bitmapCluster != 0) && (byteCount > 0))
+		{
+			const uint64_t bytePerCluster = (uint64_t)GetBytePerSector() * GetSectorPerCluster();
+
+			/* a record of the mount may have been dropped from the contiguous table */
+			if (GetNextCluster(s_volume.bitmapCluster) == 0)
+			{
+				FatCacheSetContiguous(s_volume.bitmapCluster, (unsigned int)((s_volume.bitmapLength + bytePerCluster - 1) / bytePerCluster));
+			}
+			bitmap = ReadChainData(s_volume.bitmapCluster, byteCount, &size);
+		}
+	}
+	else
+	{
+		uint32_t* next = (uint32_t*)malloc(FAT_PAGE_ENTRIES * sizeof(uint32_t));
+		unsigned int first;
+		unsigned int i;
+
+		bitmap = (uint8_t*)calloc(byteCount + 1, 1);
+
+		/* one page of the FAT at a time, free and bad clusters are not allocated */
+		for (first = 0; (bitmap != NULL) && (next != NULL) && (first < clusterCount); first += FAT_PAGE_ENTRIES)
+		{
+			const unsigned int count = (clusterCount - first < FAT_PAGE_ENTRIES) ? (clusterCount - first) : FAT_PAGE_ENTRIES;
+
+			DecodeFATEntries(first + FIRST_CLUSTER, count, next);
+			for (i = 0; i < count; i++)
+			{
+				if ((next[i] != 0) && (next[i] != BAD_CLUSTER))
+				{
+					bitmap[(first + i) / 8] |= (uint8_t)(1 << ((first + i) % 8));
+				}
+			}
+		}
+
+		if (next == NULL)
+		{
+			free(bitmap);
+			bitmap = NULL;
+		}
+		free(next);
+	}
+
+	TRACE_END(TRACE_CAT_FAT, "LoadAllocationBitmap");
+	return bitmap;
+}
+
+/* FAT32 keeps a free cluster count, it is marked unknown before the first change */
+static void InvalidateFreeCount()
+{
+	const unsigned int fsInfoSector = (unsigned int)ReadNumber(2, g_biosParam.fsInfoSector);
+	uint8_t* sector;
+
+	if ((s_volume.fatType != FAT_TYPE_32) || s_isFreeCountStale || (fsInfoSector == 0) || (fsInfoSector == 0xFFFF))
+	{
+		return;
+	}
+
+	sector = (uint8_t*)malloc(s_volume.bytePerSector);
+	if (sector != NULL)
+	{
+		ReadSector(sector, fsInfoSector);
+		if (ReadNumber(4, sector) == FSINFO_SIGNATURE)
+		{
+			memset(sector + FSINFO_FREE_COUNT, 0xFF, 4);
+			WriteSector(sector, fsInfoSector);
+		}
+		free(sector);
+	}
+	s_isFreeCountStale = 1;
+}
+
+/*!
+ * @brief <Change the FAT entry of a cluster in every copy of the FAT>
+ *
+ * @param _cluster <cluster number>.
+ * @param _next <next cluster, 0 for free or EOC>.
+ *
+ * @return <zero on success, non-zero if the sectors can not be written>.
+ */
+int SetNextCluster(unsigned int _cluster, unsigned int _next)
+{
+	const unsigned int bytePerSector = s_volume.bytePerSector;
+	const unsigned int offset = FatEntryOffset(_cluster);
+	const unsigned int firstSector = offset / bytePerSector;
+	const unsigned int sectorCount = (offset + ((FatEntryOffset(1) == 4) ? 3 : 1)) / bytePerSector - firstSector + 1;
+	uint8_t* fat = (uint8_t*)malloc((size_t)2 * bytePerSector);
+	unsigned int copy;
+	unsigned int i;
+	int isFailed = (fat == NULL) || !IsValidCluster(_cluster);
+
+	InvalidateFreeCount();
+
+	/* a FAT12 entry may straddle two sectors */
+	for (copy = 0; !isFailed && (copy < s_volume.numFAT); copy++)
+	{
+		const unsigned int sector = s_volume.startSectorFAT + copy * s_volume.sectorPerFAT + firstSector;
+
+		ReadNSectors(fat, sector, sectorCount);
+		EncodeEntry(fat + offset % bytePerSector, _cluster, _next);
+		for (i = 0; !isFailed && (i < sectorCount); i++)
+		{
+			isFailed = WriteSector(fat + (size_t)i * bytePerSector, sector + i);
+		}
+	}
+
+	if (!isFailed)
+	{
+		/* a decoded FAT of a loaded index no longer matches */
+		SetDecodedFAT(NULL, 0);
+		FatCacheSetNext(_cluster, (_next >= EOC_MIN) ? EOC : _next);
+	}
+
+	free(fat);
+	return isFailed;
+}
+
+/*!
+ * @brief <Take a free cluster and append it to a chain>
+ *
+ * @param _previous <last cluster of the chain, 0 to start a new chain>.
+ *
+ * @return <the new cluster, marked end of chain; 0 if the volume is full or can not be written>.
+ */
+unsigned int AllocateCluster(unsigned int _previous)
+{
+	const unsigned int clusterCount = s_volume.clusterCount;
+	unsigned int cluster = 0;
+	unsigned int steps;
+
+	/* right after the chain keeps it contiguous, else from where the last search stopped */
+	unsigned int candidate = (IsValidCluster(_previous + 1) && (GetNextCluster(_previous + 1) == 0)) ? _previous + 1 : s_nextFree;
+
+	for (steps = 0; (cluster == 0) && (steps < clusterCount); steps++)
+	{
+		if (!IsValidCluster(candidate))
+		{
+			candidate = FIRST_CLUSTER;
+		}
+		if (GetNextCluster(candidate) == 0)
+		{
+			cluster = candidate;
+		}
+		candidate++;
+	}
+
+	if (cluster != 0)
+	{
+		s_nextFree = cluster + 1;
+		if ((SetNextCluster(cluster, EOC) != 0) ||
+			((_previous != 0) && (SetNextCluster(_previous, cluster) != 0)))
+		{
+			cluster = 0;
+		}
+	}
+
+	return cluster;
+}
+
+/*!
+ * @brief <Mark every cluster of a chain free>
+ *
+ * @param _startCluster <first cluster of the chain, 0 for an empty file>.
+ *
+ * @return <zero on success>.
+ */
+int FreeClusterChain(unsigned int _startCluster)
+{
+	unsigned int extentCount = 0;
+	Extent* extents = GetFileExtents(_startCluster, &extentCount);
+	unsigned int i;
+	unsigned int j;
+	int isFailed = 0;
+
+	for (i = 0; !isFailed && (i < extentCount); i++)
+	{
+		for (j = 0; !isFailed && (j < extents[i].count); j++)
+		{
+			isFailed = SetNextCluster(extents[i].cluster + j, 0);
+		}
+
+		/* freed clusters are found again by the next search */
+		if (extents[i].cluster < s_nextFree)
+		{
+			s_nextFree = extents[i].cluster;
+		}
+	}
+
+	free(extents);
+	return isFailed;
+}
\ No newline at end of file
@@ -1,6 +1,7 @@
 #ifndef _FAT_H_
 #define _FAT_H_
 
+#include <stdio.h>
 #include <stdint.h>
 
 /*******************************************************************************
@@ -8,11 +9,24 @@
  ******************************************************************************/
 #define BIOS_PARAM_OFFSET 0x00B
 
-/* End of cluster */
-#define EOC 0xFFF
+/* End of cluster, FAT12 and FAT16 values are widened to the FAT32 ones when decoded */
+#define EOC 0x0FFFFFFF
+#define EOC_MIN 0x0FFFFFF8 /* any value from EOC_MIN to EOC marks the end of a chain */
+#define BAD_CLUSTER 0x0FFFFFF7 /* cluster marked unusable */
+#define FIRST_CLUSTER 2
+
+/* GetFatType, chosen from the number of clusters */
+#define FAT_TYPE_12 12
+#define FAT_TYPE_16 16
+#define FAT_TYPE_32 32
+#define FAT_TYPE_EXFAT 64
 
 #define YEAR_OFFSET 1980
 
+/* Maximum length of a path built by WalkTree, including '\0' */
+#define FAT_MAX_PATH 260
+#define WALK_MAX_DEPTH 64 /* levels of folders visited by WalkTree, protects against directory loops */
+
 /* directoryEntry.name */
 #define ENTRY_EMPTY 0x00   /* Entry is available and no subsequent entry is in use. */
 #define ENTRY_E5 0x05      /* Initial character is actually 0xE5*/
@@ -43,7 +57,7 @@ typedef struct _directoryEntry
     uint8_t creatTime[2]; /* create time */
     uint8_t creatDate[2]; /* create date */
     uint8_t dontCare3[2];
-    uint8_t dontCare4[2];
+    uint8_t startClustersHigh[2]; /* high 16 bits of starting cluster (FAT32) */
     uint8_t modifiedTime[2];  /* Last modified time  */
     uint8_t modifiedDate[2];  /* last modified date */
     uint8_t startClusters[2]; /* starting cluster of file */
@@ -51,7 +65,7 @@ typedef struct _directoryEntry
 } DirectoryEntry;
 
 /*
- * BIOS Parameter Block structure (FAT12/16)
+ * BIOS Parameter Block structure (FAT12/16), followed by the FAT32 extension
  */
 typedef struct _tagBIOSParam
 {
@@ -67,6 +81,12 @@ typedef struct _tagBIOSParam
     uint8_t numHeads[2];          /* Number of heads for disks */
     uint8_t numHiddenSectors[4];  /* Count of hidden sectors */
     uint8_t numSectors[4];        /* Total logical sectors including hidden sectors. */
+    uint8_t sectorPerFAT32[4];    /* FAT32: Logical sectors per File Allocation Table */
+    uint8_t extFlags[2];          /* FAT32: mirroring flags */
+    uint8_t fsVersion[2];         /* FAT32: version */
+    uint8_t rootCluster[4];       /* FAT32: first cluster of root directory */
+    uint8_t fsInfoSector[2];      /* FAT32: sector of the FS information sector */
+    uint8_t backupBootSector[2];  /* FAT32: sector of the copy of the boot sectors */
 } BIOSParam;
 
 /*
@@ -89,6 +109,44 @@ typedef struct
     uint16_t hours;
 } Time;
 
+/*
+ * Run of contiguous clusters of a file
+ */
+typedef struct
+{
+    unsigned int cluster; /* first cluster of the run */
+    unsigned int count;   /* number of clusters in the run */
+} Extent;
+
+/*
+ * FAT12/16/32 volume read by WalkTreeFrom, independent of the mounted one
+ */
+typedef struct
+{
+    FILE *reader;        /* handle of OpenImgReader, NULL to read the mounted volume through the HAL */
+    const uint32_t *fat; /* next cluster of every cluster from DecodeFATEntries(0, ...), NULL for GetNextCluster */
+    uint64_t offset;     /* byte offset of the volume in the image */
+    unsigned int fatType;
+    unsigned int bytePerSector;
+    unsigned int sectorPerCluster;
+    unsigned int startSectorRoot;
+    unsigned int sectorPerRoot;
+    unsigned int clusterCount;
+    unsigned int rootCluster;
+} VolumeSource;
+
+/*
+ * Called for every entry found by ScanDirectory / WalkTree,
+ * return non-zero to stop the scan.
+ */
+typedef int (*EntryVisitor)(DirectoryEntry *entry, const char *path, void *context);
+
+/*
+ * Called by StreamFile for every chunk of file data,
+ * return non-zero to stop reading.
+ */
+typedef int (*DataVisitor)(const uint8_t *data, unsigned int length, unsigned int fileOffset, void *context);
+
 #define F_SEEK_SET 0
 #define F_SEEK_CUR 1
 /*
@@ -101,6 +159,10 @@ typedef struct
     unsigned int currentCluster; //current cluster in disk
     unsigned int currentSector; //currentSector in cluster, range 0 to sectorPerCluster
     unsigned int currentByte; //current byte in sector, range 0 to bytePerSector
+    unsigned int position; //current offset from the beginning of file
+    unsigned int runEnd; //first cluster after the run of currentCluster
+    unsigned int runIndex; //run of currentCluster in the runs of the chain
+    unsigned int runFirst; //cluster index in the file of the first cluster of that run
     //unsigned int seek; //current
 } File;
 
@@ -232,6 +294,44 @@ void FatInit(const char *_imgName);
 
 void FatDeInit();
 
+/*!
+ * @brief <Mount a copy-on-write overlay on the opened image>
+ *
+ * Later sector writes go to the delta file and reads see them, the image
+ * itself is never modified and can be shared by several processes.
+ *
+ * @param _deltaName <Name of the delta file, created if it does not exist>.
+ *
+ * @return <zero on success>.
+ */
+int FatAttachOverlay(const char *_deltaName);
+
+/*!
+ * @brief <Log later writes in a write-ahead journal on the opened image>
+ *
+ * Attach the overlay first if there is one, the journal writes back to it;
+ * otherwise the image itself is written. A journal left by a crash is
+ * replayed before the volume is mounted again.
+ *
+ * @param _journalName <Name of the journal file, created if it does not exist>.
+ *
+ * @return <zero on success>.
+ */
+int FatAttachJournal(const char *_journalName);
+
+/*!
+ * @brief <Mount another partition of the opened image>
+ *
+ * FatInit mounts the first FAT partition of a full disk image, see FindPartitions.
+ * The image stays open, switching partitions only decodes the new boot sector.
+ *
+ * @param _offset <byte offset of the boot sector in the image>.
+ * @param _size <bytes of the partition, 0 up to the end of the image>.
+ *
+ * @return <zero on success, non-zero if an overlay is attached>.
+ */
+int FatMountPartition(uint64_t _offset, uint64_t _size);
+
 
 unsigned int GetNextCluster(unsigned int current);
 
@@ -250,4 +350,302 @@ int GetEntry(void *entry, unsigned int i, unsigned int startCluster);
  * @return <none>
  */
 void Fseek(File* _file, unsigned int _offset, int _origin);
+
+/*!
+ * @brief <Get number of bytes per sector>
+ *
+ * @param <none>.
+ *
+ * @return <bytes per sector>.
+ */
+unsigned int GetBytePerSector();
+
+/*!
+ * @brief <Get number of sectors per cluster>
+ *
+ * @param <none>.
+ *
+ * @return <sectors per cluster>.
+ */
+unsigned int GetSectorPerCluster();
+
+/*!
+ * @brief <Get first sector of the first FAT>
+ *
+ * @param <none>.
+ *
+ * @return <Position of first sector of FAT number 0>.
+ */
+unsigned int GetStartSectorFAT();
+
+/*!
+ * @brief <Get number of sectors of one FAT>
+ *
+ * @param <none>.
+ *
+ * @return <sectors per FAT>.
+ */
+unsigned int GetSectorPerFAT();
+
+/*!
+ * @brief <Get number of copies of the FAT>
+ *
+ * @param <none>.
+ *
+ * @return <number of FATs>.
+ */
+unsigned int GetNumFAT();
+
+/*!
+ * @brief <Get the type of the mounted FAT>
+ *
+ * @param <none>.
+ *
+ * @return <FAT_TYPE_12, FAT_TYPE_16, FAT_TYPE_32 or FAT_TYPE_EXFAT>.
+ */
+unsigned int GetFatType();
+
+/*!
+ * @brief <Get first cluster of the root directory>
+ *
+ * @param <none>.
+ *
+ * @return <root cluster on FAT32 and exFAT, 0 when the root directory has a fixed region (FAT12/16)>.
+ */
+unsigned int GetRootCluster();
+
+/*!
+ * @brief <Get starting cluster of a directory entry>
+ *
+ * @param entry <Pointer to a entry object>.
+ *
+ * @return <starting cluster, the high 16 bits are used on FAT32 and exFAT only>.
+ */
+unsigned int GetEntryCluster(const DirectoryEntry *entry);
+
+/*!
+ * @brief <Set starting cluster of a directory entry>
+ *
+ * @param entry <Pointer to a entry object>.
+ * @param _cluster <starting cluster>.
+ *
+ * @return <none>.
+ */
+void SetEntryCluster(DirectoryEntry *entry, unsigned int _cluster);
+
+/*!
+ * @brief <Get number of clusters in the data region>
+ *
+ * @param <none>.
+ *
+ * @return <number of data clusters, valid clusters are FIRST_CLUSTER to count + 1>.
+ */
+unsigned int GetClusterCount();
+
+/*!
+ * @brief <Get first sector of a cluster>
+ *
+ * @param _cluster <cluster number, at least FIRST_CLUSTER>.
+ *
+ * @return <Position of first sector of the cluster>.
+ */
+uint64_t ClusterToSector(unsigned int _cluster);
+
+/*!
+ * @brief <Check that a cluster number points inside the data region>
+ *
+ * @param _cluster <cluster number>.
+ *
+ * @return <non-zero if the cluster is valid>.
+ */
+int IsValidCluster(unsigned int _cluster);
+
+/*!
+ * @brief <Get the runs of contiguous clusters of a chain, in file order>
+ *
+ * The walk stops at the end of chain, at an invalid cluster
+ * or after GetClusterCount() clusters (loop in the chain).
+ *
+ * @param _startCluster <first cluster of the chain>.
+ * @param _extentCount <Pointer to store number of runs>.
+ *
+ * @return <array of runs to free() by the caller, NULL if the chain is empty>.
+ */
+Extent *GetFileExtents(unsigned int _startCluster, unsigned int *_extentCount);
+
+/*!
+ * @brief <Call _visitor for every 32 bytes slot of a directory>
+ *
+ * Slots are visited in disk order, including deleted and long name slots,
+ * until the first ENTRY_EMPTY slot (which is visited too). A short entry
+ * closing a valid set of long name slots (complete, checksum of the short
+ * name matching) is visited with the long name.
+ * On exFAT every file entry set in use is visited once, as a DirectoryEntry
+ * built from it with an upper case short alias as name.
+ *
+ * @param _startCluster <Start cluster of the directory, 0 for root directory>.
+ * @param _visitor <function called for every slot, path parameter is the UTF-8 name of
+ * the entry set on exFAT, the UTF-8 long name of a short entry on FAT12/16/32, NULL otherwise>.
+ * @param _context <passed to _visitor>.
+ *
+ * @return <non-zero if stopped by _visitor>.
+ */
+int ScanDirectory(unsigned int _startCluster, EntryVisitor _visitor, void *_context);
+
+/*!
+ * @brief <Call _visitor for every file and folder below a directory>
+ *
+ * Long name, deleted, volume label, "." and ".." entries are skipped.
+ * Folders are visited before their content.
+ *
+ * @param _startCluster <Start cluster of the directory, 0 for root directory>.
+ * @param _path <path of the directory, "" for root directory>.
+ * @param _visitor <function called with the entry and its full path>.
+ * @param _context <passed to _visitor>.
+ *
+ * @return <non-zero if stopped by _visitor>.
+ */
+int WalkTree(unsigned int _startCluster, const char *_path, EntryVisitor _visitor, void *_context);
+
+/*!
+ * @brief <Describe the mounted volume for WalkTreeFrom>
+ *
+ * @param _source <Pointer to a VolumeSource object to fill>.
+ * @param _reader <handle of OpenImgReader, NULL to read through the HAL>.
+ * @param _fat <next cluster of every cluster from DecodeFATEntries(0, ...), NULL for GetNextCluster>.
+ *
+ * @return <zero on success, non-zero on exFAT>.
+ */
+int GetVolumeSource(VolumeSource *_source, FILE *_reader, const uint32_t *_fat);
+
+/*!
+ * @brief <WalkTree over a volume described by GetVolumeSource>
+ *
+ * Safe on a worker thread when the source has a reader and a decoded FAT,
+ * even once another partition is mounted, as long as the image is not
+ * changed meanwhile. The visitor gets the entries of that volume.
+ *
+ * @param _source <Pointer to a VolumeSource object, NULL for the mounted volume>.
+ * @param _startCluster <Start cluster of the directory, 0 for root directory>.
+ * @param _path <path of the directory, "" for root directory>.
+ * @param _maxDepth <levels of folders below the directory to visit, 0 for its own entries only>.
+ * @param _visitor <function called with the entry and its full path>.
+ * @param _context <passed to _visitor>.
+ *
+ * @return <non-zero if stopped by _visitor, -1 if _source is an exFAT volume>.
+ */
+int WalkTreeFrom(const VolumeSource *_source, unsigned int _startCluster, const char *_path,
+                 unsigned int _maxDepth, EntryVisitor _visitor, void *_context);
+
+/*!
+ * @brief <Read the data of a file run by run with large ReadNSectors calls>
+ *
+ * @param entry <Pointer to a entry object>.
+ * @param _visitor <function called for every chunk, truncated to the file size>.
+ * @param _context <passed to _visitor>.
+ *
+ * @return <number of bytes delivered to _visitor>.
+ */
+unsigned int StreamFile(DirectoryEntry *entry, DataVisitor _visitor, void *_context);
+
+/*!
+ * @brief <Read the data of a file from runs collected by GetFileExtents>
+ *
+ * Safe on a worker thread when _reader comes from OpenImgReader, as long as
+ * the volume is not changed meanwhile: only the geometry is read.
+ *
+ * @param _reader <handle of OpenImgReader, NULL to read through the HAL>.
+ * @param _extents <runs of the file, in file order>.
+ * @param _extentCount <number of runs>.
+ * @param _size <size of the file in bytes>.
+ * @param _visitor <function called for every chunk, truncated to _size>.
+ * @param _context <passed to _visitor>.
+ *
+ * @return <number of bytes delivered to _visitor>.
+ */
+unsigned int StreamExtents(FILE *_reader, const Extent *_extents, unsigned int _extentCount, unsigned int _size,
+                           DataVisitor _visitor, void *_context);
+
+/*!
+ * @brief <Serve GetNextCluster from an already decoded FAT>
+ *
+ * @param _table <next cluster of every cluster, NULL to read the FAT from the image again>.
+ * @param _count <number of items in _table>.
+ *
+ * @return <none>.
+ */
+void SetDecodedFAT(const uint32_t *_table, unsigned int _count);
+
+/*!
+ * @brief <Decode consecutive FAT entries with one read of the FAT sectors>
+ *
+ * End of chain and bad cluster marks are returned as EOC and BAD_CLUSTER
+ * whatever the FAT type.
+ *
+ * @param _first <first cluster to decode>.
+ * @param _count <number of clusters to decode>.
+ * @param _next <array of _count items to store the next cluster of every cluster>.
+ *
+ * @return <none>.
+ */
+void DecodeFATEntries(unsigned int _first, unsigned int _count, uint32_t *_next);
+
+/*!
+ * @brief <Store one entry in a raw copy of the FAT>
+ *
+ * @param _fat <first byte of the FAT>.
+ * @param _cluster <cluster number>.
+ * @param _next <next cluster of _cluster, 0 for free or EOC>.
+ *
+ * @return <none>.
+ */
+void EncodeFATEntry(uint8_t *_fat, unsigned int _cluster, unsigned int _next);
+
+/*!
+ * @brief <Get which clusters of the data region are allocated>
+ *
+ * exFAT reads its allocation bitmap, FAT12/16/32 derive it from the FAT
+ * (every cluster that is neither free nor bad).
+ *
+ * @param <none>.
+ *
+ * @return <one bit per cluster from FIRST_CLUSTER, set if allocated, to free() by the caller;
+ * NULL if out of memory or if the exFAT bitmap is missing>.
+ */
+uint8_t *LoadAllocationBitmap();
+
+/*!
+ * @brief <Change the FAT entry of a cluster in every copy of the FAT>
+ *
+ * Goes through WriteSector, a journal or an overlay must be attached.
+ * FAT32 marks its free cluster count unknown on the first change.
+ *
+ * @param _cluster <cluster number>.
+ * @param _next <next cluster, 0 for free or EOC>.
+ *
+ * @return <zero on success, non-zero if the sectors can not be written>.
+ */
+int SetNextCluster(unsigned int _cluster, unsigned int _next);
+
+/*!
+ * @brief <Take a free cluster and append it to a chain>
+ *
+ * The cluster right after _previous is preferred, so that a growing chain
+ * stays contiguous; otherwise the search goes on from the last allocation.
+ *
+ * @param _previous <last cluster of the chain, 0 to start a new chain>.
+ *
+ * @return <the new cluster, marked end of chain; 0 if the volume is full or can not be written>.
+ */
+unsigned int AllocateCluster(unsigned int _previous);
+
+/*!
+ * @brief <Mark every cluster of a chain free>
+ *
+ * @param _startCluster <first cluster of the chain, 0 for an empty file>.
+ *
+ * @return <zero on success>.
+ */
+int FreeClusterChain(unsigned int _startCluster);
+
 #endif
\ No newline at end of file
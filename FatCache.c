@@ -0,0 +1,534 @@
+#include "FatCache.h"
+#include "FAT.h"
+#include "Stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define PAGE_EMPTY 0xFFFFFFFFU
+#define CHAIN_CACHE_SLOTS 4096 /* must be a power of two */
+#define CONTIGUOUS_MIN_CAPACITY 64 /* must be a power of two */
+
+/*
+ * One slot of decoded FAT entries
+ */
+typedef struct
+{
+    unsigned int page; /* page held by the slot, PAGE_EMPTY if none */
+    int isReferenced;  /* CLOCK reference bit */
+} PageSlot;
+
+/*
+ * Chain of a start cluster stored as runs of contiguous clusters
+ */
+typedef struct
+{
+    unsigned int startCluster; /* 0 if the slot is empty */
+    unsigned int runCount;
+    Extent *runs;
+    int isReferenced;
+} ChainSlot;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static unsigned int EvictPage();
+
+static void FreeChain(ChainSlot *_slot);
+
+static Extent *WalkChain(unsigned int _startCluster, unsigned int *_runCount);
+
+static Extent *FindContiguous(unsigned int _startCluster);
+
+static void EvictChains(size_t _room);
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+/* decoded pages */
+static uint32_t *s_pageData = NULL;   /* slotCount * FAT_PAGE_ENTRIES entries */
+static PageSlot *s_pageSlots = NULL;
+static unsigned int s_pageSlotCount = 0;
+static unsigned int s_pageHand = 0;   /* CLOCK hand */
+static uint32_t *s_pageTable = NULL;  /* page -> slot, PAGE_EMPTY if not decoded */
+static unsigned int s_pageCount = 0;
+static unsigned int s_entryCount = 0; /* clusters covered by the FAT */
+
+/* chains */
+static ChainSlot s_chains[CHAIN_CACHE_SLOTS];
+static size_t s_chainBudget = 0;
+static size_t s_chainBytes = 0;
+static unsigned int s_chainHand = 0;
+static Extent *s_scratchRuns = NULL;  /* chain too large to be cached */
+
+/* exFAT files without FAT chain, charged to the chain budget: the FAT can not rebuild them */
+static Extent *s_contiguous = NULL;   /* open addressing on the first cluster, 0 if free */
+static unsigned int s_contiguousCount = 0;
+static unsigned int s_contiguousCapacity = 0;
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/*!
+ * @brief <Create the caches of the mounted volume>
+ *
+ * @param _pageBudget <memory limit of decoded FAT pages in bytes>.
+ * @param _chainBudget <memory limit of cached chains in bytes>.
+ *
+ * @return <zero on success>.
+ */
+int FatCacheInit(size_t _pageBudget, size_t _chainBudget)
+{
+    unsigned int i;
+
+    FatCacheDeInit();
+
+    s_entryCount = GetClusterCount() + FIRST_CLUSTER;
+    s_pageCount = (s_entryCount + FAT_PAGE_ENTRIES - 1) / FAT_PAGE_ENTRIES;
+    s_pageSlotCount = (unsigned int)(_pageBudget / (FAT_PAGE_ENTRIES * sizeof(uint32_t)));
+
+    if (s_pageSlotCount == 0)
+    {
+        s_pageSlotCount = 1;
+    }
+    if (s_pageSlotCount > s_pageCount)
+    {
+        s_pageSlotCount = s_pageCount;
+    }
+
+    s_pageTable = (uint32_t *)malloc(s_pageCount * sizeof(uint32_t));
+    s_pageSlots = (PageSlot *)malloc(s_pageSlotCount * sizeof(PageSlot));
+    s_pageData = (uint32_t *)malloc((size_t)s_pageSlotCount * FAT_PAGE_ENTRIES * sizeof(uint32_t));
+
+    if ((s_pageTable == NULL) || (s_pageSlots == NULL) || (s_pageData == NULL))
+    {
+        FatCacheDeInit();
+        return 1;
+    }
+
+    for (i = 0; i < s_pageCount; i++)
+    {
+        s_pageTable[i] = PAGE_EMPTY;
+    }
+    for (i = 0; i < s_pageSlotCount; i++)
+    {
+        s_pageSlots[i].page = PAGE_EMPTY;
+        s_pageSlots[i].isReferenced = 0;
+    }
+    s_pageHand = 0;
+
+    s_chainBudget = _chainBudget;
+    return 0;
+}
+
+/*!
+ * @brief <Release the caches>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void FatCacheDeInit()
+{
+    FatCacheInvalidate();
+
+    free(s_pageTable);
+    free(s_pageSlots);
+    free(s_pageData);
+    free(s_scratchRuns);
+    free(s_contiguous);
+
+    s_pageTable = NULL;
+    s_pageSlots = NULL;
+    s_pageData = NULL;
+    s_scratchRuns = NULL;
+    s_contiguous = NULL;
+    s_contiguousCount = 0;
+    s_contiguousCapacity = 0;
+    s_pageSlotCount = 0;
+    s_pageCount = 0;
+    s_entryCount = 0;
+}
+
+/*!
+ * @brief <Drop every cached page and chain>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void FatCacheInvalidate()
+{
+    unsigned int i;
+
+    for (i = 0; (s_pageTable != NULL) && (i < s_pageCount); i++)
+    {
+        s_pageTable[i] = PAGE_EMPTY;
+    }
+    for (i = 0; (s_pageSlots != NULL) && (i < s_pageSlotCount); i++)
+    {
+        s_pageSlots[i].page = PAGE_EMPTY;
+        s_pageSlots[i].isReferenced = 0;
+    }
+
+    for (i = 0; i < CHAIN_CACHE_SLOTS; i++)
+    {
+        FreeChain(&s_chains[i]);
+    }
+}
+
+/*!
+ * @brief <Follow a change of the FAT entry of a cluster>
+ *
+ * @param _cluster <cluster number>.
+ * @param _next <new FAT entry of _cluster, decoded like DecodeFATEntries>.
+ *
+ * @return <none>.
+ */
+void FatCacheSetNext(unsigned int _cluster, unsigned int _next)
+{
+    unsigned int i;
+
+    if ((s_pageTable != NULL) && (_cluster < s_entryCount) &&
+        (s_pageTable[_cluster / FAT_PAGE_ENTRIES] != PAGE_EMPTY))
+    {
+        s_pageData[(size_t)s_pageTable[_cluster / FAT_PAGE_ENTRIES] * FAT_PAGE_ENTRIES + _cluster % FAT_PAGE_ENTRIES] = _next;
+    }
+
+    /* nothing to walk when no chain was looked up since the last change */
+    for (i = 0; (s_chainBytes != 0) && (i < CHAIN_CACHE_SLOTS); i++)
+    {
+        FreeChain(&s_chains[i]);
+    }
+}
+
+/* CLOCK: first slot not referenced since the last sweep */
+static unsigned int EvictPage()
+{
+    PageSlot *slot;
+
+    for (;;)
+    {
+        slot = &s_pageSlots[s_pageHand];
+        if (!slot->isReferenced)
+        {
+            break;
+        }
+        slot->isReferenced = 0;
+        s_pageHand = (s_pageHand + 1) % s_pageSlotCount;
+    }
+
+    if (slot->page != PAGE_EMPTY)
+    {
+        s_pageTable[slot->page] = PAGE_EMPTY;
+        GetVolumeStats()->fatPageEvictions++;
+    }
+
+    s_pageHand = (s_pageHand + 1) % s_pageSlotCount;
+    return (unsigned int)(slot - s_pageSlots);
+}
+
+/*!
+ * @brief <Get the next cluster from a decoded page, decode the page on a miss>
+ *
+ * @param _cluster <cluster number>.
+ * @param _next <Pointer to store the FAT entry of _cluster>.
+ *
+ * @return <zero on success, non-zero if the cache is not available>.
+ */
+int FatCacheGetNext(unsigned int _cluster, unsigned int *_next)
+{
+    const unsigned int page = _cluster / FAT_PAGE_ENTRIES;
+    unsigned int slot;
+
+    if ((s_pageTable == NULL) || (_cluster >= s_entryCount))
+    {
+        return 1;
+    }
+
+    slot = s_pageTable[page];
+    if (slot == PAGE_EMPTY)
+    {
+        const unsigned int first = page * FAT_PAGE_ENTRIES;
+        unsigned int count = s_entryCount - first;
+
+        if (count > FAT_PAGE_ENTRIES)
+        {
+            count = FAT_PAGE_ENTRIES;
+        }
+
+        slot = EvictPage();
+        DecodeFATEntries(first, count, &s_pageData[(size_t)slot * FAT_PAGE_ENTRIES]);
+        s_pageSlots[slot].page = page;
+        s_pageTable[page] = slot;
+        GetVolumeStats()->fatPageMisses++;
+    }
+    else
+    {
+        GetVolumeStats()->fatPageHits++;
+    }
+
+    s_pageSlots[slot].isReferenced = 1;
+    *_next = s_pageData[(size_t)slot * FAT_PAGE_ENTRIES + _cluster % FAT_PAGE_ENTRIES];
+
+    return 0;
+}
+
+static void FreeChain(ChainSlot *_slot)
+{
+    if (_slot->runs != NULL)
+    {
+        s_chainBytes -= _slot->runCount * sizeof(Extent);
+        free(_slot->runs);
+    }
+
+    _slot->startCluster = 0;
+    _slot->runCount = 0;
+    _slot->runs = NULL;
+    _slot->isReferenced = 0;
+}
+
+/*!
+ * @brief <Follow a chain and merge contiguous clusters into runs>
+ *
+ * @param _startCluster <first cluster of the chain>.
+ * @param _runCount <Pointer to store number of runs>.
+ *
+ * @return <runs to free() by the caller, NULL if the chain is empty>.
+ */
+static Extent *WalkChain(unsigned int _startCluster, unsigned int *_runCount)
+{
+    const unsigned int clusterCount = GetClusterCount();
+    Extent *runs = NULL;
+    unsigned int count = 0;
+    unsigned int capacity = 0;
+    unsigned int cluster = _startCluster;
+    unsigned int steps = 0;
+
+    while (IsValidCluster(cluster) && (steps < clusterCount))
+    {
+        if ((count > 0) && (runs[count - 1].cluster + runs[count - 1].count == cluster))
+        {
+            runs[count - 1].count++;
+        }
+        else
+        {
+            if (count == capacity)
+            {
+                Extent *grown;
+
+                capacity = (capacity == 0) ? 4 : capacity * 2;
+                grown = (Extent *)realloc(runs, capacity * sizeof(Extent));
+                if (grown == NULL)
+                {
+                    break;
+                }
+                runs = grown;
+            }
+
+            runs[count].cluster = cluster;
+            runs[count].count = 1;
+            count++;
+        }
+
+        cluster = GetNextCluster(cluster);
+        steps++;
+    }
+
+    *_runCount = count;
+    return runs;
+}
+
+/*!
+ * @brief <Get the runs of contiguous clusters of a chain from the chain cache>
+ *
+ * @param _startCluster <first cluster of the chain>.
+ * @param _extentCount <Pointer to store number of runs>.
+ *
+ * @return <runs, valid until the next call; NULL if the chain is empty>.
+ */
+const Extent *GetChainRuns(unsigned int _startCluster, unsigned int *_extentCount)
+{
+    ChainSlot *slot = &s_chains[(_startCluster * 2654435761U) & (CHAIN_CACHE_SLOTS - 1)];
+    unsigned int runCount = 0;
+    Extent *runs = FindContiguous(_startCluster);
+    size_t bytes;
+    size_t room;
+
+    /* one run known from the directory entry, no FAT lookup */
+    if (runs != NULL)
+    {
+        GetVolumeStats()->chainHits++;
+        *_extentCount = 1;
+        return runs;
+    }
+
+    if ((slot->runs != NULL) && (slot->startCluster == _startCluster))
+    {
+        GetVolumeStats()->chainHits++;
+        slot->isReferenced = 1;
+        *_extentCount = slot->runCount;
+        return slot->runs;
+    }
+
+    GetVolumeStats()->chainMisses++;
+    runs = WalkChain(_startCluster, &runCount);
+    bytes = runCount * sizeof(Extent);
+    *_extentCount = runCount;
+
+    /* the contiguous table takes at most half of the budget */
+    room = s_chainBudget - s_contiguousCapacity * sizeof(Extent);
+    if ((runs == NULL) || (bytes > room))
+    {
+        /* too large to be cached, kept until the next call */
+        free(s_scratchRuns);
+        s_scratchRuns = runs;
+        return runs;
+    }
+
+    FreeChain(slot);
+    EvictChains(room - bytes);
+
+    slot->startCluster = _startCluster;
+    slot->runCount = runCount;
+    slot->runs = runs;
+    slot->isReferenced = 1;
+    s_chainBytes += bytes;
+
+    return runs;
+}
+
+/* CLOCK over the chain slots until the cached runs fit in _room bytes */
+static void EvictChains(size_t _room)
+{
+    while (s_chainBytes > _room)
+    {
+        ChainSlot *victim = &s_chains[s_chainHand];
+
+        s_chainHand = (s_chainHand + 1) & (CHAIN_CACHE_SLOTS - 1);
+        if (victim->isReferenced)
+        {
+            victim->isReferenced = 0;
+        }
+        else
+        {
+            FreeChain(victim);
+        }
+    }
+}
+
+/* item of the contiguous table holding _startCluster, NULL if not there */
+static Extent *FindContiguous(unsigned int _startCluster)
+{
+    unsigned int i;
+
+    if ((s_contiguousCount == 0) || (_startCluster == 0))
+    {
+        return NULL;
+    }
+
+    i = (_startCluster * 2654435761U) & (s_contiguousCapacity - 1);
+    while (s_contiguous[i].cluster != 0)
+    {
+        if (s_contiguous[i].cluster == _startCluster)
+        {
+            return &s_contiguous[i];
+        }
+        i = (i + 1) & (s_contiguousCapacity - 1);
+    }
+
+    return NULL;
+}
+
+/*!
+ * @brief <Record a chain whose clusters are contiguous and not linked in the FAT>
+ *
+ * @param _startCluster <first cluster of the chain>.
+ * @param _clusterCount <number of clusters>.
+ *
+ * @return <zero on success>.
+ */
+int FatCacheSetContiguous(unsigned int _startCluster, unsigned int _clusterCount)
+{
+    Extent *item = FindContiguous(_startCluster);
+    unsigned int i;
+
+    if (!IsValidCluster(_startCluster) || (_clusterCount == 0))
+    {
+        return 1;
+    }
+
+    /* clipped to the end of the volume */
+    if (_clusterCount > GetClusterCount() + FIRST_CLUSTER - _startCluster)
+    {
+        _clusterCount = GetClusterCount() + FIRST_CLUSTER - _startCluster;
+    }
+
+    if (item != NULL)
+    {
+        item->count = _clusterCount;
+        return 0;
+    }
+
+    /* grown at 50% load */
+    if ((s_contiguousCount + 1) * 2 > s_contiguousCapacity)
+    {
+        unsigned int capacity = (s_contiguousCapacity == 0) ? CONTIGUOUS_MIN_CAPACITY : s_contiguousCapacity * 2;
+        Extent *table;
+
+        /* beyond half of the chain budget the records start over, they are
+           recorded again when their directory entries are decoded */
+        if ((size_t)capacity * sizeof(Extent) > s_chainBudget / 2)
+        {
+            if ((size_t)CONTIGUOUS_MIN_CAPACITY * sizeof(Extent) > s_chainBudget / 2)
+            {
+                return 1;
+            }
+            free(s_contiguous);
+            s_contiguous = NULL;
+            s_contiguousCount = 0;
+            s_contiguousCapacity = 0;
+            capacity = CONTIGUOUS_MIN_CAPACITY;
+        }
+
+        EvictChains(s_chainBudget - (size_t)capacity * sizeof(Extent));
+        table = (Extent *)calloc(capacity, sizeof(Extent));
+        if (table == NULL)
+        {
+            return 1;
+        }
+
+        for (i = 0; i < s_contiguousCapacity; i++)
+        {
+            if (s_contiguous[i].cluster != 0)
+            {
+                unsigned int j = (s_contiguous[i].cluster * 2654435761U) & (capacity - 1);
+
+                while (table[j].cluster != 0)
+                {
+                    j = (j + 1) & (capacity - 1);
+                }
+                table[j] = s_contiguous[i];
+            }
+        }
+
+        free(s_contiguous);
+        s_contiguous = table;
+        s_contiguousCapacity = capacity;
+    }
+
+    i = (_startCluster * 2654435761U) & (s_contiguousCapacity - 1);
+    while (s_contiguous[i].cluster != 0)
+    {
+        i = (i + 1) & (s_contiguousCapacity - 1);
+    }
+    s_contiguous[i].cluster = _startCluster;
+    s_contiguous[i].count = _clusterCount;
+    s_contiguousCount++;
+
+    return 0;
+}
\ No newline at end of file
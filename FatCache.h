@@ -0,0 +1,103 @@
+#ifndef _FATCACHE_H_
+#define _FATCACHE_H_
+
+#include "FAT.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define FAT_PAGE_ENTRIES 1024                   /* clusters decoded together */
+#define FAT_CACHE_DEFAULT_BUDGET (4 * 1024 * 1024) /* bytes of decoded pages */
+#define CHAIN_CACHE_DEFAULT_BUDGET (1024 * 1024)   /* bytes of cached runs */
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Create the caches of the mounted volume>
+ *
+ * FAT sectors are decoded one page of FAT_PAGE_ENTRIES clusters at a time,
+ * on first use, and pages are evicted with the CLOCK algorithm once
+ * _pageBudget bytes are used. Chains are kept as runs of contiguous clusters
+ * within _chainBudget bytes.
+ *
+ * @param _pageBudget <memory limit of decoded FAT pages in bytes>.
+ * @param _chainBudget <memory limit of cached chains in bytes>.
+ *
+ * @return <zero on success>.
+ */
+int FatCacheInit(size_t _pageBudget, size_t _chainBudget);
+
+/*!
+ * @brief <Release the caches>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void FatCacheDeInit();
+
+/*!
+ * @brief <Get the next cluster from a decoded page, decode the page on a miss>
+ *
+ * @param _cluster <cluster number>.
+ * @param _next <Pointer to store the FAT entry of _cluster>.
+ *
+ * @return <zero on success, non-zero if the cache is not available>.
+ */
+int FatCacheGetNext(unsigned int _cluster, unsigned int *_next);
+
+/*!
+ * @brief <Get the runs of contiguous clusters of a chain from the chain cache>
+ *
+ * A chain of N runs is walked in O(N) lookups once, then served from memory.
+ *
+ * @param _startCluster <first cluster of the chain>.
+ * @param _extentCount <Pointer to store number of runs>.
+ *
+ * @return <runs, valid until the next call; NULL if the chain is empty>.
+ */
+const Extent *GetChainRuns(unsigned int _startCluster, unsigned int *_extentCount);
+
+/*!
+ * @brief <Record a chain whose clusters are contiguous and not linked in the FAT>
+ *
+ * Used for exFAT files with the NoFatChain flag, GetChainRuns then returns
+ * a single run for _startCluster without reading the FAT. The table takes
+ * at most half of the chain budget, cached chains are evicted to make room;
+ * once full it is cleared and records come back as their directory entries
+ * are decoded again.
+ *
+ * @param _startCluster <first cluster of the chain>.
+ * @param _clusterCount <number of clusters>.
+ *
+ * @return <zero on success>.
+ */
+int FatCacheSetContiguous(unsigned int _startCluster, unsigned int _clusterCount);
+
+/*!
+ * @brief <Drop every cached page and chain>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void FatCacheInvalidate();
+
+/*!
+ * @brief <Follow a change of the FAT entry of a cluster>
+ *
+ * The decoded page holding _cluster is updated if it is cached, cached
+ * chains are dropped since any of them may go through _cluster.
+ *
+ * @param _cluster <cluster number>.
+ * @param _next <new FAT entry of _cluster, decoded like DecodeFATEntries>.
+ *
+ * @return <none>.
+ */
+void FatCacheSetNext(unsigned int _cluster, unsigned int _next);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,255 @@
+#include "FileTable.h"
+#include "HAL.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define FILE_GENERATION_MASK (0x7FFFFFFFU >> FILE_HANDLE_INDEX_BITS) /* handles stay positive */
+#define FILE_FREE_END (-1)
+
+#ifdef _MSC_VER
+#define CACHE_ALIGNED __declspec(align(64))
+#else
+#define CACHE_ALIGNED __attribute__((aligned(64)))
+#endif
+
+/*
+ * One handle, a cache line
+ */
+typedef struct CACHE_ALIGNED _fileSlot
+{
+    File file;                 /* position and cached run of the chain */
+    unsigned int size;         /* bytes of the file */
+    uint32_t generation;       /* odd while open, incremented by open and close */
+    int32_t nextFree;          /* next free slot while closed */
+    unsigned int nextPosition; /* position after the last read, a read there is sequential */
+    unsigned int readaheadEnd; /* position up to which sectors were prefetched */
+    unsigned int window;       /* readahead sectors, 0 after a seek */
+} FileSlot;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static FileSlot *FindSlot(int _handle);
+
+static void Readahead(FileSlot *_slot);
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static FileSlot s_slots[FILE_TABLE_CAPACITY];
+static int32_t s_freeHead = FILE_FREE_END;
+static unsigned int s_openCount = 0;
+static int s_isReady = 0; /* the free list is built on first use */
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/* slot of an open handle, NULL for a closed or stale one */
+static FileSlot *FindSlot(int _handle)
+{
+    const unsigned int index = (unsigned int)_handle & (FILE_TABLE_CAPACITY - 1);
+    FileSlot *slot = NULL;
+
+    if ((_handle >= 0) &&
+        (s_slots[index].generation & 1) &&
+        ((s_slots[index].generation & FILE_GENERATION_MASK) == ((unsigned int)_handle >> FILE_HANDLE_INDEX_BITS)))
+    {
+        slot = &s_slots[index];
+    }
+
+    return slot;
+}
+
+/* grow the window on sequential reads and prefetch ahead of the reader */
+static void Readahead(FileSlot *_slot)
+{
+    const File *file = &_slot->file;
+    const unsigned int bytePerSector = GetBytePerSector();
+
+    if (file->position != _slot->nextPosition)
+    {
+        /* random access, no readahead until reads are sequential again */
+        _slot->window = 0;
+        _slot->readaheadEnd = 0;
+    }
+    else if ((file->currentCluster != EOC) && (file->runEnd > file->currentCluster) &&
+             (file->position + (_slot->window / 2) * bytePerSector >= _slot->readaheadEnd))
+    {
+        /* the reader is in the second half of the window, ask for the next one */
+        const uint64_t runSectors = (uint64_t)(file->runEnd - file->currentCluster) * GetSectorPerCluster() -
+                                    file->currentSector;
+        const unsigned int fileSectors = (_slot->size - file->position + bytePerSector - 1) / bytePerSector;
+        unsigned int count;
+
+        _slot->window = (_slot->window == 0) ? FILE_READAHEAD_MIN : _slot->window * 2;
+        if (_slot->window > FILE_READAHEAD_MAX)
+        {
+            _slot->window = FILE_READAHEAD_MAX;
+        }
+
+        count = _slot->window;
+        count = (count > runSectors) ? (unsigned int)runSectors : count;
+        count = (count > fileSectors) ? fileSectors : count;
+
+        if (count > 0)
+        {
+            PrefetchSectors(ClusterToSector(file->currentCluster) + file->currentSector, count);
+        }
+        _slot->readaheadEnd = file->position - file->currentByte + count * bytePerSector;
+    }
+}
+
+/*!
+ * @brief <Open a file of the mounted volume in the handle table>
+ *
+ * @param entry <Pointer to the directory entry of the file>.
+ *
+ * @return <handle, FILE_HANDLE_INVALID if the table is full>.
+ */
+int OpenHandle(DirectoryEntry *entry)
+{
+    FileSlot *slot;
+    int32_t index;
+
+    if (!s_isReady)
+    {
+        CloseAllHandles();
+    }
+
+    index = s_freeHead;
+    if (index == FILE_FREE_END)
+    {
+        return FILE_HANDLE_INVALID;
+    }
+
+    slot = &s_slots[index];
+    s_freeHead = slot->nextFree;
+    s_openCount++;
+
+    slot->generation++;
+    slot->size = GetSizeofFile(entry);
+    slot->nextPosition = 0;
+    slot->readaheadEnd = 0;
+    slot->window = 0;
+
+    memset(&slot->file, 0, sizeof(File));
+    slot->file.startCluster = GetEntryCluster(entry);
+    slot->file.currentCluster = slot->file.startCluster;
+    Fseek(&slot->file, 0, F_SEEK_SET);
+
+    return (int)(((slot->generation & FILE_GENERATION_MASK) << FILE_HANDLE_INDEX_BITS) | (uint32_t)index);
+}
+
+/*!
+ * @brief <Close a handle, its slot is reused by the next OpenHandle>
+ *
+ * @param _handle <handle returned by OpenHandle>.
+ *
+ * @return <zero on success, non-zero if the handle is not open>.
+ */
+int FileHandleClose(int _handle)
+{
+    FileSlot *slot = FindSlot(_handle);
+
+    if (slot != NULL)
+    {
+        slot->generation++;
+        slot->nextFree = s_freeHead;
+        s_freeHead = (int32_t)(slot - s_slots);
+        s_openCount--;
+    }
+
+    return (slot == NULL);
+}
+
+/*!
+ * @brief <Read from the position of a handle, up to the end of the file>
+ *
+ * @param _handle <handle returned by OpenHandle>.
+ * @param _buffer <Pointer to a block of memory of at least _length bytes>.
+ * @param _length <bytes to read>.
+ *
+ * @return <bytes read, 0 at the end of the file or if the handle is not open>.
+ */
+unsigned int ReadHandle(int _handle, void *_buffer, unsigned int _length)
+{
+    FileSlot *slot = FindSlot(_handle);
+    unsigned int length = 0;
+
+    if ((slot != NULL) && (slot->file.position < slot->size))
+    {
+        length = slot->size - slot->file.position;
+        length = (length > _length) ? _length : length;
+
+        Readahead(slot);
+        Fread(_buffer, 1, length, &slot->file);
+        slot->nextPosition = slot->file.position;
+    }
+
+    return length;
+}
+
+/*!
+ * @brief <Set the position of a handle>
+ *
+ * @param _handle <handle returned by OpenHandle>.
+ * @param _offset <Number of bytes to _offset from _origin>.
+ * @param _origin <F_SEEK_SET or F_SEEK_CUR>.
+ *
+ * @return <zero on success, non-zero if the handle is not open>.
+ */
+int SeekHandle(int _handle, unsigned int _offset, int _origin)
+{
+    FileSlot *slot = FindSlot(_handle);
+
+    if (slot != NULL)
+    {
+        Fseek(&slot->file, _offset, _origin);
+    }
+
+    return (slot == NULL);
+}
+
+/*!
+ * @brief <Close every handle, called when a volume is mounted or unmounted>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void CloseAllHandles()
+{
+    int32_t i;
+
+    /* rebuilt in index order, low slots are used first */
+    s_freeHead = FILE_FREE_END;
+    for (i = FILE_TABLE_CAPACITY - 1; i >= 0; i--)
+    {
+        if (s_slots[i].generation & 1)
+        {
+            s_slots[i].generation++;
+        }
+        s_slots[i].nextFree = s_freeHead;
+        s_freeHead = i;
+    }
+
+    s_openCount = 0;
+    s_isReady = 1;
+}
+
+/*!
+ * @brief <Get the number of open handles>
+ *
+ * @param <none>.
+ *
+ * @return <number of open handles>.
+ */
+unsigned int GetOpenHandleCount()
+{
+    return s_openCount;
+}
@@ -0,0 +1,89 @@
+#ifndef _FILETABLE_H_
+#define _FILETABLE_H_
+
+#include "FAT.h"
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define FILE_HANDLE_INDEX_BITS 12
+#define FILE_TABLE_CAPACITY (1 << FILE_HANDLE_INDEX_BITS) /* open handles at most */
+#define FILE_HANDLE_INVALID (-1)
+
+#define FILE_READAHEAD_MIN 8   /* sectors of the first readahead window */
+#define FILE_READAHEAD_MAX 256 /* sectors of the largest readahead window */
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Open a file of the mounted volume in the handle table>
+ *
+ * The table is a fixed array of FILE_TABLE_CAPACITY cache line sized slots
+ * reused through a free list, nothing is allocated. A handle holds the slot
+ * index and its generation, which changes on every close, so a handle used
+ * after FileHandleClose (or after the volume is mounted again) is refused.
+ * The File of a slot never leaves the table, every access goes through the
+ * handle and its generation check.
+ *
+ * @param entry <Pointer to the directory entry of the file>.
+ *
+ * @return <handle, FILE_HANDLE_INVALID if the table is full>.
+ */
+int OpenHandle(DirectoryEntry *entry);
+
+/*!
+ * @brief <Close a handle, its slot is reused by the next OpenHandle>
+ *
+ * @param _handle <handle returned by OpenHandle>.
+ *
+ * @return <zero on success, non-zero if the handle is not open>.
+ */
+int FileHandleClose(int _handle);
+
+/*!
+ * @brief <Read from the position of a handle, up to the end of the file>
+ *
+ * Sequential reads grow a readahead window from FILE_READAHEAD_MIN to
+ * FILE_READAHEAD_MAX sectors within the current run of clusters, announced
+ * to the system with PrefetchSectors; a seek drops it.
+ *
+ * @param _handle <handle returned by OpenHandle>.
+ * @param _buffer <Pointer to a block of memory of at least _length bytes>.
+ * @param _length <bytes to read>.
+ *
+ * @return <bytes read, 0 at the end of the file or if the handle is not open>.
+ */
+unsigned int ReadHandle(int _handle, void *_buffer, unsigned int _length);
+
+/*!
+ * @brief <Set the position of a handle>
+ *
+ * @param _handle <handle returned by OpenHandle>.
+ * @param _offset <Number of bytes to _offset from _origin>.
+ * @param _origin <F_SEEK_SET or F_SEEK_CUR>.
+ *
+ * @return <zero on success, non-zero if the handle is not open>.
+ */
+int SeekHandle(int _handle, unsigned int _offset, int _origin);
+
+/*!
+ * @brief <Close every handle, called when a volume is mounted or unmounted>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void CloseAllHandles();
+
+/*!
+ * @brief <Get the number of open handles>
+ *
+ * @param <none>.
+ *
+ * @return <number of open handles>.
+ */
+unsigned int GetOpenHandleCount();
+
+#endif
\ No newline at end of file
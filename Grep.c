@@ -0,0 +1,468 @@
+#include "Grep.h"
+#include "FAT.h"
+#include "HAL.h"
+#include "Workers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <regex.h>
+#endif
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#if defined(REG_STARTEND)
+#define GREP_HAS_REGEX /* regexec can search binary data with embedded zeros */
+#endif
+
+#define GREP_REGEX_WINDOW 4096 /* longest unfinished line kept between chunks */
+#define GREP_MIN_BYTES_PER_THREAD (16 * 1024 * 1024) /* less data is not worth a thread */
+
+/*
+ * File to search
+ */
+typedef struct
+{
+    char *path;
+    unsigned int startCluster;
+    unsigned int size;
+    Extent *extents; /* runs of the file, collected before the workers start */
+    unsigned int extentCount;
+} GrepFile;
+
+/*
+ * Growable array of GrepFile
+ */
+typedef struct
+{
+    GrepFile *items;
+    unsigned int count;
+    unsigned int capacity;
+} GrepFileList;
+
+/*
+ * Match found by a thread, printed once every thread is done
+ */
+typedef struct
+{
+    unsigned int file; /* index in the GrepFileList */
+    unsigned int offset;
+} GrepMatch;
+
+/*
+ * State of the search of one thread
+ */
+typedef struct
+{
+    const uint8_t *pattern;
+    size_t patternLength;
+    int kind;
+#ifdef GREP_HAS_REGEX
+    const regex_t *regex;      /* compiled once, regexec is thread safe */
+#endif
+    uint8_t *window;           /* end of the previous chunk followed by the current one */
+    size_t windowLength;
+    size_t windowCapacity;
+    unsigned int windowOffset; /* file offset of window[0] */
+    unsigned int nextOffset;   /* matches starting before were already reported */
+    unsigned int file;         /* file being searched */
+    GrepMatch *matches;
+    unsigned int matchCount;
+    unsigned int matchCapacity;
+    int isFailed;              /* out of memory */
+} GrepContext;
+
+/*
+ * Share of the files of one thread
+ */
+typedef struct
+{
+    GrepContext grep;
+    const GrepFile *files;
+    unsigned int begin;
+    unsigned int end;
+} GrepWorker;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static int CollectFile(DirectoryEntry *entry, const char *path, void *context);
+
+static int CompareByCluster(const void *_a, const void *_b);
+
+static const uint8_t *FindLiteral(const uint8_t *_data, size_t _length, const uint8_t *_pattern, size_t _patternLength);
+
+static void ReportMatch(GrepContext *_grep, size_t _windowPosition);
+
+static size_t SearchWindow(GrepContext *_grep);
+
+static int GrepChunk(const uint8_t *data, unsigned int length, unsigned int fileOffset, void *context);
+
+static int GrepFiles(void *_worker, int _isInline);
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/* WalkTree visitor, remember every regular file */
+static int CollectFile(DirectoryEntry *entry, const char *path, void *context)
+{
+    GrepFileList *list = (GrepFileList *)context;
+
+    if (entry->attributes & ENTRY_DIRECTORY)
+    {
+        return 0;
+    }
+
+    if (list->count == list->capacity)
+    {
+        unsigned int capacity = (list->capacity == 0) ? 64 : list->capacity * 2;
+        GrepFile *items = (GrepFile *)realloc(list->items, capacity * sizeof(GrepFile));
+
+        if (items == NULL)
+        {
+            return 1;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    list->items[list->count].path = (char *)malloc(strlen(path) + 1);
+    if (list->items[list->count].path == NULL)
+    {
+        return 1;
+    }
+    strcpy(list->items[list->count].path, path);
+    list->items[list->count].startCluster = GetEntryCluster(entry);
+    list->items[list->count].size = GetSizeofFile(entry);
+    list->items[list->count].extents = NULL;
+    list->items[list->count].extentCount = 0;
+    list->count++;
+
+    return 0;
+}
+
+static int CompareByCluster(const void *_a, const void *_b)
+{
+    const GrepFile *a = (const GrepFile *)_a;
+    const GrepFile *b = (const GrepFile *)_b;
+
+    return (a->startCluster > b->startCluster) - (a->startCluster < b->startCluster);
+}
+
+/* memchr skips to candidates of the first byte, it is vectorized by the C library */
+static const uint8_t *FindLiteral(const uint8_t *_data, size_t _length, const uint8_t *_pattern, size_t _patternLength)
+{
+    const uint8_t *end = _data + _length;
+    const uint8_t *candidate = _data;
+
+    while ((size_t)(end - candidate) >= _patternLength)
+    {
+        candidate = (const uint8_t *)memchr(candidate, _pattern[0], end - candidate - _patternLength + 1);
+        if (candidate == NULL)
+        {
+            break;
+        }
+        if (memcmp(candidate + 1, _pattern + 1, _patternLength - 1) == 0)
+        {
+            return candidate;
+        }
+        candidate++;
+    }
+
+    return NULL;
+}
+
+static void ReportMatch(GrepContext *_grep, size_t _windowPosition)
+{
+    const unsigned int offset = _grep->windowOffset + (unsigned int)_windowPosition;
+
+    /* the kept tail is searched again with the next chunk */
+    if (offset >= _grep->nextOffset)
+    {
+        if (_grep->matchCount == _grep->matchCapacity)
+        {
+            unsigned int capacity = (_grep->matchCapacity == 0) ? 64 : _grep->matchCapacity * 2;
+            GrepMatch *matches = (GrepMatch *)realloc(_grep->matches, capacity * sizeof(GrepMatch));
+
+            if (matches == NULL)
+            {
+                _grep->isFailed = 1;
+                return;
+            }
+            _grep->matches = matches;
+            _grep->matchCapacity = capacity;
+        }
+
+        _grep->matches[_grep->matchCount].file = _grep->file;
+        _grep->matches[_grep->matchCount].offset = offset;
+        _grep->matchCount++;
+        _grep->nextOffset = offset + 1;
+    }
+}
+
+/*!
+ * @brief <Report the matches of the window>
+ *
+ * @param _grep <Pointer to a GrepContext object>.
+ *
+ * @return <number of bytes at the end of the window to keep for the next chunk>.
+ */
+static size_t SearchWindow(GrepContext *_grep)
+{
+    size_t keep = 0;
+
+    if (_grep->kind == GREP_LITERAL)
+    {
+        const uint8_t *match = _grep->window;
+        size_t position = 0;
+
+        while ((match = FindLiteral(_grep->window + position, _grep->windowLength - position,
+                                    _grep->pattern, _grep->patternLength)) != NULL)
+        {
+            position = match - _grep->window;
+            ReportMatch(_grep, position);
+            position++;
+        }
+
+        /* a match across the boundary starts in the last patternLength - 1 bytes */
+        keep = _grep->patternLength - 1;
+    }
+#ifdef GREP_HAS_REGEX
+    else
+    {
+        const uint8_t *lineEnd = NULL;
+        regmatch_t match;
+        size_t position = 0;
+        size_t i;
+
+        /* the last line may continue in the next chunk, it is searched then */
+        for (i = _grep->windowLength; i > 0; i--)
+        {
+            if (_grep->window[i - 1] == '\n')
+            {
+                lineEnd = _grep->window + i;
+                break;
+            }
+        }
+        keep = _grep->windowLength - ((lineEnd != NULL) ? (size_t)(lineEnd - _grep->window) : 0);
+        if (keep > GREP_REGEX_WINDOW)
+        {
+            keep = GREP_REGEX_WINDOW;
+        }
+
+        while (position < _grep->windowLength)
+        {
+            match.rm_so = (regoff_t)position;
+            match.rm_eo = (regoff_t)_grep->windowLength;
+            if (regexec(_grep->regex, (const char *)_grep->window, 1, &match,
+                        REG_STARTEND | ((position > 0) || (_grep->windowOffset > 0) ? REG_NOTBOL : 0)) != 0)
+            {
+                break;
+            }
+
+            ReportMatch(_grep, (size_t)match.rm_so);
+            position = (match.rm_eo > match.rm_so) ? (size_t)match.rm_eo : (size_t)match.rm_so + 1;
+        }
+    }
+#endif
+
+    if (keep > _grep->windowLength)
+    {
+        keep = _grep->windowLength;
+    }
+
+    return keep;
+}
+
+/* StreamFile visitor, the chunk is searched after the tail of the previous one */
+static int GrepChunk(const uint8_t *data, unsigned int length, unsigned int fileOffset, void *context)
+{
+    GrepContext *grep = (GrepContext *)context;
+    size_t keep;
+
+    if (grep->windowLength + length > grep->windowCapacity)
+    {
+        size_t capacity = grep->windowLength + length;
+        uint8_t *window = (uint8_t *)realloc(grep->window, capacity);
+
+        if (window == NULL)
+        {
+            return 1;
+        }
+        grep->window = window;
+        grep->windowCapacity = capacity;
+    }
+
+    memcpy(grep->window + grep->windowLength, data, length);
+    grep->windowLength += length;
+
+    keep = SearchWindow(grep);
+
+    memmove(grep->window, grep->window + grep->windowLength - keep, keep);
+    grep->windowOffset = fileOffset + length - (unsigned int)keep;
+    grep->windowLength = keep;
+
+    return 0;
+}
+
+/*!
+ * @brief <Search the files of a share, body of RunWorkers>
+ *
+ * A thread reads through its own handle of the image; the files of an
+ * inline share go through the HAL, like any other read of the volume.
+ *
+ * @param _worker <Pointer to a GrepWorker object>.
+ * @param _isInline <non-zero on the calling thread>.
+ *
+ * @return <non-zero if the image can not be opened by the thread>.
+ */
+static int GrepFiles(void *_worker, int _isInline)
+{
+    GrepWorker *worker = (GrepWorker *)_worker;
+    FILE *reader = NULL;
+    unsigned int i;
+
+    if (!_isInline)
+    {
+        reader = OpenImgReader();
+        if (reader == NULL)
+        {
+            return 1;
+        }
+    }
+
+    for (i = worker->begin; (i < worker->end) && !worker->grep.isFailed; i++)
+    {
+        worker->grep.file = i;
+        worker->grep.windowLength = 0;
+        worker->grep.windowOffset = 0;
+        worker->grep.nextOffset = 0;
+
+        StreamExtents(reader, worker->files[i].extents, worker->files[i].extentCount, worker->files[i].size,
+                      GrepChunk, &worker->grep);
+    }
+
+    if (reader != NULL)
+    {
+        fclose(reader);
+    }
+
+    return 0;
+}
+
+/*!
+ * @brief <Search the content of every file of the mounted image>
+ *
+ * @param _pattern <string to search>.
+ * @param _kind <GREP_LITERAL or GREP_REGEX>.
+ * @param _out <Pointer to a FILE object receiving the matches>.
+ *
+ * @return <number of matches, -1 if the pattern is empty or can not be compiled>.
+ */
+int GrepImage(const char *_pattern, int _kind, FILE *_out)
+{
+    GrepFileList list = {NULL, 0, 0};
+    GrepWorker workers[WORKERS_MAX_THREADS];
+    unsigned int threadCount;
+    uint64_t totalSize = 0;
+    uint64_t doneSize = 0;
+    unsigned int begin = 0;
+    int matchCount = 0;
+    unsigned int t;
+    unsigned int i;
+#ifdef GREP_HAS_REGEX
+    regex_t regex;
+#endif
+
+    if (strlen(_pattern) == 0)
+    {
+        return -1;
+    }
+
+    if (_kind == GREP_REGEX)
+    {
+#ifdef GREP_HAS_REGEX
+        if (regcomp(&regex, _pattern, REG_EXTENDED | REG_NEWLINE) != 0)
+        {
+            return -1;
+        }
+#else
+        return -1;
+#endif
+    }
+
+    WalkTree(0, "", CollectFile, &list);
+
+    /* one forward pass over the image instead of seeking back and forth */
+    qsort(list.items, list.count, sizeof(GrepFile), CompareByCluster);
+
+    /* the FAT is only read here, the workers do not touch the HAL */
+    for (i = 0; i < list.count; i++)
+    {
+        if (list.items[i].size > 0)
+        {
+            list.items[i].extents = GetFileExtents(list.items[i].startCluster, &list.items[i].extentCount);
+        }
+        totalSize += list.items[i].size;
+    }
+
+    threadCount = GetWorkerCount(totalSize, GREP_MIN_BYTES_PER_THREAD);
+
+    /* each thread reads a contiguous part of the image with the same amount of data */
+    for (t = 0; t < threadCount; t++)
+    {
+        const uint64_t target = totalSize * (t + 1) / threadCount;
+
+        memset(&workers[t], 0, sizeof(GrepWorker));
+        workers[t].grep.pattern = (const uint8_t *)_pattern;
+        workers[t].grep.patternLength = strlen(_pattern);
+        workers[t].grep.kind = _kind;
+#ifdef GREP_HAS_REGEX
+        workers[t].grep.regex = &regex;
+#endif
+        workers[t].files = list.items;
+        workers[t].begin = begin;
+        while ((begin < list.count) && ((doneSize < target) || (t + 1 == threadCount)))
+        {
+            doneSize += list.items[begin].size;
+            begin++;
+        }
+        workers[t].end = begin;
+    }
+
+    RunWorkers(workers, sizeof(GrepWorker), threadCount, GrepFiles);
+
+    /* the shares follow each other, so do their matches */
+    for (t = 0; t < threadCount; t++)
+    {
+        for (i = 0; i < workers[t].grep.matchCount; i++)
+        {
+            const GrepMatch *match = &workers[t].grep.matches[i];
+
+            fprintf(_out, "%s:%u\n", list.items[match->file].path, match->offset);
+        }
+        matchCount += (int)workers[t].grep.matchCount;
+        free(workers[t].grep.matches);
+        free(workers[t].grep.window);
+    }
+
+    for (i = 0; i < list.count; i++)
+    {
+        free(list.items[i].path);
+        free(list.items[i].extents);
+    }
+
+#ifdef GREP_HAS_REGEX
+    if (_kind == GREP_REGEX)
+    {
+        regfree(&regex);
+    }
+#endif
+
+    free(list.items);
+    return matchCount;
+}
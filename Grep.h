@@ -0,0 +1,35 @@
+#ifndef _GREP_H_
+#define _GREP_H_
+
+#include <stdio.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define GREP_LITERAL 0 /* pattern is a plain byte string */
+#define GREP_REGEX 1   /* pattern is a POSIX extended regular expression */
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Search the content of every file of the mounted image>
+ *
+ * Files are read in order of their first cluster, so the image is scanned
+ * from start to end, and every match is reported as "<path>:<offset>".
+ * Large images are split in contiguous parts searched by up to
+ * WORKERS_MAX_THREADS threads, each with its own handle of the image; the
+ * matches are printed in the same order as by a single thread.
+ * Matches across chunk and extent boundaries are found. Regular expressions
+ * are matched line by line (REG_NEWLINE), lines are cut every GREP_REGEX_WINDOW bytes.
+ *
+ * @param _pattern <string to search>.
+ * @param _kind <GREP_LITERAL or GREP_REGEX>.
+ * @param _out <Pointer to a FILE object receiving the matches>.
+ *
+ * @return <number of matches, -1 if the pattern is empty or can not be compiled>.
+ */
+int GrepImage(const char *_pattern, int _kind, FILE *_out);
+
+#endif
\ No newline at end of file
@@ -1,24 +1,83 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* copy_file_range */
+#endif
+#ifndef _WIN32
+#define _FILE_OFFSET_BITS 64 /* 64-bit off_t on 32-bit systems */
+#endif
+
 #include "HAL.h"
+#include "Trace.h"
+#include "Stats.h"
+#include "Overlay.h"
+#include "Journal.h"
+#include "SharedCache.h"
+#include "DeviceModel.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#endif
 
 /*******************************************************************************
  * Definitions
  ******************************************************************************/
 #define BYTEPERSEC_OFFSET 0x00B /*sector offset, Bytes per logical sector*/
+#define EXFAT_SECTOR_SHIFT_OFFSET 0x06C /* exFAT, log2 of bytes per sector */
+#define SEND_CHUNK_SIZE (64 * 1024) /* bytes per read/write when sendfile is not available */
+
+#ifdef _WIN32
+#define HAL_FILENO _fileno
+#define HAL_WRITE _write
+#define HAL_CHSIZE(fd, size) _chsize_s(fd, size)
+#define HAL_FSEEK(file, offset) _fseeki64(file, (__int64)(offset), SEEK_SET)
+#else
+#define HAL_FILENO fileno
+#define HAL_WRITE write
+#define HAL_CHSIZE(fd, size) ftruncate(fd, (off_t)(size))
+#define HAL_FSEEK(file, offset) fseeko(file, (off_t)(offset), SEEK_SET)
+#endif
 
 /*******************************************************************************
  * Prototypes
  ******************************************************************************/
+static size_t ReadAt(void *_buffer, uint64_t _offset, size_t _length);
+
+static size_t ReadFileAt(FILE *_file, void *_buffer, uint64_t _offset, size_t _length);
+
+static uint16_t ReadBytePerSector(uint64_t _offset);
+
+static uint64_t ImageIdentity();
+
+static int IsPatched(uint64_t _sectorPosition, uint64_t _count);
+
+static void PatchSectors(void *_sectors, uint64_t _sectorPosition, unsigned int _count);
 
 /*******************************************************************************
  * Variables
  ******************************************************************************/
 FILE *g_img = NULL;
 void *g_tempSector = NULL;
-unsigned int g_tempSectorPos;
+uint64_t g_tempSectorPos;
 uint16_t g_bytePerSector = 0;
+
+static uint64_t s_partitionOffset = 0; /* byte offset of the mounted volume in the image */
+static uint64_t s_partitionSize = 0;   /* bytes of the mounted volume, 0 up to the end of the image */
+static char *s_imgName = NULL;         /* to open the image again for writing */
 /*******************************************************************************
  * Code
  ******************************************************************************/
@@ -30,13 +89,26 @@ uint16_t g_bytePerSector = 0;
  *
  * @return <Pointer to a block of memory>.
  */
-void *GetSector(unsigned int _sectorPosition)
+void *GetSector(uint64_t _sectorPosition)
 {
+    VolumeStats *stats = GetVolumeStats();
+    const uint64_t start = g_statsEnabled ? GetTimeNs() : 0;
+
     if (_sectorPosition != g_tempSectorPos)
     {
         ReadSector(g_tempSector, _sectorPosition);
+        g_tempSectorPos = _sectorPosition;
+        stats->cacheMisses++;
+    }
+    else
+    {
+        stats->cacheHits++;
     }
 
+    if (start != 0)
+    {
+        HistogramAdd(&stats->latency[HAL_GET_SECTOR], GetTimeNs() - start);
+    }
     return g_tempSector;
 }
 
@@ -61,12 +133,177 @@ void OpenImg(const char *fileName)
         exit(1);
     }
 
-    fseek(g_img, BYTEPERSEC_OFFSET, SEEK_SET);
-    fread(&g_bytePerSector, sizeof(g_bytePerSector), 1, g_img);
+    s_imgName = (char *)malloc(strlen(fileName) + 1);
+    if (s_imgName != NULL)
+    {
+        strcpy(s_imgName, fileName);
+    }
+
+    ResetVolumeStats();
+    SetSharedCacheImage(ImageIdentity());
+    SetPartition(0, 0);
+}
+
+/* key of the image file in the shared sector cache, changes when the file is written */
+static uint64_t ImageIdentity()
+{
+    uint64_t identity = 0;
+#ifndef _WIN32
+    struct stat info;
+
+    if (fstat(fileno(g_img), &info) == 0)
+    {
+        const uint64_t fields[5] = {(uint64_t)info.st_dev, (uint64_t)info.st_ino, (uint64_t)info.st_size,
+                                    (uint64_t)info.st_mtime, (uint64_t)info.st_ctime};
+        const uint8_t *bytes = (const uint8_t *)fields;
+        size_t i;
+
+        /* FNV-1a, never 0 which bypasses the cache */
+        identity = 14695981039346656037ULL;
+        for (i = 0; i < sizeof(fields); i++)
+        {
+            identity = (identity ^ bytes[i]) * 1099511628211ULL;
+        }
+        identity |= 1;
+    }
+#endif
+
+    return identity;
+}
+
+/* bytes per sector of the boot sector at _offset */
+static uint16_t ReadBytePerSector(uint64_t _offset)
+{
+    uint16_t bytePerSector = 0;
+
+    ReadAt(&bytePerSector, _offset + BYTEPERSEC_OFFSET, sizeof(bytePerSector));
+
+    /* exFAT has no BIOS Param, only the power of two of the sector size */
+    if (bytePerSector == 0)
+    {
+        uint8_t shift = 0;
+
+        ReadAt(&shift, _offset + EXFAT_SECTOR_SHIFT_OFFSET, sizeof(shift));
+        bytePerSector = (uint16_t)(1U << ((shift >= 9) && (shift <= 12) ? shift : 9));
+    }
+
+    return bytePerSector;
+}
+
+/*!
+ * @brief <Mount the volume starting at a byte offset of the opened image>
+ *
+ * @param _offset <byte offset of the boot sector, 0 for a volume without partition table>.
+ * @param _size <bytes of the volume, 0 up to the end of the image>.
+ *
+ * @return <zero on success, non-zero if an overlay or a journal is attached or out of memory>.
+ */
+int SetPartition(uint64_t _offset, uint64_t _size)
+{
+    const uint16_t bytePerSector = ReadBytePerSector(_offset);
+    void *sector = NULL;
+    int isFailed = IsOverlayOpen() || IsJournalOpen();
+
+    if (!isFailed)
+    {
+        sector = malloc(bytePerSector);
+        isFailed = (sector == NULL);
+    }
+
+    if (!isFailed)
+    {
+        free(g_tempSector);
+        s_partitionOffset = _offset;
+        s_partitionSize = _size;
+        g_bytePerSector = bytePerSector;
+
+        /* the handle of the image stays open, only the cached sector changes */
+        g_tempSector = sector;
+        ReadSector(g_tempSector, 0);
+        g_tempSectorPos = 0;
+    }
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Get the byte offset of the mounted volume in the image>
+ *
+ * @param <none>.
+ *
+ * @return <byte offset, 0 when the image is a volume of its own>.
+ */
+uint64_t GetPartitionOffset()
+{
+    return s_partitionOffset;
+}
+
+/*!
+ * @brief <Read bytes of the opened image, whatever the mounted partition>
+ *
+ * @param _buffer <Pointer to a block of memory of at least _length bytes>.
+ * @param _offset <byte offset from the start of the image>.
+ * @param _length <number of bytes>.
+ *
+ * @return <number of bytes read, the rest of _buffer is zero filled>.
+ */
+size_t ReadImg(void *_buffer, uint64_t _offset, size_t _length)
+{
+    size_t done = ReadAt(_buffer, _offset, _length);
+
+    GetVolumeStats()->seekCount++;
+    GetVolumeStats()->bytesRead += done;
+    return done;
+}
+
+/*!
+ * @brief <Open another read-only handle of the image for a worker thread>
+ *
+ * @param <none>.
+ *
+ * @return <Pointer to a FILE object to close with fclose, NULL if not available>.
+ */
+FILE *OpenImgReader()
+{
+    FILE *reader = NULL;
+
+    if ((s_imgName != NULL) && !IsOverlayOpen() && !IsJournalOpen())
+    {
+        fopen_s(&reader, s_imgName, "rb");
+    }
+
+    return reader;
+}
+
+/*!
+ * @brief <Read bytes of the image through a handle of OpenImgReader>
+ *
+ * @param _reader <Pointer to a FILE object returned by OpenImgReader>.
+ * @param _buffer <Pointer to a block of memory of at least _length bytes>.
+ * @param _offset <byte offset from the start of the image>.
+ * @param _length <number of bytes>.
+ *
+ * @return <number of bytes read, the rest of _buffer is zero filled>.
+ */
+size_t ReadImgFrom(FILE *_reader, void *_buffer, uint64_t _offset, size_t _length)
+{
+    return ReadFileAt(_reader, _buffer, _offset, _length);
+}
 
-    g_tempSector = (void *)malloc(g_bytePerSector);
-    ReadSector(g_tempSector, 0);
-    g_tempSectorPos = 0;
+/*!
+ * @brief <Read sectors of the mounted volume through a handle of OpenImgReader>
+ *
+ * @param _reader <Pointer to a FILE object returned by OpenImgReader>.
+ * @param _sector <Pointer to a block of memory of at least (_count * bytePerSector) bytes>.
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors>.
+ *
+ * @return <none>.
+ */
+void ReadSectorsFrom(FILE *_reader, void *_sector, uint64_t _sectorPosition, unsigned int _count)
+{
+    ReadFileAt(_reader, _sector, s_partitionOffset + (uint64_t)g_bytePerSector * _sectorPosition,
+               (size_t)_count * g_bytePerSector);
 }
 
 /*!
@@ -78,9 +315,18 @@ void OpenImg(const char *fileName)
  */
 void CloseImg()
 {
+    /* the last batches are written back before the overlay is closed */
+    CloseJournal();
+    CloseOverlay();
     free(g_tempSector);
+    free(s_imgName);
     fclose(g_img);
     g_img = NULL;
+    s_imgName = NULL;
+    g_tempSector = NULL;
+    s_partitionOffset = 0;
+    s_partitionSize = 0;
+    SetSharedCacheImage(0);
 }
 
 /*!
@@ -91,12 +337,38 @@ void CloseImg()
  *
  * @return <none>.
  */
-void ReadSector(void *_sector, unsigned int _sectorPosition)
+void ReadSector(void *_sector, uint64_t _sectorPosition)
 {
-    long offset;
-    offset = g_bytePerSector * _sectorPosition;
-    fseek(g_img, offset, SEEK_SET);
-    fread(_sector, 1, g_bytePerSector, g_img);
+    VolumeStats *stats = GetVolumeStats();
+    const uint64_t start = g_statsEnabled ? GetTimeNs() : 0;
+    TRACE_BEGIN();
+
+    /* written sectors come from the journal until they are checkpointed, then from the overlay */
+    if (!ReadJournalSector(_sector, _sectorPosition) && !ReadOverlaySector(_sector, _sectorPosition))
+    {
+        const uint64_t offset = s_partitionOffset + (uint64_t)g_bytePerSector * _sectorPosition;
+
+        /* another process may have read it already */
+        if (ReadSharedSector(_sector, offset, g_bytePerSector))
+        {
+            stats->sharedSectorsRead++;
+        }
+        else
+        {
+            ReadAt(_sector, offset, g_bytePerSector);
+            StoreSharedSector(_sector, offset, g_bytePerSector);
+
+            stats->seekCount++;
+            stats->sectorsRead++;
+            stats->bytesRead += g_bytePerSector;
+        }
+    }
+    if (start != 0)
+    {
+        HistogramAdd(&stats->latency[HAL_READ_SECTOR], GetTimeNs() - start);
+    }
+
+    TRACE_END(TRACE_CAT_HAL, "ReadSector");
 }
 
 /*!
@@ -108,10 +380,563 @@ void ReadSector(void *_sector, unsigned int _sectorPosition)
  *
  * @return <none>.
  */
-void ReadNSectors(void *_sector, unsigned int _sectorPosition, unsigned int _count)
+void ReadNSectors(void *_sector, uint64_t _sectorPosition, unsigned int _count)
 {
-    long offset;
-    offset = g_bytePerSector * _sectorPosition;
-    fseek(g_img, offset, SEEK_SET);
-    fread(_sector, 1, g_bytePerSector * _count, g_img);
+    VolumeStats *stats = GetVolumeStats();
+    const uint64_t start = g_statsEnabled ? GetTimeNs() : 0;
+    const uint64_t offset = s_partitionOffset + (uint64_t)g_bytePerSector * _sectorPosition;
+    const int isShared = (_count <= SHARED_CACHE_MAX_RUN);
+    unsigned int shared = 0;
+    unsigned int i;
+    TRACE_BEGIN();
+
+    /* short runs (FAT pages, directories) go through the shared cache, bulk data does not */
+    while (isShared && (shared < _count) &&
+           ReadSharedSector((uint8_t *)_sector + (size_t)g_bytePerSector * shared,
+                            offset + (uint64_t)g_bytePerSector * shared, g_bytePerSector))
+    {
+        shared++;
+    }
+
+    if (shared < _count)
+    {
+        ReadAt((uint8_t *)_sector + (size_t)g_bytePerSector * shared, offset + (uint64_t)g_bytePerSector * shared,
+               (size_t)g_bytePerSector * (_count - shared));
+
+        for (i = shared; isShared && (i < _count); i++)
+        {
+            StoreSharedSector((uint8_t *)_sector + (size_t)g_bytePerSector * i, offset + (uint64_t)g_bytePerSector * i,
+                              g_bytePerSector);
+        }
+
+        stats->seekCount++;
+        stats->sectorsRead += _count - shared;
+        stats->bytesRead += (uint64_t)g_bytePerSector * (_count - shared);
+    }
+    stats->sharedSectorsRead += shared;
+    PatchSectors(_sector, _sectorPosition, _count);
+    if (start != 0)
+    {
+        HistogramAdd(&stats->latency[HAL_READ_N_SECTORS], GetTimeNs() - start);
+    }
+
+    TRACE_END(TRACE_CAT_HAL, "ReadNSectors");
+}
+
+/*!
+ * @brief <Write 1 sector to the journal, or to the copy-on-write overlay without one>
+ *
+ * @param _sector <Pointer to a block of memory of bytePerSector bytes>.
+ * @param _sectorPosition <sector position>.
+ *
+ * @return <zero on success, non-zero if neither a journal nor an overlay is attached>.
+ */
+int WriteSector(const void *_sector, uint64_t _sectorPosition)
+{
+    int isFailed = IsJournalOpen() ? WriteJournalSector(_sector, _sectorPosition)
+                                   : WriteOverlaySector(_sector, _sectorPosition);
+
+    /* keep the GetSector copy in step */
+    if (!isFailed && (_sectorPosition == g_tempSectorPos))
+    {
+        memcpy(g_tempSector, _sector, g_bytePerSector);
+    }
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Send every later write to a delta file, the image stays read-only>
+ *
+ * @param _deltaName <Name of the delta file, created if it does not exist>.
+ *
+ * @return <zero on success>.
+ */
+int AttachOverlay(const char *_deltaName)
+{
+    int isFailed = OpenOverlay(_deltaName, g_bytePerSector);
+
+    /* the cached sector may have been written in the overlay */
+    if (!isFailed)
+    {
+        ReadSector(g_tempSector, g_tempSectorPos);
+    }
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Log every later write in a write-ahead journal>
+ *
+ * @param _journalName <Name of the journal file, created if it does not exist>.
+ *
+ * @return <zero on success>.
+ */
+int AttachJournal(const char *_journalName)
+{
+    int isFailed = 0;
+
+    /* without an overlay the checkpoint writes to the image itself */
+    if (!IsOverlayOpen())
+    {
+        FILE *img = NULL;
+
+        if (s_imgName != NULL)
+        {
+            fopen_s(&img, s_imgName, "r+b");
+        }
+        isFailed = (img == NULL);
+
+        if (!isFailed)
+        {
+            fclose(g_img);
+            g_img = img;
+            /* other processes can not tell a written image from the one they cached */
+            SetSharedCacheImage(0);
+        }
+    }
+
+    /* a journal left by a crash is replayed here */
+    isFailed = isFailed || (OpenJournal(_journalName, g_bytePerSector, s_partitionOffset) != 0);
+
+    if (!isFailed)
+    {
+        ReadSector(g_tempSector, g_tempSectorPos);
+    }
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Make the writes so far durable>
+ *
+ * @param <none>.
+ *
+ * @return <zero on success>.
+ */
+int CommitWrites()
+{
+    return IsJournalOpen() ? CommitJournal() : 0;
+}
+
+/*!
+ * @brief <Write 1 sector where the journal checkpoint puts it: the overlay, or the image>
+ *
+ * @param _sector <Pointer to a block of memory of bytePerSector bytes>.
+ * @param _sectorPosition <sector position>.
+ *
+ * @return <zero on success>.
+ */
+int StoreSector(const void *_sector, uint64_t _sectorPosition)
+{
+    int isFailed;
+
+    if (IsOverlayOpen())
+    {
+        isFailed = WriteOverlaySector(_sector, _sectorPosition);
+    }
+    else
+    {
+        isFailed = (HAL_FSEEK(g_img, s_partitionOffset + (uint64_t)g_bytePerSector * _sectorPosition) != 0) ||
+                   (fwrite(_sector, 1, g_bytePerSector, g_img) != g_bytePerSector);
+    }
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Flush the sectors written by StoreSector to the disk>
+ *
+ * @param <none>.
+ *
+ * @return <zero on success>.
+ */
+int SyncStore()
+{
+    return IsOverlayOpen() ? SyncOverlay() : ((fflush(g_img) != 0) || (SyncFile(g_img) != 0));
+}
+
+/*!
+ * @brief <Copy bytes of the image, starting at a sector, to an output stream>
+ *
+ * @param _out <Pointer to a FILE object, flushed before the copy>.
+ * @param _sectorPosition <sector position of the first byte>.
+ * @param _byteCount <number of bytes to copy>.
+ *
+ * @return <number of bytes copied>.
+ */
+unsigned int SendSectors(FILE *_out, uint64_t _sectorPosition, unsigned int _byteCount)
+{
+    VolumeStats *stats = GetVolumeStats();
+    const uint64_t start = g_statsEnabled ? GetTimeNs() : 0;
+    const uint64_t offset = s_partitionOffset + (uint64_t)g_bytePerSector * _sectorPosition;
+    const int outFd = HAL_FILENO(_out);
+    const int isPatched = IsPatched(_sectorPosition, (_byteCount + g_bytePerSector - 1) / g_bytePerSector);
+    unsigned int sent = 0;
+    TRACE_BEGIN();
+
+    fflush(_out);
+
+#ifdef __linux__
+    if (!isPatched)
+    {
+        off_t inOffset = (off_t)offset;
+
+        while (sent < _byteCount)
+        {
+            ssize_t n = sendfile(outFd, HAL_FILENO(g_img), &inOffset, _byteCount - sent);
+            if (n <= 0)
+            {
+                break;
+            }
+            sent += (unsigned int)n;
+        }
+    }
+#endif
+
+    /* no sendfile, or it refused this pair of files */
+    if (sent < _byteCount)
+    {
+        char *buffer = (char *)malloc(SEND_CHUNK_SIZE);
+
+        HAL_FSEEK(g_img, offset + sent);
+        stats->seekCount++;
+
+        while ((buffer != NULL) && (sent < _byteCount))
+        {
+            unsigned int length = _byteCount - sent;
+            unsigned int written = 0;
+
+            if (length > SEND_CHUNK_SIZE)
+            {
+                length = SEND_CHUNK_SIZE;
+            }
+
+            length = (unsigned int)fread(buffer, 1, length, g_img);
+            if (isPatched)
+            {
+                /* chunks are whole sectors, sent is a multiple of the chunk size */
+                PatchSectors(buffer, _sectorPosition + sent / g_bytePerSector,
+                             (length + g_bytePerSector - 1) / g_bytePerSector);
+            }
+            while (written < length)
+            {
+                int n = HAL_WRITE(outFd, buffer + written, length - written);
+                if (n <= 0)
+                {
+                    break;
+                }
+                written += (unsigned int)n;
+            }
+
+            sent += written;
+            if ((length == 0) || (written < length))
+            {
+                break;
+            }
+        }
+
+        free(buffer);
+    }
+
+    SimulateRead(offset, sent);
+    stats->sectorsRead += (sent + g_bytePerSector - 1) / g_bytePerSector;
+    stats->bytesRead += sent;
+    if (start != 0)
+    {
+        HistogramAdd(&stats->latency[HAL_SEND_SECTORS], GetTimeNs() - start);
+    }
+
+    TRACE_END(TRACE_CAT_HAL, "SendSectors");
+    return sent;
+}
+
+/*!
+ * @brief <Copy sectors of the image to the same position of another image file>
+ *
+ * @param _out <Pointer to a FILE object opened for writing, flushed before the copy>.
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors to copy>.
+ *
+ * @return <number of sectors copied>.
+ */
+uint64_t CloneSectors(FILE *_out, uint64_t _sectorPosition, uint64_t _count)
+{
+    VolumeStats *stats = GetVolumeStats();
+    const uint64_t start = g_statsEnabled ? GetTimeNs() : 0;
+    const uint64_t offset = (uint64_t)g_bytePerSector * _sectorPosition; /* in the volume and in _out */
+    const uint64_t byteCount = (uint64_t)g_bytePerSector * _count;
+    const int isPatched = IsPatched(_sectorPosition, _count);
+    uint64_t copied = 0;
+    TRACE_BEGIN();
+
+    fflush(_out);
+
+#ifdef __linux__
+    if (!isPatched)
+    {
+        /* stays in the kernel, may share extents on reflink file systems */
+        loff_t inOffset = (loff_t)(s_partitionOffset + offset);
+        loff_t outOffset = (loff_t)offset;
+
+        while (copied < byteCount)
+        {
+            ssize_t n = copy_file_range(HAL_FILENO(g_img), &inOffset, HAL_FILENO(_out), &outOffset,
+                                        (size_t)(byteCount - copied), 0);
+            if (n <= 0)
+            {
+                break;
+            }
+            copied += (uint64_t)n;
+        }
+    }
+#endif
+
+    /* no copy_file_range, or it refused this pair of files */
+    if (copied < byteCount)
+    {
+        char *buffer = (char *)malloc(SEND_CHUNK_SIZE);
+
+        HAL_FSEEK(g_img, s_partitionOffset + offset + copied);
+        HAL_FSEEK(_out, offset + copied);
+        stats->seekCount++;
+
+        while ((buffer != NULL) && (copied < byteCount))
+        {
+            size_t length = SEND_CHUNK_SIZE;
+
+            if (length > byteCount - copied)
+            {
+                length = (size_t)(byteCount - copied);
+            }
+
+            length = fread(buffer, 1, length, g_img);
+            if (isPatched)
+            {
+                PatchSectors(buffer, _sectorPosition + copied / g_bytePerSector,
+                             (unsigned int)(length / g_bytePerSector));
+            }
+            if ((length == 0) || (fwrite(buffer, 1, length, _out) != length))
+            {
+                break;
+            }
+            copied += length;
+        }
+
+        fflush(_out);
+        free(buffer);
+    }
+
+    SimulateRead(s_partitionOffset + offset, copied);
+    stats->sectorsRead += copied / g_bytePerSector;
+    stats->bytesRead += copied;
+    if (start != 0)
+    {
+        HistogramAdd(&stats->latency[HAL_CLONE_SECTORS], GetTimeNs() - start);
+    }
+
+    TRACE_END(TRACE_CAT_HAL, "CloneSectors");
+    return copied / g_bytePerSector;
+}
+
+/*!
+ * @brief <Tell the system that sectors of the image will be read soon>
+ *
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors>.
+ *
+ * @return <none>.
+ */
+void PrefetchSectors(uint64_t _sectorPosition, unsigned int _count)
+{
+#ifdef __linux__
+    /* the page cache reads them in the background */
+    posix_fadvise(HAL_FILENO(g_img), (off_t)(s_partitionOffset + (uint64_t)g_bytePerSector * _sectorPosition),
+                  (off_t)g_bytePerSector * _count, POSIX_FADV_WILLNEED);
+#endif
+    GetVolumeStats()->sectorsPrefetched += _count;
+}
+
+/*!
+ * @brief <Get the file descriptor of the image and the byte offset of a range of sectors>
+ *
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors>.
+ * @param _offset <Pointer to store the byte offset of the first sector in the image file>.
+ *
+ * @return <file descriptor, -1 if no image is open or the overlay or journal has a copy of one of the sectors>.
+ */
+int GetImgRange(uint64_t _sectorPosition, uint64_t _count, uint64_t *_offset)
+{
+    int fd = -1;
+
+    if ((g_img != NULL) && !IsPatched(_sectorPosition, _count))
+    {
+        *_offset = s_partitionOffset + (uint64_t)g_bytePerSector * _sectorPosition;
+        fd = HAL_FILENO(g_img);
+    }
+
+    return fd;
+}
+
+/*!
+ * @brief <Set the size of a file, unwritten space becomes a hole where supported>
+ *
+ * @param _file <Pointer to a FILE object opened for writing>.
+ * @param _size <new size in bytes>.
+ *
+ * @return <zero on success>.
+ */
+int SetFileSize(FILE *_file, uint64_t _size)
+{
+    fflush(_file);
+    return (HAL_CHSIZE(HAL_FILENO(_file), _size) == 0) ? 0 : 1;
+}
+
+/*!
+ * @brief <Flush the data of a file to the disk>
+ *
+ * @param _file <Pointer to a FILE object, flushed by the caller>.
+ *
+ * @return <zero on success>.
+ */
+int SyncFile(FILE *_file)
+{
+#ifdef _WIN32
+    return (_commit(HAL_FILENO(_file)) == 0) ? 0 : 1;
+#else
+    return (fsync(HAL_FILENO(_file)) == 0) ? 0 : 1;
+#endif
+}
+
+/*!
+ * @brief <Set the position of a file, 64-bit offsets on every platform>
+ *
+ * @param _file <Pointer to a FILE object>.
+ * @param _offset <offset from the beginning of the file in bytes>.
+ *
+ * @return <zero on success>.
+ */
+int SeekFile(FILE *_file, uint64_t _offset)
+{
+    return (HAL_FSEEK(_file, _offset) == 0) ? 0 : 1;
+}
+
+/* some sector of the range has a newer copy than the image */
+static int IsPatched(uint64_t _sectorPosition, uint64_t _count)
+{
+    return OverlayIntersects(_sectorPosition, _count) || JournalIntersects(_sectorPosition, _count);
+}
+
+/* replace sectors read from the image by their newer copy, the journal one is the newest */
+static void PatchSectors(void *_sectors, uint64_t _sectorPosition, unsigned int _count)
+{
+    PatchOverlaySectors(_sectors, _sectorPosition, _count);
+    PatchJournalSectors(_sectors, _sectorPosition, _count);
+}
+
+/* read at a byte offset of the image, through the device model */
+static size_t ReadAt(void *_buffer, uint64_t _offset, size_t _length)
+{
+    /* every read request of the image reaches the device here */
+    SimulateRead(_offset, _length);
+
+    return ReadFileAt(g_img, _buffer, _offset, _length);
+}
+
+/* read at a byte offset of a file, pread does not move a shared file position */
+static size_t ReadFileAt(FILE *_file, void *_buffer, uint64_t _offset, size_t _length)
+{
+    size_t done = 0;
+
+#ifdef _WIN32
+    if (HAL_FSEEK(_file, _offset) == 0)
+    {
+        done = fread(_buffer, 1, _length, _file);
+    }
+#else
+    while (done < _length)
+    {
+        ssize_t n = pread(HAL_FILENO(_file), (char *)_buffer + done, _length - done, (off_t)(_offset + done));
+        if (n <= 0)
+        {
+            break;
+        }
+        done += (size_t)n;
+    }
+#endif
+
+    /* past the end of the image reads as zeros */
+    if (done < _length)
+    {
+        memset((char *)_buffer + done, 0, _length - done);
+    }
+
+    return done;
+}
+
+/*!
+ * @brief <Get size and last modification time of the opened image>
+ *
+ * @param _size <Pointer to store the size in bytes, of the mounted partition only>.
+ * @param _mtime <Pointer to store the modification time in seconds since 1970>.
+ *
+ * @return <zero on success>.
+ */
+int GetImgInfo(uint64_t *_size, uint64_t *_mtime)
+{
+#ifdef _WIN32
+    struct _stat64 info;
+
+    if ((g_img == NULL) || (_fstat64(_fileno(g_img), &info) != 0))
+    {
+        return 1;
+    }
+#else
+    struct stat info;
+
+    if ((g_img == NULL) || (fstat(fileno(g_img), &info) != 0))
+    {
+        return 1;
+    }
+#endif
+
+    /* a partition looks like an image of its own */
+    *_size = ((uint64_t)info.st_size > s_partitionOffset) ? (uint64_t)info.st_size - s_partitionOffset : 0;
+    if ((s_partitionSize != 0) && (*_size > s_partitionSize))
+    {
+        *_size = s_partitionSize;
+    }
+    *_mtime = (uint64_t)info.st_mtime;
+    return 0;
+}
+
+/*!
+ * @brief <Read a monotonic clock>
+ *
+ * @param <none>.
+ *
+ * @return <time in nanoseconds from an arbitrary origin>.
+ */
+uint64_t GetTimeNs()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ULL +
+           (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ULL / frequency.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+#endif
 }
@@ -1,6 +1,9 @@
 #ifndef _HAL_H_
 #define _HAL_H_
 
+#include <stdio.h>
+#include <stdint.h>
+
 /*******************************************************************************
  * Definitions
  ******************************************************************************/
@@ -16,7 +19,7 @@
  *
  * @return <Pointer to a block of memory>.
  */
-void *GetSector(unsigned int _sectorPosition);
+void *GetSector(uint64_t _sectorPosition);
 
 /*!
  * @brief <Read 1 sector and store them in the block of memory specified by _sector>
@@ -26,7 +29,7 @@ void *GetSector(unsigned int _sectorPosition);
  *
  * @return <none>.
  */
-void ReadSector(void *_sector, unsigned int _sectorPosition);
+void ReadSector(void *_sector, uint64_t _sectorPosition);
 
 /*!
  * @brief <Read _count sector and store them in the block of memory specified by sector>
@@ -37,7 +40,152 @@ void ReadSector(void *_sector, unsigned int _sectorPosition);
  *
  * @return <none>.
  */
-void ReadNSectors(void *_sector, unsigned int _sectorPosition, unsigned int _count);
+void ReadNSectors(void *_sector, uint64_t _sectorPosition, unsigned int _count);
+
+/*!
+ * @brief <Write 1 sector to the journal, or to the copy-on-write overlay without one>
+ *
+ * Sectors are written to the image itself only by the checkpoint of a
+ * journal attached without an overlay.
+ *
+ * @param _sector <Pointer to a block of memory of bytePerSector bytes>.
+ * @param _sectorPosition <sector position>.
+ *
+ * @return <zero on success, non-zero if neither a journal nor an overlay is attached>.
+ */
+int WriteSector(const void *_sector, uint64_t _sectorPosition);
+
+/*!
+ * @brief <Send every later write to a delta file, the image stays read-only>
+ *
+ * Reads of sectors found in the delta file are served from it, the others
+ * from the image. The delta file is closed by CloseImg.
+ *
+ * @param _deltaName <Name of the delta file, created if it does not exist>.
+ *
+ * @return <zero on success>.
+ */
+int AttachOverlay(const char *_deltaName);
+
+/*!
+ * @brief <Log every later write in a write-ahead journal>
+ *
+ * Writes are grouped in batches made durable by CommitWrites, and written
+ * back lazily to the overlay if one is attached, otherwise to the image,
+ * which is opened again for writing. Attach the overlay first. A journal
+ * left by a crash is replayed. The journal is closed by CloseImg.
+ *
+ * @param _journalName <Name of the journal file, created if it does not exist>.
+ *
+ * @return <zero on success>.
+ */
+int AttachJournal(const char *_journalName);
+
+/*!
+ * @brief <Make the writes so far durable>
+ *
+ * One journal commit (one fsync) for every sector written since the last
+ * call; nothing to do without a journal.
+ *
+ * @param <none>.
+ *
+ * @return <zero on success>.
+ */
+int CommitWrites();
+
+/*!
+ * @brief <Write 1 sector where the journal checkpoint puts it: the overlay, or the image>
+ *
+ * @param _sector <Pointer to a block of memory of bytePerSector bytes>.
+ * @param _sectorPosition <sector position>.
+ *
+ * @return <zero on success>.
+ */
+int StoreSector(const void *_sector, uint64_t _sectorPosition);
+
+/*!
+ * @brief <Flush the sectors written by StoreSector to the disk>
+ *
+ * @param <none>.
+ *
+ * @return <zero on success>.
+ */
+int SyncStore();
+
+/*!
+ * @brief <Copy bytes of the image, starting at a sector, to an output stream>
+ *
+ * The data does not go through a user buffer when the platform allows it
+ * (sendfile on Linux), otherwise it is copied with large read/write calls.
+ *
+ * @param _out <Pointer to a FILE object, flushed before the copy>.
+ * @param _sectorPosition <sector position of the first byte>.
+ * @param _byteCount <number of bytes to copy>.
+ *
+ * @return <number of bytes copied>.
+ */
+unsigned int SendSectors(FILE *_out, uint64_t _sectorPosition, unsigned int _byteCount);
+
+/*!
+ * @brief <Copy sectors of the image to the same position of another image file>
+ *
+ * The data stays in the kernel when the platform allows it
+ * (copy_file_range on Linux), otherwise it is copied with large read/write calls.
+ * Positions in _out are relative to the mounted partition, which becomes an image of its own.
+ *
+ * @param _out <Pointer to a FILE object opened for writing, flushed before the copy>.
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors to copy>.
+ *
+ * @return <number of sectors copied>.
+ */
+uint64_t CloneSectors(FILE *_out, uint64_t _sectorPosition, uint64_t _count);
+
+/*!
+ * @brief <Tell the system that sectors of the image will be read soon>
+ *
+ * Only a hint (posix_fadvise on Linux, nothing elsewhere), no data is returned
+ * and the overlay is not looked at.
+ *
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors>.
+ *
+ * @return <none>.
+ */
+void PrefetchSectors(uint64_t _sectorPosition, unsigned int _count);
+
+/*!
+ * @brief <Get the file descriptor of the image and the byte offset of a range of sectors>
+ *
+ * Lets another process read the sectors itself (the descriptor can be passed
+ * over a Unix socket), only while they are not patched by the overlay.
+ *
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors>.
+ * @param _offset <Pointer to store the byte offset of the first sector in the image file>.
+ *
+ * @return <file descriptor, -1 if no image is open or the overlay or journal has a copy of one of the sectors>.
+ */
+int GetImgRange(uint64_t _sectorPosition, uint64_t _count, uint64_t *_offset);
+
+/*!
+ * @brief <Set the size of a file, unwritten space becomes a hole where supported>
+ *
+ * @param _file <Pointer to a FILE object opened for writing>.
+ * @param _size <new size in bytes>.
+ *
+ * @return <zero on success>.
+ */
+int SetFileSize(FILE *_file, uint64_t _size);
+
+/*!
+ * @brief <Flush the data of a file to the disk>
+ *
+ * @param _file <Pointer to a FILE object, flushed by the caller>.
+ *
+ * @return <zero on success>.
+ */
+int SyncFile(FILE *_file);
 
 /*!
  * @brief <open file img whose name is specified in the parameter filename>
@@ -57,4 +205,105 @@ void OpenImg(const char *fileName);
  */
 void CloseImg();
 
+/*!
+ * @brief <Mount the volume starting at a byte offset of the opened image>
+ *
+ * Every sector position given to the HAL is then relative to _offset. The image
+ * is not opened again, several partitions are read through the same handle.
+ *
+ * @param _offset <byte offset of the boot sector, 0 for a volume without partition table>.
+ * @param _size <bytes of the volume, 0 up to the end of the image>.
+ *
+ * @return <zero on success, non-zero if an overlay or a journal is attached or out of memory>.
+ */
+int SetPartition(uint64_t _offset, uint64_t _size);
+
+/*!
+ * @brief <Get the byte offset of the mounted volume in the image>
+ *
+ * @param <none>.
+ *
+ * @return <byte offset, 0 when the image is a volume of its own>.
+ */
+uint64_t GetPartitionOffset();
+
+/*!
+ * @brief <Read bytes of the opened image, whatever the mounted partition>
+ *
+ * The overlay is not applied, used to read partition tables.
+ *
+ * @param _buffer <Pointer to a block of memory of at least _length bytes>.
+ * @param _offset <byte offset from the start of the image>.
+ * @param _length <number of bytes>.
+ *
+ * @return <number of bytes read, the rest of _buffer is zero filled>.
+ */
+size_t ReadImg(void *_buffer, uint64_t _offset, size_t _length);
+
+/*!
+ * @brief <Open another read-only handle of the image for a worker thread>
+ *
+ * The HAL itself is not thread safe: a worker reads through its own handle
+ * with ReadImgFrom / ReadSectorsFrom, without cache, statistics or device
+ * model. No handle is given while an overlay or a journal is attached,
+ * their sectors are only known to the HAL. Outside Windows the reads do not
+ * move the position of the handle, threads may share one.
+ *
+ * @return <Pointer to a FILE object to close with fclose, NULL if not available>.
+ */
+FILE *OpenImgReader();
+
+/*!
+ * @brief <Read bytes of the image through a handle of OpenImgReader>
+ *
+ * @param _reader <Pointer to a FILE object returned by OpenImgReader>.
+ * @param _buffer <Pointer to a block of memory of at least _length bytes>.
+ * @param _offset <byte offset from the start of the image>.
+ * @param _length <number of bytes>.
+ *
+ * @return <number of bytes read, the rest of _buffer is zero filled>.
+ */
+size_t ReadImgFrom(FILE *_reader, void *_buffer, uint64_t _offset, size_t _length);
+
+/*!
+ * @brief <Read sectors of the mounted volume through a handle of OpenImgReader>
+ *
+ * @param _reader <Pointer to a FILE object returned by OpenImgReader>.
+ * @param _sector <Pointer to a block of memory of at least (_count * bytePerSector) bytes>.
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors>.
+ *
+ * @return <none>.
+ */
+void ReadSectorsFrom(FILE *_reader, void *_sector, uint64_t _sectorPosition, unsigned int _count);
+
+/*!
+ * @brief <Set the position of a file, 64-bit offsets on every platform>
+ *
+ * @param _file <Pointer to a FILE object>.
+ * @param _offset <offset from the beginning of the file in bytes>.
+ *
+ * @return <zero on success>.
+ */
+int SeekFile(FILE *_file, uint64_t _offset);
+
+/*!
+ * @brief <Get size and last modification time of the opened image>
+ *
+ * @param _size <Pointer to store the size in bytes, of the mounted partition only>.
+ * @param _mtime <Pointer to store the modification time in seconds since 1970>.
+ *
+ * @return <zero on success>.
+ */
+int GetImgInfo(uint64_t *_size, uint64_t *_mtime);
+
+/*!
+ * @brief <Read a monotonic clock>
+ *
+ * @param <none>.
+ *
+ * @return <time in nanoseconds from an arbitrary origin>.
+ */
+uint64_t GetTimeNs();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,327 @@
+#include "Hash.h"
+#include <string.h>
+#include <stdint.h>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <nmmintrin.h>
+#define HASH_HW_CRC32C 1
+#define HASH_TARGET_SSE42
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define HASH_HW_CRC32C 1
+#define HASH_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define CRC32C_POLY 0x82F63B78 /* reflected Castagnoli polynomial */
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static uint64_t Read64(const uint8_t *_p);
+
+static uint32_t Read32(const uint8_t *_p);
+
+static uint64_t Xxh64Round(uint64_t _acc, uint64_t _input);
+
+static uint64_t Xxh64Merge(uint64_t _hash, uint64_t _acc);
+
+static uint32_t Crc32cSoft(uint32_t _crc, const uint8_t *_data, size_t _length);
+
+#ifdef HASH_HW_CRC32C
+static int HasSse42();
+
+static uint32_t Crc32cHard(uint32_t _crc, const uint8_t *_data, size_t _length);
+#endif
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static uint32_t s_crcTable[256];
+static int s_crcTableReady = 0;
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/* little endian loads, unaligned */
+static uint64_t Read64(const uint8_t *_p)
+{
+    return (uint64_t)Read32(_p) | ((uint64_t)Read32(_p + 4) << 32);
+}
+
+static uint32_t Read32(const uint8_t *_p)
+{
+    return (uint32_t)_p[0] | ((uint32_t)_p[1] << 8) | ((uint32_t)_p[2] << 16) | ((uint32_t)_p[3] << 24);
+}
+
+static uint64_t Xxh64Round(uint64_t _acc, uint64_t _input)
+{
+    _acc += _input * PRIME64_2;
+    _acc = ROTL64(_acc, 31);
+    return _acc * PRIME64_1;
+}
+
+static uint64_t Xxh64Merge(uint64_t _hash, uint64_t _acc)
+{
+    _hash ^= Xxh64Round(0, _acc);
+    return _hash * PRIME64_1 + PRIME64_4;
+}
+
+/*!
+ * @brief <Start a new XXH64 hash>
+ *
+ * @param _state <Pointer to a Xxh64State object>.
+ * @param _seed <seed of the hash, 0 by default>.
+ *
+ * @return <none>.
+ */
+void Xxh64Reset(Xxh64State *_state, uint64_t _seed)
+{
+    memset(_state, 0, sizeof(*_state));
+    _state->seed = _seed;
+    _state->acc[0] = _seed + PRIME64_1 + PRIME64_2;
+    _state->acc[1] = _seed + PRIME64_2;
+    _state->acc[2] = _seed;
+    _state->acc[3] = _seed - PRIME64_1;
+}
+
+/*!
+ * @brief <Add data to a XXH64 hash>
+ *
+ * @param _state <Pointer to a Xxh64State object>.
+ * @param _data <Pointer to the data>.
+ * @param _length <Number of bytes>.
+ *
+ * @return <none>.
+ */
+void Xxh64Update(Xxh64State *_state, const void *_data, size_t _length)
+{
+    const uint8_t *p = (const uint8_t *)_data;
+    const uint8_t *end = p + _length;
+
+    _state->totalLength += _length;
+
+    /* complete the pending stripe first */
+    if (_state->bufferSize > 0)
+    {
+        size_t fill = 32 - _state->bufferSize;
+
+        if (fill > _length)
+        {
+            fill = _length;
+        }
+        memcpy(_state->buffer + _state->bufferSize, p, fill);
+        _state->bufferSize += (unsigned int)fill;
+        p += fill;
+
+        if (_state->bufferSize < 32)
+        {
+            return;
+        }
+
+        _state->acc[0] = Xxh64Round(_state->acc[0], Read64(_state->buffer));
+        _state->acc[1] = Xxh64Round(_state->acc[1], Read64(_state->buffer + 8));
+        _state->acc[2] = Xxh64Round(_state->acc[2], Read64(_state->buffer + 16));
+        _state->acc[3] = Xxh64Round(_state->acc[3], Read64(_state->buffer + 24));
+        _state->bufferSize = 0;
+    }
+
+    while (end - p >= 32)
+    {
+        _state->acc[0] = Xxh64Round(_state->acc[0], Read64(p));
+        _state->acc[1] = Xxh64Round(_state->acc[1], Read64(p + 8));
+        _state->acc[2] = Xxh64Round(_state->acc[2], Read64(p + 16));
+        _state->acc[3] = Xxh64Round(_state->acc[3], Read64(p + 24));
+        p += 32;
+    }
+
+    if (p < end)
+    {
+        memcpy(_state->buffer, p, (size_t)(end - p));
+        _state->bufferSize = (unsigned int)(end - p);
+    }
+}
+
+/*!
+ * @brief <Get the XXH64 hash of all data added since Xxh64Reset>
+ *
+ * @param _state <Pointer to a Xxh64State object>.
+ *
+ * @return <64 bits hash>.
+ */
+uint64_t Xxh64Digest(const Xxh64State *_state)
+{
+    const uint8_t *p = _state->buffer;
+    const uint8_t *end = p + _state->bufferSize;
+    uint64_t hash;
+
+    if (_state->totalLength >= 32)
+    {
+        hash = ROTL64(_state->acc[0], 1) + ROTL64(_state->acc[1], 7) +
+               ROTL64(_state->acc[2], 12) + ROTL64(_state->acc[3], 18);
+        hash = Xxh64Merge(hash, _state->acc[0]);
+        hash = Xxh64Merge(hash, _state->acc[1]);
+        hash = Xxh64Merge(hash, _state->acc[2]);
+        hash = Xxh64Merge(hash, _state->acc[3]);
+    }
+    else
+    {
+        hash = _state->seed + PRIME64_5;
+    }
+
+    hash += _state->totalLength;
+
+    while (end - p >= 8)
+    {
+        hash ^= Xxh64Round(0, Read64(p));
+        hash = ROTL64(hash, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+
+    if (end - p >= 4)
+    {
+        hash ^= (uint64_t)Read32(p) * PRIME64_1;
+        hash = ROTL64(hash, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end)
+    {
+        hash ^= (*p) * PRIME64_5;
+        hash = ROTL64(hash, 11) * PRIME64_1;
+        p++;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+/* table driven CRC32C, one byte per step */
+static uint32_t Crc32cSoft(uint32_t _crc, const uint8_t *_data, size_t _length)
+{
+    size_t i;
+
+    if (!s_crcTableReady)
+    {
+        uint32_t n;
+        int k;
+
+        for (n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for (k = 0; k < 8; k++)
+            {
+                c = (c & 1) ? (CRC32C_POLY ^ (c >> 1)) : (c >> 1);
+            }
+            s_crcTable[n] = c;
+        }
+        s_crcTableReady = 1;
+    }
+
+    for (i = 0; i < _length; i++)
+    {
+        _crc = s_crcTable[(_crc ^ _data[i]) & 0xFF] ^ (_crc >> 8);
+    }
+
+    return _crc;
+}
+
+#ifdef HASH_HW_CRC32C
+/* CPUID.1:ECX bit 20 */
+static int HasSse42()
+{
+    static int s_hasSse42 = -1;
+
+    if (s_hasSse42 < 0)
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        s_hasSse42 = (info[2] >> 20) & 1;
+#else
+        __builtin_cpu_init();
+        s_hasSse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+#endif
+    }
+
+    return s_hasSse42;
+}
+
+/* crc32 instruction, 8 bytes per step */
+HASH_TARGET_SSE42 static uint32_t Crc32cHard(uint32_t _crc, const uint8_t *_data, size_t _length)
+{
+#if defined(_M_X64) || defined(__x86_64__)
+    uint64_t crc64 = _crc;
+
+    while (_length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, _data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        _data += 8;
+        _length -= 8;
+    }
+    _crc = (uint32_t)crc64;
+#else
+    while (_length >= 4)
+    {
+        uint32_t word;
+        memcpy(&word, _data, 4);
+        _crc = _mm_crc32_u32(_crc, word);
+        _data += 4;
+        _length -= 4;
+    }
+#endif
+
+    while (_length > 0)
+    {
+        _crc = _mm_crc32_u8(_crc, *_data);
+        _data++;
+        _length--;
+    }
+
+    return _crc;
+}
+#endif /* HASH_HW_CRC32C */
+
+/*!
+ * @brief <Update a CRC32C (Castagnoli) checksum>
+ *
+ * @param _crc <checksum of the previous data, 0 for the first call>.
+ * @param _data <Pointer to the data>.
+ * @param _length <Number of bytes>.
+ *
+ * @return <checksum of the previous data followed by _data>.
+ */
+uint32_t Crc32c(uint32_t _crc, const void *_data, size_t _length)
+{
+    const uint8_t *data = (const uint8_t *)_data;
+
+    _crc = ~_crc;
+
+#ifdef HASH_HW_CRC32C
+    if (HasSse42())
+    {
+        return ~Crc32cHard(_crc, data, _length);
+    }
+#endif
+
+    return ~Crc32cSoft(_crc, data, _length);
+}
@@ -0,0 +1,70 @@
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+
+/*
+ * Streaming state of XXH64
+ */
+typedef struct
+{
+    uint64_t acc[4];    /* accumulators */
+    uint64_t seed;
+    uint64_t totalLength;
+    uint8_t buffer[32]; /* bytes waiting for a full stripe */
+    unsigned int bufferSize;
+} Xxh64State;
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Start a new XXH64 hash>
+ *
+ * @param _state <Pointer to a Xxh64State object>.
+ * @param _seed <seed of the hash, 0 by default>.
+ *
+ * @return <none>.
+ */
+void Xxh64Reset(Xxh64State *_state, uint64_t _seed);
+
+/*!
+ * @brief <Add data to a XXH64 hash>
+ *
+ * @param _state <Pointer to a Xxh64State object>.
+ * @param _data <Pointer to the data>.
+ * @param _length <Number of bytes>.
+ *
+ * @return <none>.
+ */
+void Xxh64Update(Xxh64State *_state, const void *_data, size_t _length);
+
+/*!
+ * @brief <Get the XXH64 hash of all data added since Xxh64Reset>
+ *
+ * @param _state <Pointer to a Xxh64State object>.
+ *
+ * @return <64 bits hash>.
+ */
+uint64_t Xxh64Digest(const Xxh64State *_state);
+
+/*!
+ * @brief <Update a CRC32C (Castagnoli) checksum>
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU supports it.
+ *
+ * @param _crc <checksum of the previous data, 0 for the first call>.
+ * @param _data <Pointer to the data>.
+ * @param _length <Number of bytes>.
+ *
+ * @return <checksum of the previous data followed by _data>.
+ */
+uint32_t Crc32c(uint32_t _crc, const void *_data, size_t _length);
+
+#endif
\ No newline at end of file
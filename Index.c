@@ -0,0 +1,708 @@
+#include "Index.h"
+#include "FAT.h"
+#include "HAL.h"
+#include "Hash.h"
+#include "Overlay.h"
+#include "Journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define INDEX_MAGIC "FATIDX1"
+#define INDEX_VERSION 2
+
+/*
+ * Header at offset 0 of the index file, offsets are in bytes from the start of the file
+ */
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t clusterCount;
+    uint64_t imageSize;
+    uint64_t imageMtime;
+    uint64_t fatHash; /* XXH64 of the first FAT */
+    uint32_t fatOffset;
+    uint32_t fatCount; /* uint32_t next cluster for clusters 0 to fatCount - 1 */
+    uint32_t nodeOffset;
+    uint32_t nodeCount;
+    uint32_t extentOffset;
+    uint32_t extentCount;
+    uint32_t nameOffset;
+    uint32_t nameSize;
+} IndexHeader;
+
+/*
+ * Tables of an index being built
+ */
+typedef struct
+{
+    uint32_t *fat;
+    unsigned int fatCount;
+    IndexNode *nodes;
+    unsigned int nodeCount;
+    unsigned int nodeCapacity;
+    Extent *extents;
+    unsigned int extentCount;
+    unsigned int extentCapacity;
+    char *names;
+    unsigned int nameSize;
+    unsigned int nameCapacity;
+} IndexBuilder;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static int MapIndexFile(const char *_indexFile);
+
+static void UnmapIndexFile();
+
+static uint64_t HashFAT();
+
+static int AddNode(DirectoryEntry *entry, const char *path, void *context);
+
+static int AddExtent(IndexBuilder *_builder, unsigned int _cluster, unsigned int _count, int _isNewRun);
+
+static int CompareNodes(const void *_a, const void *_b);
+
+static int CompareByCluster(const void *_a, const void *_b);
+
+static int BuildExtents(IndexBuilder *_builder, int _reuseChains);
+
+static int WriteIndexFile(const char *_fileName, IndexHeader *_header, const IndexBuilder *_builder);
+
+static int BuildIndex(const char *_fileName, IndexHeader *_header, int _reuseChains);
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static const uint8_t *s_map = NULL;
+static size_t s_mapSize = 0;
+#ifdef _WIN32
+static HANDLE s_mapping = NULL;
+#endif
+
+static const IndexHeader *s_header = NULL;
+static const IndexNode *s_nodes = NULL;
+static const Extent *s_extents = NULL;
+static const char *s_names = NULL;
+
+/* name pool used by CompareNodes */
+static const char *s_sortNames = NULL;
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/*!
+ * @brief <Map an index file read-only and check its layout>
+ *
+ * @param _indexFile <name of the index file>.
+ *
+ * @return <zero if the file is mapped and well formed>.
+ */
+static int MapIndexFile(const char *_indexFile)
+{
+    const IndexHeader *header;
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(_indexFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    LARGE_INTEGER size;
+
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return 1;
+    }
+    if (!GetFileSizeEx(file, &size) || (size.QuadPart < (LONGLONG)sizeof(IndexHeader)))
+    {
+        CloseHandle(file);
+        return 1;
+    }
+
+    s_mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (s_mapping == NULL)
+    {
+        return 1;
+    }
+
+    s_map = (const uint8_t *)MapViewOfFile(s_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (s_map == NULL)
+    {
+        CloseHandle(s_mapping);
+        s_mapping = NULL;
+        return 1;
+    }
+    s_mapSize = (size_t)size.QuadPart;
+#else
+    struct stat info;
+    void *map;
+    int fd = open(_indexFile, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return 1;
+    }
+    if ((fstat(fd, &info) != 0) || (info.st_size < (off_t)sizeof(IndexHeader)))
+    {
+        close(fd);
+        return 1;
+    }
+
+    map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return 1;
+    }
+
+    s_map = (const uint8_t *)map;
+    s_mapSize = (size_t)info.st_size;
+#endif
+
+    header = (const IndexHeader *)s_map;
+    if ((memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0) ||
+        (header->version != INDEX_VERSION) ||
+        ((uint64_t)header->fatOffset + (uint64_t)header->fatCount * sizeof(uint32_t) > s_mapSize) ||
+        ((uint64_t)header->nodeOffset + (uint64_t)header->nodeCount * sizeof(IndexNode) > s_mapSize) ||
+        ((uint64_t)header->extentOffset + (uint64_t)header->extentCount * sizeof(Extent) > s_mapSize) ||
+        ((uint64_t)header->nameOffset + header->nameSize > s_mapSize))
+    {
+        UnmapIndexFile();
+        return 1;
+    }
+
+    s_header = header;
+    s_nodes = (const IndexNode *)(s_map + header->nodeOffset);
+    s_extents = (const Extent *)(s_map + header->extentOffset);
+    s_names = (const char *)(s_map + header->nameOffset);
+
+    return 0;
+}
+
+static void UnmapIndexFile()
+{
+    if (s_map != NULL)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(s_map);
+        CloseHandle(s_mapping);
+        s_mapping = NULL;
+#else
+        munmap((void *)s_map, s_mapSize);
+#endif
+    }
+
+    s_map = NULL;
+    s_mapSize = 0;
+    s_header = NULL;
+    s_nodes = NULL;
+    s_extents = NULL;
+    s_names = NULL;
+}
+
+/* XXH64 of the first FAT, read with one ReadNSectors call */
+static uint64_t HashFAT()
+{
+    const unsigned int sectorPerFAT = GetSectorPerFAT();
+    uint8_t *buffer = (uint8_t *)malloc((size_t)sectorPerFAT * GetBytePerSector());
+    Xxh64State state;
+
+    Xxh64Reset(&state, 0);
+    if (buffer != NULL)
+    {
+        ReadNSectors(buffer, GetStartSectorFAT(), sectorPerFAT);
+        Xxh64Update(&state, buffer, (size_t)sectorPerFAT * GetBytePerSector());
+        free(buffer);
+    }
+
+    return Xxh64Digest(&state);
+}
+
+/* WalkTree visitor, one node and its path per entry */
+static int AddNode(DirectoryEntry *entry, const char *path, void *context)
+{
+    IndexBuilder *builder = (IndexBuilder *)context;
+    const unsigned int length = (unsigned int)strlen(path) + 1;
+    IndexNode *node;
+
+    if (builder->nodeCount == builder->nodeCapacity)
+    {
+        unsigned int capacity = (builder->nodeCapacity == 0) ? 256 : builder->nodeCapacity * 2;
+        IndexNode *nodes = (IndexNode *)realloc(builder->nodes, capacity * sizeof(IndexNode));
+
+        if (nodes == NULL)
+        {
+            return 1;
+        }
+        builder->nodes = nodes;
+        builder->nodeCapacity = capacity;
+    }
+
+    if (builder->nameSize + length > builder->nameCapacity)
+    {
+        unsigned int capacity = (builder->nameCapacity == 0) ? 4096 : builder->nameCapacity * 2;
+        char *names;
+
+        while (builder->nameSize + length > capacity)
+        {
+            capacity *= 2;
+        }
+        names = (char *)realloc(builder->names, capacity);
+        if (names == NULL)
+        {
+            return 1;
+        }
+        builder->names = names;
+        builder->nameCapacity = capacity;
+    }
+
+    node = &builder->nodes[builder->nodeCount++];
+    memset(node, 0, sizeof(IndexNode));
+    node->nameOffset = builder->nameSize;
+    node->size = (uint32_t)ReadNumber(4, entry->size);
+    node->startCluster = GetEntryCluster(entry);
+    node->timestamp = ((uint32_t)ReadNumber(2, entry->modifiedDate) << 16) |
+                      (uint32_t)ReadNumber(2, entry->modifiedTime);
+    node->attributes = entry->attributes;
+
+    memcpy(builder->names + builder->nameSize, path, length);
+    builder->nameSize += length;
+
+    return 0;
+}
+
+/* append clusters to the chain being built, merged with the last run unless _isNewRun */
+static int AddExtent(IndexBuilder *_builder, unsigned int _cluster, unsigned int _count, int _isNewRun)
+{
+    Extent *last = (_builder->extentCount > 0) ? &_builder->extents[_builder->extentCount - 1] : NULL;
+
+    if (!_isNewRun && (last != NULL) && (last->cluster + last->count == _cluster))
+    {
+        last->count += _count;
+        return 0;
+    }
+
+    if (_builder->extentCount == _builder->extentCapacity)
+    {
+        unsigned int capacity = (_builder->extentCapacity == 0) ? 256 : _builder->extentCapacity * 2;
+        Extent *extents = (Extent *)realloc(_builder->extents, capacity * sizeof(Extent));
+
+        if (extents == NULL)
+        {
+            return 1;
+        }
+        _builder->extents = extents;
+        _builder->extentCapacity = capacity;
+    }
+
+    _builder->extents[_builder->extentCount].cluster = _cluster;
+    _builder->extents[_builder->extentCount].count = _count;
+    _builder->extentCount++;
+
+    return 0;
+}
+
+static int CompareNodes(const void *_a, const void *_b)
+{
+    return strcmp(s_sortNames + ((const IndexNode *)_a)->nameOffset,
+                  s_sortNames + ((const IndexNode *)_b)->nameOffset);
+}
+
+static int CompareByCluster(const void *_a, const void *_b)
+{
+    const uint32_t a = ((const IndexNode *)_a)->startCluster;
+    const uint32_t b = ((const IndexNode *)_b)->startCluster;
+
+    return (a > b) - (a < b);
+}
+
+/*!
+ * @brief <Fill the runs of every node from the decoded FAT of the builder>
+ *
+ * @param _builder <Pointer to a IndexBuilder object with FAT and nodes>.
+ * @param _reuseChains <non-zero to copy the runs of the mapped index for known start clusters>.
+ *
+ * @return <zero on success>.
+ */
+static int BuildExtents(IndexBuilder *_builder, int _reuseChains)
+{
+    const unsigned int clusterCount = GetClusterCount();
+    IndexNode *oldByCluster = NULL;
+    unsigned int i;
+    int isFailed = 0;
+
+    if (_reuseChains && (s_header->nodeCount > 0))
+    {
+        oldByCluster = (IndexNode *)malloc(s_header->nodeCount * sizeof(IndexNode));
+        if (oldByCluster != NULL)
+        {
+            memcpy(oldByCluster, s_nodes, s_header->nodeCount * sizeof(IndexNode));
+            qsort(oldByCluster, s_header->nodeCount, sizeof(IndexNode), CompareByCluster);
+        }
+    }
+
+    for (i = 0; (i < _builder->nodeCount) && !isFailed; i++)
+    {
+        IndexNode *node = &_builder->nodes[i];
+        const IndexNode *old = NULL;
+        unsigned int e;
+
+        node->firstExtent = _builder->extentCount;
+
+        if (oldByCluster != NULL)
+        {
+            old = (const IndexNode *)bsearch(node, oldByCluster, s_header->nodeCount,
+                                             sizeof(IndexNode), CompareByCluster);
+        }
+
+        if (old != NULL)
+        {
+            /* same FAT, same start cluster: same chain */
+            for (e = 0; (e < old->extentCount) && !isFailed; e++)
+            {
+                const Extent *extent = &s_extents[old->firstExtent + e];
+                isFailed = AddExtent(_builder, extent->cluster, extent->count, 1);
+            }
+        }
+        else
+        {
+            unsigned int cluster = node->startCluster;
+
+            for (e = 0; IsValidCluster(cluster) && (e < clusterCount) && !isFailed; e++)
+            {
+                /* the first cluster of a chain never extends the previous chain */
+                isFailed = AddExtent(_builder, cluster, 1, e == 0);
+                cluster = _builder->fat[cluster];
+            }
+        }
+
+        node->extentCount = _builder->extentCount - node->firstExtent;
+    }
+
+    free(oldByCluster);
+    return isFailed;
+}
+
+/*!
+ * @brief <Write the tables of the builder: header, FAT, nodes, runs and names>
+ *
+ * @param _fileName <name of the file to create>.
+ * @param _header <Pointer to a IndexHeader object, offsets are filled here>.
+ * @param _builder <Pointer to a IndexBuilder object>.
+ *
+ * @return <zero on success>.
+ */
+static int WriteIndexFile(const char *_fileName, IndexHeader *_header, const IndexBuilder *_builder)
+{
+    FILE *out = NULL;
+    unsigned int i;
+
+    _header->fatOffset = sizeof(IndexHeader);
+    _header->fatCount = _builder->fatCount;
+    _header->nodeOffset = (_header->fatOffset + _builder->fatCount * sizeof(uint32_t) + 7) & ~7U;
+    _header->nodeCount = _builder->nodeCount;
+    _header->extentOffset = _header->nodeOffset + _builder->nodeCount * sizeof(IndexNode);
+    _header->extentCount = _builder->extentCount;
+    _header->nameOffset = _header->extentOffset + _builder->extentCount * sizeof(Extent);
+    _header->nameSize = _builder->nameSize;
+
+    fopen_s(&out, _fileName, "wb");
+    if (out == NULL)
+    {
+        return 1;
+    }
+
+    fwrite(_header, sizeof(IndexHeader), 1, out);
+    fwrite(_builder->fat, sizeof(uint32_t), _builder->fatCount, out);
+    for (i = _header->fatOffset + _builder->fatCount * sizeof(uint32_t); i < _header->nodeOffset; i++)
+    {
+        fputc(0, out);
+    }
+    fwrite(_builder->nodes, sizeof(IndexNode), _builder->nodeCount, out);
+    fwrite(_builder->extents, sizeof(Extent), _builder->extentCount, out);
+    fwrite(_builder->names, 1, _builder->nameSize, out);
+
+    return (ferror(out) != 0) | (fclose(out) != 0);
+}
+
+/*!
+ * @brief <Build an index of the mounted image>
+ *
+ * @param _fileName <name of the file to create>.
+ * @param _header <Pointer to a IndexHeader object with the key of the image>.
+ * @param _reuseChains <non-zero if the mapped index has the same FAT,
+ *                      its decoded FAT and runs are copied instead of walked again>.
+ *
+ * @return <zero on success>.
+ */
+static int BuildIndex(const char *_fileName, IndexHeader *_header, int _reuseChains)
+{
+    IndexBuilder builder;
+    unsigned int i;
+    int isFailed;
+
+    memset(&builder, 0, sizeof(builder));
+    builder.fatCount = GetClusterCount() + FIRST_CLUSTER;
+    builder.fat = (uint32_t *)malloc(builder.fatCount * sizeof(uint32_t));
+    isFailed = (builder.fat == NULL);
+
+    _reuseChains = _reuseChains && (s_header != NULL) && (s_header->fatCount == builder.fatCount);
+
+    if (!isFailed)
+    {
+        if (_reuseChains)
+        {
+            memcpy(builder.fat, s_map + s_header->fatOffset, builder.fatCount * sizeof(uint32_t));
+        }
+        else
+        {
+            SetDecodedFAT(NULL, 0);
+            builder.fat[0] = 0;
+            builder.fat[1] = 0;
+            for (i = FIRST_CLUSTER; i < builder.fatCount; i++)
+            {
+                builder.fat[i] = GetNextCluster(i);
+            }
+        }
+
+        /* directory chains are followed on the decoded FAT */
+        SetDecodedFAT(builder.fat, builder.fatCount);
+        isFailed = WalkTree(0, "", AddNode, &builder);
+    }
+
+    if (!isFailed)
+    {
+        isFailed = BuildExtents(&builder, _reuseChains);
+    }
+
+    if (!isFailed)
+    {
+        s_sortNames = builder.names;
+        qsort(builder.nodes, builder.nodeCount, sizeof(IndexNode), CompareNodes);
+
+        isFailed = WriteIndexFile(_fileName, _header, &builder);
+    }
+
+    SetDecodedFAT(NULL, 0);
+    free(builder.fat);
+    free(builder.nodes);
+    free(builder.extents);
+    free(builder.names);
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Map the sidecar index of the mounted image, build it if needed>
+ *
+ * @param _indexFile <name of the index file, usually "<image>.idx">.
+ *
+ * @return <INDEX_HOT, INDEX_REFRESHED, INDEX_REBUILT, -1 on failure, on exFAT
+ *          or with an overlay or a journal attached>.
+ */
+int LoadIndex(const char *_indexFile)
+{
+    IndexHeader header;
+    char *tempFile;
+    int retVal;
+
+    CloseIndex();
+
+    /* exFAT contiguous files and long names are not stored in the index */
+    if (GetFatType() == FAT_TYPE_EXFAT)
+    {
+        return -1;
+    }
+
+    /* the key covers the image file only, patched sectors would be missed */
+    if (IsOverlayOpen() || IsJournalOpen())
+    {
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.clusterCount = GetClusterCount();
+    GetImgInfo(&header.imageSize, &header.imageMtime);
+    /* the mtime has a one second resolution, the FAT is always hashed */
+    header.fatHash = HashFAT();
+
+    if (MapIndexFile(_indexFile) == 0)
+    {
+        if (s_header->fatHash != header.fatHash)
+        {
+            retVal = INDEX_REBUILT;
+        }
+        else if ((s_header->imageSize == header.imageSize) &&
+                 (s_header->imageMtime == header.imageMtime) &&
+                 (s_header->clusterCount == header.clusterCount))
+        {
+            SetDecodedFAT((const uint32_t *)(s_map + s_header->fatOffset), s_header->fatCount);
+            return INDEX_HOT;
+        }
+        else
+        {
+            retVal = INDEX_REFRESHED;
+        }
+    }
+    else
+    {
+        retVal = INDEX_REBUILT;
+    }
+
+    tempFile = (char *)malloc(strlen(_indexFile) + 5);
+    if (tempFile == NULL)
+    {
+        UnmapIndexFile();
+        return -1;
+    }
+    strcpy(tempFile, _indexFile);
+    strcat(tempFile, ".tmp");
+
+    if (BuildIndex(tempFile, &header, retVal == INDEX_REFRESHED) != 0)
+    {
+        retVal = -1;
+    }
+
+    /* the old file must be unmapped before it is replaced */
+    UnmapIndexFile();
+
+    if (retVal >= 0)
+    {
+        remove(_indexFile);
+        if ((rename(tempFile, _indexFile) != 0) || (MapIndexFile(_indexFile) != 0))
+        {
+            retVal = -1;
+        }
+        else
+        {
+            SetDecodedFAT((const uint32_t *)(s_map + s_header->fatOffset), s_header->fatCount);
+        }
+    }
+
+    free(tempFile);
+    return retVal;
+}
+
+/*!
+ * @brief <Unmap the index, GetNextCluster reads the image again>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void CloseIndex()
+{
+    if (s_map != NULL)
+    {
+        SetDecodedFAT(NULL, 0);
+    }
+    UnmapIndexFile();
+}
+
+/*!
+ * @brief <Find a path in the index>
+ *
+ * @param _path <absolute path, case insensitive>.
+ *
+ * @return <Pointer to the node, NULL if not found or no index is loaded>.
+ */
+const IndexNode *FindIndexNode(const char *_path)
+{
+    char path[FAT_MAX_PATH];
+    size_t length = 0;
+    int low = 0;
+    int high;
+
+    if (s_header == NULL)
+    {
+        return NULL;
+    }
+
+    /* paths are stored upper case, without trailing '/' */
+    while ((_path[length] != '\0') && (length < FAT_MAX_PATH - 1))
+    {
+        path[length] = (char)toupper((unsigned char)_path[length]);
+        length++;
+    }
+    while ((length > 0) && (path[length - 1] == '/'))
+    {
+        length--;
+    }
+    path[length] = '\0';
+
+    high = (int)s_header->nodeCount - 1;
+    while (low <= high)
+    {
+        const int mid = (low + high) / 2;
+        const int cmp = strcmp(s_names + s_nodes[mid].nameOffset, path);
+
+        if (cmp == 0)
+        {
+            return &s_nodes[mid];
+        }
+        else if (cmp < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+
+    return NULL;
+}
+
+/*!
+ * @brief <Get the full path of a node>
+ *
+ * @param _node <Pointer to a IndexNode object>.
+ *
+ * @return <path>.
+ */
+const char *GetIndexPath(const IndexNode *_node)
+{
+    return s_names + _node->nameOffset;
+}
+
+/*!
+ * @brief <Get the runs of clusters of a node>
+ *
+ * @param _node <Pointer to a IndexNode object>.
+ *
+ * @return <array of _node->extentCount runs>.
+ */
+const Extent *GetIndexExtents(const IndexNode *_node)
+{
+    return s_extents + _node->firstExtent;
+}
+
+/*!
+ * @brief <Get all nodes of the index>
+ *
+ * @param _count <Pointer to store number of nodes>.
+ *
+ * @return <array of nodes sorted by path, NULL if no index is loaded>.
+ */
+const IndexNode *GetIndexNodes(unsigned int *_count)
+{
+    *_count = (s_header != NULL) ? s_header->nodeCount : 0;
+    return s_nodes;
+}
@@ -0,0 +1,96 @@
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include "FAT.h"
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+/* LoadIndex results */
+#define INDEX_HOT 0       /* index matched the image and its FAT, no directory was parsed */
+#define INDEX_REFRESHED 1 /* FAT unchanged, directory tree read again */
+#define INDEX_REBUILT 2   /* index missing or FAT changed, built from scratch */
+
+/*
+ * One file or folder of the index, nodes are sorted by path
+ */
+typedef struct
+{
+    uint32_t nameOffset;   /* full path, offset in the name pool */
+    uint32_t size;         /* size of file in bytes */
+    uint32_t startCluster; /* starting cluster of file */
+    uint32_t timestamp;    /* modified date << 16 | modified time */
+    uint32_t attributes;   /* file attributes */
+    uint32_t firstExtent;  /* first run of the chain in the extent table */
+    uint32_t extentCount;  /* number of runs of the chain */
+    uint32_t reserved;
+} IndexNode;
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Map the sidecar index of the mounted image, build it if needed>
+ *
+ * The index holds the decoded FAT, every path with its size, start cluster
+ * and runs of clusters. It is keyed by the size and modification time of
+ * the image and a hash of the FAT region; the FAT is hashed on every load.
+ * Once loaded, GetNextCluster is served from the mapped FAT. No index is
+ * used while an overlay or a journal is attached, their sectors are not
+ * part of the key.
+ *
+ * @param _indexFile <name of the index file, usually "<image>.idx">.
+ *
+ * @return <INDEX_HOT, INDEX_REFRESHED, INDEX_REBUILT, -1 on failure, on exFAT
+ *          or with an overlay or a journal attached>.
+ */
+int LoadIndex(const char *_indexFile);
+
+/*!
+ * @brief <Unmap the index, GetNextCluster reads the image again>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void CloseIndex();
+
+/*!
+ * @brief <Find a path in the index>
+ *
+ * @param _path <absolute path, case insensitive>.
+ *
+ * @return <Pointer to the node, NULL if not found or no index is loaded>.
+ */
+const IndexNode *FindIndexNode(const char *_path);
+
+/*!
+ * @brief <Get the full path of a node>
+ *
+ * @param _node <Pointer to a IndexNode object>.
+ *
+ * @return <path>.
+ */
+const char *GetIndexPath(const IndexNode *_node);
+
+/*!
+ * @brief <Get the runs of clusters of a node>
+ *
+ * @param _node <Pointer to a IndexNode object>.
+ *
+ * @return <array of _node->extentCount runs>.
+ */
+const Extent *GetIndexExtents(const IndexNode *_node);
+
+/*!
+ * @brief <Get all nodes of the index>
+ *
+ * @param _count <Pointer to store number of nodes>.
+ *
+ * @return <array of nodes sorted by path, NULL if no index is loaded>.
+ */
+const IndexNode *GetIndexNodes(unsigned int *_count);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,679 @@
+#include "Journal.h"
+#include "Stats.h"
+#include "Hash.h"
+#include "HAL.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define JOURNAL_EMPTY 0xFFFFFFFFU
+#define JOURNAL_NO_SECTOR UINT64_MAX
+#define JOURNAL_MIN_CAPACITY 256 /* must be a power of two */
+
+/*
+ * One item of the lookup table, sector of the volume -> slot of the in-memory copy
+ */
+typedef struct
+{
+    uint64_t sector; /* JOURNAL_NO_SECTOR if the item is free */
+    uint32_t slot;
+} JournalItem;
+
+/*
+ * Sector records of a batch read back by OpenJournal, kept until its commit record
+ */
+typedef struct
+{
+    uint64_t *sectors;
+    uint8_t *data;
+    unsigned int count;
+    unsigned int capacity;
+} StagedBatch;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static unsigned int HashSector(uint64_t _sectorPosition);
+
+static uint32_t FindSlot(uint64_t _sectorPosition);
+
+static int PutSector(const void *_sector, uint64_t _sectorPosition, int _isPending);
+
+static void ClearSectors();
+
+static void PutRecordHeader(uint8_t *_record, uint32_t _type, uint32_t _crc, uint64_t _position, uint64_t _sequence);
+
+static int StageSector(StagedBatch *_batch, const uint8_t *_sector, uint64_t _sectorPosition);
+
+static int Replay();
+
+static int CompareSlots(const void *_a, const void *_b);
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static FILE *s_journal = NULL;
+static unsigned int s_bytePerSector = 0;
+static uint64_t s_end = 0;      /* end of the last complete batch */
+static uint64_t s_sequence = 0; /* of the next batch */
+
+static JournalItem *s_items = NULL; /* open addressing, linear probing */
+static unsigned int s_itemCapacity = 0;
+static uint64_t *s_slotSectors = NULL; /* slot -> sector */
+static uint8_t *s_slotData = NULL;     /* slot -> latest data of the sector */
+static uint8_t *s_isPending = NULL;    /* slot -> written since the last commit */
+static uint32_t *s_pending = NULL;     /* slots of the current batch */
+static unsigned int s_slotCount = 0;
+static unsigned int s_slotCapacity = 0;
+static unsigned int s_pendingCount = 0;
+
+static uint64_t s_minSector = JOURNAL_NO_SECTOR; /* range of logged sectors */
+static uint64_t s_maxSector = 0;
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+static unsigned int HashSector(uint64_t _sectorPosition)
+{
+    return (unsigned int)(_sectorPosition ^ (_sectorPosition >> 32)) * 2654435761U;
+}
+
+/* slot of a sector, JOURNAL_EMPTY if it is not in the journal */
+static uint32_t FindSlot(uint64_t _sectorPosition)
+{
+    unsigned int i;
+
+    if ((s_slotCount == 0) || (_sectorPosition < s_minSector) || (_sectorPosition > s_maxSector))
+    {
+        return JOURNAL_EMPTY;
+    }
+
+    i = HashSector(_sectorPosition) & (s_itemCapacity - 1);
+    while (s_items[i].sector != JOURNAL_NO_SECTOR)
+    {
+        if (s_items[i].sector == _sectorPosition)
+        {
+            return s_items[i].slot;
+        }
+        i = (i + 1) & (s_itemCapacity - 1);
+    }
+
+    return JOURNAL_EMPTY;
+}
+
+/* keep the latest data of a sector, the table grows at 70% load; zero on success */
+static int PutSector(const void *_sector, uint64_t _sectorPosition, int _isPending)
+{
+    uint32_t slot = FindSlot(_sectorPosition);
+    unsigned int i;
+
+    if (slot == JOURNAL_EMPTY)
+    {
+        if ((s_slotCount + 1) * 10 > s_itemCapacity * 7)
+        {
+            const unsigned int capacity = (s_itemCapacity == 0) ? JOURNAL_MIN_CAPACITY : s_itemCapacity * 2;
+            JournalItem *items = (JournalItem *)malloc(capacity * sizeof(JournalItem));
+
+            if (items == NULL)
+            {
+                return 1;
+            }
+            memset(items, 0xFF, capacity * sizeof(JournalItem));
+
+            for (i = 0; i < s_itemCapacity; i++)
+            {
+                if (s_items[i].sector != JOURNAL_NO_SECTOR)
+                {
+                    unsigned int j = HashSector(s_items[i].sector) & (capacity - 1);
+
+                    while (items[j].sector != JOURNAL_NO_SECTOR)
+                    {
+                        j = (j + 1) & (capacity - 1);
+                    }
+                    items[j] = s_items[i];
+                }
+            }
+
+            free(s_items);
+            s_items = items;
+            s_itemCapacity = capacity;
+        }
+
+        if (s_slotCount == s_slotCapacity)
+        {
+            const unsigned int capacity = (s_slotCapacity == 0) ? JOURNAL_MIN_CAPACITY : s_slotCapacity * 2;
+            uint64_t *sectors = (uint64_t *)realloc(s_slotSectors, capacity * sizeof(uint64_t));
+            uint8_t *data = (sectors == NULL) ? NULL : (uint8_t *)realloc(s_slotData, (size_t)capacity * s_bytePerSector);
+            uint8_t *isPending = (data == NULL) ? NULL : (uint8_t *)realloc(s_isPending, capacity);
+            uint32_t *pending = (isPending == NULL) ? NULL : (uint32_t *)realloc(s_pending, capacity * sizeof(uint32_t));
+
+            s_slotSectors = (sectors != NULL) ? sectors : s_slotSectors;
+            s_slotData = (data != NULL) ? data : s_slotData;
+            s_isPending = (isPending != NULL) ? isPending : s_isPending;
+            s_pending = (pending != NULL) ? pending : s_pending;
+            if (pending == NULL)
+            {
+                return 1;
+            }
+            s_slotCapacity = capacity;
+        }
+
+        slot = s_slotCount++;
+        s_slotSectors[slot] = _sectorPosition;
+        s_isPending[slot] = 0;
+
+        i = HashSector(_sectorPosition) & (s_itemCapacity - 1);
+        while (s_items[i].sector != JOURNAL_NO_SECTOR)
+        {
+            i = (i + 1) & (s_itemCapacity - 1);
+        }
+        s_items[i].sector = _sectorPosition;
+        s_items[i].slot = slot;
+
+        if (_sectorPosition < s_minSector)
+        {
+            s_minSector = _sectorPosition;
+        }
+        if (_sectorPosition > s_maxSector)
+        {
+            s_maxSector = _sectorPosition;
+        }
+    }
+
+    /* a sector written twice in a batch is logged once */
+    memcpy(s_slotData + (size_t)slot * s_bytePerSector, _sector, s_bytePerSector);
+    if (_isPending && !s_isPending[slot])
+    {
+        s_isPending[slot] = 1;
+        s_pending[s_pendingCount++] = slot;
+    }
+
+    return 0;
+}
+
+/* forget every sector, they are all in the volume */
+static void ClearSectors()
+{
+    free(s_items);
+    free(s_slotSectors);
+    free(s_slotData);
+    free(s_isPending);
+    free(s_pending);
+
+    s_items = NULL;
+    s_itemCapacity = 0;
+    s_slotSectors = NULL;
+    s_slotData = NULL;
+    s_isPending = NULL;
+    s_pending = NULL;
+    s_slotCount = 0;
+    s_slotCapacity = 0;
+    s_pendingCount = 0;
+    s_minSector = JOURNAL_NO_SECTOR;
+    s_maxSector = 0;
+}
+
+/* type, CRC32C, sector position or record count, sequence of the batch */
+static void PutRecordHeader(uint8_t *_record, uint32_t _type, uint32_t _crc, uint64_t _position, uint64_t _sequence)
+{
+    memcpy(_record, &_type, sizeof(uint32_t));
+    memcpy(_record + 4, &_crc, sizeof(uint32_t));
+    memcpy(_record + 8, &_position, sizeof(uint64_t));
+    memcpy(_record + 16, &_sequence, sizeof(uint64_t));
+}
+
+static int StageSector(StagedBatch *_batch, const uint8_t *_sector, uint64_t _sectorPosition)
+{
+    if (_batch->count == _batch->capacity)
+    {
+        const unsigned int capacity = (_batch->capacity == 0) ? JOURNAL_MIN_CAPACITY : _batch->capacity * 2;
+        uint64_t *sectors = (uint64_t *)realloc(_batch->sectors, capacity * sizeof(uint64_t));
+        uint8_t *data = (sectors == NULL) ? NULL : (uint8_t *)realloc(_batch->data, (size_t)capacity * s_bytePerSector);
+
+        _batch->sectors = (sectors != NULL) ? sectors : _batch->sectors;
+        _batch->data = (data != NULL) ? data : _batch->data;
+        if (data == NULL)
+        {
+            return 1;
+        }
+        _batch->capacity = capacity;
+    }
+
+    _batch->sectors[_batch->count] = _sectorPosition;
+    memcpy(_batch->data + (size_t)_batch->count * s_bytePerSector, _sector, s_bytePerSector);
+    _batch->count++;
+
+    return 0;
+}
+
+/* load the complete batches after the header, s_end is set after the last one */
+static int Replay()
+{
+    const size_t recordSize = JOURNAL_RECORD_HEADER_SIZE + s_bytePerSector;
+    uint8_t *record = (uint8_t *)malloc(recordSize);
+    StagedBatch batch;
+    uint64_t offset = JOURNAL_HEADER_SIZE;
+    uint32_t batchCrc = 0;
+    int isFailed = (record == NULL);
+    int isEnd = isFailed;
+
+    memset(&batch, 0, sizeof(batch));
+    s_end = offset;
+
+    while (!isEnd && (SeekFile(s_journal, offset) == 0) &&
+           (fread(record, 1, JOURNAL_RECORD_HEADER_SIZE, s_journal) == JOURNAL_RECORD_HEADER_SIZE))
+    {
+        uint32_t type;
+        uint32_t crc;
+        uint64_t position;
+        uint64_t sequence;
+
+        memcpy(&type, record, sizeof(uint32_t));
+        memcpy(&crc, record + 4, sizeof(uint32_t));
+        memcpy(&position, record + 8, sizeof(uint64_t));
+        memcpy(&sequence, record + 16, sizeof(uint64_t));
+
+        /* a batch has one sequence, the first record gives it */
+        isEnd = (batch.count != 0) && (sequence != s_sequence);
+        s_sequence = sequence;
+
+        if (!isEnd && (type == JOURNAL_RECORD_SECTOR))
+        {
+            isEnd = (fread(record + JOURNAL_RECORD_HEADER_SIZE, 1, s_bytePerSector, s_journal) != s_bytePerSector) ||
+                    (Crc32c(0, record + JOURNAL_RECORD_HEADER_SIZE, s_bytePerSector) != crc);
+            if (!isEnd)
+            {
+                batchCrc = Crc32c(batchCrc, record, recordSize);
+                isFailed = StageSector(&batch, record + JOURNAL_RECORD_HEADER_SIZE, position);
+                isEnd = isFailed;
+                offset += recordSize;
+            }
+        }
+        else if (!isEnd && (type == JOURNAL_RECORD_COMMIT))
+        {
+            unsigned int i;
+
+            /* torn batches have fewer records or a different CRC */
+            isEnd = (position != batch.count) || (crc != batchCrc);
+            for (i = 0; !isEnd && (i < batch.count); i++)
+            {
+                isFailed = PutSector(batch.data + (size_t)i * s_bytePerSector, batch.sectors[i], 0);
+                isEnd = isFailed;
+            }
+
+            offset += JOURNAL_RECORD_HEADER_SIZE;
+            s_end = offset;
+            s_sequence = sequence + 1;
+            batch.count = 0;
+            batchCrc = 0;
+        }
+        else
+        {
+            isEnd = 1;
+        }
+    }
+
+    free(batch.sectors);
+    free(batch.data);
+    free(record);
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Open or create the write-ahead journal of the mounted volume>
+ *
+ * @param _journalName <Name of the journal file, created if it does not exist>.
+ * @param _bytePerSector <sector size of the volume>.
+ * @param _volumeOffset <byte offset of the volume in the image, a journal of another partition is refused>.
+ *
+ * @return <zero on success, non-zero if the file can not be used>.
+ */
+int OpenJournal(const char *_journalName, unsigned int _bytePerSector, uint64_t _volumeOffset)
+{
+    uint8_t header[JOURNAL_HEADER_SIZE];
+    int isFailed = 0;
+
+    CloseJournal();
+    s_bytePerSector = _bytePerSector;
+    s_sequence = 0;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    memcpy(header + 8, &_bytePerSector, sizeof(uint32_t));
+    memcpy(header + 16, &_volumeOffset, sizeof(uint64_t));
+
+    fopen_s(&s_journal, _journalName, "r+b");
+    if (s_journal == NULL)
+    {
+        /* new journal, nothing logged yet */
+        fopen_s(&s_journal, _journalName, "w+b");
+        if (s_journal == NULL)
+        {
+            return 1;
+        }
+
+        isFailed = (fwrite(header, 1, sizeof(header), s_journal) != sizeof(header)) ||
+                   (fflush(s_journal) != 0) || (SyncFile(s_journal) != 0);
+        s_end = JOURNAL_HEADER_SIZE;
+    }
+    else
+    {
+        uint8_t existing[JOURNAL_HEADER_SIZE];
+
+        isFailed = (fread(existing, 1, sizeof(existing), s_journal) != sizeof(existing)) ||
+                   (memcmp(existing, header, sizeof(header)) != 0) ||
+                   (Replay() != 0);
+
+        /* batches left by a crash reach the volume now, a torn tail is cut */
+        if (!isFailed)
+        {
+            GetVolumeStats()->journalSectorsReplayed += s_slotCount;
+            isFailed = (SetFileSize(s_journal, s_end) != 0) || (CheckpointJournal() != 0);
+        }
+    }
+
+    if (isFailed)
+    {
+        fclose(s_journal);
+        s_journal = NULL;
+        ClearSectors();
+    }
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Commit, checkpoint and close the journal>
+ *
+ * @param <none>.
+ *
+ * @return <zero if every logged sector reached the volume>.
+ */
+int CloseJournal()
+{
+    int isFailed = 0;
+
+    if (s_journal != NULL)
+    {
+        isFailed = CheckpointJournal();
+        fclose(s_journal);
+        s_journal = NULL;
+    }
+
+    ClearSectors();
+    return isFailed;
+}
+
+/*!
+ * @brief <Check that a journal is open>
+ *
+ * @param <none>.
+ *
+ * @return <non-zero if writes go through the journal>.
+ */
+int IsJournalOpen()
+{
+    return s_journal != NULL;
+}
+
+/*!
+ * @brief <Log one sector in the current batch>
+ *
+ * @param _sector <Pointer to the sector data>.
+ * @param _sectorPosition <sector position in the volume>.
+ *
+ * @return <zero on success>.
+ */
+int WriteJournalSector(const void *_sector, uint64_t _sectorPosition)
+{
+    int isFailed = (s_journal == NULL) || (PutSector(_sector, _sectorPosition, 1) != 0);
+
+    if (!isFailed)
+    {
+        GetVolumeStats()->journalSectorsLogged++;
+    }
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Append the current batch and its commit record, then fsync once>
+ *
+ * @param <none>.
+ *
+ * @return <zero on success>.
+ */
+int CommitJournal()
+{
+    const size_t recordSize = JOURNAL_RECORD_HEADER_SIZE + s_bytePerSector;
+    uint8_t *batch;
+    size_t length;
+    uint32_t crc;
+    unsigned int i;
+    int isFailed;
+
+    if ((s_journal == NULL) || (s_pendingCount == 0))
+    {
+        return (s_journal == NULL);
+    }
+
+    /* the whole batch with one write: sector records then the commit record */
+    length = s_pendingCount * recordSize + JOURNAL_RECORD_HEADER_SIZE;
+    batch = (uint8_t *)malloc(length);
+    isFailed = (batch == NULL);
+
+    if (!isFailed)
+    {
+        for (i = 0; i < s_pendingCount; i++)
+        {
+            const uint32_t slot = s_pending[i];
+            const uint8_t *data = s_slotData + (size_t)slot * s_bytePerSector;
+            uint8_t *record = batch + i * recordSize;
+
+            PutRecordHeader(record, JOURNAL_RECORD_SECTOR, Crc32c(0, data, s_bytePerSector), s_slotSectors[slot], s_sequence);
+            memcpy(record + JOURNAL_RECORD_HEADER_SIZE, data, s_bytePerSector);
+        }
+
+        crc = Crc32c(0, batch, s_pendingCount * recordSize);
+        PutRecordHeader(batch + s_pendingCount * recordSize, JOURNAL_RECORD_COMMIT, crc, s_pendingCount, s_sequence);
+
+        isFailed = (SeekFile(s_journal, s_end) != 0) ||
+                   (fwrite(batch, 1, length, s_journal) != length) ||
+                   (fflush(s_journal) != 0) ||
+                   (SyncFile(s_journal) != 0);
+        free(batch);
+    }
+
+    if (!isFailed)
+    {
+        for (i = 0; i < s_pendingCount; i++)
+        {
+            s_isPending[s_pending[i]] = 0;
+        }
+        s_pendingCount = 0;
+        s_end += length;
+        s_sequence++;
+        GetVolumeStats()->journalCommits++;
+
+        /* write back lazily, many batches at once */
+        if (s_slotCount >= JOURNAL_CHECKPOINT_SECTORS)
+        {
+            isFailed = CheckpointJournal();
+        }
+    }
+
+    return isFailed;
+}
+
+/* ascending sector position, qsort of slots */
+static int CompareSlots(const void *_a, const void *_b)
+{
+    const uint64_t a = s_slotSectors[*(const uint32_t *)_a];
+    const uint64_t b = s_slotSectors[*(const uint32_t *)_b];
+
+    return (a > b) - (a < b);
+}
+
+/*!
+ * @brief <Write the committed sectors back in ascending order and empty the journal>
+ *
+ * @param <none>.
+ *
+ * @return <zero on success>.
+ */
+int CheckpointJournal()
+{
+    uint32_t *order = NULL;
+    unsigned int i;
+    int isFailed = CommitJournal();
+
+    if (!isFailed && (s_slotCount > 0))
+    {
+        order = (uint32_t *)malloc(s_slotCount * sizeof(uint32_t));
+        isFailed = (order == NULL);
+    }
+
+    if (order != NULL)
+    {
+        /* physical order, the writes become one sweep over the volume */
+        for (i = 0; i < s_slotCount; i++)
+        {
+            order[i] = i;
+        }
+        qsort(order, s_slotCount, sizeof(uint32_t), CompareSlots);
+
+        for (i = 0; !isFailed && (i < s_slotCount); i++)
+        {
+            isFailed = StoreSector(s_slotData + (size_t)order[i] * s_bytePerSector, s_slotSectors[order[i]]);
+        }
+        isFailed = isFailed || (SyncStore() != 0);
+
+        /* the volume has every batch, only then the journal starts again */
+        if (!isFailed)
+        {
+            GetVolumeStats()->journalSectorsCheckpointed += s_slotCount;
+            ClearSectors();
+            s_end = JOURNAL_HEADER_SIZE;
+            isFailed = (SetFileSize(s_journal, s_end) != 0) || (SyncFile(s_journal) != 0);
+        }
+
+        free(order);
+    }
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Read one sector from the journal if it was logged and not written back yet>
+ *
+ * @param _sector <Pointer to a block of memory of bytePerSector bytes>.
+ * @param _sectorPosition <sector position in the volume>.
+ *
+ * @return <non-zero if the sector was read from the journal>.
+ */
+int ReadJournalSector(void *_sector, uint64_t _sectorPosition)
+{
+    const uint32_t slot = FindSlot(_sectorPosition);
+
+    if (slot == JOURNAL_EMPTY)
+    {
+        return 0;
+    }
+
+    memcpy(_sector, s_slotData + (size_t)slot * s_bytePerSector, s_bytePerSector);
+    return 1;
+}
+
+/*!
+ * @brief <Replace the sectors of a block by their journal copy>
+ *
+ * @param _sectors <Pointer to _count sectors>.
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors>.
+ *
+ * @return <number of sectors replaced>.
+ */
+unsigned int PatchJournalSectors(void *_sectors, uint64_t _sectorPosition, unsigned int _count)
+{
+    uint8_t *sectors = (uint8_t *)_sectors;
+    unsigned int patched = 0;
+    unsigned int i;
+
+    if (!JournalIntersects(_sectorPosition, _count))
+    {
+        return 0;
+    }
+
+    /* look up every sector of a short range, walk the slots for a long one */
+    if (_count <= s_slotCount)
+    {
+        for (i = 0; i < _count; i++)
+        {
+            patched += ReadJournalSector(sectors + (size_t)i * s_bytePerSector, _sectorPosition + i);
+        }
+    }
+    else
+    {
+        for (i = 0; i < s_slotCount; i++)
+        {
+            const uint64_t sector = s_slotSectors[i];
+
+            if ((sector >= _sectorPosition) && (sector - _sectorPosition < _count))
+            {
+                memcpy(sectors + (size_t)(sector - _sectorPosition) * s_bytePerSector,
+                       s_slotData + (size_t)i * s_bytePerSector, s_bytePerSector);
+                patched++;
+            }
+        }
+    }
+
+    return patched;
+}
+
+/*!
+ * @brief <Check whether a range of sectors has any sector in the journal>
+ *
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors>.
+ *
+ * @return <non-zero if at least one sector of the range is in the journal>.
+ */
+int JournalIntersects(uint64_t _sectorPosition, uint64_t _count)
+{
+    uint64_t i;
+
+    if ((s_slotCount == 0) || (_count == 0) ||
+        (_sectorPosition > s_maxSector) || (_sectorPosition + _count - 1 < s_minSector))
+    {
+        return 0;
+    }
+
+    if (_count <= s_slotCount)
+    {
+        for (i = 0; i < _count; i++)
+        {
+            if (FindSlot(_sectorPosition + i) != JOURNAL_EMPTY)
+            {
+                return 1;
+            }
+        }
+    }
+    else
+    {
+        for (i = 0; i < s_slotCount; i++)
+        {
+            if ((s_slotSectors[i] >= _sectorPosition) && (s_slotSectors[i] - _sectorPosition < _count))
+            {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define JOURNAL_MAGIC "FATWAL1"       /* first 8 bytes of a journal file */
+#define JOURNAL_HEADER_SIZE 32        /* magic, bytes per sector, reserved, volume offset, reserved */
+#define JOURNAL_RECORD_HEADER_SIZE 24 /* type, CRC32C, sector position, sequence */
+
+#define JOURNAL_RECORD_SECTOR 1 /* followed by the sector data */
+#define JOURNAL_RECORD_COMMIT 2 /* sector position field holds the number of sector records */
+
+#define JOURNAL_CHECKPOINT_SECTORS 4096 /* committed sectors kept before they are written back */
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Open or create the write-ahead journal of the mounted volume>
+ *
+ * Sector writes are logged as full sector images. A batch ends with a
+ * commit record holding the CRC32C of its records and is made durable with
+ * one fsync. Committed sectors are written back (checkpoint) in ascending
+ * order once JOURNAL_CHECKPOINT_SECTORS are waiting and on close, then the
+ * journal is emptied. Opening a journal left by a crash replays every
+ * complete batch and checkpoints it; a torn last batch is dropped. Replay
+ * only rewrites sector images, running it twice gives the same volume.
+ *
+ * @param _journalName <Name of the journal file, created if it does not exist>.
+ * @param _bytePerSector <sector size of the volume>.
+ * @param _volumeOffset <byte offset of the volume in the image, a journal of another partition is refused>.
+ *
+ * @return <zero on success, non-zero if the file can not be used>.
+ */
+int OpenJournal(const char *_journalName, unsigned int _bytePerSector, uint64_t _volumeOffset);
+
+/*!
+ * @brief <Commit, checkpoint and close the journal>
+ *
+ * @param <none>.
+ *
+ * @return <zero if every logged sector reached the volume>.
+ */
+int CloseJournal();
+
+/*!
+ * @brief <Check that a journal is open>
+ *
+ * @param <none>.
+ *
+ * @return <non-zero if writes go through the journal>.
+ */
+int IsJournalOpen();
+
+/*!
+ * @brief <Log one sector in the current batch>
+ *
+ * Nothing reaches the disk before CommitJournal, reads see the sector at once.
+ *
+ * @param _sector <Pointer to the sector data>.
+ * @param _sectorPosition <sector position in the volume>.
+ *
+ * @return <zero on success>.
+ */
+int WriteJournalSector(const void *_sector, uint64_t _sectorPosition);
+
+/*!
+ * @brief <Append the current batch and its commit record, then fsync once>
+ *
+ * @param <none>.
+ *
+ * @return <zero on success>.
+ */
+int CommitJournal();
+
+/*!
+ * @brief <Write the committed sectors back in ascending order and empty the journal>
+ *
+ * @param <none>.
+ *
+ * @return <zero on success>.
+ */
+int CheckpointJournal();
+
+/*!
+ * @brief <Read one sector from the journal if it was logged and not written back yet>
+ *
+ * @param _sector <Pointer to a block of memory of bytePerSector bytes>.
+ * @param _sectorPosition <sector position in the volume>.
+ *
+ * @return <non-zero if the sector was read from the journal>.
+ */
+int ReadJournalSector(void *_sector, uint64_t _sectorPosition);
+
+/*!
+ * @brief <Replace the sectors of a block by their journal copy>
+ *
+ * @param _sectors <Pointer to _count sectors>.
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors>.
+ *
+ * @return <number of sectors replaced>.
+ */
+unsigned int PatchJournalSectors(void *_sectors, uint64_t _sectorPosition, unsigned int _count);
+
+/*!
+ * @brief <Check whether a range of sectors has any sector in the journal>
+ *
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors>.
+ *
+ * @return <non-zero if at least one sector of the range is in the journal>.
+ */
+int JournalIntersects(uint64_t _sectorPosition, uint64_t _count);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,420 @@
+#include "Overlay.h"
+#include "Stats.h"
+#include "HAL.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define REMAP_EMPTY 0xFFFFFFFFU
+#define REMAP_NO_SECTOR UINT64_MAX
+#define REMAP_MIN_CAPACITY 256 /* must be a power of two */
+
+/*
+ * One item of the remap table, sector of the base image -> record of the delta file
+ */
+typedef struct
+{
+    uint64_t sector; /* REMAP_NO_SECTOR if the item is free */
+    uint32_t slot;
+} RemapItem;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static unsigned int HashSector(uint64_t _sectorPosition);
+
+static uint32_t FindSlot(uint64_t _sectorPosition);
+
+static int InsertSlot(uint64_t _sectorPosition, uint32_t _slot);
+
+static uint64_t SlotOffset(uint32_t _slot);
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static FILE *s_delta = NULL;
+static unsigned int s_bytePerSector = 0;
+
+static RemapItem *s_remap = NULL;     /* open addressing, linear probing */
+static unsigned int s_remapCapacity = 0;
+static uint64_t *s_slotSectors = NULL; /* record -> sector, to walk all records */
+static unsigned int s_slotCount = 0;
+static unsigned int s_slotCapacity = 0;
+
+static uint64_t s_minSector = REMAP_NO_SECTOR; /* range of written sectors */
+static uint64_t s_maxSector = 0;
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+static uint64_t SlotOffset(uint32_t _slot)
+{
+    return OVERLAY_HEADER_SIZE + (uint64_t)_slot * (sizeof(uint64_t) + s_bytePerSector);
+}
+
+static unsigned int HashSector(uint64_t _sectorPosition)
+{
+    return (unsigned int)(_sectorPosition ^ (_sectorPosition >> 32)) * 2654435761U;
+}
+
+/* record of a sector, REMAP_EMPTY if it was never written */
+static uint32_t FindSlot(uint64_t _sectorPosition)
+{
+    unsigned int i;
+
+    if ((s_slotCount == 0) || (_sectorPosition < s_minSector) || (_sectorPosition > s_maxSector))
+    {
+        return REMAP_EMPTY;
+    }
+
+    i = HashSector(_sectorPosition) & (s_remapCapacity - 1);
+    while (s_remap[i].sector != REMAP_NO_SECTOR)
+    {
+        if (s_remap[i].sector == _sectorPosition)
+        {
+            return s_remap[i].slot;
+        }
+        i = (i + 1) & (s_remapCapacity - 1);
+    }
+
+    return REMAP_EMPTY;
+}
+
+/* add a record to the remap table, grown at 70% load, zero on success */
+static int InsertSlot(uint64_t _sectorPosition, uint32_t _slot)
+{
+    unsigned int i;
+
+    if ((s_slotCount + 1) * 10 > s_remapCapacity * 7)
+    {
+        const unsigned int capacity = (s_remapCapacity == 0) ? REMAP_MIN_CAPACITY : s_remapCapacity * 2;
+        RemapItem *remap = (RemapItem *)malloc(capacity * sizeof(RemapItem));
+
+        if (remap == NULL)
+        {
+            return 1;
+        }
+        memset(remap, 0xFF, capacity * sizeof(RemapItem));
+
+        for (i = 0; i < s_remapCapacity; i++)
+        {
+            if (s_remap[i].sector != REMAP_NO_SECTOR)
+            {
+                unsigned int j = HashSector(s_remap[i].sector) & (capacity - 1);
+
+                while (remap[j].sector != REMAP_NO_SECTOR)
+                {
+                    j = (j + 1) & (capacity - 1);
+                }
+                remap[j] = s_remap[i];
+            }
+        }
+
+        free(s_remap);
+        s_remap = remap;
+        s_remapCapacity = capacity;
+    }
+
+    if (s_slotCount == s_slotCapacity)
+    {
+        const unsigned int capacity = (s_slotCapacity == 0) ? REMAP_MIN_CAPACITY : s_slotCapacity * 2;
+        uint64_t *slotSectors = (uint64_t *)realloc(s_slotSectors, capacity * sizeof(uint64_t));
+
+        if (slotSectors == NULL)
+        {
+            return 1;
+        }
+        s_slotSectors = slotSectors;
+        s_slotCapacity = capacity;
+    }
+
+    i = HashSector(_sectorPosition) & (s_remapCapacity - 1);
+    while (s_remap[i].sector != REMAP_NO_SECTOR)
+    {
+        i = (i + 1) & (s_remapCapacity - 1);
+    }
+    s_remap[i].sector = _sectorPosition;
+    s_remap[i].slot = _slot;
+    s_slotSectors[_slot] = _sectorPosition;
+    s_slotCount++;
+
+    if (_sectorPosition < s_minSector)
+    {
+        s_minSector = _sectorPosition;
+    }
+    if (_sectorPosition > s_maxSector)
+    {
+        s_maxSector = _sectorPosition;
+    }
+
+    return 0;
+}
+
+/*!
+ * @brief <Open or create the delta file of a copy-on-write overlay>
+ *
+ * @param _deltaName <Name of the delta file>.
+ * @param _bytePerSector <sector size of the base image>.
+ *
+ * @return <zero on success, non-zero if the file can not be used>.
+ */
+int OpenOverlay(const char *_deltaName, unsigned int _bytePerSector)
+{
+    uint8_t header[OVERLAY_HEADER_SIZE];
+    int isFailed = 0;
+
+    CloseOverlay();
+    s_bytePerSector = _bytePerSector;
+
+    fopen_s(&s_delta, _deltaName, "r+b");
+    if (s_delta == NULL)
+    {
+        /* new overlay, nothing written yet */
+        fopen_s(&s_delta, _deltaName, "w+b");
+        if (s_delta == NULL)
+        {
+            return 1;
+        }
+
+        memset(header, 0, sizeof(header));
+        memcpy(header, OVERLAY_MAGIC, sizeof(OVERLAY_MAGIC));
+        memcpy(header + 8, &_bytePerSector, sizeof(uint32_t));
+        isFailed = (fwrite(header, 1, sizeof(header), s_delta) != sizeof(header));
+    }
+    else if ((fread(header, 1, sizeof(header), s_delta) != sizeof(header)) ||
+             (memcmp(header, OVERLAY_MAGIC, sizeof(OVERLAY_MAGIC)) != 0) ||
+             (memcmp(header + 8, &_bytePerSector, sizeof(uint32_t)) != 0))
+    {
+        isFailed = 1;
+    }
+    else
+    {
+        uint64_t sectorPosition;
+
+        /* replay the records, a torn last record is ignored */
+        while (!isFailed && (SeekFile(s_delta, SlotOffset(s_slotCount)) == 0) &&
+               (fread(&sectorPosition, sizeof(uint64_t), 1, s_delta) == 1))
+        {
+            if (SeekFile(s_delta, SlotOffset(s_slotCount + 1) - 1) != 0 || fgetc(s_delta) == EOF)
+            {
+                break;
+            }
+            isFailed = InsertSlot(sectorPosition, s_slotCount);
+        }
+    }
+
+    if (isFailed)
+    {
+        CloseOverlay();
+    }
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Flush and close the delta file>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void CloseOverlay()
+{
+    if (s_delta != NULL)
+    {
+        fclose(s_delta);
+    }
+
+    free(s_remap);
+    free(s_slotSectors);
+
+    s_delta = NULL;
+    s_remap = NULL;
+    s_remapCapacity = 0;
+    s_slotSectors = NULL;
+    s_slotCount = 0;
+    s_slotCapacity = 0;
+    s_minSector = REMAP_NO_SECTOR;
+    s_maxSector = 0;
+}
+
+/*!
+ * @brief <Check that an overlay is open>
+ *
+ * @param <none>.
+ *
+ * @return <non-zero if sectors can be written>.
+ */
+int IsOverlayOpen()
+{
+    return s_delta != NULL;
+}
+
+/*!
+ * @brief <Flush the delta file to the disk>
+ *
+ * @param <none>.
+ *
+ * @return <zero on success>.
+ */
+int SyncOverlay()
+{
+    return (s_delta == NULL) || (fflush(s_delta) != 0) || (SyncFile(s_delta) != 0);
+}
+
+/*!
+ * @brief <Read one sector from the overlay if it was written>
+ *
+ * @param _sector <Pointer to a block of memory of bytePerSector bytes>.
+ * @param _sectorPosition <sector position in the base image>.
+ *
+ * @return <non-zero if the sector was read from the overlay>.
+ */
+int ReadOverlaySector(void *_sector, uint64_t _sectorPosition)
+{
+    const uint32_t slot = FindSlot(_sectorPosition);
+
+    if (slot == REMAP_EMPTY)
+    {
+        return 0;
+    }
+
+    SeekFile(s_delta, SlotOffset(slot) + sizeof(uint64_t));
+    fread(_sector, 1, s_bytePerSector, s_delta);
+    GetVolumeStats()->overlaySectorsRead++;
+
+    return 1;
+}
+
+/*!
+ * @brief <Replace the sectors of a block read from the base image by their overlay copy>
+ *
+ * @param _sectors <Pointer to _count sectors read from the base image>.
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors>.
+ *
+ * @return <number of sectors replaced>.
+ */
+unsigned int PatchOverlaySectors(void *_sectors, uint64_t _sectorPosition, unsigned int _count)
+{
+    uint8_t *sectors = (uint8_t *)_sectors;
+    unsigned int patched = 0;
+    unsigned int i;
+
+    if (!OverlayIntersects(_sectorPosition, _count))
+    {
+        return 0;
+    }
+
+    /* look up every sector of a short range, walk the records for a long one */
+    if (_count <= s_slotCount)
+    {
+        for (i = 0; i < _count; i++)
+        {
+            patched += ReadOverlaySector(sectors + (size_t)i * s_bytePerSector, _sectorPosition + i);
+        }
+    }
+    else
+    {
+        for (i = 0; i < s_slotCount; i++)
+        {
+            const uint64_t sector = s_slotSectors[i];
+
+            if ((sector >= _sectorPosition) && (sector - _sectorPosition < _count))
+            {
+                patched += ReadOverlaySector(sectors + (size_t)(sector - _sectorPosition) * s_bytePerSector, sector);
+            }
+        }
+    }
+
+    return patched;
+}
+
+/*!
+ * @brief <Check whether a range of sectors has any sector in the overlay>
+ *
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors>.
+ *
+ * @return <non-zero if at least one sector of the range was written>.
+ */
+int OverlayIntersects(uint64_t _sectorPosition, uint64_t _count)
+{
+    uint64_t i;
+
+    if ((s_slotCount == 0) || (_count == 0) ||
+        (_sectorPosition > s_maxSector) || (_sectorPosition + _count - 1 < s_minSector))
+    {
+        return 0;
+    }
+
+    if (_count <= s_slotCount)
+    {
+        for (i = 0; i < _count; i++)
+        {
+            if (FindSlot(_sectorPosition + i) != REMAP_EMPTY)
+            {
+                return 1;
+            }
+        }
+    }
+    else
+    {
+        for (i = 0; i < s_slotCount; i++)
+        {
+            if ((s_slotSectors[i] >= _sectorPosition) && (s_slotSectors[i] - _sectorPosition < _count))
+            {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*!
+ * @brief <Store one sector in the overlay>
+ *
+ * @param _sector <Pointer to the sector data>.
+ * @param _sectorPosition <sector position in the base image>.
+ *
+ * @return <zero on success>.
+ */
+int WriteOverlaySector(const void *_sector, uint64_t _sectorPosition)
+{
+    uint32_t slot;
+    uint64_t sectorPosition = _sectorPosition;
+    int isFailed = (s_delta == NULL);
+
+    if (!isFailed)
+    {
+        slot = FindSlot(_sectorPosition);
+
+        if (slot == REMAP_EMPTY)
+        {
+            /* new record at the end of the file */
+            slot = s_slotCount;
+            isFailed = (SeekFile(s_delta, SlotOffset(slot)) != 0) ||
+                       (fwrite(&sectorPosition, sizeof(uint64_t), 1, s_delta) != 1) ||
+                       (fwrite(_sector, 1, s_bytePerSector, s_delta) != s_bytePerSector) ||
+                       (InsertSlot(sectorPosition, slot) != 0);
+        }
+        else
+        {
+            isFailed = (SeekFile(s_delta, SlotOffset(slot) + sizeof(uint64_t)) != 0) ||
+                       (fwrite(_sector, 1, s_bytePerSector, s_delta) != s_bytePerSector);
+        }
+    }
+
+    if (!isFailed)
+    {
+        GetVolumeStats()->overlaySectorsWritten++;
+    }
+
+    return isFailed;
+}
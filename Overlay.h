@@ -0,0 +1,99 @@
+#ifndef _OVERLAY_H_
+#define _OVERLAY_H_
+
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define OVERLAY_MAGIC "FATCOW2"  /* first 8 bytes of a delta file */
+#define OVERLAY_HEADER_SIZE 16   /* magic, bytes per sector, reserved */
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Open or create the delta file of a copy-on-write overlay>
+ *
+ * The delta file holds a header then one record per written sector:
+ * the sector position (uint64_t) followed by the sector data. Records are
+ * replayed into an in-memory remap table, a sector written again is
+ * updated in place.
+ *
+ * @param _deltaName <Name of the delta file>.
+ * @param _bytePerSector <sector size of the base image>.
+ *
+ * @return <zero on success, non-zero if the file can not be used>.
+ */
+int OpenOverlay(const char *_deltaName, unsigned int _bytePerSector);
+
+/*!
+ * @brief <Flush and close the delta file>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void CloseOverlay();
+
+/*!
+ * @brief <Check that an overlay is open>
+ *
+ * @param <none>.
+ *
+ * @return <non-zero if sectors can be written>.
+ */
+int IsOverlayOpen();
+
+/*!
+ * @brief <Flush the delta file to the disk>
+ *
+ * @param <none>.
+ *
+ * @return <zero on success>.
+ */
+int SyncOverlay();
+
+/*!
+ * @brief <Read one sector from the overlay if it was written>
+ *
+ * @param _sector <Pointer to a block of memory of bytePerSector bytes>.
+ * @param _sectorPosition <sector position in the base image>.
+ *
+ * @return <non-zero if the sector was read from the overlay>.
+ */
+int ReadOverlaySector(void *_sector, uint64_t _sectorPosition);
+
+/*!
+ * @brief <Replace the sectors of a block read from the base image by their overlay copy>
+ *
+ * @param _sectors <Pointer to _count sectors read from the base image>.
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors>.
+ *
+ * @return <number of sectors replaced>.
+ */
+unsigned int PatchOverlaySectors(void *_sectors, uint64_t _sectorPosition, unsigned int _count);
+
+/*!
+ * @brief <Check whether a range of sectors has any sector in the overlay>
+ *
+ * @param _sectorPosition <position of the first sector>.
+ * @param _count <number of sectors>.
+ *
+ * @return <non-zero if at least one sector of the range was written>.
+ */
+int OverlayIntersects(uint64_t _sectorPosition, uint64_t _count);
+
+/*!
+ * @brief <Store one sector in the overlay>
+ *
+ * @param _sector <Pointer to the sector data>.
+ * @param _sectorPosition <sector position in the base image>.
+ *
+ * @return <zero on success>.
+ */
+int WriteOverlaySector(const void *_sector, uint64_t _sectorPosition);
+
+#endif
\ No newline at end of file
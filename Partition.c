@@ -0,0 +1,472 @@
+#include "Partition.h"
+#include "FAT.h"
+#include "HAL.h"
+#include "Workers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define MBR_SECTOR_SIZE 512
+#define MBR_TABLE_OFFSET 446 /* 4 entries of 16 bytes */
+#define MBR_ENTRY_SIZE 16
+#define MBR_ENTRY_COUNT 4
+#define MBR_SIGNATURE_OFFSET 510
+#define MBR_FIRST_LOGICAL 5 /* number of the first partition of an extended partition */
+#define MBR_MAX_LOGICAL 128 /* protects the EBR chain against loops */
+
+#define MBR_TYPE_GPT 0xEE /* protective MBR */
+
+#define GPT_ENTRIES_LBA_OFFSET 72
+#define GPT_ENTRY_COUNT_OFFSET 80
+#define GPT_ENTRY_SIZE_OFFSET 84
+#define GPT_MAX_ENTRIES 1024
+#define GPT_MIN_ENTRY_SIZE 128
+#define GPT_FIRST_LBA_OFFSET 32
+#define GPT_LAST_LBA_OFFSET 40
+
+#define BOOT_JUMP_SHORT 0xEB
+#define BOOT_JUMP_NEAR 0xE9
+
+/*
+ * Scan state of one partition table
+ */
+typedef struct
+{
+    Partition *list;
+    unsigned int capacity;
+    unsigned int count;
+} PartitionList;
+
+/*
+ * Line of WritePartitionReport
+ */
+typedef struct
+{
+    const Partition *partition;
+    int isMounted;
+    unsigned int fatName;
+    unsigned int clusterCount;
+    uint32_t *fat;       /* decoded FAT, NULL when the files were counted while mounted */
+    VolumeSource source; /* the partition, walked by a thread */
+    unsigned int files;
+} PartitionScan;
+
+/*
+ * Partitions walked by one thread: first, first + step, ...
+ */
+typedef struct
+{
+    PartitionScan *scans;
+    unsigned int count;
+    unsigned int first;
+    unsigned int step;
+} PartitionWorker;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static int IsExtended(uint8_t _type);
+
+static int AddPartition(PartitionList *_partitions, uint64_t _offset, uint64_t _size,
+                        unsigned int _number, uint8_t _scheme, uint8_t _type);
+
+static void ReadMBR(PartitionList *_partitions, const uint8_t *_mbr);
+
+static int ReadGPT(PartitionList *_partitions, unsigned int _sectorSize);
+
+static int CountFile(DirectoryEntry *entry, const char *path, void *context);
+
+static int CountPartitionFiles(void *_worker, int _isInline);
+
+static void MountScan(PartitionScan *_scan, FILE *_reader);
+
+static unsigned int AddSuperfloppy(Partition *_list);
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/*!
+ * @brief <Check that a sector is a FAT12/16/32 or exFAT boot sector>
+ *
+ * @param _sector <first 512 bytes of the sector>.
+ *
+ * @return <non-zero if it is a boot sector>.
+ */
+int IsBootSector(const uint8_t *_sector)
+{
+    const BIOSParam *param = (const BIOSParam *)(_sector + BIOS_PARAM_OFFSET);
+    const unsigned int bytePerSector = (unsigned int)ReadNumber(2, param->bytePerSector);
+    const unsigned int secPerCluster = param->secPerCluster;
+    int isBoot = (memcmp(_sector + 3, "EXFAT   ", 8) == 0);
+
+    /* no signature of its own, the BIOS Param must be sane */
+    if (!isBoot && ((_sector[0] == BOOT_JUMP_SHORT) || (_sector[0] == BOOT_JUMP_NEAR)))
+    {
+        isBoot = (bytePerSector >= 512) && (bytePerSector <= 4096) &&
+                 ((bytePerSector & (bytePerSector - 1)) == 0) &&
+                 (secPerCluster != 0) && ((secPerCluster & (secPerCluster - 1)) == 0) &&
+                 (ReadNumber(2, param->numReservedSector) != 0) &&
+                 (param->numFAT != 0) && (param->numFAT <= 4);
+    }
+
+    return isBoot;
+}
+
+/* extended partition types of CHS, LBA and Linux tools */
+static int IsExtended(uint8_t _type)
+{
+    return (_type == 0x05) || (_type == 0x0F) || (_type == 0x85);
+}
+
+/* keep a partition if its first sector is a boot sector, non-zero when _list is full */
+static int AddPartition(PartitionList *_partitions, uint64_t _offset, uint64_t _size,
+                        unsigned int _number, uint8_t _scheme, uint8_t _type)
+{
+    uint8_t sector[MBR_SECTOR_SIZE];
+
+    if ((_partitions->count < _partitions->capacity) && (_size > 0))
+    {
+        ReadImg(sector, _offset, sizeof(sector));
+        if (IsBootSector(sector))
+        {
+            Partition *partition = &_partitions->list[_partitions->count++];
+
+            partition->offset = _offset;
+            partition->size = _size;
+            partition->number = _number;
+            partition->scheme = _scheme;
+            partition->type = _type;
+        }
+    }
+
+    return (_partitions->count == _partitions->capacity);
+}
+
+/* primary entries, then the logical partitions of the extended partition */
+static void ReadMBR(PartitionList *_partitions, const uint8_t *_mbr)
+{
+    uint8_t ebr[MBR_SECTOR_SIZE];
+    unsigned int i;
+    int isFull = 0;
+
+    for (i = 0; (i < MBR_ENTRY_COUNT) && !isFull; i++)
+    {
+        const uint8_t *entry = _mbr + MBR_TABLE_OFFSET + i * MBR_ENTRY_SIZE;
+        const uint8_t type = entry[4];
+        const uint64_t start = ReadNumber(4, entry + 8);
+        const uint64_t count = ReadNumber(4, entry + 12);
+
+        if (IsExtended(type))
+        {
+            /* every EBR: entry 0 relative to itself, entry 1 to the extended partition */
+            uint64_t ebrStart = start;
+            unsigned int logical;
+
+            for (logical = 0; (logical < MBR_MAX_LOGICAL) && (ebrStart != 0) && !isFull; logical++)
+            {
+                const uint8_t *first = ebr + MBR_TABLE_OFFSET;
+                const uint8_t *next = first + MBR_ENTRY_SIZE;
+
+                ReadImg(ebr, ebrStart * MBR_SECTOR_SIZE, sizeof(ebr));
+                if ((ebr[MBR_SIGNATURE_OFFSET] != 0x55) || (ebr[MBR_SIGNATURE_OFFSET + 1] != 0xAA))
+                {
+                    break;
+                }
+
+                if (first[4] != 0)
+                {
+                    isFull = AddPartition(_partitions,
+                                          (ebrStart + ReadNumber(4, first + 8)) * MBR_SECTOR_SIZE,
+                                          ReadNumber(4, first + 12) * MBR_SECTOR_SIZE,
+                                          MBR_FIRST_LOGICAL + logical, PARTITION_MBR, first[4]);
+                }
+
+                ebrStart = (IsExtended(next[4]) && (ReadNumber(4, next + 8) != 0)) ? start + ReadNumber(4, next + 8) : 0;
+            }
+        }
+        else if (type != 0)
+        {
+            isFull = AddPartition(_partitions, start * MBR_SECTOR_SIZE, count * MBR_SECTOR_SIZE,
+                                  i + 1, PARTITION_MBR, type);
+        }
+    }
+}
+
+/* partition entries of the GPT header at LBA 1, zero if there is no header */
+static int ReadGPT(PartitionList *_partitions, unsigned int _sectorSize)
+{
+    static const uint8_t unused[16] = {0};
+    uint8_t header[MBR_SECTOR_SIZE];
+    uint8_t *entries = NULL;
+    uint64_t entryCount;
+    uint64_t entrySize;
+    unsigned int i;
+    int isFound;
+
+    ReadImg(header, _sectorSize, sizeof(header));
+    isFound = (memcmp(header, "EFI PART", 8) == 0);
+
+    entryCount = ReadNumber(4, header + GPT_ENTRY_COUNT_OFFSET);
+    entrySize = ReadNumber(4, header + GPT_ENTRY_SIZE_OFFSET);
+
+    if (isFound && (entryCount <= GPT_MAX_ENTRIES) &&
+        (entrySize >= GPT_MIN_ENTRY_SIZE) && (entrySize <= _sectorSize))
+    {
+        /* the whole entry array with one read */
+        entries = (uint8_t *)malloc((size_t)(entryCount * entrySize));
+    }
+
+    if (entries != NULL)
+    {
+        int isFull = 0;
+
+        ReadImg(entries, ReadNumber(8, header + GPT_ENTRIES_LBA_OFFSET) * _sectorSize, (size_t)(entryCount * entrySize));
+
+        for (i = 0; (i < entryCount) && !isFull; i++)
+        {
+            const uint8_t *entry = entries + i * entrySize;
+            const uint64_t first = ReadNumber(8, entry + GPT_FIRST_LBA_OFFSET);
+            const uint64_t last = ReadNumber(8, entry + GPT_LAST_LBA_OFFSET);
+
+            /* the type GUID of an unused entry is all zero */
+            if ((memcmp(entry, unused, sizeof(unused)) != 0) && (last >= first))
+            {
+                isFull = AddPartition(_partitions, first * _sectorSize, (last - first + 1) * _sectorSize,
+                                      i + 1, PARTITION_GPT, 0);
+            }
+        }
+
+        free(entries);
+    }
+
+    return isFound;
+}
+
+/*!
+ * @brief <Find the FAT12/16/32 and exFAT partitions of the opened image>
+ *
+ * @param _list <array receiving the partitions>.
+ * @param _capacity <number of items of _list>.
+ *
+ * @return <number of partitions found, 0 if the image has no partition table>.
+ */
+unsigned int FindPartitions(Partition *_list, unsigned int _capacity)
+{
+    uint8_t mbr[MBR_SECTOR_SIZE];
+    PartitionList partitions;
+    int isProtective = 0;
+    unsigned int i;
+
+    partitions.list = _list;
+    partitions.capacity = _capacity;
+    partitions.count = 0;
+
+    ReadImg(mbr, 0, sizeof(mbr));
+
+    if (!IsBootSector(mbr) && (mbr[MBR_SIGNATURE_OFFSET] == 0x55) && (mbr[MBR_SIGNATURE_OFFSET + 1] == 0xAA))
+    {
+        for (i = 0; i < MBR_ENTRY_COUNT; i++)
+        {
+            isProtective = isProtective || (mbr[MBR_TABLE_OFFSET + i * MBR_ENTRY_SIZE + 4] == MBR_TYPE_GPT);
+        }
+
+        /* GPT disks of 512 or 4096 bytes logical sectors */
+        if (!isProtective || (!ReadGPT(&partitions, 512) && !ReadGPT(&partitions, 4096)))
+        {
+            ReadMBR(&partitions, mbr);
+        }
+    }
+
+    return partitions.count;
+}
+
+/* WalkTree visitor, count files */
+static int CountFile(DirectoryEntry *entry, const char *path, void *context)
+{
+    (void)path;
+    if (!(entry->attributes & ENTRY_DIRECTORY))
+    {
+        (*(unsigned int *)context)++;
+    }
+
+    return 0;
+}
+
+/*!
+ * @brief <Count the files of a share of the partitions, body of RunWorkers>
+ *
+ * @param _worker <Pointer to a PartitionWorker object>.
+ * @param _isInline <non-zero on the calling thread>.
+ *
+ * @return <zero, every share reads through the shared handle>.
+ */
+static int CountPartitionFiles(void *_worker, int _isInline)
+{
+    PartitionWorker *worker = (PartitionWorker *)_worker;
+    unsigned int i;
+
+    for (i = worker->first; i < worker->count; i += worker->step)
+    {
+        PartitionScan *scan = &worker->scans[i];
+
+        if (scan->fat != NULL)
+        {
+            WalkTreeFrom(&scan->source, 0, "", WALK_MAX_DEPTH, CountFile, &scan->files);
+        }
+    }
+
+    (void)_isInline;
+    return 0;
+}
+
+/*!
+ * @brief <Mount a partition, keep its geometry and decoded FAT for a thread>
+ *
+ * The files of exFAT partitions, or of every partition without _reader,
+ * are counted here while the partition is mounted.
+ *
+ * @param _scan <Pointer to a PartitionScan object with its partition set>.
+ * @param _reader <image handle shared by the threads, or NULL>.
+ *
+ * @return <none>.
+ */
+static void MountScan(PartitionScan *_scan, FILE *_reader)
+{
+    const Partition *partition = _scan->partition;
+
+    /* same image handle, only the boot sector and the FAT cache change */
+    if (FatMountPartition(partition->offset, partition->size) != 0)
+    {
+        return;
+    }
+
+    _scan->isMounted = 1;
+    _scan->clusterCount = GetClusterCount();
+    switch (GetFatType())
+    {
+    case FAT_TYPE_EXFAT:
+        _scan->fatName = 3;
+        break;
+    case FAT_TYPE_32:
+        _scan->fatName = 2;
+        break;
+    case FAT_TYPE_16:
+        _scan->fatName = 1;
+        break;
+    default:
+        _scan->fatName = 0;
+        break;
+    }
+
+    if ((_reader != NULL) && (GetFatType() != FAT_TYPE_EXFAT))
+    {
+        _scan->fat = (uint32_t *)malloc(((size_t)_scan->clusterCount + FIRST_CLUSTER) * sizeof(uint32_t));
+    }
+
+    if (_scan->fat != NULL)
+    {
+        DecodeFATEntries(0, _scan->clusterCount + FIRST_CLUSTER, _scan->fat);
+        GetVolumeSource(&_scan->source, _reader, _scan->fat);
+    }
+    else
+    {
+        WalkTree(0, "", CountFile, &_scan->files);
+    }
+}
+
+/* whole image as the only partition when sector 0 is a boot sector, return the count */
+static unsigned int AddSuperfloppy(Partition *_list)
+{
+    uint8_t sector[MBR_SECTOR_SIZE];
+    uint64_t mtime;
+
+    ReadImg(sector, 0, sizeof(sector));
+    if (!IsBootSector(sector) || (GetPartitionOffset() != 0) || (GetImgInfo(&_list[0].size, &mtime) != 0))
+    {
+        return 0;
+    }
+
+    _list[0].offset = 0;
+    _list[0].number = 1;
+    _list[0].scheme = PARTITION_NONE;
+    _list[0].type = 0;
+    return 1;
+}
+
+/*!
+ * @brief <Mount every FAT partition of the opened image in turn and print a summary>
+ *
+ * @param _report <Pointer to a FILE object receiving the list>.
+ *
+ * @return <number of partitions, 1 for a superfloppy>.
+ */
+unsigned int WritePartitionReport(FILE *_report)
+{
+    static const char *const fatNames[] = {"FAT12", "FAT16", "FAT32", "exFAT"};
+    static const char *const schemeNames[] = {"none", "mbr", "gpt"};
+    Partition *partitions = (Partition *)malloc(MAX_PARTITIONS * sizeof(Partition));
+    PartitionScan *scans = (PartitionScan *)calloc(MAX_PARTITIONS, sizeof(PartitionScan));
+    PartitionWorker workers[WORKERS_MAX_THREADS];
+    FILE *reader = OpenImgReader();
+    unsigned int threadCount;
+    unsigned int count = 0;
+    unsigned int t;
+    unsigned int i;
+
+    if ((partitions != NULL) && (scans != NULL))
+    {
+        count = FindPartitions(partitions, MAX_PARTITIONS);
+        if (count == 0)
+        {
+            count = AddSuperfloppy(partitions);
+        }
+    }
+
+    /* boot sectors and FATs are read in turn, the trees are walked together */
+    for (i = 0; i < count; i++)
+    {
+        scans[i].partition = &partitions[i];
+        MountScan(&scans[i], reader);
+    }
+
+    /* no more threads than partitions */
+    threadCount = GetWorkerCount(count, 1);
+
+    for (t = 0; t < threadCount; t++)
+    {
+        workers[t].scans = scans;
+        workers[t].count = count;
+        workers[t].first = t;
+        workers[t].step = threadCount;
+    }
+
+    RunWorkers(workers, sizeof(PartitionWorker), threadCount, CountPartitionFiles);
+
+    fprintf(_report, "part scheme type           offset             size    fs   clusters    files\n");
+    for (i = 0; i < count; i++)
+    {
+        const PartitionScan *scan = &scans[i];
+        const Partition *partition = scan->partition;
+
+        if (scan->isMounted)
+        {
+            fprintf(_report, "%4u %6s 0x%02X %16llu %16llu %5s %10u %8u\n",
+                    partition->number, schemeNames[partition->scheme], partition->type,
+                    (unsigned long long)partition->offset, (unsigned long long)partition->size,
+                    fatNames[scan->fatName], scan->clusterCount, scan->files);
+        }
+        free(scan->fat);
+    }
+
+    if (reader != NULL)
+    {
+        fclose(reader);
+    }
+    free(scans);
+    free(partitions);
+    return count;
+}
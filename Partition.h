@@ -0,0 +1,73 @@
+#ifndef _PARTITION_H_
+#define _PARTITION_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define PARTITION_NONE 0 /* no partition table, the whole image is the volume */
+#define PARTITION_MBR 1
+#define PARTITION_GPT 2
+
+#define MAX_PARTITIONS 64 /* FAT partitions reported by FindPartitions at most */
+
+/*
+ * FAT partition found in the partition table of a full disk image
+ */
+typedef struct
+{
+    uint64_t offset;     /* byte offset of the boot sector in the image */
+    uint64_t size;       /* bytes */
+    unsigned int number; /* entry of the table from 1, MBR logical partitions from 5 */
+    uint8_t scheme;      /* PARTITION_NONE, PARTITION_MBR or PARTITION_GPT */
+    uint8_t type;        /* MBR partition type, 0 on GPT */
+} Partition;
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Find the FAT12/16/32 and exFAT partitions of the opened image>
+ *
+ * GPT is read when the protective MBR says so, otherwise the primary MBR
+ * entries and the chain of extended boot records. Only partitions whose
+ * boot sector is a FAT or exFAT boot sector are returned, in table order.
+ * Sector 0 itself being a boot sector means there is no partition table.
+ *
+ * @param _list <array receiving the partitions>.
+ * @param _capacity <number of items of _list>.
+ *
+ * @return <number of partitions found, 0 if the image has no partition table>.
+ */
+unsigned int FindPartitions(Partition *_list, unsigned int _capacity);
+
+/*!
+ * @brief <Check that a sector is a FAT12/16/32 or exFAT boot sector>
+ *
+ * @param _sector <first 512 bytes of the sector>.
+ *
+ * @return <non-zero if it is a boot sector>.
+ */
+int IsBootSector(const uint8_t *_sector);
+
+/*!
+ * @brief <Mount every FAT partition of the opened image in turn and print a summary>
+ *
+ * One line per partition: number, scheme, MBR type, byte offset, size, file system,
+ * clusters and files. An image without a partition table, a superfloppy, is
+ * listed as partition 1 of scheme "none" at offset 0, as --partition 1 mounts it. The boot sector and the FAT of every partition are read
+ * in turn through the HAL, the last one listed stays mounted. The trees are
+ * then walked by up to WORKERS_MAX_THREADS threads (one on Windows)
+ * sharing one more handle of the image. exFAT partitions, and all of them
+ * with an overlay or a journal attached, are walked while mounted.
+ *
+ * @param _report <Pointer to a FILE object receiving the list>.
+ *
+ * @return <number of partitions, 1 for a superfloppy>.
+ */
+unsigned int WritePartitionReport(FILE *_report);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,575 @@
+#include "Recover.h"
+#include "FAT.h"
+#include "HAL.h"
+#include "Workers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define CARVE_BATCH_CLUSTERS 128 /* free clusters read per ReadNSectors call */
+#define CARVE_MIN_BYTES_PER_THREAD (16 * 1024 * 1024) /* a smaller data region is not worth a thread */
+#define CARVE_TAIL_MAX 16        /* longest trailer */
+#define IS_ALLOCATED(bitmap, index) (((bitmap)[(index) / 8] >> ((index) % 8)) & 1)
+
+/*
+ * Known file format, recognized by its first bytes
+ */
+typedef struct
+{
+    const char *type;
+    const char *header;
+    size_t headerLength;
+    const char *trailer; /* NULL if the format has no trailer */
+    size_t trailerLength;
+} Signature;
+
+/*
+ * State of one ListDeleted call
+ */
+typedef struct
+{
+    uint32_t *fat;
+    unsigned int entryCount;
+    unsigned int bytePerCluster;
+    const char *directoryPath;
+    const char *outDir;
+    FILE *report;
+    int count;
+} DeletedContext;
+
+/*
+ * File found by a thread, reported once every thread is done
+ */
+typedef struct
+{
+    unsigned int startCluster;
+    const Signature *signature;
+    uint64_t size;
+    int isComplete;
+} CarvedFile;
+
+/*
+ * State of the carving of one thread
+ */
+typedef struct
+{
+    const Signature *signature; /* format of the open file, NULL if none */
+    unsigned int startCluster;
+    uint64_t size;
+    uint8_t tail[CARVE_TAIL_MAX]; /* end of the previous cluster, for trailers across clusters */
+    size_t tailLength;
+    FILE *out;
+    const char *outDir;
+    CarvedFile *files;
+    unsigned int count;
+    unsigned int capacity;
+} CarveContext;
+
+/*
+ * Clusters of one thread, files starting in [begin, end) are followed past end
+ */
+typedef struct
+{
+    CarveContext carve;
+    const uint8_t *allocated;
+    unsigned int begin;
+    unsigned int end;
+} CarveWorker;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static const uint8_t *FindBytes(const uint8_t *_data, size_t _length, const char *_pattern, size_t _patternLength);
+
+static FILE *CreateOutput(const char *_outDir, const char *_name);
+
+static int IsRunFree(const DeletedContext *_deleted, unsigned int _startCluster, unsigned int _count);
+
+static int ReportDeleted(DirectoryEntry *entry, const char *path, void *context);
+
+static int ScanDeleted(DirectoryEntry *entry, const char *path, void *context);
+
+static const Signature *MatchSignature(const uint8_t *_data);
+
+static void OpenCarve(CarveContext *_carve, const Signature *_signature, unsigned int _cluster);
+
+static void CloseCarve(CarveContext *_carve, int _isComplete);
+
+static void AppendCarve(CarveContext *_carve, const uint8_t *_data, size_t _length, size_t _skip);
+
+static int CarveClusters(void *_worker, int _isInline);
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static const Signature s_signatures[] = {
+    {"jpg", "\xFF\xD8\xFF", 3, "\xFF\xD9", 2},
+    {"png", "\x89PNG\r\n\x1A\n", 8, "IEND\xAE\x42\x60\x82", 8},
+    {"gif", "GIF8", 4, "\x00\x3B", 2},
+    {"pdf", "%PDF-", 5, "%%EOF", 5},
+    {"zip", "PK\x03\x04", 4, NULL, 0},
+};
+
+#define SIGNATURE_COUNT (sizeof(s_signatures) / sizeof(s_signatures[0]))
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/* first occurrence of _pattern, NULL if none */
+static const uint8_t *FindBytes(const uint8_t *_data, size_t _length, const char *_pattern, size_t _patternLength)
+{
+    const uint8_t *end = _data + _length;
+    const uint8_t *candidate = _data;
+
+    while ((size_t)(end - candidate) >= _patternLength)
+    {
+        candidate = (const uint8_t *)memchr(candidate, (uint8_t)_pattern[0], end - candidate - _patternLength + 1);
+        if (candidate == NULL)
+        {
+            break;
+        }
+        if (memcmp(candidate, _pattern, _patternLength) == 0)
+        {
+            return candidate;
+        }
+        candidate++;
+    }
+
+    return NULL;
+}
+
+/* "<_outDir>/<_name>" opened for writing */
+static FILE *CreateOutput(const char *_outDir, const char *_name)
+{
+    char fileName[FAT_MAX_PATH * 2];
+    FILE *out = NULL;
+    const int length = snprintf(fileName, sizeof(fileName), "%s/%s", _outDir, _name);
+
+    /* a truncated name would write another file */
+    if ((length > 0) && ((size_t)length < sizeof(fileName)))
+    {
+        fopen_s(&out, fileName, "wb");
+    }
+
+    return out;
+}
+
+static int IsRunFree(const DeletedContext *_deleted, unsigned int _startCluster, unsigned int _count)
+{
+    unsigned int i;
+
+    if ((_startCluster < FIRST_CLUSTER) || (_startCluster + _count > _deleted->entryCount))
+    {
+        return 0;
+    }
+
+    for (i = 0; i < _count; i++)
+    {
+        if (_deleted->fat[_startCluster + i] != 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* ScanDirectory visitor, every deleted slot of one directory */
+static int ReportDeleted(DirectoryEntry *entry, const char *path, void *context)
+{
+    DeletedContext *deleted = (DeletedContext *)context;
+    const int isDirectory = (entry->attributes & ENTRY_DIRECTORY) != 0;
+    const unsigned int startCluster = GetEntryCluster(entry);
+    const unsigned int size = isDirectory ? 0 : GetSizeofFile(entry);
+    unsigned int needed;
+    char name[14];
+    size_t length;
+    int isRecoverable;
+
+    (void)path;
+    if ((entry->name[0] != ENTRY_DELETED) || (entry->attributes == ENTRY_NAME) ||
+        (entry->attributes & ENTRY_VOLUME))
+    {
+        return 0;
+    }
+
+    GetName(name, entry);
+    name[0] = '?';
+    length = strlen(name);
+    if ((length > 0) && (name[length - 1] == '.'))
+    {
+        name[length - 1] = '\0';
+    }
+
+    /* a directory needs its first cluster, a file only clusters for its size */
+    needed = isDirectory ? 1 : (unsigned int)(((uint64_t)size + deleted->bytePerCluster - 1) / deleted->bytePerCluster);
+    isRecoverable = (needed > 0) && IsRunFree(deleted, startCluster, needed);
+
+    fprintf(deleted->report, "%c %u %u %s %s/%s\n", isDirectory ? 'd' : 'f', startCluster, size,
+            isRecoverable ? "RECOVERABLE" : "OVERWRITTEN", deleted->directoryPath, name);
+    deleted->count++;
+
+    /* contiguous reconstruction, the chain itself was cleared */
+    if (isRecoverable && !isDirectory && (deleted->outDir != NULL))
+    {
+        char outName[32];
+        FILE *out;
+
+        name[0] = '_';
+        sprintf(outName, "%u_%s", startCluster, name);
+        out = CreateOutput(deleted->outDir, outName);
+        if (out != NULL)
+        {
+            SendSectors(out, ClusterToSector(startCluster), size);
+            fclose(out);
+        }
+    }
+
+    return 0;
+}
+
+/* WalkTree visitor, scan the slots of every live directory */
+static int ScanDeleted(DirectoryEntry *entry, const char *path, void *context)
+{
+    DeletedContext *deleted = (DeletedContext *)context;
+
+    if (entry->attributes & ENTRY_DIRECTORY)
+    {
+        const char *parentPath = deleted->directoryPath;
+
+        deleted->directoryPath = path;
+        ScanDirectory(GetEntryCluster(entry), ReportDeleted, deleted);
+        deleted->directoryPath = parentPath;
+    }
+
+    return 0;
+}
+
+/*!
+ * @brief <List the deleted entries of every directory of the mounted image>
+ *
+ * @param _report <Pointer to a FILE object receiving the list>.
+ * @param _outDir <existing folder receiving the recovered files, or NULL>.
+ *
+ * @return <number of deleted entries>.
+ */
+int ListDeleted(FILE *_report, const char *_outDir)
+{
+    DeletedContext deleted;
+
+    memset(&deleted, 0, sizeof(deleted));
+    deleted.entryCount = GetClusterCount() + FIRST_CLUSTER;
+    deleted.bytePerCluster = GetBytePerSector() * GetSectorPerCluster();
+    deleted.directoryPath = "";
+    deleted.outDir = _outDir;
+    deleted.report = _report;
+    deleted.fat = (uint32_t *)malloc(deleted.entryCount * sizeof(uint32_t));
+
+    if (deleted.fat != NULL)
+    {
+        DecodeFATEntries(0, deleted.entryCount, deleted.fat);
+
+        ScanDirectory(0, ReportDeleted, &deleted);
+        WalkTree(0, "", ScanDeleted, &deleted);
+
+        free(deleted.fat);
+    }
+
+    return deleted.count;
+}
+
+/* format whose header starts _data, NULL if none */
+static const Signature *MatchSignature(const uint8_t *_data)
+{
+    unsigned int i;
+
+    for (i = 0; i < SIGNATURE_COUNT; i++)
+    {
+        if (memcmp(_data, s_signatures[i].header, s_signatures[i].headerLength) == 0)
+        {
+            return &s_signatures[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void OpenCarve(CarveContext *_carve, const Signature *_signature, unsigned int _cluster)
+{
+    _carve->signature = _signature;
+    _carve->startCluster = _cluster;
+    _carve->size = 0;
+    _carve->tailLength = 0;
+    _carve->out = NULL;
+
+    if (_carve->outDir != NULL)
+    {
+        char outName[32];
+
+        sprintf(outName, "%u.%s", _cluster, _signature->type);
+        _carve->out = CreateOutput(_carve->outDir, outName);
+    }
+}
+
+static void CloseCarve(CarveContext *_carve, int _isComplete)
+{
+    if (_carve->signature != NULL)
+    {
+        if (_carve->count == _carve->capacity)
+        {
+            unsigned int capacity = (_carve->capacity == 0) ? 64 : _carve->capacity * 2;
+            CarvedFile *files = (CarvedFile *)realloc(_carve->files, capacity * sizeof(CarvedFile));
+
+            if (files != NULL)
+            {
+                _carve->files = files;
+                _carve->capacity = capacity;
+            }
+        }
+        if (_carve->count < _carve->capacity)
+        {
+            CarvedFile *file = &_carve->files[_carve->count++];
+
+            file->startCluster = _carve->startCluster;
+            file->signature = _carve->signature;
+            file->size = _carve->size;
+            file->isComplete = _isComplete;
+        }
+
+        if (_carve->out != NULL)
+        {
+            fclose(_carve->out);
+        }
+    }
+
+    _carve->signature = NULL;
+    _carve->out = NULL;
+}
+
+/* add one cluster to the open file, close it at its trailer */
+static void AppendCarve(CarveContext *_carve, const uint8_t *_data, size_t _length, size_t _skip)
+{
+    const Signature *signature = _carve->signature;
+    size_t end = _length;
+    int isComplete = 0;
+
+    if (signature->trailer != NULL)
+    {
+        const uint8_t *found = NULL;
+
+        /* trailer starting in the previous cluster */
+        if (_carve->tailLength > 0)
+        {
+            uint8_t joined[CARVE_TAIL_MAX * 2];
+            size_t head = (_length < signature->trailerLength) ? _length : signature->trailerLength;
+
+            memcpy(joined, _carve->tail, _carve->tailLength);
+            memcpy(joined + _carve->tailLength, _data, head);
+            found = FindBytes(joined, _carve->tailLength + head, signature->trailer, signature->trailerLength);
+            if (found != NULL)
+            {
+                end = (found - joined) + signature->trailerLength - _carve->tailLength;
+                isComplete = 1;
+            }
+        }
+
+        if (!isComplete)
+        {
+            found = FindBytes(_data + _skip, _length - _skip, signature->trailer, signature->trailerLength);
+            if (found != NULL)
+            {
+                end = (found - _data) + signature->trailerLength;
+                isComplete = 1;
+            }
+        }
+
+        _carve->tailLength = signature->trailerLength - 1;
+        if (_carve->tailLength > _length)
+        {
+            _carve->tailLength = _length;
+        }
+        memcpy(_carve->tail, _data + _length - _carve->tailLength, _carve->tailLength);
+    }
+
+    if (_carve->out != NULL)
+    {
+        fwrite(_data, 1, end, _carve->out);
+    }
+    _carve->size += end;
+
+    if (isComplete)
+    {
+        CloseCarve(_carve, 1);
+    }
+}
+
+/*!
+ * @brief <Carve the free clusters of a share, body of RunWorkers>
+ *
+ * A file starting in the share is followed past its end, up to its trailer,
+ * the next signature or the next allocated cluster, like a single pass
+ * would do; the next share ignores it. A thread reads through its own
+ * handle of the image, an inline share through the HAL.
+ *
+ * @param _worker <Pointer to a CarveWorker object>.
+ * @param _isInline <non-zero on the calling thread>.
+ *
+ * @return <non-zero if the image can not be opened by the thread>.
+ */
+static int CarveClusters(void *_worker, int _isInline)
+{
+    CarveWorker *worker = (CarveWorker *)_worker;
+    CarveContext *carve = &worker->carve;
+    const unsigned int entryCount = GetClusterCount() + FIRST_CLUSTER;
+    const unsigned int sectorPerCluster = GetSectorPerCluster();
+    const unsigned int bytePerCluster = GetBytePerSector() * sectorPerCluster;
+    unsigned int cluster = worker->begin;
+    int isDone = 0;
+    FILE *reader = NULL;
+    uint8_t *buffer;
+
+    if (!_isInline)
+    {
+        reader = OpenImgReader();
+        if (reader == NULL)
+        {
+            return 1;
+        }
+    }
+
+    buffer = (uint8_t *)malloc((size_t)CARVE_BATCH_CLUSTERS * bytePerCluster);
+
+    while ((buffer != NULL) && !isDone && (cluster < entryCount) &&
+           ((cluster < worker->end) || (carve->signature != NULL)))
+    {
+        unsigned int count = 0;
+        unsigned int i;
+
+        /* allocated space is never read, a file can not continue across it */
+        while ((cluster + count < entryCount) && (count < CARVE_BATCH_CLUSTERS) &&
+               ((cluster >= worker->end) || (cluster + count < worker->end)) &&
+               !IS_ALLOCATED(worker->allocated, cluster + count - FIRST_CLUSTER))
+        {
+            count++;
+        }
+
+        if (count == 0)
+        {
+            CloseCarve(carve, 0);
+            cluster++;
+        }
+        else
+        {
+            if (reader != NULL)
+            {
+                ReadSectorsFrom(reader, buffer, ClusterToSector(cluster), count * sectorPerCluster);
+            }
+            else
+            {
+                ReadNSectors(buffer, ClusterToSector(cluster), count * sectorPerCluster);
+            }
+
+            for (i = 0; (i < count) && !isDone; i++)
+            {
+                const uint8_t *data = buffer + (size_t)i * bytePerCluster;
+                const Signature *signature = MatchSignature(data);
+
+                if (cluster + i >= worker->end)
+                {
+                    /* past the share only the open file goes on */
+                    if ((signature != NULL) || (carve->signature == NULL))
+                    {
+                        CloseCarve(carve, 0);
+                        isDone = 1;
+                    }
+                    else
+                    {
+                        AppendCarve(carve, data, bytePerCluster, 0);
+                    }
+                }
+                /* files start on a cluster boundary */
+                else if (signature != NULL)
+                {
+                    CloseCarve(carve, 0);
+                    OpenCarve(carve, signature, cluster + i);
+                    AppendCarve(carve, data, bytePerCluster, signature->headerLength);
+                }
+                else if (carve->signature != NULL)
+                {
+                    AppendCarve(carve, data, bytePerCluster, 0);
+                }
+            }
+
+            cluster += count;
+        }
+    }
+
+    CloseCarve(carve, 0);
+
+    if (reader != NULL)
+    {
+        fclose(reader);
+    }
+    free(buffer);
+    return 0;
+}
+
+/*!
+ * @brief <Look for known file signatures at the start of every free cluster>
+ *
+ * @param _report <Pointer to a FILE object receiving the list>.
+ * @param _outDir <existing folder receiving the carved files, or NULL>.
+ *
+ * @return <number of carved files>.
+ */
+int CarveFreeSpace(FILE *_report, const char *_outDir)
+{
+    const unsigned int clusterCount = GetClusterCount();
+    const uint64_t bytePerCluster = (uint64_t)GetBytePerSector() * GetSectorPerCluster();
+    uint8_t *allocated = LoadAllocationBitmap();
+    CarveWorker workers[WORKERS_MAX_THREADS];
+    unsigned int threadCount;
+    int count = 0;
+    unsigned int t;
+    unsigned int i;
+
+    if (allocated == NULL)
+    {
+        return 0;
+    }
+
+    threadCount = GetWorkerCount(clusterCount * bytePerCluster, CARVE_MIN_BYTES_PER_THREAD);
+
+    for (t = 0; t < threadCount; t++)
+    {
+        memset(&workers[t], 0, sizeof(CarveWorker));
+        workers[t].carve.outDir = _outDir;
+        workers[t].allocated = allocated;
+        workers[t].begin = FIRST_CLUSTER + (unsigned int)((uint64_t)clusterCount * t / threadCount);
+        workers[t].end = FIRST_CLUSTER + (unsigned int)((uint64_t)clusterCount * (t + 1) / threadCount);
+    }
+
+    RunWorkers(workers, sizeof(CarveWorker), threadCount, CarveClusters);
+
+    /* the shares follow each other, so do their files */
+    for (t = 0; t < threadCount; t++)
+    {
+        for (i = 0; i < workers[t].carve.count; i++)
+        {
+            const CarvedFile *file = &workers[t].carve.files[i];
+
+            fprintf(_report, "%u %s %llu %s\n", file->startCluster, file->signature->type,
+                    (unsigned long long)file->size, file->isComplete ? "complete" : "truncated");
+        }
+        count += (int)workers[t].carve.count;
+        free(workers[t].carve.files);
+    }
+
+    free(allocated);
+    return count;
+}
@@ -0,0 +1,44 @@
+#ifndef _RECOVER_H_
+#define _RECOVER_H_
+
+#include <stdio.h>
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <List the deleted entries of every directory of the mounted image>
+ *
+ * One line per entry: "<f|d> <start cluster> <size> <status> <path>", the first
+ * character of the name is lost and shown as '?'. Status is RECOVERABLE when the
+ * clusters from the start cluster, as many as the size needs, are all free,
+ * OVERWRITTEN otherwise. RECOVERABLE files are written to _outDir as
+ * "<start cluster>_<name>" when _outDir is not NULL.
+ *
+ * @param _report <Pointer to a FILE object receiving the list>.
+ * @param _outDir <existing folder receiving the recovered files, or NULL>.
+ *
+ * @return <number of deleted entries>.
+ */
+int ListDeleted(FILE *_report, const char *_outDir);
+
+/*!
+ * @brief <Look for known file signatures at the start of every free cluster>
+ *
+ * Only free clusters are read, in physical order. A carved file runs from its
+ * signature to its trailer, or to the end of the free run when no trailer is
+ * found. One line per file: "<cluster> <type> <size> <complete|truncated>".
+ * Carved files are written to _outDir as "<cluster>.<type>" when _outDir is not NULL.
+ * The data region is split in up to WORKERS_MAX_THREADS parts carved by as many
+ * threads, each with its own handle of the image; the list is the same as
+ * with a single thread.
+ *
+ * @param _report <Pointer to a FILE object receiving the list>.
+ * @param _outDir <existing folder receiving the carved files, or NULL>.
+ *
+ * @return <number of carved files>.
+ */
+int CarveFreeSpace(FILE *_report, const char *_outDir);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,524 @@
+#include "SharedCache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define SHARED_CACHE_MAGIC 0x48435346U /* "FSCH", written last by the creator */
+#define SHARED_CACHE_VERSION 1
+#define SHARED_CACHE_ALIGN 64          /* cache line, shards do not share one */
+#define SHARED_CACHE_WAIT_MS 2000      /* time given to the creator to initialise */
+#define SHARED_CACHE_END (-1)          /* end of a bucket chain */
+
+#define ALIGN_UP(x) (((x) + SHARED_CACHE_ALIGN - 1) & ~(size_t)(SHARED_CACHE_ALIGN - 1))
+
+/*
+ * First bytes of the segment, the layout follows from it
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t shardCount;
+    uint32_t slotsPerShard;
+    uint32_t bucketsPerShard; /* power of two */
+    uint32_t slotSize;
+    uint64_t bytes;
+} SharedHeader;
+
+/*
+ * Lock and CLOCK state of one shard
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    uint32_t hand; /* next slot looked at by CLOCK */
+    uint32_t used; /* slots filled, eviction starts once all are */
+} SharedShard;
+
+/*
+ * One cached sector, the data is in the data area at the same index
+ */
+typedef struct
+{
+    uint64_t image;
+    uint64_t offset;
+    int32_t next;         /* next slot of the bucket */
+    uint16_t length;
+    uint8_t isReferenced; /* CLOCK bit, set on every hit */
+    uint8_t isUsed;
+} SharedSlot;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static size_t Layout(const SharedHeader *_header, uint8_t *_segment);
+
+static uint64_t HashSector(uint64_t _image, uint64_t _offset);
+
+static int LockShard(unsigned int _shard);
+
+static void ClearShard(unsigned int _shard);
+
+static int32_t FindSlot(unsigned int _shard, int32_t *_bucket, uint64_t _offset, unsigned int _length);
+
+static void UnlinkSlot(unsigned int _shard, int32_t _slot);
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static uint8_t *s_segment = NULL;
+static size_t s_segmentBytes = 0;
+static const SharedHeader *s_header = NULL;
+static SharedShard *s_shards = NULL; /* every shard is SHARED_CACHE_ALIGN bytes apart */
+static size_t s_shardStride = 0;
+static int32_t *s_buckets = NULL;
+static SharedSlot *s_slots = NULL;
+static uint8_t *s_data = NULL;
+static uint64_t s_image = 0;
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/* size of the segment: header, shards, buckets, slots, data; the pointers are set if _segment is given */
+static size_t Layout(const SharedHeader *_header, uint8_t *_segment)
+{
+    const size_t slotCount = (size_t)_header->shardCount * _header->slotsPerShard;
+    const size_t shards = ALIGN_UP(sizeof(SharedHeader));
+    const size_t buckets = shards + ALIGN_UP(sizeof(SharedShard)) * _header->shardCount;
+    const size_t slots = buckets + ALIGN_UP((size_t)_header->shardCount * _header->bucketsPerShard * sizeof(int32_t));
+    const size_t data = slots + ALIGN_UP(slotCount * sizeof(SharedSlot));
+
+    if (_segment != NULL)
+    {
+        s_header = (const SharedHeader *)_segment;
+        s_shardStride = ALIGN_UP(sizeof(SharedShard));
+        s_shards = (SharedShard *)(_segment + shards);
+        s_buckets = (int32_t *)(_segment + buckets);
+        s_slots = (SharedSlot *)(_segment + slots);
+        s_data = _segment + data;
+    }
+
+    return data + slotCount * _header->slotSize;
+}
+
+#define SHARD(i) ((SharedShard *)((uint8_t *)s_shards + (size_t)(i) * s_shardStride))
+
+/* mixes image and sector offset, the high bits pick the shard */
+static uint64_t HashSector(uint64_t _image, uint64_t _offset)
+{
+    return ((_offset >> 9) ^ _image ^ (_image >> 29)) * 0x9E3779B97F4A7C15ULL;
+}
+
+/* take the lock of a shard, repairing it if its owner died while holding it */
+static int LockShard(unsigned int _shard)
+{
+    SharedShard *shard = SHARD(_shard);
+    int result = pthread_mutex_lock(&shard->lock);
+
+    if (result == EOWNERDEAD)
+    {
+        /* the chains may be half updated, start the shard again empty */
+        ClearShard(_shard);
+        pthread_mutex_consistent(&shard->lock);
+        result = 0;
+    }
+
+    return result;
+}
+
+static void ClearShard(unsigned int _shard)
+{
+    const uint32_t slots = s_header->slotsPerShard;
+    const uint32_t buckets = s_header->bucketsPerShard;
+    uint32_t i;
+
+    for (i = 0; i < buckets; i++)
+    {
+        s_buckets[(size_t)_shard * buckets + i] = SHARED_CACHE_END;
+    }
+    memset(&s_slots[(size_t)_shard * slots], 0, slots * sizeof(SharedSlot));
+
+    SHARD(_shard)->hand = 0;
+    SHARD(_shard)->used = 0;
+}
+
+/* slot of a sector of the current image in a bucket chain, the shard is locked */
+static int32_t FindSlot(unsigned int _shard, int32_t *_bucket, uint64_t _offset, unsigned int _length)
+{
+    int32_t slot = *_bucket;
+
+    (void)_shard;
+    while ((slot != SHARED_CACHE_END) &&
+           ((s_slots[slot].image != s_image) || (s_slots[slot].offset != _offset) || (s_slots[slot].length != _length)))
+    {
+        slot = s_slots[slot].next;
+    }
+
+    return slot;
+}
+
+/* remove an evicted slot from its bucket chain */
+static void UnlinkSlot(unsigned int _shard, int32_t _slot)
+{
+    const uint64_t hash = HashSector(s_slots[_slot].image, s_slots[_slot].offset);
+    int32_t *link = &s_buckets[(size_t)_shard * s_header->bucketsPerShard +
+                               ((uint32_t)(hash >> 20) & (s_header->bucketsPerShard - 1))];
+
+    while ((*link != SHARED_CACHE_END) && (*link != _slot))
+    {
+        link = &s_slots[*link].next;
+    }
+    if (*link == _slot)
+    {
+        *link = s_slots[_slot].next;
+    }
+}
+
+/*!
+ * @brief <Attach the sector cache shared by every process using the same name>
+ *
+ * @param _name <name of the segment, without the leading '/'>.
+ * @param _bytes <size of the segment if it is created>.
+ *
+ * @return <zero on success>.
+ */
+int OpenSharedCache(const char *_name, size_t _bytes)
+{
+    char path[256];
+    struct stat info;
+    int isCreated = 0;
+    int isFailed = (strlen(_name) + 2 > sizeof(path));
+    int fd = -1;
+
+    CloseSharedCache();
+
+    if (!isFailed)
+    {
+        snprintf(path, sizeof(path), "/%s", _name);
+
+        /* the first process creates it, the others wait for the magic */
+        fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+        isCreated = (fd >= 0);
+        if (!isCreated && (errno == EEXIST))
+        {
+            fd = shm_open(path, O_RDWR, 0600);
+        }
+        isFailed = (fd < 0);
+    }
+
+    if (!isFailed && isCreated)
+    {
+        /* a slot costs its data, its SharedSlot and up to two bucket heads */
+        const size_t perSlot = SHARED_CACHE_SLOT_SIZE + sizeof(SharedSlot) + 2 * sizeof(int32_t);
+        SharedHeader header;
+
+        header.magic = 0;
+        header.version = SHARED_CACHE_VERSION;
+        header.shardCount = SHARED_CACHE_SHARDS;
+        header.slotsPerShard = (uint32_t)(_bytes / perSlot / SHARED_CACHE_SHARDS);
+        header.slotsPerShard = (header.slotsPerShard == 0) ? 1 : header.slotsPerShard;
+        header.bucketsPerShard = 1;
+        while (header.bucketsPerShard < header.slotsPerShard)
+        {
+            header.bucketsPerShard *= 2;
+        }
+        header.slotSize = SHARED_CACHE_SLOT_SIZE;
+        header.bytes = Layout(&header, NULL);
+
+        isFailed = (ftruncate(fd, (off_t)header.bytes) != 0);
+        if (!isFailed)
+        {
+            s_segmentBytes = (size_t)header.bytes;
+            s_segment = (uint8_t *)mmap(NULL, s_segmentBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            isFailed = (s_segment == MAP_FAILED);
+        }
+
+        if (!isFailed)
+        {
+            pthread_mutexattr_t attributes;
+            unsigned int i;
+
+            memcpy(s_segment, &header, sizeof(header));
+            Layout(&header, s_segment);
+
+            pthread_mutexattr_init(&attributes);
+            pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+            pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+            for (i = 0; i < SHARED_CACHE_SHARDS; i++)
+            {
+                pthread_mutex_init(&SHARD(i)->lock, &attributes);
+                ClearShard(i);
+            }
+            pthread_mutexattr_destroy(&attributes);
+
+            __atomic_store_n(&((SharedHeader *)s_segment)->magic, SHARED_CACHE_MAGIC, __ATOMIC_RELEASE);
+        }
+    }
+    else if (!isFailed)
+    {
+        const struct timespec pause = {0, 1000000};
+        int waited;
+
+        /* the size is set by the creator before anything else */
+        for (waited = 0; (waited < SHARED_CACHE_WAIT_MS) && (fstat(fd, &info) == 0) &&
+                         ((size_t)info.st_size < sizeof(SharedHeader));
+             waited++)
+        {
+            nanosleep(&pause, NULL);
+        }
+
+        isFailed = (fstat(fd, &info) != 0) || ((size_t)info.st_size < sizeof(SharedHeader));
+        if (!isFailed)
+        {
+            s_segmentBytes = (size_t)info.st_size;
+            s_segment = (uint8_t *)mmap(NULL, s_segmentBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            isFailed = (s_segment == MAP_FAILED);
+        }
+
+        if (!isFailed)
+        {
+            const SharedHeader *header = (const SharedHeader *)s_segment;
+
+            while ((waited < SHARED_CACHE_WAIT_MS) && (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHARED_CACHE_MAGIC))
+            {
+                nanosleep(&pause, NULL);
+                waited++;
+            }
+
+            isFailed = (header->magic != SHARED_CACHE_MAGIC) || (header->version != SHARED_CACHE_VERSION) ||
+                       (header->bytes != s_segmentBytes) || (header->shardCount == 0) ||
+                       (header->slotSize != SHARED_CACHE_SLOT_SIZE);
+            isFailed = isFailed || (Layout(header, NULL) != s_segmentBytes);
+            if (!isFailed)
+            {
+                Layout(header, s_segment);
+            }
+        }
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    if (isFailed)
+    {
+        if ((s_segment != NULL) && (s_segment != MAP_FAILED))
+        {
+            munmap(s_segment, s_segmentBytes);
+        }
+        s_segment = NULL;
+        s_header = NULL;
+        fprintf(stderr, "shared cache %s not available\n", _name);
+    }
+
+    return isFailed;
+}
+
+/*!
+ * @brief <Detach the shared sector cache, the segment itself stays>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void CloseSharedCache()
+{
+    if (s_segment != NULL)
+    {
+        munmap(s_segment, s_segmentBytes);
+        s_segment = NULL;
+        s_header = NULL;
+    }
+}
+
+/*!
+ * @brief <Set the identity of the image whose sectors are read next>
+ *
+ * @param _image <hash of the device, inode, size and modification time of the image file, 0 to bypass the cache>.
+ *
+ * @return <none>.
+ */
+void SetSharedCacheImage(uint64_t _image)
+{
+    s_image = _image;
+}
+
+/*!
+ * @brief <Copy a sector of the current image from the shared cache>
+ *
+ * @param _sector <Pointer to a block of memory of _length bytes>.
+ * @param _offset <byte offset of the sector in the image file>.
+ * @param _length <bytes of the sector>.
+ *
+ * @return <non-zero if the sector was found>.
+ */
+int ReadSharedSector(void *_sector, uint64_t _offset, unsigned int _length)
+{
+    int isFound = 0;
+
+    if ((s_header != NULL) && (s_image != 0) && (_length <= s_header->slotSize))
+    {
+        const uint64_t hash = HashSector(s_image, _offset);
+        const unsigned int shard = (unsigned int)((hash >> 58) % s_header->shardCount);
+
+        if (LockShard(shard) == 0)
+        {
+            int32_t *bucket = &s_buckets[(size_t)shard * s_header->bucketsPerShard +
+                                         ((uint32_t)(hash >> 20) & (s_header->bucketsPerShard - 1))];
+            const int32_t slot = FindSlot(shard, bucket, _offset, _length);
+
+            isFound = (slot != SHARED_CACHE_END);
+            if (isFound)
+            {
+                memcpy(_sector, s_data + (size_t)slot * s_header->slotSize, _length);
+                s_slots[slot].isReferenced = 1;
+            }
+
+            pthread_mutex_unlock(&SHARD(shard)->lock);
+        }
+    }
+
+    return isFound;
+}
+
+/*!
+ * @brief <Store a sector of the current image read from the image file>
+ *
+ * @param _sector <Pointer to the sector data>.
+ * @param _offset <byte offset of the sector in the image file>.
+ * @param _length <bytes of the sector, not stored above SHARED_CACHE_SLOT_SIZE>.
+ *
+ * @return <none>.
+ */
+void StoreSharedSector(const void *_sector, uint64_t _offset, unsigned int _length)
+{
+    if ((s_header != NULL) && (s_image != 0) && (_length <= s_header->slotSize))
+    {
+        const uint64_t hash = HashSector(s_image, _offset);
+        const unsigned int shard = (unsigned int)((hash >> 58) % s_header->shardCount);
+
+        if (LockShard(shard) == 0)
+        {
+            SharedShard *state = SHARD(shard);
+            const int32_t first = (int32_t)((size_t)shard * s_header->slotsPerShard);
+            int32_t *bucket = &s_buckets[(size_t)shard * s_header->bucketsPerShard +
+                                         ((uint32_t)(hash >> 20) & (s_header->bucketsPerShard - 1))];
+            int32_t slot = FindSlot(shard, bucket, _offset, _length);
+
+            /* another process may have stored it meanwhile */
+            if (slot == SHARED_CACHE_END)
+            {
+                if (state->used < s_header->slotsPerShard)
+                {
+                    slot = first + (int32_t)state->used++;
+                }
+                else
+                {
+                    /* CLOCK: the first slot not referenced since the hand last passed */
+                    while (s_slots[first + state->hand].isReferenced)
+                    {
+                        s_slots[first + state->hand].isReferenced = 0;
+                        state->hand = (state->hand + 1) % s_header->slotsPerShard;
+                    }
+                    slot = first + (int32_t)state->hand;
+                    state->hand = (state->hand + 1) % s_header->slotsPerShard;
+                    UnlinkSlot(shard, slot);
+                }
+
+                /* data first, the slot is linked once complete */
+                memcpy(s_data + (size_t)slot * s_header->slotSize, _sector, _length);
+                s_slots[slot].image = s_image;
+                s_slots[slot].offset = _offset;
+                s_slots[slot].length = (uint16_t)_length;
+                s_slots[slot].isUsed = 1;
+                s_slots[slot].isReferenced = 0;
+                s_slots[slot].next = *bucket;
+                *bucket = slot;
+            }
+
+            pthread_mutex_unlock(&state->lock);
+        }
+    }
+}
+
+#else
+
+/*!
+ * @brief <Attach the sector cache shared by every process using the same name>
+ *
+ * @param _name <name of the segment, without the leading '/'>.
+ * @param _bytes <size of the segment if it is created>.
+ *
+ * @return <zero on success>.
+ */
+int OpenSharedCache(const char *_name, size_t _bytes)
+{
+    /* robust process-shared mutexes are Linux only */
+    fprintf(stderr, "shared cache is not supported on this platform\n");
+    return 1;
+}
+
+/*!
+ * @brief <Detach the shared sector cache, the segment itself stays>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void CloseSharedCache()
+{
+}
+
+/*!
+ * @brief <Set the identity of the image whose sectors are read next>
+ *
+ * @param _image <hash of the device, inode, size and modification time of the image file, 0 to bypass the cache>.
+ *
+ * @return <none>.
+ */
+void SetSharedCacheImage(uint64_t _image)
+{
+}
+
+/*!
+ * @brief <Copy a sector of the current image from the shared cache>
+ *
+ * @param _sector <Pointer to a block of memory of _length bytes>.
+ * @param _offset <byte offset of the sector in the image file>.
+ * @param _length <bytes of the sector>.
+ *
+ * @return <non-zero if the sector was found>.
+ */
+int ReadSharedSector(void *_sector, uint64_t _offset, unsigned int _length)
+{
+    return 0;
+}
+
+/*!
+ * @brief <Store a sector of the current image read from the image file>
+ *
+ * @param _sector <Pointer to the sector data>.
+ * @param _offset <byte offset of the sector in the image file>.
+ * @param _length <bytes of the sector, not stored above SHARED_CACHE_SLOT_SIZE>.
+ *
+ * @return <none>.
+ */
+void StoreSharedSector(const void *_sector, uint64_t _offset, unsigned int _length)
+{
+}
+
+#endif
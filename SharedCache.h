@@ -0,0 +1,77 @@
+#ifndef _SHAREDCACHE_H_
+#define _SHAREDCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define SHARED_CACHE_DEFAULT_BYTES (64 * 1024 * 1024) /* size of a new segment */
+#define SHARED_CACHE_SLOT_SIZE 4096                  /* largest sector kept */
+#define SHARED_CACHE_SHARDS 64                       /* independently locked parts */
+#define SHARED_CACHE_MAX_RUN 16                      /* longest ReadNSectors served sector by sector */
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Attach the sector cache shared by every process using the same name>
+ *
+ * The cache lives in a named shared memory segment, created with _bytes if it
+ * does not exist yet, and holds sectors of the base images keyed by image
+ * identity and byte offset. It is split in SHARED_CACHE_SHARDS shards, each
+ * one a hash table behind a robust process-shared mutex with CLOCK eviction.
+ * Sectors are copied in and out under the lock, no reference outlives a call;
+ * a shard whose lock owner died is cleared by the next process locking it.
+ * The segment stays until it is removed (/dev/shm/<name> on Linux). Linux only.
+ *
+ * @param _name <name of the segment, without the leading '/'>.
+ * @param _bytes <size of the segment if it is created>.
+ *
+ * @return <zero on success>.
+ */
+int OpenSharedCache(const char *_name, size_t _bytes);
+
+/*!
+ * @brief <Detach the shared sector cache, the segment itself stays>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void CloseSharedCache();
+
+/*!
+ * @brief <Set the identity of the image whose sectors are read next>
+ *
+ * @param _image <hash of the device, inode, size and modification time of the image file, 0 to bypass the cache>.
+ *
+ * @return <none>.
+ */
+void SetSharedCacheImage(uint64_t _image);
+
+/*!
+ * @brief <Copy a sector of the current image from the shared cache>
+ *
+ * @param _sector <Pointer to a block of memory of _length bytes>.
+ * @param _offset <byte offset of the sector in the image file>.
+ * @param _length <bytes of the sector>.
+ *
+ * @return <non-zero if the sector was found>.
+ */
+int ReadSharedSector(void *_sector, uint64_t _offset, unsigned int _length);
+
+/*!
+ * @brief <Store a sector of the current image read from the image file>
+ *
+ * @param _sector <Pointer to the sector data>.
+ * @param _offset <byte offset of the sector in the image file>.
+ * @param _length <bytes of the sector, not stored above SHARED_CACHE_SLOT_SIZE>.
+ *
+ * @return <none>.
+ */
+void StoreSharedSector(const void *_sector, uint64_t _offset, unsigned int _length);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,318 @@
+#include "Stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#if defined(_MSC_VER)
+#define STATS_THREAD_LOCAL __declspec(thread)
+#else
+#define STATS_THREAD_LOCAL __thread
+#endif
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static void MergeHistogram(Histogram *_to, const Histogram *_from);
+
+static void DumpHistogramText(FILE *_out, const char *_name, const char *_unit, const Histogram *_histogram);
+
+static void DumpHistogramJson(FILE *_out, const char *_name, const Histogram *_histogram);
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+volatile int g_statsEnabled = 0;
+
+static VolumeStats s_stats;
+static STATS_THREAD_LOCAL VolumeStats *t_stats = NULL;
+
+static const char *const s_halCallNames[HAL_CALL_COUNT] = {
+    "GetSector",
+    "ReadSector",
+    "ReadNSectors",
+    "SendSectors",
+    "CloneSectors",
+};
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/*!
+ * @brief <Start or stop timing the HAL calls>
+ *
+ * @param _enable <non-zero to fill the latency histograms, zero to stop>.
+ *
+ * @return <none>.
+ */
+void StatsEnable(int _enable)
+{
+    g_statsEnabled = (_enable != 0);
+}
+
+/*!
+ * @brief <Get the statistics of the mounted image>
+ *
+ * @param <none>.
+ *
+ * @return <Pointer to the statistics, valid until the next ResetVolumeStats>.
+ */
+VolumeStats *GetVolumeStats()
+{
+    return (t_stats != NULL) ? t_stats : &s_stats;
+}
+
+/*!
+ * @brief <Count the work of the calling thread apart, without locking>
+ *
+ * @param _stats <Pointer to zeroed counters owned by the thread, NULL to go back
+ * to the statistics of the mounted image>.
+ *
+ * @return <none>.
+ */
+void AttachThreadStats(VolumeStats *_stats)
+{
+    t_stats = _stats;
+}
+
+/* add the buckets of _from to _to */
+static void MergeHistogram(Histogram *_to, const Histogram *_from)
+{
+    int i;
+
+    _to->count += _from->count;
+    _to->sum += _from->sum;
+    if (_from->max > _to->max)
+    {
+        _to->max = _from->max;
+    }
+    for (i = 0; i < STATS_HIST_BUCKETS; i++)
+    {
+        _to->buckets[i] += _from->buckets[i];
+    }
+}
+
+/*!
+ * @brief <Add the counters of a thread to the statistics of the mounted image>
+ *
+ * @param _stats <Pointer to the counters of the thread>.
+ *
+ * @return <none>.
+ */
+void MergeVolumeStats(const VolumeStats *_stats)
+{
+    int i;
+
+    s_stats.sectorsRead += _stats->sectorsRead;
+    s_stats.bytesRead += _stats->bytesRead;
+    s_stats.seekCount += _stats->seekCount;
+    s_stats.cacheHits += _stats->cacheHits;
+    s_stats.cacheMisses += _stats->cacheMisses;
+    s_stats.overlaySectorsRead += _stats->overlaySectorsRead;
+    s_stats.overlaySectorsWritten += _stats->overlaySectorsWritten;
+    s_stats.sharedSectorsRead += _stats->sharedSectorsRead;
+    s_stats.sectorsPrefetched += _stats->sectorsPrefetched;
+    s_stats.journalSectorsLogged += _stats->journalSectorsLogged;
+    s_stats.journalCommits += _stats->journalCommits;
+    s_stats.journalSectorsCheckpointed += _stats->journalSectorsCheckpointed;
+    s_stats.journalSectorsReplayed += _stats->journalSectorsReplayed;
+    for (i = 0; i < HAL_CALL_COUNT; i++)
+    {
+        MergeHistogram(&s_stats.latency[i], &_stats->latency[i]);
+    }
+    s_stats.simulatedNs += _stats->simulatedNs;
+    s_stats.simulatedSeekNs += _stats->simulatedSeekNs;
+    MergeHistogram(&s_stats.simulatedRequestNs, &_stats->simulatedRequestNs);
+
+    s_stats.fatEntriesDecoded += _stats->fatEntriesDecoded;
+    s_stats.fatPageHits += _stats->fatPageHits;
+    s_stats.fatPageMisses += _stats->fatPageMisses;
+    s_stats.fatPageEvictions += _stats->fatPageEvictions;
+    s_stats.chainHits += _stats->chainHits;
+    s_stats.chainMisses += _stats->chainMisses;
+    s_stats.dirEntriesScanned += _stats->dirEntriesScanned;
+    MergeHistogram(&s_stats.runsPerFseek, &_stats->runsPerFseek);
+}
+
+/*!
+ * @brief <Clear all counters, called when an image is opened>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void ResetVolumeStats()
+{
+    memset(&s_stats, 0, sizeof(s_stats));
+}
+
+/*!
+ * @brief <Add one value to a log-scale histogram>
+ *
+ * @param _histogram <Pointer to a Histogram object>.
+ * @param _value <value to add>.
+ *
+ * @return <none>.
+ */
+void HistogramAdd(Histogram *_histogram, uint64_t _value)
+{
+    unsigned int bucket = 0;
+    uint64_t v = _value;
+
+    while ((v > 1) && (bucket < STATS_HIST_BUCKETS - 1))
+    {
+        v >>= 1;
+        bucket++;
+    }
+
+    _histogram->count++;
+    _histogram->sum += _value;
+    if (_value > _histogram->max)
+    {
+        _histogram->max = _value;
+    }
+    _histogram->buckets[bucket]++;
+}
+
+/* one line per non-empty bucket */
+static void DumpHistogramText(FILE *_out, const char *_name, const char *_unit, const Histogram *_histogram)
+{
+    int i;
+
+    fprintf(_out, "%-20s count %llu, avg %llu %s, max %llu %s\n", _name,
+            (unsigned long long)_histogram->count,
+            (unsigned long long)(_histogram->count ? _histogram->sum / _histogram->count : 0), _unit,
+            (unsigned long long)_histogram->max, _unit);
+
+    for (i = 0; i < STATS_HIST_BUCKETS; i++)
+    {
+        if (_histogram->buckets[i] != 0)
+        {
+            fprintf(_out, "    < %-12llu %llu\n", 2ULL << i, (unsigned long long)_histogram->buckets[i]);
+        }
+    }
+}
+
+/* "name":{"count":..,"sum":..,"max":..,"buckets":[..]} */
+static void DumpHistogramJson(FILE *_out, const char *_name, const Histogram *_histogram)
+{
+    int i;
+    int last = STATS_HIST_BUCKETS - 1;
+
+    /* trailing empty buckets are not written */
+    while ((last > 0) && (_histogram->buckets[last] == 0))
+    {
+        last--;
+    }
+
+    fprintf(_out, "\"%s\":{\"count\":%llu,\"sum\":%llu,\"max\":%llu,\"buckets\":[", _name,
+            (unsigned long long)_histogram->count,
+            (unsigned long long)_histogram->sum,
+            (unsigned long long)_histogram->max);
+
+    for (i = 0; i <= last; i++)
+    {
+        fprintf(_out, "%s%llu", (i == 0) ? "" : ",", (unsigned long long)_histogram->buckets[i]);
+    }
+    fprintf(_out, "]}");
+}
+
+/*!
+ * @brief <Write the statistics of the mounted image>
+ *
+ * @param _out <Pointer to a FILE object>.
+ * @param _format <STATS_FORMAT_TEXT or STATS_FORMAT_JSON>.
+ *
+ * @return <none>.
+ */
+void DumpVolumeStats(FILE *_out, int _format)
+{
+    const VolumeStats *stats = &s_stats;
+    int i;
+
+    if (_format == STATS_FORMAT_JSON)
+    {
+        fprintf(_out, "{\"sectorsRead\":%llu,\"bytesRead\":%llu,\"seekCount\":%llu,"
+                      "\"cacheHits\":%llu,\"cacheMisses\":%llu,"
+                      "\"overlaySectorsRead\":%llu,\"overlaySectorsWritten\":%llu,\"sharedSectorsRead\":%llu,\"sectorsPrefetched\":%llu,"
+                      "\"journalSectorsLogged\":%llu,\"journalCommits\":%llu,\"journalSectorsCheckpointed\":%llu,\"journalSectorsReplayed\":%llu,"
+                      "\"simulatedNs\":%llu,\"simulatedSeekNs\":%llu,"
+                      "\"fatEntriesDecoded\":%llu,\"fatPageHits\":%llu,\"fatPageMisses\":%llu,"
+                      "\"fatPageEvictions\":%llu,\"chainHits\":%llu,\"chainMisses\":%llu,"
+                      "\"dirEntriesScanned\":%llu,",
+                (unsigned long long)stats->sectorsRead,
+                (unsigned long long)stats->bytesRead,
+                (unsigned long long)stats->seekCount,
+                (unsigned long long)stats->cacheHits,
+                (unsigned long long)stats->cacheMisses,
+                (unsigned long long)stats->overlaySectorsRead,
+                (unsigned long long)stats->overlaySectorsWritten,
+                (unsigned long long)stats->sharedSectorsRead,
+                (unsigned long long)stats->sectorsPrefetched,
+                (unsigned long long)stats->journalSectorsLogged,
+                (unsigned long long)stats->journalCommits,
+                (unsigned long long)stats->journalSectorsCheckpointed,
+                (unsigned long long)stats->journalSectorsReplayed,
+                (unsigned long long)stats->simulatedNs,
+                (unsigned long long)stats->simulatedSeekNs,
+                (unsigned long long)stats->fatEntriesDecoded,
+                (unsigned long long)stats->fatPageHits,
+                (unsigned long long)stats->fatPageMisses,
+                (unsigned long long)stats->fatPageEvictions,
+                (unsigned long long)stats->chainHits,
+                (unsigned long long)stats->chainMisses,
+                (unsigned long long)stats->dirEntriesScanned);
+
+        DumpHistogramJson(_out, "runsPerFseek", &stats->runsPerFseek);
+        fprintf(_out, ",");
+        DumpHistogramJson(_out, "simulatedRequestNs", &stats->simulatedRequestNs);
+        fprintf(_out, ",\"latencyNs\":{");
+        for (i = 0; i < HAL_CALL_COUNT; i++)
+        {
+            if (i != 0)
+            {
+                fprintf(_out, ",");
+            }
+            DumpHistogramJson(_out, s_halCallNames[i], &stats->latency[i]);
+        }
+        fprintf(_out, "}}\n");
+    }
+    else
+    {
+        fprintf(_out, "sectors read         %llu\n", (unsigned long long)stats->sectorsRead);
+        fprintf(_out, "bytes read           %llu\n", (unsigned long long)stats->bytesRead);
+        fprintf(_out, "seek count           %llu\n", (unsigned long long)stats->seekCount);
+        fprintf(_out, "cache hits           %llu\n", (unsigned long long)stats->cacheHits);
+        fprintf(_out, "cache misses         %llu\n", (unsigned long long)stats->cacheMisses);
+        fprintf(_out, "overlay reads        %llu\n", (unsigned long long)stats->overlaySectorsRead);
+        fprintf(_out, "overlay writes       %llu\n", (unsigned long long)stats->overlaySectorsWritten);
+        fprintf(_out, "shared cache reads   %llu\n", (unsigned long long)stats->sharedSectorsRead);
+        fprintf(_out, "sectors prefetched   %llu\n", (unsigned long long)stats->sectorsPrefetched);
+        fprintf(_out, "journal writes       %llu\n", (unsigned long long)stats->journalSectorsLogged);
+        fprintf(_out, "journal commits      %llu\n", (unsigned long long)stats->journalCommits);
+        fprintf(_out, "journal checkpointed %llu\n", (unsigned long long)stats->journalSectorsCheckpointed);
+        fprintf(_out, "journal replayed     %llu\n", (unsigned long long)stats->journalSectorsReplayed);
+        fprintf(_out, "simulated device ns  %llu\n", (unsigned long long)stats->simulatedNs);
+        fprintf(_out, "simulated seek ns    %llu\n", (unsigned long long)stats->simulatedSeekNs);
+        fprintf(_out, "FAT entries decoded  %llu\n", (unsigned long long)stats->fatEntriesDecoded);
+        fprintf(_out, "FAT page hits        %llu\n", (unsigned long long)stats->fatPageHits);
+        fprintf(_out, "FAT page misses      %llu\n", (unsigned long long)stats->fatPageMisses);
+        fprintf(_out, "FAT page evictions   %llu\n", (unsigned long long)stats->fatPageEvictions);
+        fprintf(_out, "chain hits           %llu\n", (unsigned long long)stats->chainHits);
+        fprintf(_out, "chain misses         %llu\n", (unsigned long long)stats->chainMisses);
+        fprintf(_out, "dir entries scanned  %llu\n", (unsigned long long)stats->dirEntriesScanned);
+
+        DumpHistogramText(_out, "runs per Fseek", "runs", &stats->runsPerFseek);
+        if (stats->simulatedRequestNs.count != 0)
+        {
+            DumpHistogramText(_out, "simulated request", "ns", &stats->simulatedRequestNs);
+        }
+        for (i = 0; i < HAL_CALL_COUNT; i++)
+        {
+            DumpHistogramText(_out, s_halCallNames[i], "ns", &stats->latency[i]);
+        }
+    }
+}
@@ -0,0 +1,155 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+/* bucket i counts values in [2^i, 2^(i+1)), bucket 0 also counts 0 */
+#define STATS_HIST_BUCKETS 32
+
+#define STATS_FORMAT_TEXT 0
+#define STATS_FORMAT_JSON 1
+
+/*
+ * HAL calls with a latency histogram
+ */
+typedef enum
+{
+    HAL_GET_SECTOR,
+    HAL_READ_SECTOR,
+    HAL_READ_N_SECTORS,
+    HAL_SEND_SECTORS,
+    HAL_CLONE_SECTORS,
+    HAL_CALL_COUNT
+} HalCall;
+
+/*
+ * Log-scale histogram
+ */
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[STATS_HIST_BUCKETS];
+} Histogram;
+
+/*
+ * I/O and cache counters of the mounted image
+ */
+typedef struct
+{
+    /* HAL */
+    uint64_t sectorsRead;  /* sectors read from the image */
+    uint64_t bytesRead;    /* bytes read from the image */
+    uint64_t seekCount;    /* positioned reads (pread/fseek) on the image */
+    uint64_t cacheHits;    /* GetSector served from memory */
+    uint64_t cacheMisses;  /* GetSector had to read the image */
+    uint64_t overlaySectorsRead;    /* sectors served by the copy-on-write overlay */
+    uint64_t overlaySectorsWritten; /* sectors stored in the copy-on-write overlay */
+    uint64_t sharedSectorsRead;     /* sectors served by the shared cache of other processes */
+    uint64_t sectorsPrefetched;     /* sectors announced by the readahead of file handles */
+    uint64_t journalSectorsLogged;       /* sector writes logged in the journal */
+    uint64_t journalCommits;             /* journal batches made durable, one fsync each */
+    uint64_t journalSectorsCheckpointed; /* sectors written back by journal checkpoints */
+    uint64_t journalSectorsReplayed;     /* sectors of complete batches found when the journal was opened */
+    Histogram latency[HAL_CALL_COUNT]; /* ns per call */
+    uint64_t simulatedNs;           /* time of the simulated device, see DeviceModel.h */
+    uint64_t simulatedSeekNs;       /* part of simulatedNs spent seeking */
+    Histogram simulatedRequestNs;   /* simulated ns per read request */
+
+    /* FAT */
+    uint64_t fatEntriesDecoded; /* FAT entries decoded from FAT sectors */
+    uint64_t fatPageHits;       /* lookups served by a decoded FAT page */
+    uint64_t fatPageMisses;     /* FAT pages decoded */
+    uint64_t fatPageEvictions;  /* FAT pages dropped by CLOCK */
+    uint64_t chainHits;         /* chains served from the chain cache */
+    uint64_t chainMisses;       /* chains walked through the FAT */
+    uint64_t dirEntriesScanned; /* directory entries visited */
+    Histogram runsPerFseek;     /* runs walked per Fseek call */
+} VolumeStats;
+
+/*
+ * The latency histograms cost two clock reads per HAL call, they are only
+ * filled while g_statsEnabled is set by StatsEnable; the counters always are.
+ */
+extern volatile int g_statsEnabled;
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Start or stop timing the HAL calls>
+ *
+ * @param _enable <non-zero to fill the latency histograms, zero to stop>.
+ *
+ * @return <none>.
+ */
+void StatsEnable(int _enable);
+
+/*!
+ * @brief <Get the statistics of the mounted image>
+ *
+ * A thread with its own counters (AttachThreadStats) gets them instead.
+ *
+ * @param <none>.
+ *
+ * @return <Pointer to the statistics, valid until the next ResetVolumeStats>.
+ */
+VolumeStats *GetVolumeStats();
+
+/*!
+ * @brief <Count the work of the calling thread apart, without locking>
+ *
+ * @param _stats <Pointer to zeroed counters owned by the thread, NULL to go back
+ * to the statistics of the mounted image>.
+ *
+ * @return <none>.
+ */
+void AttachThreadStats(VolumeStats *_stats);
+
+/*!
+ * @brief <Add the counters of a thread to the statistics of the mounted image>
+ *
+ * Called by the thread that started it, once it has been joined.
+ *
+ * @param _stats <Pointer to the counters of the thread>.
+ *
+ * @return <none>.
+ */
+void MergeVolumeStats(const VolumeStats *_stats);
+
+/*!
+ * @brief <Clear all counters, called when an image is opened>
+ *
+ * @param <none>.
+ *
+ * @return <none>.
+ */
+void ResetVolumeStats();
+
+/*!
+ * @brief <Add one value to a log-scale histogram>
+ *
+ * @param _histogram <Pointer to a Histogram object>.
+ * @param _value <value to add>.
+ *
+ * @return <none>.
+ */
+void HistogramAdd(Histogram *_histogram, uint64_t _value);
+
+/*!
+ * @brief <Write the statistics of the mounted image>
+ *
+ * @param _out <Pointer to a FILE object>.
+ * @param _format <STATS_FORMAT_TEXT or STATS_FORMAT_JSON>.
+ *
+ * @return <none>.
+ */
+void DumpVolumeStats(FILE *_out, int _format);
+
+#endif
\ No newline at end of file
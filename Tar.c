@@ -0,0 +1,319 @@
+#include "Tar.h"
+#include "FAT.h"
+#include "HAL.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define TAR_BLOCK 512
+#define TAR_NAME_SIZE 100
+#define TAR_PREFIX_SIZE 155
+
+/*
+ * ustar header, one block
+ */
+typedef struct
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+} TarHeader;
+
+/*
+ * State of one WriteTar call
+ */
+typedef struct
+{
+    FILE *out;
+    int entryCount;
+    int isFailed;
+} TarContext;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static uint64_t GetEntryTime(DirectoryEntry *_entry);
+
+static int SplitPath(TarHeader *_header, const char *_path);
+
+static int FillHeader(TarHeader *_header, const char *_path, uint64_t _size, uint64_t _mtime,
+                      unsigned int _mode, char _typeflag);
+
+static int WriteBlocks(TarContext *_tar, const void *_data, size_t _byteCount);
+
+static int WriteLongPath(TarContext *_tar, const char *_path, uint64_t _mtime);
+
+static void WriteData(TarContext *_tar, DirectoryEntry *_entry, unsigned int _size);
+
+static int TarEntry(DirectoryEntry *entry, const char *path, void *context);
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static const uint8_t s_zeroBlock[TAR_BLOCK];
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/* last modification of an entry in seconds since 1970, the FAT time is taken as UTC */
+static uint64_t GetEntryTime(DirectoryEntry *_entry)
+{
+    static const unsigned int daysBeforeMonth[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+    Date date;
+    Time time;
+    unsigned int year;
+    unsigned int month;
+    uint64_t days;
+
+    GetFileModifiedDate(&date, _entry);
+    GetFileModifiedTime(&time, _entry);
+
+    year = date.year + YEAR_OFFSET;
+    month = ((date.month >= 1) && (date.month <= 12)) ? date.month : 1;
+
+    /* days from 1970 to 1 January of year, leap years of [1970, year - 1] included */
+    days = (uint64_t)(year - 1970) * 365 + ((year - 1) / 4 - 1969 / 4) -
+           ((year - 1) / 100 - 1969 / 100) + ((year - 1) / 400 - 1969 / 400);
+    days += daysBeforeMonth[month - 1] + ((date.day > 0) ? date.day - 1 : 0);
+    if ((month > 2) && ((year % 4) == 0) && (((year % 100) != 0) || ((year % 400) == 0)))
+    {
+        days++;
+    }
+
+    return days * 86400 + time.hours * 3600 + time.minutes * 60 + time.seconds * 2;
+}
+
+/* store _path in name and prefix, truncated and non-zero if it does not fit */
+static int SplitPath(TarHeader *_header, const char *_path)
+{
+    const size_t length = strlen(_path);
+    const char *split;
+    int isTruncated = 0;
+
+    if (length <= TAR_NAME_SIZE)
+    {
+        memcpy(_header->name, _path, length);
+    }
+    else
+    {
+        /* first '/' leaving at most TAR_NAME_SIZE bytes for the name */
+        split = _path + length - TAR_NAME_SIZE - 1;
+        while ((*split != '\0') && (*split != '/'))
+        {
+            split++;
+        }
+
+        if ((*split == '\0') || ((size_t)(split - _path) > TAR_PREFIX_SIZE))
+        {
+            memcpy(_header->name, _path, TAR_NAME_SIZE);
+            isTruncated = 1;
+        }
+        else
+        {
+            memcpy(_header->prefix, _path, split - _path);
+            memcpy(_header->name, split + 1, length - (split - _path) - 1);
+        }
+    }
+
+    return isTruncated;
+}
+
+/* header of one member, checksum included, non-zero if the path was truncated */
+static int FillHeader(TarHeader *_header, const char *_path, uint64_t _size, uint64_t _mtime,
+                      unsigned int _mode, char _typeflag)
+{
+    const uint8_t *bytes = (const uint8_t *)_header;
+    unsigned int checksum = 0;
+    unsigned int i;
+    int isTruncated;
+
+    memset(_header, 0, sizeof(TarHeader));
+    isTruncated = SplitPath(_header, _path);
+    sprintf(_header->mode, "%07o", _mode);
+    sprintf(_header->uid, "%07o", 0);
+    sprintf(_header->gid, "%07o", 0);
+    sprintf(_header->size, "%011llo", (unsigned long long)_size);
+    sprintf(_header->mtime, "%011llo", (unsigned long long)_mtime);
+    _header->typeflag = _typeflag;
+    memcpy(_header->magic, "ustar", 6);
+    memcpy(_header->version, "00", 2);
+
+    /* checksum is computed with its own field filled with spaces */
+    memset(_header->checksum, ' ', sizeof(_header->checksum));
+    for (i = 0; i < sizeof(TarHeader); i++)
+    {
+        checksum += bytes[i];
+    }
+    sprintf(_header->checksum, "%06o", checksum);
+    _header->checksum[7] = ' ';
+
+    return isTruncated;
+}
+
+/* write _byteCount bytes padded to a whole number of blocks */
+static int WriteBlocks(TarContext *_tar, const void *_data, size_t _byteCount)
+{
+    const size_t padding = (TAR_BLOCK - (_byteCount % TAR_BLOCK)) % TAR_BLOCK;
+
+    if (!_tar->isFailed)
+    {
+        _tar->isFailed = (fwrite(_data, 1, _byteCount, _tar->out) != _byteCount) ||
+                         (fwrite(s_zeroBlock, 1, padding, _tar->out) != padding);
+    }
+
+    return _tar->isFailed;
+}
+
+/* pax extended header carrying the full path of the next member */
+static int WriteLongPath(TarContext *_tar, const char *_path, uint64_t _mtime)
+{
+    char record[FAT_MAX_PATH + 32];
+    TarHeader header;
+    const unsigned int base = (unsigned int)(strlen(" path=\n") + strlen(_path));
+    unsigned int total = base + 1;
+    unsigned int digits;
+    unsigned int n;
+
+    /* "<length> path=<path>\n", the length counts its own digits */
+    do
+    {
+        digits = 0;
+        for (n = total; n > 0; n /= 10)
+        {
+            digits++;
+        }
+        n = total;
+        total = base + digits;
+    } while (n != total);
+
+    sprintf(record, "%u path=%s\n", total, _path);
+
+    FillHeader(&header, "PaxHeader", total, _mtime, 0644, 'x');
+    WriteBlocks(_tar, &header, sizeof(header));
+    return WriteBlocks(_tar, record, total);
+}
+
+/* file data from its extents, zero filled if the chain is shorter than the size */
+static void WriteData(TarContext *_tar, DirectoryEntry *_entry, unsigned int _size)
+{
+    const unsigned int bytePerCluster = GetBytePerSector() * GetSectorPerCluster();
+    unsigned int extentCount = 0;
+    unsigned int sent = 0;
+    unsigned int i;
+    Extent *extents = GetFileExtents(GetEntryCluster(_entry), &extentCount);
+
+    fflush(_tar->out);
+
+    for (i = 0; (i < extentCount) && (sent < _size) && !_tar->isFailed; i++)
+    {
+        const uint64_t runBytes = (uint64_t)extents[i].count * bytePerCluster;
+        unsigned int length = _size - sent;
+
+        if (runBytes < length)
+        {
+            length = (unsigned int)runBytes;
+        }
+
+        _tar->isFailed = (SendSectors(_tar->out, ClusterToSector(extents[i].cluster), length) != length);
+        sent += length;
+    }
+
+    while ((sent < _size) && !_tar->isFailed)
+    {
+        const unsigned int length = (_size - sent < TAR_BLOCK) ? _size - sent : TAR_BLOCK;
+
+        _tar->isFailed = (fwrite(s_zeroBlock, 1, length, _tar->out) != length);
+        sent += length;
+    }
+
+    if (!_tar->isFailed && ((_size % TAR_BLOCK) != 0))
+    {
+        const size_t padding = TAR_BLOCK - (_size % TAR_BLOCK);
+
+        _tar->isFailed = (fwrite(s_zeroBlock, 1, padding, _tar->out) != padding);
+    }
+
+    free(extents);
+}
+
+/* WalkTree visitor, one member per entry */
+static int TarEntry(DirectoryEntry *entry, const char *path, void *context)
+{
+    TarContext *tar = (TarContext *)context;
+    const int isDirectory = (entry->attributes & ENTRY_DIRECTORY) != 0;
+    const unsigned int size = isDirectory ? 0 : GetSizeofFile(entry);
+    const uint64_t mtime = GetEntryTime(entry);
+    char name[FAT_MAX_PATH + 1];
+    unsigned int mode;
+    TarHeader header;
+
+    /* members are relative, folders end with '/' */
+    strcpy(name, path + 1);
+    if (isDirectory)
+    {
+        strcat(name, "/");
+        mode = 0755;
+    }
+    else
+    {
+        mode = (entry->attributes & ENTRY_READONLY) ? 0444 : 0644;
+    }
+
+    if (FillHeader(&header, name, size, mtime, mode, isDirectory ? '5' : '0') != 0)
+    {
+        WriteLongPath(tar, name, mtime);
+    }
+
+    WriteBlocks(tar, &header, sizeof(header));
+    if (!isDirectory)
+    {
+        WriteData(tar, entry, size);
+    }
+
+    tar->entryCount++;
+    return tar->isFailed;
+}
+
+/*!
+ * @brief <Write every file and folder of the mounted image as a POSIX tar stream>
+ *
+ * @param _out <Pointer to a FILE object opened in binary mode>.
+ *
+ * @return <number of entries written, -1 on a write error>.
+ */
+int WriteTar(FILE *_out)
+{
+    TarContext tar;
+
+    tar.out = _out;
+    tar.entryCount = 0;
+    tar.isFailed = 0;
+
+    WalkTree(0, "", TarEntry, &tar);
+
+    /* end of archive */
+    WriteBlocks(&tar, s_zeroBlock, TAR_BLOCK);
+    WriteBlocks(&tar, s_zeroBlock, TAR_BLOCK);
+    tar.isFailed = (fflush(_out) != 0) || tar.isFailed;
+
+    return tar.isFailed ? -1 : tar.entryCount;
+}
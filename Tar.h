@@ -0,0 +1,24 @@
+#ifndef _TAR_H_
+#define _TAR_H_
+
+#include <stdio.h>
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Write every file and folder of the mounted image as a POSIX tar stream>
+ *
+ * The tree is written in one pass: a ustar header built from the directory
+ * entry, then the data sent straight from the extents of the file. Paths
+ * longer than the ustar fields get a pax extended header. Memory use does
+ * not depend on the size of the image.
+ *
+ * @param _out <Pointer to a FILE object opened in binary mode>.
+ *
+ * @return <number of entries written, -1 on a write error>.
+ */
+int WriteTar(FILE *_out);
+
+#endif
\ No newline at end of file
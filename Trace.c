@@ -0,0 +1,193 @@
+#include "Trace.h"
+#include "HAL.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#endif
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+
+#if defined(_MSC_VER)
+#define TRACE_THREAD_LOCAL __declspec(thread)
+#define TRACE_CAS_PTR(dst, expected, desired) \
+    (InterlockedCompareExchangePointer((PVOID volatile *)(dst), (desired), (expected)) == (expected))
+#define TRACE_ATOMIC_INC(p) ((uint32_t)InterlockedIncrement((volatile LONG *)(p)))
+#define TRACE_LOAD_ACQUIRE(p) (*(p))
+#define TRACE_STORE_RELEASE(p, v) (*(p) = (v))
+#else
+#define TRACE_THREAD_LOCAL __thread
+#define TRACE_CAS_PTR(dst, expected, desired) __sync_bool_compare_and_swap((dst), (expected), (desired))
+#define TRACE_ATOMIC_INC(p) __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#define TRACE_LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define TRACE_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+/*
+ * One complete ("X") event
+ */
+typedef struct
+{
+    const char *category;
+    const char *name;
+    uint64_t start;    /* ns */
+    uint64_t duration; /* ns */
+} TraceEvent;
+
+/*
+ * Ring buffer owned by one thread. Only the owner writes events,
+ * the head is published with release semantics so TraceWrite can read it
+ * from another thread without taking a lock.
+ */
+typedef struct _tagTraceRing
+{
+    struct _tagTraceRing *next;
+    uint32_t tid;
+    volatile uint32_t head; /* total number of events recorded */
+    TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static TraceRing *GetThreadRing();
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+volatile int g_traceEnabled = 0;
+
+static TraceRing *volatile s_rings = NULL;
+static volatile uint32_t s_nextTid = 0;
+static TRACE_THREAD_LOCAL TraceRing *t_ring = NULL;
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/*!
+ * @brief <Get the ring buffer of the calling thread, create it on first use>
+ *
+ * @param <none>.
+ *
+ * @return <Pointer to the ring, NULL if out of memory>.
+ */
+static TraceRing *GetThreadRing()
+{
+    TraceRing *ring = t_ring;
+
+    if (ring == NULL)
+    {
+        TraceRing *head;
+
+        ring = (TraceRing *)calloc(1, sizeof(TraceRing));
+        if (ring != NULL)
+        {
+            ring->tid = TRACE_ATOMIC_INC(&s_nextTid);
+
+            /* lock-free push on the list of rings */
+            do
+            {
+                head = s_rings;
+                ring->next = head;
+            } while (!TRACE_CAS_PTR(&s_rings, head, ring));
+
+            t_ring = ring;
+        }
+    }
+
+    return ring;
+}
+
+/*!
+ * @brief <Start or stop recording trace events>
+ *
+ * @param _enable <non-zero to start recording, zero to stop>.
+ *
+ * @return <none>.
+ */
+void TraceEnable(int _enable)
+{
+    g_traceEnabled = (_enable != 0);
+}
+
+/*!
+ * @brief <Store one complete event in the ring buffer of the calling thread>
+ *
+ * @param _category <Static string, category of the event>.
+ * @param _name <Static string, name of the event>.
+ * @param _start <Start time of the event in nanoseconds (GetTimeNs)>.
+ *
+ * @return <none>.
+ */
+void TraceRecord(const char *_category, const char *_name, uint64_t _start)
+{
+    const uint64_t now = GetTimeNs();
+    TraceRing *ring = GetThreadRing();
+
+    if (ring != NULL)
+    {
+        const uint32_t head = ring->head;
+        TraceEvent *event = &ring->events[head & TRACE_RING_MASK];
+
+        event->category = _category;
+        event->name = _name;
+        event->start = _start;
+        event->duration = now - _start;
+
+        /* oldest events are overwritten once the ring is full */
+        TRACE_STORE_RELEASE(&ring->head, head + 1);
+    }
+}
+
+/*!
+ * @brief <Write all recorded events as Chrome trace-event JSON>
+ *
+ * @param _fileName <Name of the JSON file to create>.
+ *
+ * @return <number of events written, -1 if the file can not be created>.
+ */
+int TraceWrite(const char *_fileName)
+{
+    FILE *out = NULL;
+    TraceRing *ring;
+    int count = 0;
+
+    fopen_s(&out, _fileName, "w");
+    if (out == NULL)
+    {
+        return -1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    for (ring = s_rings; ring != NULL; ring = ring->next)
+    {
+        const uint32_t head = TRACE_LOAD_ACQUIRE(&ring->head);
+        uint32_t i = (head > TRACE_RING_SIZE) ? (head - TRACE_RING_SIZE) : 0;
+
+        for (; i < head; i++)
+        {
+            const TraceEvent *event = &ring->events[i & TRACE_RING_MASK];
+
+            /* ts and dur are in microseconds */
+            fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                         "\"ts\":%llu.%03u,\"dur\":%llu.%03u}",
+                    (count == 0) ? "" : ",\n",
+                    event->name, event->category, ring->tid,
+                    (unsigned long long)(event->start / 1000), (unsigned int)(event->start % 1000),
+                    (unsigned long long)(event->duration / 1000), (unsigned int)(event->duration % 1000));
+            count++;
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+    fclose(out);
+
+    return count;
+}
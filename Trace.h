@@ -0,0 +1,72 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "HAL.h"
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+/* Number of events kept per thread, must be a power of two */
+#define TRACE_RING_SIZE 8192
+
+#define TRACE_CAT_FAT "FAT"
+#define TRACE_CAT_HAL "HAL"
+
+/*
+ * Scoped tracing. The probes are always compiled in and cost one test of
+ * g_traceEnabled while tracing is off; call TraceEnable(1) at run time to
+ * start recording.
+ * TRACE_BEGIN() must be placed after the declarations of the function and
+ * TRACE_END() right before its (single) return.
+ */
+extern volatile int g_traceEnabled;
+
+#define TRACE_BEGIN() \
+    uint64_t traceStart_ = g_traceEnabled ? GetTimeNs() : 0
+
+#define TRACE_END(category, name)                 \
+    do                                            \
+    {                                             \
+        if (g_traceEnabled && (traceStart_ != 0)) \
+        {                                         \
+            TraceRecord(category, name, traceStart_); \
+        }                                         \
+    } while (0)
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Start or stop recording trace events>
+ *
+ * @param _enable <non-zero to start recording, zero to stop>.
+ *
+ * @return <none>.
+ */
+void TraceEnable(int _enable);
+
+/*!
+ * @brief <Store one complete event in the ring buffer of the calling thread>
+ *
+ * @param _category <Static string, category of the event>.
+ * @param _name <Static string, name of the event>.
+ * @param _start <Start time of the event in nanoseconds (GetTimeNs)>.
+ *
+ * @return <none>.
+ */
+void TraceRecord(const char *_category, const char *_name, uint64_t _start);
+
+/*!
+ * @brief <Write all recorded events as Chrome trace-event JSON>
+ *
+ * The file can be opened with chrome://tracing or ui.perfetto.dev.
+ *
+ * @param _fileName <Name of the JSON file to create>.
+ *
+ * @return <number of events written, -1 if the file can not be created>.
+ */
+int TraceWrite(const char *_fileName);
+
+#endif
\ No newline at end of file
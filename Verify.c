@@ -0,0 +1,431 @@
+#include "Verify.h"
+#include "FAT.h"
+#include "HAL.h"
+#include "Hash.h"
+#include "Workers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define MANIFEST_LINE_MAX (FAT_MAX_PATH + 64)
+#define VERIFY_MIN_BYTES_PER_THREAD (16 * 1024 * 1024) /* less data is not worth a thread */
+
+/*
+ * Hashes of one file
+ */
+typedef struct
+{
+    char *path;
+    unsigned int startCluster;
+    unsigned int size;
+    uint64_t xxh64;
+    uint32_t crc32c;
+    int isMatched; /* used by VerifyManifest */
+    Extent *extents; /* runs of the file, collected before the workers start */
+    unsigned int extentCount;
+} FileDigest;
+
+/*
+ * Growable array of FileDigest
+ */
+typedef struct
+{
+    FileDigest *items;
+    unsigned int count;
+    unsigned int capacity;
+} DigestList;
+
+/*
+ * Running hashes of the file being read
+ */
+typedef struct
+{
+    Xxh64State xxh64;
+    uint32_t crc32c;
+} HashContext;
+
+/*
+ * Share of the files of one thread
+ */
+typedef struct
+{
+    FileDigest *items;
+    unsigned int begin;
+    unsigned int end;
+} HashWorker;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static FileDigest *AddDigest(DigestList *_list, const char *_path);
+
+static void FreeDigests(DigestList *_list);
+
+static int CollectFile(DirectoryEntry *entry, const char *path, void *context);
+
+static int HashChunk(const uint8_t *data, unsigned int length, unsigned int fileOffset, void *context);
+
+static int CompareByCluster(const void *_a, const void *_b);
+
+static int CompareByPath(const void *_a, const void *_b);
+
+static int HashFiles(void *_worker, int _isInline);
+
+static void HashImage(DigestList *_list);
+
+static int LoadManifest(const char *_manifestFile, DigestList *_list);
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/* append an item with a copy of _path, NULL if out of memory */
+static FileDigest *AddDigest(DigestList *_list, const char *_path)
+{
+    FileDigest *digest;
+
+    if (_list->count == _list->capacity)
+    {
+        unsigned int capacity = (_list->capacity == 0) ? 64 : _list->capacity * 2;
+        FileDigest *items = (FileDigest *)realloc(_list->items, capacity * sizeof(FileDigest));
+
+        if (items == NULL)
+        {
+            return NULL;
+        }
+        _list->items = items;
+        _list->capacity = capacity;
+    }
+
+    digest = &_list->items[_list->count];
+    memset(digest, 0, sizeof(FileDigest));
+    digest->path = (char *)malloc(strlen(_path) + 1);
+    if (digest->path == NULL)
+    {
+        return NULL;
+    }
+    strcpy(digest->path, _path);
+    _list->count++;
+
+    return digest;
+}
+
+static void FreeDigests(DigestList *_list)
+{
+    unsigned int i;
+
+    for (i = 0; i < _list->count; i++)
+    {
+        free(_list->items[i].path);
+        free(_list->items[i].extents);
+    }
+    free(_list->items);
+    _list->items = NULL;
+    _list->count = 0;
+    _list->capacity = 0;
+}
+
+/* WalkTree visitor, remember every regular file */
+static int CollectFile(DirectoryEntry *entry, const char *path, void *context)
+{
+    FileDigest *digest;
+
+    if (!(entry->attributes & ENTRY_DIRECTORY))
+    {
+        digest = AddDigest((DigestList *)context, path);
+        if (digest != NULL)
+        {
+            digest->startCluster = GetEntryCluster(entry);
+            digest->size = GetSizeofFile(entry);
+        }
+    }
+
+    return 0;
+}
+
+/* StreamFile visitor */
+static int HashChunk(const uint8_t *data, unsigned int length, unsigned int fileOffset, void *context)
+{
+    HashContext *hash = (HashContext *)context;
+
+    (void)fileOffset;
+    Xxh64Update(&hash->xxh64, data, length);
+    hash->crc32c = Crc32c(hash->crc32c, data, length);
+
+    return 0;
+}
+
+static int CompareByCluster(const void *_a, const void *_b)
+{
+    const FileDigest *a = (const FileDigest *)_a;
+    const FileDigest *b = (const FileDigest *)_b;
+
+    return (a->startCluster > b->startCluster) - (a->startCluster < b->startCluster);
+}
+
+static int CompareByPath(const void *_a, const void *_b)
+{
+    return strcmp(((const FileDigest *)_a)->path, ((const FileDigest *)_b)->path);
+}
+
+/*!
+ * @brief <Hash the files of a share, body of RunWorkers>
+ *
+ * A thread reads through its own handle of the image; the files of an
+ * inline share go through the HAL, like any other read of the volume.
+ *
+ * @param _worker <Pointer to a HashWorker object>.
+ * @param _isInline <non-zero on the calling thread>.
+ *
+ * @return <non-zero if the image can not be opened by the thread>.
+ */
+static int HashFiles(void *_worker, int _isInline)
+{
+    HashWorker *worker = (HashWorker *)_worker;
+    FILE *reader = NULL;
+    unsigned int i;
+
+    if (!_isInline)
+    {
+        reader = OpenImgReader();
+        if (reader == NULL)
+        {
+            return 1;
+        }
+    }
+
+    for (i = worker->begin; i < worker->end; i++)
+    {
+        FileDigest *digest = &worker->items[i];
+        HashContext hash;
+
+        Xxh64Reset(&hash.xxh64, 0);
+        hash.crc32c = 0;
+        StreamExtents(reader, digest->extents, digest->extentCount, digest->size, HashChunk, &hash);
+
+        digest->xxh64 = Xxh64Digest(&hash.xxh64);
+        digest->crc32c = hash.crc32c;
+    }
+
+    if (reader != NULL)
+    {
+        fclose(reader);
+    }
+
+    return 0;
+}
+
+/*!
+ * @brief <Collect every file of the image and hash them in physical order>
+ *
+ * The chains are read first, then up to WORKERS_MAX_THREADS threads hash
+ * contiguous parts of the cluster-sorted list with the same amount of data.
+ * The first part and any part without a thread or without a handle of the
+ * image (overlay or journal attached) are hashed on the calling thread.
+ *
+ * @param _list <Pointer to an empty DigestList object>.
+ *
+ * @return <none>.
+ */
+static void HashImage(DigestList *_list)
+{
+    HashWorker workers[WORKERS_MAX_THREADS];
+    unsigned int threadCount;
+    uint64_t totalSize = 0;
+    uint64_t doneSize = 0;
+    unsigned int begin = 0;
+    unsigned int t;
+    unsigned int i;
+
+    WalkTree(0, "", CollectFile, _list);
+
+    /* one forward pass over the image instead of seeking back and forth */
+    qsort(_list->items, _list->count, sizeof(FileDigest), CompareByCluster);
+
+    /* the FAT is only read here, the workers do not touch the HAL */
+    for (i = 0; i < _list->count; i++)
+    {
+        FileDigest *digest = &_list->items[i];
+
+        if (digest->size > 0)
+        {
+            digest->extents = GetFileExtents(digest->startCluster, &digest->extentCount);
+        }
+        totalSize += digest->size;
+    }
+
+    threadCount = GetWorkerCount(totalSize, VERIFY_MIN_BYTES_PER_THREAD);
+
+    /* the CRC32C table and CPU check are set up once, before the threads share them */
+    Crc32c(0, NULL, 0);
+
+    for (t = 0; t < threadCount; t++)
+    {
+        const uint64_t target = totalSize * (t + 1) / threadCount;
+
+        workers[t].items = _list->items;
+        workers[t].begin = begin;
+        while ((begin < _list->count) && ((doneSize < target) || (t + 1 == threadCount)))
+        {
+            doneSize += _list->items[begin].size;
+            begin++;
+        }
+        workers[t].end = begin;
+    }
+
+    RunWorkers(workers, sizeof(HashWorker), threadCount, HashFiles);
+}
+
+/*!
+ * @brief <Hash every file of the mounted image and write a manifest>
+ *
+ * @param _out <Pointer to a FILE object receiving the manifest>.
+ *
+ * @return <number of files hashed>.
+ */
+int WriteManifest(FILE *_out)
+{
+    DigestList list = {NULL, 0, 0};
+    unsigned int i;
+    int count;
+
+    HashImage(&list);
+    qsort(list.items, list.count, sizeof(FileDigest), CompareByPath);
+
+    for (i = 0; i < list.count; i++)
+    {
+        const FileDigest *digest = &list.items[i];
+
+        fprintf(_out, "%016llx %08x %u %s\n", (unsigned long long)digest->xxh64,
+                (unsigned int)digest->crc32c, digest->size, digest->path);
+    }
+
+    count = (int)list.count;
+    FreeDigests(&list);
+
+    return count;
+}
+
+/*!
+ * @brief <Read a manifest written by WriteManifest>
+ *
+ * @param _manifestFile <name of the manifest>.
+ * @param _list <Pointer to an empty DigestList object>.
+ *
+ * @return <zero on success, -1 if the file can not be opened>.
+ */
+static int LoadManifest(const char *_manifestFile, DigestList *_list)
+{
+    FILE *in = NULL;
+    char line[MANIFEST_LINE_MAX];
+
+    fopen_s(&in, _manifestFile, "r");
+    if (in == NULL)
+    {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        char *p = line;
+        char *end;
+        uint64_t xxh64;
+        uint32_t crc32c;
+        unsigned int size;
+        FileDigest *digest;
+
+        line[strcspn(line, "\r\n")] = '\0';
+
+        xxh64 = strtoull(p, &end, 16);
+        if (end == p)
+        {
+            continue;
+        }
+        p = end;
+        crc32c = (uint32_t)strtoul(p, &end, 16);
+        p = end;
+        size = (unsigned int)strtoul(p, &end, 10);
+        if ((end == p) || (*end != ' '))
+        {
+            continue;
+        }
+
+        digest = AddDigest(_list, end + 1);
+        if (digest != NULL)
+        {
+            digest->xxh64 = xxh64;
+            digest->crc32c = crc32c;
+            digest->size = size;
+        }
+    }
+
+    fclose(in);
+    return 0;
+}
+
+/*!
+ * @brief <Hash every file of the mounted image and compare with a manifest>
+ *
+ * @param _manifestFile <name of a file written by WriteManifest>.
+ * @param _report <Pointer to a FILE object receiving the differences>.
+ *
+ * @return <number of differences, -1 if the manifest can not be read>.
+ */
+int VerifyManifest(const char *_manifestFile, FILE *_report)
+{
+    DigestList expected = {NULL, 0, 0};
+    DigestList actual = {NULL, 0, 0};
+    unsigned int i;
+    int differences = 0;
+
+    if (LoadManifest(_manifestFile, &expected) != 0)
+    {
+        return -1;
+    }
+    qsort(expected.items, expected.count, sizeof(FileDigest), CompareByPath);
+
+    HashImage(&actual);
+    qsort(actual.items, actual.count, sizeof(FileDigest), CompareByPath);
+
+    for (i = 0; i < actual.count; i++)
+    {
+        FileDigest *digest = &actual.items[i];
+        FileDigest *stored = (FileDigest *)bsearch(digest, expected.items, expected.count,
+                                                   sizeof(FileDigest), CompareByPath);
+
+        if (stored == NULL)
+        {
+            fprintf(_report, "NEW %s\n", digest->path);
+            differences++;
+        }
+        else
+        {
+            stored->isMatched = 1;
+            if ((stored->xxh64 != digest->xxh64) ||
+                (stored->crc32c != digest->crc32c) ||
+                (stored->size != digest->size))
+            {
+                fprintf(_report, "MISMATCH %s\n", digest->path);
+                differences++;
+            }
+        }
+    }
+
+    for (i = 0; i < expected.count; i++)
+    {
+        if (!expected.items[i].isMatched)
+        {
+            fprintf(_report, "MISSING %s\n", expected.items[i].path);
+            differences++;
+        }
+    }
+
+    FreeDigests(&expected);
+    FreeDigests(&actual);
+
+    return differences;
+}
@@ -0,0 +1,37 @@
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+
+#include <stdio.h>
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Hash every file of the mounted image and write a manifest>
+ *
+ * One line per file: "<xxh64> <crc32c> <size> <path>", hashes in hex.
+ * Files are read in order of their first cluster so the image is
+ * scanned from start to end, large images by several threads each
+ * reading its own part with its own handle of the image.
+ *
+ * @param _out <Pointer to a FILE object receiving the manifest>.
+ *
+ * @return <number of files hashed>.
+ */
+int WriteManifest(FILE *_out);
+
+/*!
+ * @brief <Hash every file of the mounted image and compare with a manifest>
+ *
+ * Every difference is reported on one line:
+ * "MISMATCH <path>", "MISSING <path>" (not in the image) or "NEW <path>" (not in the manifest).
+ *
+ * @param _manifestFile <name of a file written by WriteManifest>.
+ * @param _report <Pointer to a FILE object receiving the differences>.
+ *
+ * @return <number of differences, -1 if the manifest can not be read>.
+ */
+int VerifyManifest(const char *_manifestFile, FILE *_report);
+
+#endif
\ No newline at end of file
@@ -1,81 +1,34 @@
 #include "View.h"
 #include "FAT.h"
+#include "HAL.h"
+#include "DirSnapshot.h"
 #include <stdio.h>
 #include <stdlib.h>
 
-#define _1KB 1024
-/**/
-static void PrintTime(Time *time);
-
-/* Print date DD/MM/YYYY */
-static void PrintDate(Date *date);
-
-static void PrintInfoEntry(DirectoryEntry *entry);
-
-static void PrintInfoEntry(DirectoryEntry *entry)
-{
-    Date date;
-    Time time;
-    char name[20];
-    char extension[20];
-    unsigned int size;
-
-    GetName(name, entry);
-    GetFileType(extension, entry);
-    GetFileModifiedDate(&date, entry);
-    GetFileModifiedTime(&time, entry);
-    size = GetSizeofFile(entry) / _1KB;    
-
-    printf("%-20s ", name);
-    PrintDate(&date);
-    printf("  ");
-    PrintTime(&time);
-    printf("%7s", " ");
-
-    if (entry->attributes & ENTRY_DIRECTORY)
-    {
-        printf("%-8s\n", "Folder");
-    }
-    else
-    {
-        printf("%-8s ", extension);
-
-        if (size == 0)
-        {
-            size = 1;
-        }
-        printf("%6d KB\n", size);
-    }
-
-}
-
 /*!
  * @brief <ShowFolder and select entry to open>
  *
  * @param startCluster <Start of file in clusters>.
+ * @param entry <Pointer to a entry object receiving the selected entry>.
  *
- * @return <index entry selected>.
+ * @return <non-zero if an entry was selected, zero to exit>.
  */
-int ShowFolder(unsigned int startCluster)
+int ShowFolder(unsigned int startCluster, DirectoryEntry *entry)
 {
-    int i = 0;
-    DirectoryEntry entry;
+    int i;
+    DirSnapshot snapshot;
+    char *listing;
+    size_t length = 0;
     int retVal;
 
-    printf("    Name               | Date modified            | Type   | Size\n");
-    do
+    /* decode the whole folder at once and print it with one write */
+    i = LoadDirSnapshot(&snapshot, startCluster);
+    listing = RenderDirSnapshot(&snapshot, &length);
+    if (listing != NULL)
     {
-        GetEntry(&entry, i + 1, startCluster);
-        if ((entry.attributes != ENTRY_NAME) &&
-            (entry.name[0] != ENTRY_EMPTY) &&
-            (entry.name[0] != ENTRY_DELETED))
-        {
-            i++;
-            printf("%2d. ", i);
-            
-            PrintInfoEntry(&entry);
-        }
-    } while (entry.name[0] != ENTRY_EMPTY);
+        fwrite(listing, 1, length, stdout);
+        free(listing);
+    }
 
     printf("<Nhap [0] de thoat chuong trinh>\n");
     do
@@ -88,9 +41,16 @@ int ShowFolder(unsigned int startCluster)
             printf("Khong co file nay\n");
         }
     } while (retVal > i);
-   
 
-    return retVal;
+    /* rows are numbered in display order, the entry comes from the snapshot
+       and not from a second scan that would count other slots */
+    if (retVal > 0)
+    {
+        GetSnapshotEntry(&snapshot, snapshot.order[retVal - 1], entry);
+    }
+    FreeDirSnapshot(&snapshot);
+
+    return retVal > 0;
 }
 
 /*!
@@ -102,81 +62,47 @@ int ShowFolder(unsigned int startCluster)
  */
 void PrintFile(DirectoryEntry *entry)
 {
-    File *myfile;    
-    char name[13];
-    int isNotEOF = 1;
+    const unsigned int bytePerCluster = GetBytePerSector() * GetSectorPerCluster();
+    unsigned int size = GetSizeofFile(entry);
+    unsigned int extentCount = 0;
+    unsigned int e;
+    Extent *extents;
    
 #ifdef DEBUG
     FILE* log;
+    char name[14];
     GetName(name, entry);
     fopen_s(&log, name, "wb+");
     //log = fopen(name, "wb+");
 #endif // DEBUG
 
-    myfile = OpenFile(entry);
-    
+    /* whole runs of clusters at once, truncated to the size of the file */
+    extents = GetFileExtents(GetEntryCluster(entry), &extentCount);
 
-    while (isNotEOF)
+    for (e = 0; (e < extentCount) && (size > 0); e++)
     {
-        uint8_t buff[512];
-        isNotEOF = Fread(buff, 1, 512, myfile);
-        if (isNotEOF)
+        const uint64_t runBytes = (uint64_t)extents[e].count * bytePerCluster;
+        unsigned int length = size;
+        uint64_t sectorPos = ClusterToSector(extents[e].cluster);
+
+        if (runBytes < length)
         {
-            for (int i = 0; i < 512; i++)
-            {
-                printf("%c", buff[i]);
-            }
+            length = (unsigned int)runBytes;
+        }
+
+        SendSectors(stdout, sectorPos, length);
 
 #ifdef DEBUG
-            fwrite(buff, 1, 512, log);
-#endif // DEBUG            
-        }
+        SendSectors(log, sectorPos, length);
+#endif // DEBUG
+
+        size -= length;
     }
-    CloseFile(myfile);
+
+    free(extents);
 
 #ifdef DEBUG
     fclose(log);
 #endif // DEBUG  
     
-}
-
-/* Print date DD/MM/YYYY */
-static void PrintDate(Date *date)
-{
-    if (date->day < 10)
-    {
-        printf("0");
-    }
-    printf("%d/", date->day);
-
-    if (date->month < 10)
-    {
-        printf("0");
-    }
-    printf("%d/%d", date->month, date->year + YEAR_OFFSET);
-}
-
-/*printf xx:xx AM/PM */
-static void PrintTime(Time *time)
-{
-    if (time->hours < 10)
-    {
-        printf("0");
-    }
-    printf("%d:", time->hours);
-
-    if (time->seconds < 10)
-    {
-        printf("0");
-    }
-    printf("%d ", time->seconds);
-
-    if (time->hours < 12)
-    {
-        printf("AM");
-    }
-    else
-    {
-        printf("PM");
-    }
 }
\ No newline at end of file
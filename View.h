@@ -7,10 +7,11 @@
  * @brief <ShowFolder and select entry to open>
  *
  * @param startCluster <Start of file in clusters>.
+ * @param entry <Pointer to a entry object receiving the selected entry>.
  *
- * @return <index entry selected>.
+ * @return <non-zero if an entry was selected, zero to exit>.
  */
-int ShowFolder(unsigned int startCluster);
+int ShowFolder(unsigned int startCluster, DirectoryEntry *entry);
 
 /*!
  * @brief <print data in file whose information is specified in the parameter entry>
@@ -0,0 +1,147 @@
+#include "Workers.h"
+#include "Stats.h"
+#include <stdint.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+/*
+ * Thread running one share
+ */
+typedef struct
+{
+    void *share;
+    WorkerBody body;
+    int result; /* returned by body */
+#ifndef _WIN32
+    VolumeStats stats; /* counters of the thread, merged after the join */
+    pthread_t thread;
+    int isStarted;
+#endif
+} WorkerThread;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+#ifndef _WIN32
+static void *RunThread(void *_thread);
+#endif
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+#ifndef _WIN32
+/* thread entry point, run one share off the calling thread */
+static void *RunThread(void *_thread)
+{
+    WorkerThread *thread = (WorkerThread *)_thread;
+
+    AttachThreadStats(&thread->stats);
+    thread->result = thread->body(thread->share, 0);
+    AttachThreadStats(NULL);
+    return NULL;
+}
+#endif
+
+/*!
+ * @brief <Number of shares to split some work in>
+ *
+ * @param _work <amount of work, bytes, jobs or items>.
+ * @param _minWorkPerShare <smallest amount worth a thread>.
+ *
+ * @return <number of shares, at least one>.
+ */
+unsigned int GetWorkerCount(uint64_t _work, uint64_t _minWorkPerShare)
+{
+    unsigned int count = WORKERS_MAX_THREADS;
+
+#ifndef _WIN32
+    const long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if ((cpuCount > 0) && ((unsigned long)cpuCount < count))
+    {
+        count = (unsigned int)cpuCount;
+    }
+#else
+    count = 1;
+#endif
+
+    while ((count > 1) && (_work / count < _minWorkPerShare))
+    {
+        count--;
+    }
+
+    return count;
+}
+
+/*!
+ * @brief <Run every share of an array, share 0 on the calling thread>
+ *
+ * @param _shares <array of shares>.
+ * @param _shareSize <size of one share in bytes>.
+ * @param _count <number of shares, at most WORKERS_MAX_THREADS>.
+ * @param _body <function run for every share>.
+ *
+ * @return <none>.
+ */
+void RunWorkers(void *_shares, size_t _shareSize, unsigned int _count, WorkerBody _body)
+{
+    WorkerThread threads[WORKERS_MAX_THREADS];
+    unsigned int t;
+
+    if (_count > WORKERS_MAX_THREADS)
+    {
+        _count = WORKERS_MAX_THREADS;
+    }
+
+    for (t = 0; t < _count; t++)
+    {
+        threads[t].share = (uint8_t *)_shares + t * _shareSize;
+        threads[t].body = _body;
+        threads[t].result = 0;
+    }
+
+#ifndef _WIN32
+    /* every thread first, then share 0 works alongside them */
+    for (t = 1; t < _count; t++)
+    {
+        memset(&threads[t].stats, 0, sizeof(threads[t].stats));
+        threads[t].isStarted = (pthread_create(&threads[t].thread, NULL, RunThread, &threads[t]) == 0);
+    }
+
+    _body(threads[0].share, 1);
+
+    /* without a thread the share runs here */
+    for (t = 1; t < _count; t++)
+    {
+        if (!threads[t].isStarted)
+        {
+            _body(threads[t].share, 1);
+        }
+    }
+
+    for (t = 1; t < _count; t++)
+    {
+        if (threads[t].isStarted)
+        {
+            pthread_join(threads[t].thread, NULL);
+            MergeVolumeStats(&threads[t].stats);
+        }
+        if (threads[t].result != 0)
+        {
+            _body(threads[t].share, 1);
+        }
+    }
+#else
+    for (t = 0; t < _count; t++)
+    {
+        _body(threads[t].share, 1);
+    }
+#endif
+}
@@ -0,0 +1,55 @@
+#ifndef _WORKERS_H_
+#define _WORKERS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define WORKERS_MAX_THREADS 8 /* shares of one RunWorkers call, the calling thread included */
+
+/*
+ * Body of one share. _isInline is set on the calling thread, which may read
+ * through the HAL; a share on its own thread reads through OpenImgReader.
+ * Non-zero means the share could not run on its thread (no handle of the
+ * image) and is run again inline.
+ */
+typedef int (*WorkerBody)(void *_share, int _isInline);
+
+/*******************************************************************************
+ * API
+ ******************************************************************************/
+
+/*!
+ * @brief <Number of shares to split some work in>
+ *
+ * At most WORKERS_MAX_THREADS and the number of online CPUs, one on
+ * Windows, and fewer while a share would get less than _minWorkPerShare.
+ *
+ * @param _work <amount of work, bytes, jobs or items>.
+ * @param _minWorkPerShare <smallest amount worth a thread>.
+ *
+ * @return <number of shares, at least one>.
+ */
+unsigned int GetWorkerCount(uint64_t _work, uint64_t _minWorkPerShare);
+
+/*!
+ * @brief <Run every share of an array, share 0 on the calling thread>
+ *
+ * The threads of shares 1.. are all started before share 0 runs here, so
+ * the calling thread works alongside them. A share whose thread can not be
+ * started runs here after share 0; a share that fails on its thread runs
+ * here again after the join. Returns when every share is done, with the
+ * counters of every thread merged into GetVolumeStats.
+ *
+ * @param _shares <array of shares>.
+ * @param _shareSize <size of one share in bytes>.
+ * @param _count <number of shares, at most WORKERS_MAX_THREADS>.
+ * @param _body <function run for every share>.
+ *
+ * @return <none>.
+ */
+void RunWorkers(void *_shares, size_t _shareSize, unsigned int _count, WorkerBody _body);
+
+#endif
\ No newline at end of file
@@ -1,7 +1,29 @@
 #include "FAT.h"
 #include "View.h"
+#include "Trace.h"
+#include "Stats.h"
+#include "Verify.h"
+#include "Batch.h"
+#include "Index.h"
+#include "Check.h"
+#include "Defrag.h"
+#include "Clone.h"
+#include "Tar.h"
+#include "Grep.h"
+#include "Recover.h"
+#include "Partition.h"
+#include "Daemon.h"
+#include "SharedCache.h"
+#include "DeviceModel.h"
+#include "Diff.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 enum State
 {
@@ -11,14 +33,295 @@ enum State
 	_EXIT
 };
 
-int main()
+#define MAX_POSITIONAL 8
+
+int main(int argc, char *argv[])
 {
-	unsigned int i;
 	unsigned int currentFolder = 0;
 	int state = _ShowFolder;
+	const char *traceFile = NULL;
+	int statsFormat = -1;
+	int arg;
+	const char *positional[MAX_POSITIONAL];
+	int positionalCount = 0;
+	const char *mode = "";
+	int retVal = 0;
+	int useIndex = 0;
+	const char *imgName = "floppy.img";
+	const char *overlayName = NULL;
+	const char *journalName = NULL;
+	int partitionNumber = 1;
+	const char *sharedCacheName = NULL;
 
 	DirectoryEntry entry;
-	FatInit("floppy.img");
+
+	for (arg = 1; arg < argc; arg++)
+	{
+		/* --trace <file.json>: record FAT/HAL events, open with ui.perfetto.dev */
+		if ((strcmp(argv[arg], "--trace") == 0) && (arg + 1 < argc))
+		{
+			traceFile = argv[++arg];
+			TraceEnable(1);
+		}
+		/* --stats / --stats-json: print I/O and cache counters on exit */
+		else if (strcmp(argv[arg], "--stats") == 0)
+		{
+			statsFormat = STATS_FORMAT_TEXT;
+			StatsEnable(1);
+		}
+		else if (strcmp(argv[arg], "--stats-json") == 0)
+		{
+			statsFormat = STATS_FORMAT_JSON;
+			StatsEnable(1);
+		}
+		/* --index: keep decoded metadata in "<image>.idx" for the next mount */
+		else if (strcmp(argv[arg], "--index") == 0)
+		{
+			useIndex = 1;
+		}
+		/* --overlay <delta>: copy-on-write, writes go to the delta file only */
+		else if ((strcmp(argv[arg], "--overlay") == 0) && (arg + 1 < argc))
+		{
+			overlayName = argv[++arg];
+		}
+		/* --journal <file>: write-ahead log of metadata writes, replayed after a crash */
+		else if ((strcmp(argv[arg], "--journal") == 0) && (arg + 1 < argc))
+		{
+			journalName = argv[++arg];
+		}
+		/* --partition <n>: n-th FAT partition of a full disk image, the first by default */
+		else if ((strcmp(argv[arg], "--partition") == 0) && (arg + 1 < argc))
+		{
+			partitionNumber = atoi(argv[++arg]);
+		}
+		/* --shared-cache <name>: sectors read by one process are served to the others */
+		else if ((strcmp(argv[arg], "--shared-cache") == 0) && (arg + 1 < argc))
+		{
+			sharedCacheName = argv[++arg];
+		}
+		/* --simulate <model>: read the image as if from slow media, see DeviceModel.h */
+		else if ((strcmp(argv[arg], "--simulate") == 0) && (arg + 1 < argc))
+		{
+			DeviceModel model;
+
+			if (ParseDeviceModel(argv[++arg], &model) != 0)
+			{
+				fprintf(stderr, "invalid device model %s\n", argv[arg]);
+				return 1;
+			}
+			SetDeviceModel(&model);
+		}
+		else if (positionalCount < MAX_POSITIONAL)
+		{
+			positional[positionalCount++] = argv[arg];
+		}
+	}
+
+	/* <mode> <image> [arguments], interactive browser of floppy.img by default */
+	if (positionalCount > 1)
+	{
+		mode = positional[0];
+		imgName = positional[1];
+	}
+
+	if (sharedCacheName != NULL)
+	{
+		OpenSharedCache(sharedCacheName, SHARED_CACHE_DEFAULT_BYTES);
+	}
+
+	/* serve <socket> [cache bytes]: images are named by each request, see Daemon.h */
+	if (strcmp(mode, "serve") == 0)
+	{
+		retVal = RunDaemon(imgName, (positionalCount > 2) ? (size_t)strtoull(positional[2], NULL, 10) : DAEMON_CACHE_DEFAULT_BUDGET);
+		CloseSharedCache();
+		return retVal;
+	}
+
+	FatInit(imgName);
+
+	if (partitionNumber != 1)
+	{
+		Partition partitions[MAX_PARTITIONS];
+		const int count = (int)FindPartitions(partitions, MAX_PARTITIONS);
+
+		if ((partitionNumber < 1) || (partitionNumber > count) ||
+			(FatMountPartition(partitions[partitionNumber - 1].offset, partitions[partitionNumber - 1].size) != 0))
+		{
+			fprintf(stderr, "no FAT partition %d in %s\n", partitionNumber, imgName);
+			FatDeInit();
+			return 1;
+		}
+	}
+
+	/* diff reads the image files, without the sectors of an overlay or journal */
+	if ((strcmp(mode, "diff") == 0) && ((overlayName != NULL) || (journalName != NULL)))
+	{
+		fprintf(stderr, "diff compares the image files, it can not be used with --overlay or --journal\n");
+		FatDeInit();
+		return 2;
+	}
+
+	if ((overlayName != NULL) && (FatAttachOverlay(overlayName) != 0))
+	{
+		fprintf(stderr, "can not use overlay %s\n", overlayName);
+		FatDeInit();
+		return 1;
+	}
+
+	if ((journalName != NULL) && (FatAttachJournal(journalName) != 0))
+	{
+		fprintf(stderr, "can not use journal %s\n", journalName);
+		FatDeInit();
+		return 1;
+	}
+
+	if (useIndex)
+	{
+		char *indexName = (char *)malloc(strlen(imgName) + 16);
+
+		if (indexName != NULL)
+		{
+			/* one index per partition */
+			strcpy(indexName, imgName);
+			if (partitionNumber != 1)
+			{
+				sprintf(indexName + strlen(indexName), ".p%d", partitionNumber);
+			}
+			strcat(indexName, ".idx");
+			LoadIndex(indexName);
+			free(indexName);
+		}
+	}
+
+	/* these tools read or rewrite FAT12/16/32 structures only */
+	if ((GetFatType() == FAT_TYPE_EXFAT) &&
+		((strcmp(mode, "check") == 0) || (strcmp(mode, "defrag") == 0) || (strcmp(mode, "deleted") == 0) ||
+		 (strcmp(mode, "diff") == 0) || (strcmp(mode, "patch") == 0)))
+	{
+		fprintf(stderr, "%s is not supported on exFAT\n", mode);
+		retVal = 1;
+		state = _EXIT;
+	}
+	else if (strcmp(mode, "partitions") == 0)
+	{
+		/* partitions <image>: list the FAT partitions of a full disk image, or the volume of a superfloppy */
+		retVal = (WritePartitionReport(stdout) > 0) ? 0 : 1;
+		state = _EXIT;
+	}
+	else if (strcmp(mode, "hash") == 0)
+	{
+		/* hash <image>: print the manifest of every file */
+		WriteManifest(stdout);
+		state = _EXIT;
+	}
+	else if ((strcmp(mode, "verify") == 0) && (positionalCount > 2))
+	{
+		/* verify <image> <manifest>: print the differences, exit code 1 if any */
+		retVal = (VerifyManifest(positional[2], stdout) == 0) ? 0 : 1;
+		state = _EXIT;
+	}
+	else if (strcmp(mode, "check") == 0)
+	{
+		/* check <image>: print FAT and directory problems, exit code 1 if any */
+		retVal = (CheckVolume(stdout) == 0) ? 0 : 1;
+		state = _EXIT;
+	}
+	else if (strcmp(mode, "frag") == 0)
+	{
+		/* frag <image>: print extents and seek distance of every file */
+		WriteFragReport(stdout);
+		state = _EXIT;
+	}
+	else if ((strcmp(mode, "defrag") == 0) && (positionalCount > 2))
+	{
+		/* defrag <image> <output>: write a copy with every chain contiguous */
+		retVal = DefragImage(positional[2]);
+		state = _EXIT;
+	}
+	else if ((strcmp(mode, "clone") == 0) && (positionalCount > 2))
+	{
+		/* clone <image> <output>: copy used clusters only, free space stays sparse */
+		retVal = CloneImage(positional[2]);
+		state = _EXIT;
+	}
+	else if (strcmp(mode, "tar") == 0)
+	{
+		/* tar <image>: write the whole tree as a tar stream on stdout */
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		retVal = (WriteTar(stdout) < 0) ? 1 : 0;
+		state = _EXIT;
+	}
+	else if (((strcmp(mode, "grep") == 0) || (strcmp(mode, "egrep") == 0)) && (positionalCount > 2))
+	{
+		/* grep|egrep <image> <pattern>: print "<path>:<offset>" of every match, exit code 1 if none */
+		int matches = GrepImage(positional[2], (mode[0] == 'e') ? GREP_REGEX : GREP_LITERAL, stdout);
+
+		retVal = (matches > 0) ? 0 : ((matches == 0) ? 1 : 2);
+		state = _EXIT;
+	}
+	else if (strcmp(mode, "deleted") == 0)
+	{
+		/* deleted <image> [folder]: list deleted entries, recover the intact ones into folder */
+		ListDeleted(stdout, (positionalCount > 2) ? positional[2] : NULL);
+		state = _EXIT;
+	}
+	else if (strcmp(mode, "carve") == 0)
+	{
+		/* carve <image> [folder]: find known file formats in free clusters */
+		CarveFreeSpace(stdout, (positionalCount > 2) ? positional[2] : NULL);
+		state = _EXIT;
+	}
+	else if ((strcmp(mode, "diff") == 0) && (positionalCount > 2))
+	{
+		/* diff <old image> <new image> [delta]: print added, removed and modified files, exit code 1 if any */
+		const int differences = DiffImages(imgName, positional[2], (positionalCount > 3) ? positional[3] : NULL, stdout);
+
+		if (differences < 0)
+		{
+			fprintf(stderr, "can not compare %s with %s\n", imgName, positional[2]);
+		}
+		retVal = (differences == 0) ? 0 : ((differences > 0) ? 1 : 2);
+		state = _EXIT;
+	}
+	else if ((strcmp(mode, "patch") == 0) && (positionalCount > 2))
+	{
+		/* patch <image> <delta>: write a delta made by diff, with --journal or --overlay */
+		retVal = ApplyDelta(positional[2]);
+		if (retVal != 0)
+		{
+			fprintf(stderr, "can not apply %s\n", positional[2]);
+		}
+		state = _EXIT;
+	}
+	else if (strcmp(mode, "batch") == 0)
+	{
+		/* batch <image> [script]: run commands from the script or stdin on one mount */
+		FILE *script = stdin;
+
+		if (positionalCount > 2)
+		{
+			fopen_s(&script, positional[2], "r");
+		}
+
+		if (script == NULL)
+		{
+			retVal = 1;
+		}
+		else
+		{
+#ifdef _WIN32
+			_setmode(_fileno(stdout), _O_BINARY);
+#endif
+			retVal = (RunBatch(script, stdout) == 0) ? 0 : 1;
+			if (script != stdin)
+			{
+				fclose(script);
+			}
+		}
+		state = _EXIT;
+	}
 
 	while (state != _EXIT)
 	{
@@ -26,8 +329,7 @@ int main()
 		switch (state)
 		{
 		case _ShowFolder:
-			i = ShowFolder(currentFolder);
-			if (i == 0)
+			if (ShowFolder(currentFolder, &entry) == 0)
 			{
 				state = _EXIT;
 			}
@@ -39,11 +341,10 @@ int main()
 			break;
 
 		case _GetEntry:
-			GetEntry(&entry, i, currentFolder);
 			if (entry.attributes & ENTRY_DIRECTORY)
 			{
 				state = _ShowFolder;
-				currentFolder = ReadNumber(2, entry.startClusters);
+				currentFolder = GetEntryCluster(&entry);
 			}
 			else
 			{
@@ -62,5 +363,20 @@ int main()
 		}
 	}
 
+	if (statsFormat >= 0)
+	{
+		DumpVolumeStats(stderr, statsFormat);
+	}
+
+	CloseIndex();
 	FatDeInit();
+	CloseSharedCache();
+
+	if (traceFile != NULL)
+	{
+		TraceEnable(0);
+		TraceWrite(traceFile);
+	}
+
+	return retVal;
 }
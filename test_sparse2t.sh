@@ -0,0 +1,184 @@
+#!/bin/sh
+# test_sparse2t.sh <tool> [image]
+#
+# Builds a sparse 2 TiB FAT32 image (4096 byte sectors, 32 KiB clusters,
+# 536870912 sectors) with a file in the first clusters, a fragmented file
+# in the last clusters of the volume and a file of 4 GiB - 1 bytes, then runs
+# hash, verify and check on it and compares the data read by batch cat with
+# the markers written into the clusters.
+# Only the written sectors take space on disk.
+# <tool> is the built main2.c, [image] defaults to /tmp/sparse2t.img.
+
+TOOL=${1:?usage: $0 <tool> [image]}
+IMG=${2:-/tmp/sparse2t.img}
+MANIFEST=$IMG.manifest
+EXPECTED=$IMG.expected
+
+BPS=4096
+SPC=8
+RESERVED=32
+NFAT=2
+TOTAL=536870912
+CBYTES=$((BPS * SPC))
+HUGE=1024
+HUGESIZE=$((0xFFFFFFFF))
+HUGECLUSTERS=$(((HUGESIZE + CBYTES - 1) / CBYTES))
+
+# sectors per FAT: smallest count holding every cluster of the data region
+SPF=1
+while :; do
+    NCLUS=$(((TOTAL - RESERVED - NFAT * SPF) / SPC))
+    [ $(((NCLUS + 2) * 4)) -le $((SPF * BPS)) ] && break
+    SPF=$((((NCLUS + 2) * 4 + BPS - 1) / BPS))
+done
+DATA=$((RESERVED + NFAT * SPF))
+LAST=$((NCLUS + 1))
+
+fail()
+{
+    echo "FAIL: $*"
+    exit 1
+}
+
+# le <value> <bytes>: little-endian bytes of value
+le()
+{
+    v=$1
+    i=0
+    while [ $i -lt $2 ]; do
+        printf "\\$(printf %03o $((v & 255)))"
+        v=$((v >> 8))
+        i=$((i + 1))
+    done
+}
+
+# put <byte offset> [file]: write stdin into the image, or file, at offset
+put()
+{
+    dd of="${2:-$IMG}" bs=65536 iflag=fullblock oflag=seek_bytes seek="$1" conv=notrunc status=none ||
+        fail "write at $1"
+}
+
+# dirent <8.3 name> <attr> <cluster> <size>
+dirent()
+{
+    printf '%s' "$1"
+    le "$2" 1
+    le 0 1; le 0 1; le 0 2; le $((0x5021)) 2; le 0 2
+    le $(($3 >> 16)) 2
+    le $((0x6000)) 2; le $((0x5021)) 2
+    le $(($3 & 0xFFFF)) 2
+    le "$4" 4
+}
+
+# fat <cluster> <value>: set the entry in both FATs
+fat()
+{
+    n=0
+    while [ $n -lt $NFAT ]; do
+        le "$2" 4 | put $(((RESERVED + n * SPF) * BPS + $1 * 4))
+        n=$((n + 1))
+    done
+}
+
+# content <path>: data of the file read by batch cat, without its "OK <size>" line
+content()
+{
+    printf 'cat %s\n' "$1" | timeout 600 "$TOOL" batch "$IMG" | tail -n +2
+}
+
+# cluster <cluster>: byte offset of the cluster
+cluster()
+{
+    echo $(((DATA + ($1 - 2) * SPC) * BPS))
+}
+
+rm -f "$IMG" "$MANIFEST"
+truncate -s $((TOTAL * BPS)) "$IMG" || fail "truncate"
+
+# boot sector, FSInfo, backup boot sector at 6 and its FSInfo at 7
+for s in 0 6; do
+    {
+        printf '\353\130\220MSWIN4.1'
+        le $BPS 2; le $SPC 1; le $RESERVED 2; le $NFAT 1
+        le 0 2; le 0 2; le $((0xF8)) 1; le 0 2
+        le 63 2; le 255 2; le 0 4; le $TOTAL 4
+        le $SPF 4; le 0 2; le 0 2; le 2 4; le 1 2; le 6 2
+    } | put $((s * BPS))
+    printf '\125\252' | put $((s * BPS + 510))
+    {
+        le $((0x41615252)) 4
+    } | put $(((s + 1) * BPS))
+    {
+        le $((0x61417272)) 4; le $((NCLUS - 5 - HUGECLUSTERS)) 4; le 4 4
+    } | put $(((s + 1) * BPS + 484))
+    le $((0xAA550000)) 4 | put $(((s + 1) * BPS + 508))
+done
+
+# root directory in cluster 2, HEAD.TXT in cluster 3, TAIL.BIN fragmented
+# over the last three clusters so its reads go past 2^40 bytes, HUGE.BIN
+# contiguous from cluster 1024, its size does not fit a rounding up in 32 bits
+HEAD=$(printf 'first cluster of a 2 TiB volume\n%.0s' 1 2 3 4 5 6 7 8)
+HEADSIZE=${#HEAD}
+TAILSIZE=$((CBYTES * 2 + 100))
+fat 0 $((0x0FFFFFF8))
+fat 1 $((0x0FFFFFFF))
+fat 2 $((0x0FFFFFFF))
+fat 3 $((0x0FFFFFFF))
+fat $LAST $((LAST - 2))
+fat $((LAST - 2)) $((LAST - 1))
+fat $((LAST - 1)) $((0x0FFFFFFF))
+n=0
+while [ $n -lt $NFAT ]; do
+    LC_ALL=C awk -v first=$HUGE -v count=$HUGECLUSTERS 'BEGIN {
+        for (c = first; c < first + count; c++) {
+            v = (c + 1 < first + count) ? c + 1 : 268435455
+            printf "%c%c%c%c", v % 256, int(v / 256) % 256, int(v / 65536) % 256, int(v / 16777216)
+        }
+    }' | put $(((RESERVED + n * SPF) * BPS + HUGE * 4))
+    n=$((n + 1))
+done
+{
+    dirent 'SPARSE2T   ' 8 0 0
+    dirent 'HEAD    TXT' 32 3 $HEADSIZE
+    dirent 'TAIL    BIN' 32 $LAST $TAILSIZE
+    dirent 'HUGE    BIN' 32 $HUGE $HUGESIZE
+} | put "$(cluster 2)"
+printf '%s' "$HEAD" | put "$(cluster 3)"
+for c in $LAST $((LAST - 2)) $((LAST - 1)); do
+    printf 'cluster %u\n' $c | put "$(cluster $c)"
+    printf 'end of cluster %u\n' $c | put $(($(cluster $c) + CBYTES - 24))
+done
+printf 'end of HUGE.BIN\n' |
+    put $(($(cluster $((HUGE + (HUGESIZE - 16) / CBYTES))) + (HUGESIZE - 16) % CBYTES))
+
+# a hang here is a chunk length that wraps to 0 on HUGE.BIN
+timeout 600 "$TOOL" hash "$IMG" > "$MANIFEST" || fail "hash"
+cat "$MANIFEST"
+grep -q " $HEADSIZE /HEAD.TXT\$" "$MANIFEST" || fail "HEAD.TXT missing from the manifest"
+grep -q " $TAILSIZE /TAIL.BIN\$" "$MANIFEST" || fail "TAIL.BIN missing from the manifest"
+grep -q " $HUGESIZE /HUGE.BIN\$" "$MANIFEST" || fail "HUGE.BIN missing from the manifest"
+timeout 600 "$TOOL" verify "$IMG" "$MANIFEST" || fail "verify of the unchanged image"
+"$TOOL" check "$IMG" || fail "check"
+
+# the bytes read at the far offsets are the ones written there
+printf '%s' "$HEAD" > "$EXPECTED"
+content /HEAD.TXT | cmp -s - "$EXPECTED" || fail "HEAD.TXT read back wrong"
+rm -f "$EXPECTED"
+truncate -s $TAILSIZE "$EXPECTED"
+i=0
+for c in $LAST $((LAST - 2)) $((LAST - 1)); do
+    printf 'cluster %u\n' $c | put $((i * CBYTES)) "$EXPECTED"
+    [ $i -lt 2 ] && printf 'end of cluster %u\n' $c | put $((i * CBYTES + CBYTES - 24)) "$EXPECTED"
+    i=$((i + 1))
+done
+content /TAIL.BIN | cmp -s - "$EXPECTED" || fail "TAIL.BIN read back wrong"
+[ "$(content /HUGE.BIN | tail -c 16)" = "end of HUGE.BIN" ] || fail "end of HUGE.BIN read back wrong"
+
+# a byte changed in the last cluster of the volume must be reported
+printf 'X' | put $(($(cluster $LAST) + 100))
+timeout 600 "$TOOL" verify "$IMG" "$MANIFEST"
+[ $? -eq 1 ] || fail "verify missed a change past 2^40 bytes"
+
+rm -f "$IMG" "$MANIFEST" "$EXPECTED"
+echo "ok"